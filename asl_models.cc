@@ -67,6 +67,7 @@ Copyright (C) 2010-2011 University of Oxford */
     innovation@isis.ox.ac.uk quoting reference DE/9564. */
 
 #include "asl_models.h"
+#include <map>
 
 namespace OXASL {
 
@@ -75,7 +76,7 @@ namespace OXASL {
 
   double AIFModel_nodisp::kcblood(const double ti, const double deltblood, const double taub, const double T_1b, const bool casl,const ColumnVector dispparam) const {
   // Non dispersed arterial curve
-  Tracer_Plus tr("OXASL:kcblood_nodisp");
+  //Tracer_Plus tr("OXASL:kcblood_nodisp");
   double kcblood = 0.0;
 
 
@@ -105,7 +106,7 @@ namespace OXASL {
 
   double AIFModel_gammadisp::kcblood(const double ti,const double deltblood,const double taub,const double T_1b,const bool casl,const ColumnVector dispparam) const {
     // Gamma dispersed arterial curve (pASL)
-    Tracer_Plus tr("OXASL:kcblood_gammadisp");
+    //Tracer_Plus tr("OXASL:kcblood_gammadisp");
     double kcblood = 0.0;
 
     //extract dispersion parameters
@@ -128,13 +129,13 @@ namespace OXASL {
 	if (casl) kcblood = 2 * exp(-deltblood/T_1b);
 	else	  kcblood = 2 * exp(-ti/T_1b);
 	
-	kcblood *= ( 1 - igamc(k,s*(ti-deltblood))  ); 
+	kcblood *= ( 1 - igamc_tab(table,k,s*(ti-deltblood))  ); 
       }
       else //(ti > deltblood + taub)
 	{
 	  if (casl) kcblood = 2 * exp(-deltblood/T_1b);
 	  else	    kcblood = 2 * exp(-ti/T_1b);
-	  kcblood *= ( igamc(k,s*(ti-deltblood-taub)) - igamc(k,s*(ti-deltblood)) ) ; 
+	  kcblood *= ( igamc_tab(table,k,s*(ti-deltblood-taub)) - igamc_tab(table,k,s*(ti-deltblood)) ) ; 
 	  
 	}
     
@@ -256,7 +257,7 @@ double kcblood_gallichan(const double ti,const double deltblood,const double tau
   double ResidModel_wellmix::resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const {
     // Well mixed single compartment
     // Buxton (1998) model
-    Tracer_Plus tr("OXASL::residmodel_wellmix");
+    //Tracer_Plus tr("OXASL::residmodel_wellmix");
 
     double T_1app = 1/( 1/T_1 + fcalib/lambda );
     return exp(-ti/T_1app);
@@ -265,7 +266,7 @@ double kcblood_gallichan(const double ti,const double deltblood,const double tau
 double ResidModel_simple::resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const {
     // Simple impermeable comparment
   // decays with T1b
-    Tracer_Plus tr("OXASL::residmodel_simple");
+    //Tracer_Plus tr("OXASL::residmodel_simple");
 
     return exp(-ti/T_1b);;
   }
@@ -273,7 +274,7 @@ double ResidModel_simple::resid(const double ti, const double fcalib, const doub
   double ResidModel_imperm::resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const {
     // impermeable compartment with transit time
     //decays with T1b
-    Tracer_Plus tr("OXASL::residmodel_imperm");
+    //Tracer_Plus tr("OXASL::residmodel_imperm");
 
     double transit = (residparam.Row(1)).AsScalar();
     double resid = exp(-ti/T_1b);
@@ -286,7 +287,7 @@ double ResidModel_simple::resid(const double ti, const double fcalib, const doub
     // No backflow from tissue to blood
     // no venous outflow
     // From Parkes & Tofts and also St. Lawrence 2000 - both models are the same under these assumptions
-    Tracer_Plus tr("OXASL::residmodel_twocpt");
+    //Tracer_Plus tr("OXASL::residmodel_twocpt");
 
     // extract residue function parameters
     double kw; //exchange rate = PS/vb
@@ -305,7 +306,7 @@ double ResidModel_simple::resid(const double ti, const double fcalib, const doub
     // Two compartment model - Single Pass Approximation from St. Lawrence (2000)
     // No backflow from tissue to blood
     // label starts to leave the cappilliary after a capilliary transit time
-    Tracer_Plus tr("OXASL::residmodel_spa");
+    //Tracer_Plus tr("OXASL::residmodel_spa");
 
 // extract residue function parameters
     double PS; double vb; double tauc;
@@ -546,17 +547,17 @@ double TissueModel_nodisp_spa::kctissue(const double ti,const double fcalib, con
       else if(ti >= delttiss && ti <= (delttiss + tau))
 	{
 	  kctissue = 2* 1/A * exp( -(T_1app*delttiss + (T_1app+T_1b)*ti)/(T_1app*T_1b) )*T_1app*T_1b*pow(B,-k)*
-	    (  exp(delttiss/T_1app + ti/T_1b) * pow(s*T_1app*T_1b,k) * ( 1 - igamc(k,B/(T_1app*T_1b)*(ti-delttiss)) ) +
-	       exp(delttiss/T_1b + ti/T_1app) * pow(B,k) * ( -1 + igamc(k,s*(ti-delttiss)) )  );  
+	    (  exp(delttiss/T_1app + ti/T_1b) * pow(s*T_1app*T_1b,k) * ( 1 - igamc_tab(table,k,B/(T_1app*T_1b)*(ti-delttiss)) ) +
+	       exp(delttiss/T_1b + ti/T_1app) * pow(B,k) * ( -1 + igamc_tab(table,k,s*(ti-delttiss)) )  );  
 	  
 	}
       else //(ti > delttiss + tau)
 	{
 	  kctissue = 2* 1/(A*B) *
 	    (  exp(-A/(T_1app*T_1b)*(delttiss+tau) - ti/T_1app)*T_1app*T_1b/C*
-	       (  pow(s,k)*T_1app*T_1b* ( -1 + exp( (-1/T_1app+1/T_1b)*tau )*( 1 - igamc(k,B/(T_1app*T_1b)*(ti-delttiss)) ) +
-					  igamc(k,B/(T_1app*T_1b)*(ti-delttiss-tau)) ) - 
-		  exp( -A/(T_1app*T_1b)*(ti-delttiss-tau) )*C*B * ( igamc(k,s*(ti-delttiss-tau)) - igamc(k,s*(ti-delttiss)) ) )  );
+	       (  pow(s,k)*T_1app*T_1b* ( -1 + exp( (-1/T_1app+1/T_1b)*tau )*( 1 - igamc_tab(table,k,B/(T_1app*T_1b)*(ti-delttiss)) ) +
+					  igamc_tab(table,k,B/(T_1app*T_1b)*(ti-delttiss-tau)) ) - 
+		  exp( -A/(T_1app*T_1b)*(ti-delttiss-tau) )*C*B * ( igamc_tab(table,k,s*(ti-delttiss-tau)) - igamc_tab(table,k,s*(ti-delttiss)) ) )  );
 	  
       //if (isnan(kctissue(it))) { kctissue(it)=0.0; cout << "Warning NaN in tissue KC"; }
 	}
@@ -689,6 +690,100 @@ double TissueModel_nodisp_spa::kctissue(const double ti,const double fcalib, con
   return kctissue;
  }
 
+// --- Tabulated igamc ---
+  const IgamcTable* IgamcTable::Get(double tolerance) {
+    // built once per tolerance and kept for the life of the program
+    static map<double, IgamcTable*> tables;
+    IgamcTable*& table = tables[tolerance];
+    if (!table) table = new IgamcTable(tolerance);
+    return table;
+  }
+
+  IgamcTable::IgamcTable(double tolerance) {
+    Tracer_Plus tr("OXASL::IgamcTable");
+    // x^k <= 1 below x=1 so errors in g are no larger in igamc; beyond x=61
+    // igamc is below 1e-14 for all k here
+    lower.lower = true;  lower.x0 = 0; lower.nx = 5;  
+    upper.lower = false; upper.x0 = 1; upper.nx = 121;
+    lower.dx = 0.25;
+    upper.dx = 0.5;
+    lower.nk = upper.nk = 11;
+    lower.dk = upper.dk = 1;
+    Refine(lower, tolerance);
+    Refine(upper, tolerance);
+  }
+
+  double IgamcTable::Grid::Exact(const double k, const double x) const {
+    if (!lower) return igamc(k,x);
+    // g(k,x) = e^-x / gamma(k+1) * sum_n x^n / ((k+1)...(k+n)), for x<=1
+    double term = 1, sum = 1;
+    for (int n=1; n<100 && term > 1e-17*sum; n++) {
+      term *= x/(k+n);
+      sum += term;
+    }
+    return exp(-x)/MISCMATHS::gamma(k+1)*sum;
+  }
+
+  void IgamcTable::Grid::Fill() {
+    v.resize(nk*nx);
+    for (int i=0; i<nk; i++)
+      for (int j=0; j<nx; j++)
+	v[i*nx+j] = Exact(1+i*dk, x0+j*dx);
+  }
+
+  // four point (cubic) Lagrange weights at u in [0,3]
+  static void CubicWeights(const double u, double* w) {
+    w[0] = -(u-1)*(u-2)*(u-3)/6;
+    w[1] = u*(u-2)*(u-3)/2;
+    w[2] = -u*(u-1)*(u-3)/2;
+    w[3] = u*(u-1)*(u-2)/6;
+  }
+
+  double IgamcTable::Grid::Interpolate(const double k, const double x) const {
+    const double fk = (k-1)/dk, fx = (x-x0)/dx;
+    const int bk = max(0, min(nk-4, int(fk)-1));
+    const int bx = max(0, min(nx-4, int(fx)-1));
+    double wk[4], wx[4];
+    CubicWeights(fk-bk, wk);
+    CubicWeights(fx-bx, wx);
+    double val = 0;
+    for (int i=0; i<4; i++) {
+      const double* row = &v[(bk+i)*nx + bx];
+      val += wk[i]*(wx[0]*row[0] + wx[1]*row[1] + wx[2]*row[2] + wx[3]*row[3]);
+    }
+    return val;
+  }
+
+  void IgamcTable::Refine(Grid& grid, double tolerance) {
+    // Halve the spacing in k and/or x until the values midway between the
+    // points are right.  At 4M entries we settle for what we have.
+    const double xspan = (grid.nx-1)*grid.dx;
+    while (true) {
+      grid.Fill();
+      double errk = 0, errx = 0;
+      for (int i=0; i<grid.nk; i++)
+	for (int j=0; j<grid.nx; j++) {
+	  const double k = 1+i*grid.dk, x = grid.x0+j*grid.dx;
+	  const double scale = grid.lower ? pow(x+0.5*grid.dx, k) : 1;
+	  if (i+1 < grid.nk) 
+	    errk = max(errk, fabs(grid.Interpolate(k+0.5*grid.dk,x) - grid.Exact(k+0.5*grid.dk,x)));
+	  if (j+1 < grid.nx) 
+	    errx = max(errx, scale*fabs(grid.Interpolate(k,x+0.5*grid.dx) - grid.Exact(k,x+0.5*grid.dx)));
+	}
+      const bool refinek = errk > 0.5*tolerance, refinex = errx > 0.5*tolerance;
+      if ((!refinek && !refinex) || 2*grid.nk*grid.nx > (1<<22)) break;
+      if (refinek) { grid.dk /= 2; grid.nk = 2*grid.nk-1; }
+      if (refinex) { grid.dx /= 2; grid.nx = int(xspan/grid.dx+0.5)+1; }
+    }
+  }
+
+  double IgamcTable::operator()(const double k, const double x) const {
+    if (k < 1 || k > 11 || x < 0) return igamc(k,x);
+    if (x <= 1) return 1 - pow(x,k)*lower.Interpolate(k,x);
+    if (x <= 61) return upper.Interpolate(k,x);
+    return igamc(k,x);
+  }
+
 // --- useful general functions ---
   double icgf(const double a,const double x) {
     Tracer_Plus tr("OXASL::icgf");
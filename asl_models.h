@@ -69,6 +69,8 @@
 #if !defined(asl_models_h)
 #define asl_models_h
 
+#include <vector>
+#include <string>
 #include "miscmaths/miscmaths.h"
 #include "miscmaths/miscprob.h"
 
@@ -80,6 +82,38 @@ using namespace Utilities;
 
 namespace OXASL {
 
+  // Tabulated igamc(k,x), the regularised upper incomplete gamma function
+  // behind the gamma dispersion kernels, for k=1+p*s in [1,11] (those 
+  // kernels cap sp at 10).  Cubic interpolation on a grid refined until it
+  // agrees with igamc to within the tolerance; igamc itself is used 
+  // outside the grid.
+  class IgamcTable {
+  public:
+    // tables are shared between models asking for the same tolerance
+    static const IgamcTable* Get(double tolerance);
+    double operator()(const double k, const double x) const;
+
+  private:
+    IgamcTable(double tolerance);
+    // Near x=0 igamc = 1 - x^k g(k,x) where g is smooth but x^k isn't, so
+    // g is tabulated there and igamc beyond
+    struct Grid {
+      bool lower;
+      double x0, dx, dk;
+      int nx, nk;
+      vector<double> v; // x fastest
+      double Exact(const double k, const double x) const;
+      double Interpolate(const double k, const double x) const;
+      void Fill();
+    };
+    Grid lower, upper;
+    void Refine(Grid& grid, double tolerance);
+  };
+
+  // igamc from the table if there is one
+  inline double igamc_tab(const IgamcTable* table, const double k, const double x)
+  { return table ? (*table)(k,x) : igamc(k,x); }
+
   // generic AIF model class
   class AIFModel {
   public:
@@ -106,10 +140,16 @@ namespace OXASL {
 
   class AIFModel_gammadisp : public AIFModel {
   public:
-    AIFModel_gammadisp() { priors.ReSize(4); priors << 2 << -0.3 << 10 << 10; }
+    // tolerance>0 uses a table for igamc (see IgamcTable)
+    AIFModel_gammadisp(double tolerance = 0) 
+      { priors.ReSize(4); priors << 2 << -0.3 << 10 << 10; 
+	table = (tolerance > 0) ? IgamcTable::Get(tolerance) : NULL; }
     virtual double kcblood(const double ti, const double deltblood, const double taub, const double T_1b, bool casl,const ColumnVector dispparam) const;
     virtual int NumDisp() const {return 2;}
     virtual string Name() const { return "Gamma dispersion kernel"; }
+
+  private:
+    const IgamcTable* table;
   };
 
   //  double kcblood_gvf(const double ti, const double deltblood,const double taub,const double T_1b, const double s, const double p, bool casl);
@@ -246,11 +286,17 @@ virtual double kctissue(const double ti,const double fcalib, const double deltti
 
   class TissueModel_gammadisp_wellmix : public TissueModel {
   public:
-    TissueModel_gammadisp_wellmix() { disppriors.ReSize(4); disppriors << 2 << -0.3 << 10 << 10; } 
+    // tolerance>0 uses a table for igamc (see IgamcTable)
+    TissueModel_gammadisp_wellmix(double tolerance = 0) 
+      { disppriors.ReSize(4); disppriors << 2 << -0.3 << 10 << 10; 
+	table = (tolerance > 0) ? IgamcTable::Get(tolerance) : NULL; } 
     virtual double kctissue(const double ti, const double fcalib, const double delttiss, const double tau, const double T_1b, const double T_1, const double lambda, const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const;
  virtual int NumDisp() const {return 2;}
  virtual int NumResid() const {return 0;}
   virtual string Name() const { return "Gamma kernel dispersion | Well mixed"; }
+
+  private:
+    const IgamcTable* table;
   };
 
 
@@ -0,0 +1,1271 @@
+/*  blochmcconnell.cc - Fast Bloch-McConnell solutions for the CEST model
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include "blochmcconnell.h"
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+
+// The loops over bmLanes are left for the compiler to vectorise.  With
+// GCC on x86-64 Linux the batched helpers are also built for AVX2 (one 
+// register holds all four lanes), and FMA from GCC 12, and the version 
+// the CPU supports is picked when the program loads.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#if __GNUC__ >= 12
+#define BM_LANES __attribute__((target_clones("arch=x86-64-v3", "default")))
+#elif __GNUC__ >= 6
+#define BM_LANES __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+#ifndef BM_LANES
+#define BM_LANES
+#endif
+
+// Dense helpers on the top-left n x n of the fixed-size matrices.  Most
+// come in a one-point (BMMatrix) and a batched (BMBatchMatrix) version, so
+// that the Pade approximant below can be written once for both.
+
+static void Multiply(const BMMatrix& x, const BMMatrix& y, BMMatrix& out)
+{
+  // out mustn't be x or y
+  const int n = x.n;
+  out.n = n;
+  for (int i = 0; i < n; i++)
+    {
+      double* o = out[i];
+      for (int j = 0; j < n; j++) o[j] = 0;
+      for (int k = 0; k < n; k++)
+        {
+          const double xik = x[i][k];
+          if (xik == 0) continue; // the exchange blocks are mostly empty
+          const double* yk = y[k];
+          for (int j = 0; j < n; j++) o[j] += xik * yk[j];
+        }
+    }
+}
+
+BM_LANES static void Multiply(const BMBatchMatrix& x, const BMBatchMatrix& y, BMBatchMatrix& out)
+{
+  const int n = x.n;
+  out.n = n;
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < n; j++)
+      {
+        // Accumulate in a local so the lanes stay in registers
+        double sum[bmLanes] = { 0 };
+        for (int k = 0; k < n; k++)
+          {
+            const double* xik = x(i, k);
+            const double* ykj = y(k, j);
+            for (int l = 0; l < bmLanes; l++) sum[l] += xik[l] * ykj[l];
+          }
+        double* o = out(i, j);
+        for (int l = 0; l < bmLanes; l++) o[l] = sum[l];
+      }
+}
+
+// Products of pulse maps, which start with the crushers: only the z
+// columns (j % 3 == 2) of y are nonzero, so only those of out are worked
+// out.  For squaring, x = y and only its z columns are summed over too.
+static void MultiplyCrushed(const BMMatrix& x, const BMMatrix& y, bool square,
+                            BMMatrix& out)
+{
+  const int n = x.n, k0 = square ? 2 : 0, kstep = square ? 3 : 1;
+  out.n = n;
+  for (int i = 0; i < n; i++)
+    {
+      for (int j = 0; j < n; j++) out[i][j] = 0;
+      for (int j = 2; j < n; j += 3)
+        {
+          double sum = 0;
+          for (int k = k0; k < n; k += kstep) sum += x[i][k] * y[k][j];
+          out[i][j] = sum;
+        }
+    }
+}
+
+BM_LANES static void MultiplyCrushed(const BMBatchMatrix& x, const BMBatchMatrix& y,
+                                     bool square, BMBatchMatrix& out)
+{
+  const int n = x.n, k0 = square ? 2 : 0, kstep = square ? 3 : 1;
+  out.n = n;
+  for (int e = 0; e < n * n * bmLanes; e++) out.v[e] = 0;
+  for (int i = 0; i < n; i++)
+    for (int j = 2; j < n; j += 3)
+      {
+        double sum[bmLanes] = { 0 };
+        for (int k = k0; k < n; k += kstep)
+          {
+            const double* xik = x(i, k);
+            const double* ykj = y(k, j);
+            for (int l = 0; l < bmLanes; l++) sum[l] += xik[l] * ykj[l];
+          }
+        double* o = out(i, j);
+        for (int l = 0; l < bmLanes; l++) o[l] = sum[l];
+      }
+}
+
+static void MultiplyVector(const BMMatrix& x, const double* v, double* out)
+{
+  for (int i = 0; i < x.n; i++)
+    {
+      double sum = 0;
+      for (int k = 0; k < x.n; k++) sum += x[i][k] * v[k];
+      out[i] = sum;
+    }
+}
+
+// Vectors for a batch are n x bmLanes, lane innermost
+BM_LANES static void MultiplyVector(const BMBatchMatrix& x, const double* v, double* out)
+{
+  for (int i = 0; i < x.n; i++)
+    {
+      double* o = out + i * bmLanes;
+      for (int l = 0; l < bmLanes; l++) o[l] = 0;
+      for (int k = 0; k < x.n; k++)
+        for (int l = 0; l < bmLanes; l++) 
+          o[l] += x(i, k)[l] * v[k * bmLanes + l];
+    }
+}
+
+// out = (add ? out : 0) + c1 X1 + c2 X2 + c3 X3
+static void Combine(BMMatrix& out, bool add, double c1, const BMMatrix& X1,
+                    double c2, const BMMatrix& X2, double c3, const BMMatrix& X3)
+{
+  out.n = X1.n;
+  for (int i = 0; i < out.n; i++)
+    for (int j = 0; j < out.n; j++)
+      out[i][j] = (add ? out[i][j] : 0) 
+        + c1 * X1[i][j] + c2 * X2[i][j] + c3 * X3[i][j];
+}
+
+BM_LANES static void Combine(BMBatchMatrix& out, bool add, double c1, const BMBatchMatrix& X1,
+                    double c2, const BMBatchMatrix& X2, double c3, const BMBatchMatrix& X3)
+{
+  out.n = X1.n;
+  const int size = out.n * out.n * bmLanes;
+  for (int e = 0; e < size; e++)
+    out.v[e] = (add ? out.v[e] : 0) + c1 * X1.v[e] + c2 * X2.v[e] + c3 * X3.v[e];
+}
+
+static void AddIdentity(BMMatrix& X, double c)
+{
+  for (int i = 0; i < X.n; i++) X[i][i] += c;
+}
+
+static void AddIdentity(BMBatchMatrix& X, double c)
+{
+  for (int i = 0; i < X.n; i++)
+    for (int l = 0; l < bmLanes; l++) X(i, i)[l] += c;
+}
+
+static void Scale(BMMatrix& X, double c)
+{
+  for (int i = 0; i < X.n; i++)
+    for (int j = 0; j < X.n; j++) X[i][j] *= c;
+}
+
+static void Scale(BMBatchMatrix& X, double c)
+{
+  for (int e = 0; e < X.n * X.n * bmLanes; e++) X.v[e] *= c;
+}
+
+static double Norm1(const BMMatrix& x)
+{
+  double norm = 0;
+  for (int j = 0; j < x.n; j++)
+    {
+      double sum = 0;
+      for (int i = 0; i < x.n; i++) sum += fabs(x[i][j]);
+      norm = max(norm, sum);
+    }
+  return norm;
+}
+
+// The largest over the lanes
+static double Norm1(const BMBatchMatrix& x)
+{
+  double norm = 0;
+  for (int j = 0; j < x.n; j++)
+    {
+      double sum[bmLanes] = { 0 };
+      for (int i = 0; i < x.n; i++)
+        for (int l = 0; l < bmLanes; l++) sum[l] += fabs(x(i, j)[l]);
+      for (int l = 0; l < bmLanes; l++) norm = max(norm, sum[l]);
+    }
+  return norm;
+}
+
+// LU decomposition with partial pivoting, in place; piv[k] is the row
+// swapped with row k at step k
+static void Factorise(BMMatrix& lu, int* piv)
+{
+  const int n = lu.n;
+  for (int k = 0; k < n; k++)
+    {
+      int p = k;
+      for (int i = k + 1; i < n; i++)
+        if (fabs(lu[i][k]) > fabs(lu[p][k])) p = i;
+      if (lu[p][k] == 0)
+        throw overflow_error("Singular matrix in the Bloch-McConnell equations");
+      piv[k] = p;
+      if (p != k)
+        for (int j = 0; j < n; j++) swap(lu[p][j], lu[k][j]);
+      const double inv = 1.0 / lu[k][k];
+      for (int i = k + 1; i < n; i++)
+        {
+          const double l = (lu[i][k] *= inv);
+          if (l == 0) continue;
+          for (int j = k + 1; j < n; j++) lu[i][j] -= l * lu[k][j];
+        }
+    }
+}
+
+// Solve A x = b, overwriting b with x
+static void Solve(BMMatrix A, double* b)
+{
+  const int n = A.n;
+  int piv[bmMaxDim];
+  Factorise(A, piv);
+  for (int k = 0; k < n; k++)
+    swap(b[k], b[piv[k]]);
+  for (int i = 1; i < n; i++)
+    for (int k = 0; k < i; k++) b[i] -= A[i][k] * b[k];
+  for (int i = n - 1; i >= 0; i--)
+    {
+      for (int k = i + 1; k < n; k++) b[i] -= A[i][k] * b[k];
+      b[i] /= A[i][i];
+    }
+}
+
+// Solve A X = B, overwriting B with X (a row at a time, so the inner
+// loops run along rows)
+static void Solve(BMMatrix A, BMMatrix& B)
+{
+  const int n = A.n;
+  int piv[bmMaxDim];
+  Factorise(A, piv);
+  for (int k = 0; k < n; k++)
+    if (piv[k] != k)
+      for (int j = 0; j < n; j++) swap(B[k][j], B[piv[k]][j]);
+  for (int i = 1; i < n; i++)
+    for (int k = 0; k < i; k++)
+      {
+        const double l = A[i][k];
+        if (l == 0) continue;
+        for (int j = 0; j < n; j++) B[i][j] -= l * B[k][j];
+      }
+  for (int i = n - 1; i >= 0; i--)
+    {
+      for (int k = i + 1; k < n; k++)
+        {
+          const double u = A[i][k];
+          if (u == 0) continue;
+          for (int j = 0; j < n; j++) B[i][j] -= u * B[k][j];
+        }
+      const double inv = 1.0 / A[i][i];
+      for (int j = 0; j < n; j++) B[i][j] *= inv;
+    }
+}
+
+// The same for a batch.  Each lane picks its own pivots, so the row swaps
+// are done lane by lane, but the elimination runs across the lanes; it is
+// the same arithmetic as Factorise on each lane.  piv is n x bmLanes.
+BM_LANES static void Factorise(BMBatchMatrix& lu, int* piv)
+{
+  const int n = lu.n;
+  for (int k = 0; k < n; k++)
+    {
+      double inv[bmLanes];
+      for (int l = 0; l < bmLanes; l++)
+        {
+          int p = k;
+          for (int i = k + 1; i < n; i++)
+            if (fabs(lu(i, k)[l]) > fabs(lu(p, k)[l])) p = i;
+          if (lu(p, k)[l] == 0)
+            throw overflow_error("Singular matrix in the Bloch-McConnell equations");
+          piv[k * bmLanes + l] = p;
+          if (p != k)
+            for (int j = 0; j < n; j++) swap(lu(p, j)[l], lu(k, j)[l]);
+          inv[l] = 1.0 / lu(k, k)[l];
+        }
+      for (int i = k + 1; i < n; i++)
+        {
+          double* lik = lu(i, k);
+          for (int l = 0; l < bmLanes; l++) lik[l] *= inv[l];
+          for (int j = k + 1; j < n; j++)
+            {
+              double* lij = lu(i, j);
+              const double* lkj = lu(k, j);
+              for (int l = 0; l < bmLanes; l++) lij[l] -= lik[l] * lkj[l];
+            }
+        }
+    }
+}
+
+// Solve A x = b for each lane, overwriting b (n x bmLanes) with x
+BM_LANES static void Solve(const BMBatchMatrix& A, double* b)
+{
+  const int n = A.n;
+  BMBatchMatrix lu(A);
+  int piv[bmMaxDim * bmLanes];
+  Factorise(lu, piv);
+  for (int k = 0; k < n; k++)
+    for (int l = 0; l < bmLanes; l++)
+      swap(b[k * bmLanes + l], b[piv[k * bmLanes + l] * bmLanes + l]);
+  for (int i = 1; i < n; i++)
+    for (int k = 0; k < i; k++)
+      for (int l = 0; l < bmLanes; l++) 
+        b[i * bmLanes + l] -= lu(i, k)[l] * b[k * bmLanes + l];
+  for (int i = n - 1; i >= 0; i--)
+    {
+      for (int k = i + 1; k < n; k++)
+        for (int l = 0; l < bmLanes; l++) 
+          b[i * bmLanes + l] -= lu(i, k)[l] * b[k * bmLanes + l];
+      for (int l = 0; l < bmLanes; l++) b[i * bmLanes + l] /= lu(i, i)[l];
+    }
+}
+
+// Solve A X = B for each lane, overwriting B with X
+BM_LANES static void Solve(const BMBatchMatrix& A, BMBatchMatrix& B)
+{
+  const int n = A.n;
+  BMBatchMatrix lu(A);
+  int piv[bmMaxDim * bmLanes];
+  Factorise(lu, piv);
+  for (int k = 0; k < n; k++)
+    for (int l = 0; l < bmLanes; l++)
+      {
+        const int p = piv[k * bmLanes + l];
+        if (p != k)
+          for (int j = 0; j < n; j++) swap(B(k, j)[l], B(p, j)[l]);
+      }
+  // Each element is accumulated in registers over k (the rows it depends
+  // on are already done), as in Multiply
+  for (int i = 1; i < n; i++)
+    for (int j = 0; j < n; j++)
+      {
+        double sum[bmLanes] = { 0 };
+        for (int k = 0; k < i; k++)
+          for (int l = 0; l < bmLanes; l++) sum[l] += lu(i, k)[l] * B(k, j)[l];
+        double* bij = B(i, j);
+        for (int l = 0; l < bmLanes; l++) bij[l] -= sum[l];
+      }
+  for (int i = n - 1; i >= 0; i--)
+    {
+      const double* uii = lu(i, i);
+      double inv[bmLanes];
+      for (int l = 0; l < bmLanes; l++) inv[l] = 1.0 / uii[l];
+      for (int j = 0; j < n; j++)
+        {
+          double sum[bmLanes] = { 0 };
+          for (int k = i + 1; k < n; k++)
+            for (int l = 0; l < bmLanes; l++) sum[l] += lu(i, k)[l] * B(k, j)[l];
+          double* bij = B(i, j);
+          for (int l = 0; l < bmLanes; l++) bij[l] = (bij[l] - sum[l]) * inv[l];
+        }
+    }
+}
+
+// Pade approximant of degree m to exp(A): (V-U)^-1 (V+U), where U and V
+// are the odd and even parts of the numerator polynomial
+template <class M>
+static void PadeApproximant(const M& A, int m, M& X)
+{
+  static const double b3[] = { 120, 60, 12, 1 };
+  static const double b5[] = { 30240, 15120, 3360, 420, 30, 1 };
+  static const double b7[] = { 17297280, 8648640, 1995840, 277200, 25200, 1512, 56, 1 };
+  static const double b9[] = { 17643225600.0, 8821612800.0, 2075673600, 302702400,
+                               30270240, 2162160, 110880, 3960, 90, 1 };
+  static const double b13[] = { 64764752532480000.0, 32382376266240000.0, 
+                                7771770303897600.0, 1187353796428800.0, 
+                                129060195264000.0, 10559470521600.0, 
+                                670442572800.0, 33522128640.0, 1323241920, 
+                                40840800, 960960, 16380, 182, 1 };
+  const int n = A.n;
+  M A2(n), U(n), V(n), T(n);
+  Multiply(A, A, A2);
+
+  if (m == 13)
+    {
+      const double* b = b13;
+      M A4(n), A6(n);
+      Multiply(A2, A2, A4);
+      Multiply(A2, A4, A6);
+      Combine(T, false, b[13], A6, b[11], A4, b[9], A2);
+      Combine(X, false, b[12], A6, b[10], A4, b[8], A2);
+      Multiply(A6, T, U);
+      Multiply(A6, X, V);
+      Combine(U, true, b[7], A6, b[5], A4, b[3], A2);
+      Combine(V, true, b[6], A6, b[4], A4, b[2], A2);
+      AddIdentity(U, b[1]);
+      AddIdentity(V, b[0]);
+    }
+  else
+    {
+      const double* b = (m == 3) ? b3 : (m == 5) ? b5 : (m == 7) ? b7 : b9;
+      // Horner's rule in A^2
+      Combine(U, false, b[m], A2, 0, A2, 0, A2);
+      Combine(V, false, b[m-1], A2, 0, A2, 0, A2);
+      for (int k = m - 2; k >= 1; k -= 2)
+        {
+          AddIdentity(U, b[k]);
+          AddIdentity(V, b[k-1]);
+          if (k == 1) break;
+          Multiply(U, A2, T); U = T;
+          Multiply(V, A2, T); V = T;
+        }
+    }
+
+  Multiply(A, U, T); // U is A times the odd part
+  Combine(X, false, 1, V, 1, T, 0, T);
+  Combine(U, false, 1, V, -1, T, 0, T);
+  Solve(U, X);
+}
+
+// exp(At), given At and its 1-norm (overwriting At)
+template <class M>
+static void ExpmScaled(M& At, double norm, M& X)
+{
+  static const int mvals[5] = { 3, 5, 7, 9, 13 };
+  static const double thetam[5] = { 1.495585217958292e-002, 2.539398330063230e-001,
+                                    9.504178996162932e-001, 2.097847961257068e+000,
+                                    5.371920351148152e+000 };
+  X.n = At.n;
+  for (int i = 0; i < 4; i++)
+    if (norm <= thetam[i])
+      {
+        PadeApproximant(At, mvals[i], X);
+        return;
+      }
+
+  // Degree 13 with scaling and squaring
+  const int s = max(0, int(ceil(log2(norm / thetam[4]))));
+  Scale(At, ldexp(1.0, -s));
+  PadeApproximant(At, 13, X);
+  M T(At.n);
+  for (int i = 0; i < s; i++)
+    {
+      Multiply(X, X, T);
+      X = T;
+    }
+}
+
+// exp(At) = e^mu exp(At - mu I).  The norm is set by the fastest 
+// relaxation (a semisolid pool's R2), so taking mu from the middle of the
+// diagonal's range about halves it and saves a squaring.  |mu| is kept to 
+// 300 so that exp(At - mu I) stays far from overflowing.
+static double DiagonalShift(double lo, double hi)
+{
+  return max(-300.0, min(300.0, 0.5 * (lo + hi)));
+}
+
+void BlochMcConnell::Expm(const BMMatrix& A, double t, BMMatrix& X)
+{
+  const int n = A.n;
+  BMMatrix At(A);
+  Scale(At, t);
+  double lo = At[0][0], hi = At[0][0];
+  for (int i = 1; i < n; i++)
+    {
+      lo = min(lo, At[i][i]);
+      hi = max(hi, At[i][i]);
+    }
+  const double mu = DiagonalShift(lo, hi);
+  for (int i = 0; i < n; i++) At[i][i] -= mu;
+  ExpmScaled(At, Norm1(At), X);
+  Scale(X, exp(mu));
+}
+
+// Every lane gets the degree and scaling its largest norm needs, which
+// only makes the others a little more accurate
+void BlochMcConnell::Expm(const BMBatchMatrix& A, const double* t, BMBatchMatrix& X)
+{
+  const int n = A.n;
+  BMBatchMatrix At(n);
+  for (int e = 0; e < n * n; e++)
+    for (int l = 0; l < bmLanes; l++)
+      At.v[e * bmLanes + l] = A.v[e * bmLanes + l] * t[l];
+  double mu[bmLanes], scale[bmLanes];
+  for (int l = 0; l < bmLanes; l++)
+    {
+      double lo = At(0, 0)[l], hi = At(0, 0)[l];
+      for (int i = 1; i < n; i++)
+        {
+          lo = min(lo, At(i, i)[l]);
+          hi = max(hi, At(i, i)[l]);
+        }
+      mu[l] = DiagonalShift(lo, hi);
+      scale[l] = exp(mu[l]);
+      for (int i = 0; i < n; i++) At(i, i)[l] -= mu[l];
+    }
+  ExpmScaled(At, Norm1(At), X);
+  for (int e = 0; e < n * n; e++)
+    for (int l = 0; l < bmLanes; l++) X.v[e * bmLanes + l] *= scale[l];
+}
+
+static void Transpose(const BMMatrix& X, BMMatrix& T)
+{
+  T.n = X.n;
+  for (int i = 0; i < X.n; i++)
+    for (int j = 0; j < X.n; j++) T[j][i] = X[i][j];
+}
+
+void BlochMcConnell::ExpmFrechet(const BMMatrix& A, const BMMatrix& H, BMMatrix& L)
+{
+  // Differentiating each step of the Pade approximant and the squaring, 
+  // alongside the steps themselves (their algorithm 6.4)
+  static const double thetam[5] = { 1.495585217958292e-002, 2.539398330063230e-001,
+                                    9.504178996162932e-001, 2.097847961257068e+000,
+                                    5.371920351148152e+000 };
+  static const double b[] = { 64764752532480000.0, 32382376266240000.0, 
+                              7771770303897600.0, 1187353796428800.0, 
+                              129060195264000.0, 10559470521600.0, 
+                              670442572800.0, 33522128640.0, 1323241920, 
+                              40840800, 960960, 16380, 182, 1 };
+  static const double b3[] = { 120, 60, 12, 1 };
+  static const double b5[] = { 30240, 15120, 3360, 420, 30, 1 };
+  static const double b7[] = { 17297280, 8648640, 1995840, 277200, 25200, 1512, 56, 1 };
+  static const double b9[] = { 17643225600.0, 8821612800.0, 2075673600, 302702400,
+                               30270240, 2162160, 110880, 3960, 90, 1 };
+  const int n = A.n;
+  BMMatrix X(A), E(H);
+  const double norm = Norm1(X);
+  int m = 13, s = 0;
+  const int mvals[4] = { 3, 5, 7, 9 };
+  for (int i = 3; i >= 0; i--)
+    if (norm <= thetam[i]) m = mvals[i];
+  if (m == 13)
+    {
+      s = max(0, int(ceil(log2(norm / thetam[4]))));
+      Scale(X, ldexp(1.0, -s));
+      Scale(E, ldexp(1.0, -s));
+    }
+
+  BMMatrix A2(n), M2(n), T(n), U(n), V(n), W(n), Lu(n), Lv(n), Lw(n);
+  Multiply(X, X, A2);
+  Multiply(X, E, M2);
+  Multiply(E, X, T);
+  Combine(M2, true, 1, T, 0, T, 0, T);
+
+  if (m == 13)
+    {
+      BMMatrix A4(n), A6(n), M4(n), M6(n), W1(n), Z1(n);
+      Multiply(A2, A2, A4);
+      Multiply(A4, A2, A6);
+      Multiply(A2, M2, M4);
+      Multiply(M2, A2, T);
+      Combine(M4, true, 1, T, 0, T, 0, T);
+      Multiply(A4, M2, M6);
+      Multiply(M4, A2, T);
+      Combine(M6, true, 1, T, 0, T, 0, T);
+
+      Combine(W1, false, b[13], A6, b[11], A4, b[9], A2);
+      Combine(Z1, false, b[12], A6, b[10], A4, b[8], A2);
+      Multiply(A6, W1, W);
+      Combine(W, true, b[7], A6, b[5], A4, b[3], A2);
+      AddIdentity(W, b[1]);
+      Multiply(A6, Z1, V);
+      Combine(V, true, b[6], A6, b[4], A4, b[2], A2);
+      AddIdentity(V, b[0]);
+
+      BMMatrix Lw1(n), Lz1(n);
+      Combine(Lw1, false, b[13], M6, b[11], M4, b[9], M2);
+      Combine(Lz1, false, b[12], M6, b[10], M4, b[8], M2);
+      Multiply(A6, Lw1, Lw);
+      Multiply(M6, W1, T);
+      Combine(Lw, true, 1, T, b[7], M6, b[5], M4);
+      Combine(Lw, true, b[3], M2, 0, T, 0, T);
+      Multiply(A6, Lz1, Lv);
+      Multiply(M6, Z1, T);
+      Combine(Lv, true, 1, T, b[6], M6, b[4], M4);
+      Combine(Lv, true, b[2], M2, 0, T, 0, T);
+    }
+  else
+    {
+      // Powers of A^2 and their derivatives, for Horner-free sums
+      const double* c = (m == 3) ? b3 : (m == 5) ? b5 : (m == 7) ? b7 : b9;
+      const int k = (m - 1) / 2;
+      BMMatrix P[5], Md[5];
+      P[1] = A2;
+      Md[1] = M2;
+      for (int j = 2; j <= k; j++)
+        {
+          Multiply(P[j-1], A2, P[j]);
+          Multiply(P[j-1], M2, Md[j]);
+          Multiply(Md[j-1], A2, T);
+          Combine(Md[j], true, 1, T, 0, T, 0, T);
+        }
+      Combine(W, false, 0, A2, 0, A2, 0, A2);
+      Combine(V, false, 0, A2, 0, A2, 0, A2);
+      Combine(Lw, false, 0, A2, 0, A2, 0, A2);
+      Combine(Lv, false, 0, A2, 0, A2, 0, A2);
+      AddIdentity(W, c[1]);
+      AddIdentity(V, c[0]);
+      for (int j = 1; j <= k; j++)
+        {
+          Combine(W, true, c[2*j+1], P[j], 0, T, 0, T);
+          Combine(V, true, c[2*j], P[j], 0, T, 0, T);
+          Combine(Lw, true, c[2*j+1], Md[j], 0, T, 0, T);
+          Combine(Lv, true, c[2*j], Md[j], 0, T, 0, T);
+        }
+    }
+
+  // U = X W and its derivative
+  Multiply(X, W, U);
+  Multiply(X, Lw, Lu);
+  Multiply(E, W, T);
+  Combine(Lu, true, 1, T, 0, T, 0, T);
+
+  // R = (V-U)^-1 (V+U), L = (V-U)^-1 (Lu + Lv + (Lu - Lv) R)
+  BMMatrix Q(n), R(n);
+  Combine(Q, false, 1, V, -1, U, 0, U);
+  Combine(R, false, 1, V, 1, U, 0, U);
+  Solve(Q, R);
+  Combine(T, false, 1, Lu, -1, Lv, 0, Lv);
+  Multiply(T, R, L);
+  Combine(L, true, 1, Lu, 1, Lv, 0, Lv);
+  Solve(Q, L);
+
+  // Undo the scaling: exp(2X) = exp(X)^2, so L(2X) = R L + L R
+  for (int i = 0; i < s; i++)
+    {
+      Multiply(R, L, T);
+      Multiply(L, R, U);
+      Combine(L, false, 1, T, 1, U, 0, U);
+      Multiply(R, R, T);
+      R = T;
+    }
+}
+
+CESTPulse::CESTPulse(const ColumnVector& pmag, const ColumnVector& pt)
+{
+  const int nseg = pmag.Nrows();
+  for (int s = 1; s <= nseg; s++)
+    {
+      unsigned u = 0;
+      while (u < mag.size() && !(mag[u] == pmag(s) && dur[u] == pt(s)))
+        u++;
+      if (u == mag.size())
+        {
+          mag.push_back(pmag(s));
+          dur.push_back(pt(s));
+        }
+      order.push_back(u);
+    }
+  // A very long last segment means continuous saturation (as without 
+  // --ptrain): it lasts for tsat, rather than tsat counting pulses
+  continuous = nseg > 0 && pt(nseg) > 1e6;
+}
+
+BlochMcConnell::BlochMcConnell(const ColumnVector& M0, const Matrix& kij, 
+                               const Matrix& T12)
+  : npool(M0.Nrows()), n(3 * npool), A0(n), waterExchangeOnly(true)
+{
+  if (npool > bmMaxPools)
+    throw invalid_argument("Too many pools for the Bloch-McConnell solver");
+
+  for (int i = 0; i < n; i++)
+    {
+      for (int j = 0; j < n; j++) A0[i][j] = 0;
+      B[i] = M0i[i] = 0;
+    }
+  for (int i = 0; i < npool; i++)
+    {
+      const int st = 3 * i;
+      double kout = 0;
+      for (int j = 1; j <= npool; j++) kout += kij(i+1, j);
+      A0[st][st] = A0[st+1][st+1] = -(1/T12(2, i+1) + kout);
+      A0[st+2][st+2] = -(1/T12(1, i+1) + kout);
+      for (int j = 0; j < npool; j++)
+        if (j != i)
+          {
+            for (int d = 0; d < 3; d++)
+              A0[st+d][3*j+d] = kij(j+1, i+1); //NB 'reversal' of indices is correct here
+            if (i > 0 && j > 0 && kij(j+1, i+1) != 0)
+              waterExchangeOnly = false;
+          }
+      M0i[st+2] = M0(i+1);
+      R1[i] = 1 / T12(1, i+1);
+      B[st+2] = M0(i+1) * R1[i];
+    }
+}
+
+void BlochMcConnell::SystemMatrix(const double* wi, double w, double w1, 
+                                  BMMatrix& A) const
+{
+  A.n = n;
+  for (int i = 0; i < n; i++)
+    copy(A0[i], A0[i] + n, A[i]);
+  for (int i = 0; i < npool; i++)
+    {
+      const int st = 3 * i;
+      A[st][st+1] = -(wi[i] - w);
+      A[st+1][st] = wi[i] - w;
+      A[st+1][st+2] = -w1;
+      A[st+2][st+1] = w1;
+    }
+}
+
+void BlochMcConnell::SystemMatrix(const double* wi, const double* w, 
+                                  const double* w1, BMBatchMatrix& A) const
+{
+  A.n = n;
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < n; j++)
+      for (int l = 0; l < bmLanes; l++) A(i, j)[l] = A0[i][j];
+  for (int i = 0; i < npool; i++)
+    {
+      const int st = 3 * i;
+      for (int l = 0; l < bmLanes; l++)
+        {
+          const double dw = wi[i * bmLanes + l] - w[l];
+          A(st, st+1)[l] = -dw;
+          A(st+1, st)[l] = dw;
+          A(st+1, st+2)[l] = -w1[l];
+          A(st+2, st+1)[l] = w1[l];
+        }
+    }
+}
+
+double BlochMcConnell::SteadyStateMz(const double* wi, double w, double w1) const
+{
+  // A M + B = 0
+  BMMatrix A;
+  SystemMatrix(wi, w, w1, A);
+  double M[bmMaxDim];
+  for (int i = 0; i < n; i++) M[i] = -B[i];
+  Solve(A, M);
+  return M[2]; // only want the z-component of the water pool
+}
+
+double BlochMcConnell::PulsedMz(const CESTPulse& pulse, const double* wi, 
+                                double w, double w1, double tsat) const
+{
+  const int npulse = pulse.Continuous() ? 1 : int(tsat); // else tsat counts pulses
+  if (npulse < 1 || pulse.order.empty())
+    return M0i[2];
+
+  // Each segment takes M to E (M + A^-1 B) - A^-1 B, i.e. E M + d.  Work
+  // these out once for each distinct segment.
+  const int nDistinct = pulse.NumDistinct();
+  vector<BMMatrix> E(nDistinct);
+  vector<double> d(nDistinct * bmMaxDim);
+  BMMatrix A;
+  for (int u = 0; u < nDistinct; u++)
+    {
+      SystemMatrix(wi, w, w1 * pulse.mag[u], A);
+      const double tseg = pulse.dur[u] > 1e6 ? tsat : pulse.dur[u];
+      Expm(A, tseg, E[u]);
+      double AiB[bmMaxDim];
+      copy(B, B + n, AiB);
+      Solve(A, AiB);
+      MultiplyVector(E[u], AiB, &d[u * bmMaxDim]);
+      for (int i = 0; i < n; i++) d[u * bmMaxDim + i] -= AiB[i];
+    }
+
+  // So a whole pulse is also affine, M -> T M + c, starting with the 
+  // crusher gradients zeroing the transverse magnetizations (and so the 
+  // x and y columns of T)
+  BMMatrix T(n), next(n);
+  double c[bmMaxDim], cnext[bmMaxDim];
+  for (int i = 0; i < n; i++)
+    {
+      for (int j = 0; j < n; j++) T[i][j] = (i == j && i % 3 == 2) ? 1 : 0;
+      c[i] = 0;
+    }
+  for (unsigned s = 0; s < pulse.order.size(); s++)
+    {
+      const int u = pulse.order[s];
+      MultiplyCrushed(E[u], T, false, next);
+      T = next;
+      MultiplyVector(E[u], c, cnext);
+      for (int i = 0; i < n; i++) c[i] = cnext[i] + d[u * bmMaxDim + i];
+    }
+
+  // The train is that map npulse times over.  Powers of one map commute, 
+  // so square it for each bit of npulse, applying it to M where the bit 
+  // is set: log2(npulse) products rather than npulse.
+  double M[bmMaxDim], Mnext[bmMaxDim];
+  copy(M0i, M0i + n, M);
+  for (int bits = npulse; bits > 0; bits >>= 1)
+    {
+      if (bits & 1)
+        {
+          MultiplyVector(T, M, Mnext);
+          for (int i = 0; i < n; i++) M[i] = Mnext[i] + c[i];
+        }
+      if (bits > 1)
+        {
+          // (T, c) o (T, c) = (T T, T c + c)
+          MultiplyVector(T, c, cnext);
+          for (int i = 0; i < n; i++) c[i] += cnext[i];
+          MultiplyCrushed(T, T, true, next);
+          T = next;
+        }
+    }
+  return M[2];
+}
+
+// Abar is d(Mz)/dA for a system matrix with B1 amplitude mag*w1
+void BlochMcConnell::AddSensitivity(const BMMatrix& Abar, double mag, 
+                                    Sensitivity& g) const
+{
+  for (int i = 0; i < npool; i++)
+    {
+      const int st = 3 * i;
+      const double diag = Abar[st][st] + Abar[st+1][st+1] + Abar[st+2][st+2];
+      g.dR2[i] -= Abar[st][st] + Abar[st+1][st+1];
+      g.dR1[i] -= Abar[st+2][st+2];
+      g.dwi[i] += Abar[st+1][st] - Abar[st][st+1];
+      g.dw1 += mag * (Abar[st+2][st+1] - Abar[st+1][st+2]);
+      // Exchange out of pool i adds to its relaxation, and into pool j
+      for (int j = 0; j < npool; j++)
+        {
+          g.dk[i][j] -= diag;
+          if (j != i)
+            for (int d = 0; d < 3; d++) g.dk[i][j] += Abar[3*j+d][st+d];
+        }
+    }
+}
+
+static void ClearSensitivity(BlochMcConnell::Sensitivity& g)
+{
+  for (int i = 0; i < bmMaxPools; i++)
+    {
+      g.dM0[i] = g.dR1[i] = g.dR2[i] = g.dwi[i] = 0;
+      for (int j = 0; j < bmMaxPools; j++) g.dk[i][j] = 0;
+    }
+  g.dw1 = 0;
+}
+
+double BlochMcConnell::SteadyStateGradient(const double* wi, double w, double w1,
+                                           Sensitivity& g) const
+{
+  // A M = -B, so dMz = -lambda' (dA M + dB) where A' lambda = e3
+  ClearSensitivity(g);
+  BMMatrix A, At, Abar(n);
+  SystemMatrix(wi, w, w1, A);
+  Transpose(A, At);
+  double M[bmMaxDim], lambda[bmMaxDim];
+  for (int i = 0; i < n; i++)
+    {
+      M[i] = -B[i];
+      lambda[i] = (i == 2) ? 1 : 0;
+    }
+  Solve(A, M);
+  Solve(At, lambda);
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < n; j++) Abar[i][j] = -lambda[i] * M[j];
+  AddSensitivity(Abar, 1, g);
+  // B = M0 / T1 for each pool's z
+  for (int i = 0; i < npool; i++)
+    {
+      g.dM0[i] -= lambda[3*i+2] * R1[i];
+      g.dR1[i] -= lambda[3*i+2] * M0i[3*i+2];
+    }
+  return M[2];
+}
+
+double BlochMcConnell::PulsedGradient(const CESTPulse& pulse, const double* wi, 
+                                      double w, double w1, double tsat,
+                                      Sensitivity& g) const
+{
+  ClearSensitivity(g);
+  const int npulse = pulse.Continuous() ? 1 : int(tsat);
+  const int nseg = pulse.order.size();
+  if (npulse < 1 || nseg == 0)
+    {
+      g.dM0[0] = 1;
+      return M0i[2];
+    }
+
+  // Each segment is M -> E x - b, with x = M + b and b = A^-1 B
+  const int nDistinct = pulse.NumDistinct();
+  vector<BMMatrix> A(nDistinct), E(nDistinct);
+  vector<double> b(nDistinct * bmMaxDim), tseg(nDistinct);
+  for (int u = 0; u < nDistinct; u++)
+    {
+      SystemMatrix(wi, w, w1 * pulse.mag[u], A[u]);
+      tseg[u] = pulse.dur[u] > 1e6 ? tsat : pulse.dur[u];
+      Expm(A[u], tseg[u], E[u]);
+      copy(B, B + n, &b[u * bmMaxDim]);
+      Solve(A[u], &b[u * bmMaxDim]);
+    }
+
+  // Run the train forwards one segment at a time, keeping each x...
+  vector<double> xs(npulse * nseg * bmMaxDim);
+  double M[bmMaxDim];
+  copy(M0i, M0i + n, M);
+  for (int p = 0, step = 0; p < npulse; p++)
+    for (int s = 0; s < nseg; s++, step++)
+      {
+        if (s == 0)
+          for (int i = 0; i < n; i++) 
+            if (i % 3 != 2) M[i] = 0; // crushers
+        const int u = pulse.order[s];
+        double* x = &xs[step * bmMaxDim];
+        for (int i = 0; i < n; i++) x[i] = M[i] + b[u * bmMaxDim + i];
+        MultiplyVector(E[u], x, M);
+        for (int i = 0; i < n; i++) M[i] -= b[u * bmMaxDim + i];
+      }
+  const double Mz = M[2];
+
+  // ...then back, collecting d(Mz)/dE and d(Mz)/db for each distinct 
+  // segment over all the times it's used
+  vector<BMMatrix> Ebar(nDistinct, BMMatrix(n));
+  vector<double> bbar(nDistinct * bmMaxDim, 0.0);
+  for (int u = 0; u < nDistinct; u++)
+    for (int i = 0; i < n; i++)
+      for (int j = 0; j < n; j++) Ebar[u][i][j] = 0;
+  double lambda[bmMaxDim], mu[bmMaxDim];
+  for (int i = 0; i < n; i++) lambda[i] = (i == 2) ? 1 : 0;
+  BMMatrix Et(n);
+  for (int step = npulse * nseg - 1; step >= 0; step--)
+    {
+      const int s = step % nseg, u = pulse.order[s];
+      const double* x = &xs[step * bmMaxDim];
+      for (int i = 0; i < n; i++)
+        if (lambda[i] != 0)
+          for (int j = 0; j < n; j++) Ebar[u][i][j] += lambda[i] * x[j];
+      for (int j = 0; j < n; j++)
+        {
+          double sum = 0;
+          for (int i = 0; i < n; i++) sum += E[u][i][j] * lambda[i];
+          mu[j] = sum;
+        }
+      for (int i = 0; i < n; i++)
+        {
+          bbar[u * bmMaxDim + i] += mu[i] - lambda[i];
+          lambda[i] = mu[i];
+        }
+      if (s == 0)
+        for (int i = 0; i < n; i++) 
+          if (i % 3 != 2) lambda[i] = 0;
+    }
+  for (int i = 0; i < npool; i++)
+    g.dM0[i] += lambda[3*i+2]; // the starting magnetization
+
+  // Through E = exp(A t): d(Mz)/dA = t L(A' t, Ebar); and b = A^-1 B: 
+  // d(Mz)/dA = -z b', d(Mz)/dB = z where A' z = bbar
+  BMMatrix At(n), Abar(n), tmp(n);
+  double Bbar[bmMaxDim] = { 0 };
+  for (int u = 0; u < nDistinct; u++)
+    {
+      Transpose(A[u], At);
+      Scale(At, tseg[u]);
+      ExpmFrechet(At, Ebar[u], Abar);
+      Scale(Abar, tseg[u]);
+      // (a continuous segment's t is tsat, which isn't a parameter)
+
+      double z[bmMaxDim];
+      copy(&bbar[u * bmMaxDim], &bbar[u * bmMaxDim] + n, z);
+      Transpose(A[u], tmp);
+      Solve(tmp, z);
+      for (int i = 0; i < n; i++)
+        {
+          Bbar[i] += z[i];
+          for (int j = 0; j < n; j++) Abar[i][j] -= z[i] * b[u * bmMaxDim + j];
+        }
+      AddSensitivity(Abar, pulse.mag[u], g);
+    }
+  for (int i = 0; i < npool; i++)
+    {
+      g.dM0[i] += Bbar[3*i+2] * R1[i];
+      g.dR1[i] += Bbar[3*i+2] * M0i[3*i+2];
+    }
+  return Mz;
+}
+
+// Inverse of a 3x3 matrix per lane (row-major, 9 x bmLanes), by cofactors
+static void Invert3(const double* a, double* inv)
+{
+  for (int l = 0; l < bmLanes; l++)
+    {
+      const double a00 = a[0*bmLanes+l], a01 = a[1*bmLanes+l], a02 = a[2*bmLanes+l];
+      const double a10 = a[3*bmLanes+l], a11 = a[4*bmLanes+l], a12 = a[5*bmLanes+l];
+      const double a20 = a[6*bmLanes+l], a21 = a[7*bmLanes+l], a22 = a[8*bmLanes+l];
+      const double c00 = a11*a22 - a12*a21, c01 = a12*a20 - a10*a22, c02 = a10*a21 - a11*a20;
+      const double rdet = 1.0 / (a00*c00 + a01*c01 + a02*c02);
+      inv[0*bmLanes+l] = c00 * rdet;
+      inv[1*bmLanes+l] = (a02*a21 - a01*a22) * rdet;
+      inv[2*bmLanes+l] = (a01*a12 - a02*a11) * rdet;
+      inv[3*bmLanes+l] = c01 * rdet;
+      inv[4*bmLanes+l] = (a00*a22 - a02*a20) * rdet;
+      inv[5*bmLanes+l] = (a02*a10 - a00*a12) * rdet;
+      inv[6*bmLanes+l] = c02 * rdet;
+      inv[7*bmLanes+l] = (a01*a20 - a00*a21) * rdet;
+      inv[8*bmLanes+l] = (a00*a11 - a01*a10) * rdet;
+    }
+}
+
+void BlochMcConnell::SteadyStateLanes(const double* wi, const double* w, 
+                                      const double* w1, double* Mz) const
+{
+  if (!waterExchangeOnly)
+    {
+      // No structure to use, so solve the whole system lane by lane
+      for (int l = 0; l < bmLanes; l++)
+        {
+          double wil[bmMaxPools];
+          for (int i = 0; i < npool; i++) wil[i] = wi[i * bmLanes + l];
+          Mz[l] = SteadyStateMz(wil, w[l], w1[l]);
+        }
+      return;
+    }
+
+  // With exchange only to and from water, each other pool's 3x3 block can
+  // be eliminated, leaving a 3x3 system for water:
+  //   (Aww - sum kwj kjw Dj^-1) Mw = -Bw + sum kwj Dj^-1 Bj
+  // Each block's relaxation makes it safely invertible without pivoting.
+  double S[9 * bmLanes], r[3 * bmLanes], D[9 * bmLanes], Di[9 * bmLanes];
+  for (int l = 0; l < bmLanes; l++)
+    {
+      for (int e = 0; e < 9; e++) S[e * bmLanes + l] = A0[e / 3][e % 3];
+      const double dw = wi[l] - w[l];
+      S[1 * bmLanes + l] = -dw;
+      S[3 * bmLanes + l] = dw;
+      S[5 * bmLanes + l] = -w1[l];
+      S[7 * bmLanes + l] = w1[l];
+      r[0 * bmLanes + l] = r[1 * bmLanes + l] = 0;
+      r[2 * bmLanes + l] = -B[2];
+    }
+  for (int j = 1; j < npool; j++)
+    {
+      const int st = 3 * j;
+      const double kwj = A0[0][st], kjw = A0[st][0], bj = B[st+2];
+      for (int l = 0; l < bmLanes; l++)
+        {
+          for (int e = 0; e < 9; e++) D[e * bmLanes + l] = A0[st + e / 3][st + e % 3];
+          const double dw = wi[j * bmLanes + l] - w[l];
+          D[1 * bmLanes + l] = -dw;
+          D[3 * bmLanes + l] = dw;
+          D[5 * bmLanes + l] = -w1[l];
+          D[7 * bmLanes + l] = w1[l];
+        }
+      Invert3(D, Di);
+      for (int e = 0; e < 9; e++)
+        for (int l = 0; l < bmLanes; l++)
+          S[e * bmLanes + l] -= kwj * kjw * Di[e * bmLanes + l];
+      for (int i = 0; i < 3; i++)
+        for (int l = 0; l < bmLanes; l++)
+          r[i * bmLanes + l] += kwj * bj * Di[(3 * i + 2) * bmLanes + l];
+    }
+
+  // Only the z-component of water: Cramer's rule for that row of S^-1 r
+  Invert3(S, Di);
+  for (int l = 0; l < bmLanes; l++)
+    Mz[l] = Di[6 * bmLanes + l] * r[0 * bmLanes + l] 
+      + Di[7 * bmLanes + l] * r[1 * bmLanes + l] 
+      + Di[8 * bmLanes + l] * r[2 * bmLanes + l];
+}
+
+void BlochMcConnell::PulsedLanes(const CESTPulse& pulse, const double* wi,
+                                 const double* w, const double* w1, 
+                                 const double* tsat, double* Mz,
+                                 vector<BMBatchMatrix>& E) const
+{
+  // As PulsedMz, for bmLanes points at once
+  int npulse[bmLanes], maxPulse = 0;
+  for (int l = 0; l < bmLanes; l++)
+    {
+      npulse[l] = pulse.order.empty() ? 0 : pulse.Continuous() ? 1 : int(tsat[l]);
+      maxPulse = max(maxPulse, npulse[l]);
+    }
+  double M[bmMaxDim * bmLanes], Mnext[bmMaxDim * bmLanes];
+  for (int i = 0; i < n; i++)
+    for (int l = 0; l < bmLanes; l++) M[i * bmLanes + l] = M0i[i];
+  if (maxPulse < 1)
+    {
+      for (int l = 0; l < bmLanes; l++) Mz[l] = M0i[2];
+      return;
+    }
+
+  const int nDistinct = pulse.NumDistinct();
+  const int vsize = bmMaxDim * bmLanes;
+  E.resize(nDistinct);
+  vector<double> d(nDistinct * vsize);
+  BMBatchMatrix A(n);
+  for (int u = 0; u < nDistinct; u++)
+    {
+      double w1seg[bmLanes], tseg[bmLanes];
+      for (int l = 0; l < bmLanes; l++)
+        {
+          w1seg[l] = w1[l] * pulse.mag[u];
+          tseg[l] = pulse.dur[u] > 1e6 ? tsat[l] : pulse.dur[u];
+        }
+      SystemMatrix(wi, w, w1seg, A);
+      Expm(A, tseg, E[u]);
+
+      double AiB[bmMaxDim * bmLanes];
+      for (int i = 0; i < n; i++)
+        for (int l = 0; l < bmLanes; l++) AiB[i * bmLanes + l] = B[i];
+      Solve(A, AiB);
+      double* du = &d[u * vsize];
+      MultiplyVector(E[u], AiB, du);
+      for (int e = 0; e < n * bmLanes; e++) du[e] -= AiB[e];
+    }
+
+  // The affine map for one pulse, starting with the crushers
+  BMBatchMatrix T1(n), T2(n);
+  BMBatchMatrix* T = &T1;
+  BMBatchMatrix* next = &T2;
+  double c[bmMaxDim * bmLanes], cnext[bmMaxDim * bmLanes];
+  for (int i = 0; i < n; i++)
+    {
+      for (int j = 0; j < n; j++)
+        for (int l = 0; l < bmLanes; l++) (*T)(i, j)[l] = (i == j && i % 3 == 2) ? 1 : 0;
+      for (int l = 0; l < bmLanes; l++) c[i * bmLanes + l] = 0;
+    }
+  for (unsigned s = 0; s < pulse.order.size(); s++)
+    {
+      const int u = pulse.order[s];
+      MultiplyCrushed(E[u], *T, false, *next);
+      swap(T, next);
+      MultiplyVector(E[u], c, cnext);
+      for (int e = 0; e < n * bmLanes; e++) c[e] = cnext[e] + d[u * vsize + e];
+    }
+
+  // Powers of it by squaring; each lane takes the bits of its own npulse
+  for (int bit = 0; (maxPulse >> bit) > 0; bit++)
+    {
+      MultiplyVector(*T, M, Mnext);
+      for (int i = 0; i < n; i++)
+        for (int l = 0; l < bmLanes; l++)
+          if ((npulse[l] >> bit) & 1)
+            M[i * bmLanes + l] = Mnext[i * bmLanes + l] + c[i * bmLanes + l];
+      if ((maxPulse >> (bit + 1)) > 0)
+        {
+          MultiplyVector(*T, c, cnext);
+          for (int e = 0; e < n * bmLanes; e++) c[e] += cnext[e];
+          MultiplyCrushed(*T, *T, true, *next);
+          swap(T, next);
+        }
+    }
+  for (int l = 0; l < bmLanes; l++) Mz[l] = M[2 * bmLanes + l];
+}
+
+void BlochMcConnell::Spectrum(ColumnVector& Mz, const ColumnVector& w, 
+                              const ColumnVector& w1, const ColumnVector& t,
+                              const Matrix& wi, const CESTPulse* pulse) const
+{
+  const int nfreq = w.Nrows();
+  Mz.ReSize(nfreq);
+  double wik[bmMaxPools];
+  for (int k = 1; k <= nfreq; k++)
+    {
+      if (w1(k) == 0.0)
+        {
+          // no saturation image - the z water magnetization is just M0
+          Mz(k) = M0i[2];
+          continue;
+        }
+      for (int i = 0; i < npool; i++) wik[i] = wi(i+1, k);
+      Mz(k) = pulse ? PulsedMz(*pulse, wik, w(k), w1(k), t(k)) 
+        : SteadyStateMz(wik, w(k), w1(k));
+    }
+}
+
+void BlochMcConnell::SpectrumBatch(ColumnVector& Mz, const ColumnVector& w, 
+                                   const ColumnVector& w1, const ColumnVector& t,
+                                   const Matrix& wi, const CESTPulse* pulse) const
+{
+  const int nfreq = w.Nrows();
+  Mz.ReSize(nfreq);
+
+  // Gather the saturated points into batches, padding the last one out
+  // with copies of its last point
+  int points[bmLanes], filled = 0;
+  vector<BMBatchMatrix> E; // segment propagators, reused for every batch
+  double wiLanes[bmMaxPools * bmLanes], wLanes[bmLanes], w1Lanes[bmLanes], 
+    tLanes[bmLanes], MzLanes[bmLanes];
+  for (int k = 1; k <= nfreq; k++)
+    {
+      if (w1(k) == 0.0)
+        Mz(k) = M0i[2];
+      else
+        points[filled++] = k;
+      if (filled == bmLanes || (k == nfreq && filled > 0))
+        {
+          for (int l = 0; l < bmLanes; l++)
+            {
+              const int p = points[min(l, filled - 1)];
+              wLanes[l] = w(p);
+              w1Lanes[l] = w1(p);
+              tLanes[l] = t(p);
+              for (int i = 0; i < npool; i++) wiLanes[i * bmLanes + l] = wi(i+1, p);
+            }
+          if (pulse)
+            PulsedLanes(*pulse, wiLanes, wLanes, w1Lanes, tLanes, MzLanes, E);
+          else
+            SteadyStateLanes(wiLanes, wLanes, w1Lanes, MzLanes);
+          for (int l = 0; l < filled; l++) Mz(points[l]) = MzLanes[l];
+          filled = 0;
+        }
+    }
+}
@@ -0,0 +1,211 @@
+/*  blochmcconnell.h - Fast Bloch-McConnell solutions for the CEST model
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#pragma once
+#include <vector>
+#include "newmatap.h"
+
+using namespace std;
+using namespace NEWMAT;
+
+// Small dense matrices for the Bloch-McConnell equations (x, y and z for 
+// each pool), kept on the stack so that nothing is allocated per offset.
+// Only the top-left n x n is in use, and only that is copied.  The data 
+// are 16-byte aligned (as malloc gives) so that SSE loads line up.
+enum { bmMaxPools = 8, bmMaxDim = 3 * bmMaxPools };
+
+#ifdef __GNUC__
+#define BM_ALIGNED __attribute__((aligned(16)))
+#else
+#define BM_ALIGNED
+#endif
+
+struct BMMatrix {
+  int n;
+  double a[bmMaxDim][bmMaxDim] BM_ALIGNED;
+  explicit BMMatrix(int size = 0) : n(size) { return; }
+  BMMatrix(const BMMatrix& x) : n(x.n) { CopyFrom(x); }
+  BMMatrix& operator=(const BMMatrix& x) { n = x.n; CopyFrom(x); return *this; }
+  double* operator[](int i) { return a[i]; }
+  const double* operator[](int i) const { return a[i]; }
+private:
+  void CopyFrom(const BMMatrix& x)
+  {
+    for (int i = 0; i < n; i++)
+      for (int j = 0; j < n; j++) a[i][j] = x.a[i][j];
+  }
+};
+
+// The same for bmLanes data points at once, stored lane innermost 
+// (structure of arrays) so that the loops over lanes vectorise
+enum { bmLanes = 4 };
+
+struct BMBatchMatrix {
+  int n;
+  double v[bmMaxDim * bmMaxDim * bmLanes] BM_ALIGNED;
+  explicit BMBatchMatrix(int size = 0) : n(size) { return; }
+  BMBatchMatrix(const BMBatchMatrix& x) : n(x.n) { CopyFrom(x); }
+  BMBatchMatrix& operator=(const BMBatchMatrix& x) { n = x.n; CopyFrom(x); return *this; }
+  double* operator()(int i, int j) { return v + (i * n + j) * bmLanes; }
+  const double* operator()(int i, int j) const { return v + (i * n + j) * bmLanes; }
+private:
+  void CopyFrom(const BMBatchMatrix& x)
+  {
+    for (int e = 0; e < n * n * bmLanes; e++) v[e] = x.v[e];
+  }
+};
+
+// The pulse train from --ptrain: each segment's relative B1 magnitude and
+// duration.  Segments with the same magnitude and duration (e.g. the gaps 
+// between pulses, or the two halves of a symmetric shape) share a 
+// propagator, so each distinct one is only worked out once per offset.
+class CESTPulse {
+public:
+  CESTPulse() { return; }
+  CESTPulse(const ColumnVector& pmag, const ColumnVector& pt);
+
+  int NumDistinct() const { return mag.size(); }
+  bool Continuous() const { return continuous; }
+  
+  vector<double> mag, dur; // the distinct segments
+  vector<int> order;       // the pulse as indices into those
+private:
+  bool continuous;  // duration is the data point's tsat, not a pulse count
+};
+
+// The Bloch-McConnell system for one set of pool parameters (M0, exchange
+// rates kij and relaxation T12, as in CESTFwdModel::Mz_spectrum).  Offsets
+// and B1 only change a few elements of the system matrix, so the rest is
+// set up once and reused for every data point.
+class BlochMcConnell {
+public:
+  BlochMcConnell(const ColumnVector& M0, const Matrix& kij, const Matrix& T12);
+
+  // Water Mz after saturation at offset w with B1 amplitude w1 (rad/s); wi
+  // holds the pools' resonance frequencies at this data point
+  double SteadyStateMz(const double* wi, double w, double w1) const;
+  double PulsedMz(const CESTPulse& pulse, const double* wi, double w, 
+                  double w1, double tsat) const;
+
+  // Derivatives of the water Mz with respect to the system's quantities:
+  // each pool's M0, 1/T1, 1/T2 and resonance frequency, the exchange rates
+  // (dk[i][j] for kij(i+1,j+1), from pool i to j) and the B1 amplitude.
+  // Worked back from the one result (adjoint), so the cost is about that
+  // of another evaluation however many parameters depend on these.
+  struct Sensitivity {
+    double dM0[bmMaxPools], dR1[bmMaxPools], dR2[bmMaxPools], dwi[bmMaxPools];
+    double dk[bmMaxPools][bmMaxPools];
+    double dw1;
+  };
+  double SteadyStateGradient(const double* wi, double w, double w1, 
+                             Sensitivity& g) const;
+  double PulsedGradient(const CESTPulse& pulse, const double* wi, double w, 
+                        double w1, double tsat, Sensitivity& g) const;
+
+  // The whole spectrum: water Mz at each data point, given the offsets w,
+  // B1 amplitudes w1, saturation times (or pulse counts) t and the pools'
+  // frequencies wi (npool x points).  pulse is NULL for steady state.
+  // Spectrum does one point at a time with the methods above, and is the
+  // reference for SpectrumBatch, which does bmLanes at a time.
+  void Spectrum(ColumnVector& Mz, const ColumnVector& w, const ColumnVector& w1,
+                const ColumnVector& t, const Matrix& wi, const CESTPulse* pulse) const;
+  void SpectrumBatch(ColumnVector& Mz, const ColumnVector& w, const ColumnVector& w1,
+                     const ColumnVector& t, const Matrix& wi, const CESTPulse* pulse) const;
+
+  // exp(A*t), by Pade approximation with scaling and squaring (Higham,
+  // SIAM J. Matrix Analysis App. 26(4) 2005, 1179-1193)
+  static void Expm(const BMMatrix& A, double t, BMMatrix& X);
+  static void Expm(const BMBatchMatrix& A, const double* t, BMBatchMatrix& X);
+
+  // The Frechet derivative of exp at A in the direction H, i.e. the change
+  // in exp(A) to first order in H (Al-Mohy & Higham, SIAM J. Matrix 
+  // Analysis App. 30(4) 2009, 1639-1657)
+  static void ExpmFrechet(const BMMatrix& A, const BMMatrix& H, BMMatrix& L);
+
+private:
+  int npool, n;
+  BMMatrix A0;        // system matrix without the offset and B1 terms
+  double B[bmMaxDim]; // relaxation towards M0
+  double M0i[bmMaxDim];
+  double R1[bmMaxPools]; // 1/T1, as in B
+  bool waterExchangeOnly; // pools only exchange with water (pool 1)
+
+  void SystemMatrix(const double* wi, double w, double w1, BMMatrix& A) const;
+  void AddSensitivity(const BMMatrix& Abar, double mag, Sensitivity& g) const;
+
+  // One batch of SpectrumBatch; wi is npool x bmLanes, the rest bmLanes 
+  // long.  E holds the segment propagators, kept by the caller so that 
+  // they aren't reallocated for every batch.
+  void SystemMatrix(const double* wi, const double* w, const double* w1,
+                    BMBatchMatrix& A) const;
+  void SteadyStateLanes(const double* wi, const double* w, const double* w1,
+                        double* Mz) const;
+  void PulsedLanes(const CESTPulse& pulse, const double* wi, const double* w,
+                   const double* w1, const double* tsat, double* Mz,
+                   vector<BMBatchMatrix>& E) const;
+};
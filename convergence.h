@@ -76,6 +76,15 @@ class ConvergenceDetector {
   virtual bool NeedSave() = 0;
   virtual bool NeedRevert() = 0;
   virtual float LMalpha() = 0;
+  // Called with the latest posterior means, after Reset and before each
+  // Test.  Only detectors that look at parameter changes need it.
+  virtual void UpdateMeans(const ColumnVector& means) { return; }
+  // If true, the end-of-iteration relinearisation only moves the centre
+  // (one model evaluation) and the Jacobian is recalculated at the start of
+  // the next iteration, unless NeedRevert() says the step was rejected.
+  virtual bool TrialSteps() const { return false; }
+  // Totals over all voxels (only some detectors have anything to say)
+  virtual void DumpSummaryTo(ostream& out, const string indent = "") const { return; }
 };
 
 class CountingConvergenceDetector : public ConvergenceDetector {
@@ -393,3 +402,162 @@ inline void LMConvergenceDetector::DumpTo(ostream& out, const string indent) con
   out << indent << "Iteration " << its << " of at most " << max << " : " << reason << endl;
   out << indent << "Previous Free Energy == " << prev << endl;
 }
+
+// Stops when both the largest relative change in the posterior means and
+// the change in F fall below their tolerances (either test can be switched
+// off with a tolerance <= 0; switching off the F test also means F doesn't
+// have to be calculated at all).
+class AdaptiveConvergenceDetector : public ConvergenceDetector {
+ public:
+  virtual bool Test(double F);
+  AdaptiveConvergenceDetector(int maxIts, double paramTol, double Ftol)
+    : max(maxIts), ptol(paramTol), ftol(Ftol) 
+    { assert(max>0); assert(ptol>0 || ftol>0); Reset(); }
+  virtual void DumpTo(ostream& out, const string indent = "") const;
+  virtual void Reset(double F=-99e99)
+  { its = 0; prev = F; prevMeans.ReSize(0); change = 99e99; reason = ""; }
+  virtual bool UseF() const { return ftol > 0; }
+  virtual bool NeedSave() { return false; }
+  virtual bool NeedRevert() { return false; }
+  virtual float LMalpha() { return 0.0; }
+  virtual void UpdateMeans(const ColumnVector& means);
+
+ private:
+  int its;
+  const int max;
+  const double ptol;
+  const double ftol;
+  double prev;
+  ColumnVector prevMeans;
+  double change; // largest relative change in a mean at the last update
+  string reason;
+};
+
+inline void AdaptiveConvergenceDetector::UpdateMeans(const ColumnVector& means)
+{
+  if (prevMeans.Nrows() == means.Nrows())
+    {
+      change = 0;
+      for (int i = 1; i <= means.Nrows(); i++)
+	{
+	  double scale = fabs(prevMeans(i));
+	  if (scale < 1e-6) scale = 1e-6; // don't divide by ~zero
+	  double rel = fabs(means(i) - prevMeans(i)) / scale;
+	  if (rel > change) change = rel;
+	}
+    }
+  prevMeans = means;
+}
+
+inline bool AdaptiveConvergenceDetector::Test(double F)
+{
+  double diff = F - prev;
+  diff = diff>0 ? diff : -diff;
+  prev = F;
+  ++its;
+
+  bool paramsSettled = (ptol <= 0) || (change < ptol);
+  bool FSettled = (ftol <= 0) || (diff < ftol);
+
+  if (its >= max) { reason = "Max iterations reached"; return true; }
+  if (paramsSettled && FSettled) { reason = "Converged"; return true; }
+  return false;
+}
+
+inline void AdaptiveConvergenceDetector::DumpTo(ostream& out, const string indent) const
+{
+  out << indent << "Iteration " << its << " of at most " << max << " : " << reason << endl;
+  out << indent << "Largest relative change in means == " << change << endl;
+  if (ftol > 0)
+    out << indent << "Previous Free Energy == " << prev << endl;
+}
+
+// Levenberg-Marquardt with proper trust-region step acceptance.  Unlike
+// LMConvergenceDetector, a trial step costs a single model evaluation: 
+// the linearisation is only moved to the trial point, and the Jacobian is
+// only recalculated once the step has been accepted.  Rejected steps go
+// back to the saved linearisation without re-evaluating the model.
+class TrustRegionConvergenceDetector : public ConvergenceDetector {
+ public:
+  virtual bool Test(double F);
+  TrustRegionConvergenceDetector(int maxIts, double Fchange)
+    : max(maxIts), chg(Fchange), totalAccepted(0), totalRejected(0),
+      alphastart(1e-6), alphamax(1e6)
+    { assert(max>0); assert(chg>0); Reset(); }
+  virtual void DumpTo(ostream& out, const string indent = "") const;
+  virtual void DumpSummaryTo(ostream& out, const string indent = "") const;
+  virtual void Reset(double F=-99e99)
+  { its = 0; prev = F; revert = false; alpha = 0.0; 
+    accepted = rejected = 0; reason = ""; }
+  virtual bool UseF() const { return true; }
+  virtual bool NeedSave() { return !revert; }
+  virtual bool NeedRevert() { return revert; }
+  virtual float LMalpha() { return alpha; }
+  virtual bool TrialSteps() const { return true; }
+
+ private:
+  int its;
+  const int max;
+  double prev;
+  const double chg;
+  string reason;
+  bool revert;
+  double alpha; // 0 for a plain VB step
+
+  int accepted, rejected;           // this voxel
+  long totalAccepted, totalRejected; // all voxels
+
+  const double alphastart;
+  const double alphamax;
+};
+
+inline bool TrustRegionConvergenceDetector::Test(double F)
+{
+  double diff = F - prev;
+
+  if (diff < 0)
+    {
+      // Rejected: go back to the last accepted state and shrink the region
+      rejected++; totalRejected++;
+      revert = true;
+      alpha = (alpha == 0) ? alphastart : alpha*10;
+      if (alpha > alphamax)
+	{
+	  reason = "Reached max alpha";
+	  return true; // still reverting, to the last accepted step
+	}
+      return false;
+    }
+
+  // Accepted: grow the region again (back to plain VB when alpha is small)
+  accepted++; totalAccepted++;
+  revert = false;
+  prev = F;
+  ++its;
+  alpha = (alpha > alphastart) ? alpha/10 : 0.0;
+
+  if (diff < chg)
+    {
+      reason = "F converged";
+      return true;
+    }
+  if (its >= max)
+    {
+      reason = "Max iterations reached";
+      return true;
+    }
+  return false;
+}
+
+inline void TrustRegionConvergenceDetector::DumpTo(ostream& out, const string indent) const
+{
+  out << indent << "Iteration " << its << " of at most " << max << " : " << reason << endl;
+  out << indent << "Steps accepted: " << accepted << ", rejected: " << rejected << endl;
+  out << indent << "Previous Free Energy == " << prev << endl;
+}
+
+inline void TrustRegionConvergenceDetector::DumpSummaryTo(ostream& out, const string indent) const
+{
+  out << indent << "Trust region steps accepted: " << totalAccepted 
+      << ", rejected: " << totalRejected << endl;
+}
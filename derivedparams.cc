@@ -0,0 +1,408 @@
+/*  derivedparams.cc - Derived parameters computed from the posterior
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include "derivedparams.h"
+#include <fstream>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
+#include <algorithm>
+#include "newmat.h"
+using namespace NEWMAT;
+#include "easylog.h"
+#include "easyoptions.h"
+
+class DerivedParams::Parser {
+public:
+  Parser(Expression& e, const vector<string>& names, const string& s, 
+         const string& where)
+    : expr(e), paramNames(names), text(s), context(where), pos(0), depth(0) {}
+
+  void Parse()
+  {
+    Sum();
+    Skip();
+    if (pos != text.size())
+      Error("unexpected '" + text.substr(pos, 1) + "'");
+  }
+
+private:
+  Expression& expr;
+  const vector<string>& paramNames;
+  const string& text;
+  const string& context;
+  size_t pos;
+  int depth;
+
+  void Error(const string& msg)
+  { throw Invalid_option("Derived parameter " + context + ": " + msg); }
+
+  void Skip()
+  { while (pos < text.size() && isspace(text[pos])) pos++; }
+
+  bool Accept(char c)
+  {
+    Skip();
+    if (pos < text.size() && text[pos] == c) { pos++; return true; }
+    return false;
+  }
+
+  void Emit(Code code, int slot = 0, double value = 0)
+  {
+    Op op;
+    op.code = code;
+    op.slot = slot;
+    op.value = value;
+    expr.ops.push_back(op);
+    if (code == PARAM || code == CONST) 
+      depth++;
+    else if (code == ADD || code == SUB || code == MUL || code == DIV || code == POW)
+      depth--; // binary
+    expr.depth = max(expr.depth, depth);
+  }
+
+  void Sum()
+  {
+    Product();
+    for (;;)
+      {
+        if (Accept('+')) { Product(); Emit(ADD); }
+        else if (Accept('-')) { Product(); Emit(SUB); }
+        else return;
+      }
+  }
+
+  void Product()
+  {
+    Unary();
+    for (;;)
+      {
+        if (Accept('*')) { Unary(); Emit(MUL); }
+        else if (Accept('/')) { Unary(); Emit(DIV); }
+        else return;
+      }
+  }
+
+  void Unary()
+  {
+    if (Accept('-')) { Unary(); Emit(NEG); }
+    else if (Accept('+')) Unary();
+    else Power();
+  }
+
+  void Power()
+  {
+    Primary();
+    if (Accept('^')) { Unary(); Emit(POW); } // right associative
+  }
+
+  void Primary()
+  {
+    Skip();
+    if (pos >= text.size())
+      Error("unexpected end of expression");
+    if (Accept('('))
+      {
+        Sum();
+        if (!Accept(')')) Error("missing ')'");
+        return;
+      }
+    if (isdigit(text[pos]) || text[pos] == '.')
+      {
+        const char* start = text.c_str() + pos;
+        char* end;
+        const double value = strtod(start, &end);
+        if (end == start) Error("bad number");
+        pos += end - start;
+        Emit(CONST, 0, value);
+        return;
+      }
+    if (!isalpha(text[pos]) && text[pos] != '_')
+      Error("unexpected '" + text.substr(pos, 1) + "'");
+
+    const size_t start = pos;
+    while (pos < text.size() && (isalnum(text[pos]) || text[pos] == '_'))
+      pos++;
+    const string word = text.substr(start, pos - start);
+
+    if (Accept('('))
+      {
+        Code code;
+        if (word == "exp") code = EXP_FN;
+        else if (word == "log") code = LOG_FN;
+        else if (word == "sqrt") code = SQRT_FN;
+        else if (word == "abs") code = ABS_FN;
+        else Error("unknown function '" + word + "'");
+        Sum();
+        if (!Accept(')')) Error("missing ')'");
+        Emit(code);
+        return;
+      }
+
+    for (unsigned p = 0; p < paramNames.size(); p++)
+      if (paramNames[p] == word)
+        {
+          unsigned slot = 0;
+          while (slot < expr.params.size() && expr.params[slot] != int(p))
+            slot++;
+          if (slot == expr.params.size())
+            expr.params.push_back(p);
+          Emit(PARAM, slot);
+          return;
+        }
+    Error("unknown parameter '" + word + "'");
+  }
+};
+
+DerivedParams::DerivedParams(const string& filename, 
+                             const vector<string>& paramNames)
+  : nParams(paramNames.size())
+{
+  Tracer_Plus tr("DerivedParams::DerivedParams");
+
+  ifstream in(filename.c_str());
+  if (!in)
+    throw Invalid_option("Couldn't read derived parameters from " + filename);
+
+  string line;
+  for (int lineNo = 1; getline(in, line); lineNo++)
+    {
+      const size_t hash = line.find('#');
+      if (hash != string::npos)
+        line.erase(hash);
+      if (line.find_first_not_of(" \t\r") == string::npos)
+        continue;
+
+      const string where = filename + " line " + stringify(lineNo);
+      const size_t eq = line.find('=');
+      if (eq == string::npos)
+        throw Invalid_option("Derived parameter " + where + ": expected name = expression");
+      const size_t b = line.find_first_not_of(" \t");
+      const size_t e = line.find_last_not_of(" \t", eq - 1);
+      if (b >= eq || e == string::npos)
+        throw Invalid_option("Derived parameter " + where + ": missing name");
+
+      Expression expr;
+      expr.name = line.substr(b, e - b + 1);
+      expr.depth = 0;
+      for (unsigned i = 0; i < expr.name.size(); i++)
+        if (!isalnum(expr.name[i]) && expr.name[i] != '_')
+          throw Invalid_option("Derived parameter " + where + ": bad name '" + expr.name + "'");
+      // Their maps go alongside the model parameters' ones
+      if (find(paramNames.begin(), paramNames.end(), expr.name) != paramNames.end())
+        throw Invalid_option("Derived parameter " + where + ": '" + expr.name 
+                             + "' is already a model parameter");
+      for (unsigned i = 0; i < exprs.size(); i++)
+        if (exprs[i].name == expr.name)
+          throw Invalid_option("Derived parameter " + where + ": '" + expr.name 
+                               + "' is defined twice");
+      const string text = line.substr(eq + 1);
+      Parser(expr, paramNames, text, where).Parse();
+
+      LOG << "      Derived parameter " << expr.name << " = " 
+          << text.substr(text.find_first_not_of(" \t")) << endl;
+      exprs.push_back(expr);
+    }
+}
+
+void DerivedParams::Evaluate(const double* means, const double* cov, 
+                             int n, int stride, double* values, double* vars) const
+{
+  // Each stack entry is a value and its gradient for all n voxels, so every
+  // op is a simple loop over the block
+  vector<double> val, grad;
+  for (unsigned e = 0; e < exprs.size(); e++)
+    {
+      const Expression& ex = exprs[e];
+      const int nUsed = ex.params.size();
+      val.resize(size_t(ex.depth) * n);
+      // At least one element, so &grad[...] is valid for constant expressions
+      grad.resize(max(size_t(ex.depth) * nUsed * n, size_t(1)));
+
+      int top = -1;
+      for (unsigned i = 0; i < ex.ops.size(); i++)
+        {
+          const Op& op = ex.ops[i];
+          if (op.code == PARAM || op.code == CONST)
+            {
+              top++;
+              double* v = &val[size_t(top)*n];
+              double* g = &grad[size_t(top)*nUsed*n];
+              fill(g, g + nUsed*n, 0.0);
+              if (op.code == CONST)
+                fill(v, v + n, op.value);
+              else
+                {
+                  const double* m = means + size_t(ex.params[op.slot])*stride;
+                  copy(m, m + n, v);
+                  fill(g + op.slot*n, g + (op.slot+1)*n, 1.0);
+                }
+              continue;
+            }
+
+          double* a = &val[size_t(top)*n];
+          double* ga = &grad[size_t(top)*nUsed*n];
+          switch (op.code)
+            {
+            case NEG:
+              for (int v = 0; v < n; v++) a[v] = -a[v];
+              for (int k = 0; k < nUsed*n; k++) ga[k] = -ga[k];
+              continue;
+            case EXP_FN:
+              for (int v = 0; v < n; v++) a[v] = exp(a[v]);
+              for (int j = 0; j < nUsed; j++)
+                for (int v = 0; v < n; v++) ga[j*n+v] *= a[v];
+              continue;
+            case LOG_FN:
+              for (int j = 0; j < nUsed; j++)
+                for (int v = 0; v < n; v++) ga[j*n+v] /= a[v];
+              for (int v = 0; v < n; v++) a[v] = log(a[v]);
+              continue;
+            case SQRT_FN:
+              for (int v = 0; v < n; v++) a[v] = sqrt(a[v]);
+              for (int j = 0; j < nUsed; j++)
+                for (int v = 0; v < n; v++) ga[j*n+v] /= 2*a[v];
+              continue;
+            case ABS_FN:
+              for (int j = 0; j < nUsed; j++)
+                for (int v = 0; v < n; v++) if (a[v] < 0) ga[j*n+v] = -ga[j*n+v];
+              for (int v = 0; v < n; v++) a[v] = fabs(a[v]);
+              continue;
+            default:
+              break;
+            }
+
+          // Binary: a (below) op b (top), result replaces a
+          const double* b = a;
+          const double* gb = ga;
+          top--;
+          a = &val[size_t(top)*n];
+          ga = &grad[size_t(top)*nUsed*n];
+          switch (op.code)
+            {
+            case ADD:
+              for (int v = 0; v < n; v++) a[v] += b[v];
+              for (int k = 0; k < nUsed*n; k++) ga[k] += gb[k];
+              break;
+            case SUB:
+              for (int v = 0; v < n; v++) a[v] -= b[v];
+              for (int k = 0; k < nUsed*n; k++) ga[k] -= gb[k];
+              break;
+            case MUL:
+              for (int j = 0; j < nUsed; j++)
+                for (int v = 0; v < n; v++) 
+                  ga[j*n+v] = ga[j*n+v]*b[v] + a[v]*gb[j*n+v];
+              for (int v = 0; v < n; v++) a[v] *= b[v];
+              break;
+            case DIV:
+              for (int v = 0; v < n; v++) a[v] /= b[v];
+              for (int j = 0; j < nUsed; j++)
+                for (int v = 0; v < n; v++) 
+                  ga[j*n+v] = (ga[j*n+v] - a[v]*gb[j*n+v]) / b[v];
+              break;
+            case POW:
+              // d(a^b) = b a^(b-1) da + a^b log(a) db; the second term is
+              // left out where b doesn't vary, so negative a works too
+              for (int v = 0; v < n; v++)
+                {
+                  const double p = pow(a[v], b[v]);
+                  const double da = b[v] * pow(a[v], b[v] - 1);
+                  const double db = (a[v] > 0) ? p * log(a[v]) : 0;
+                  for (int j = 0; j < nUsed; j++)
+                    {
+                      const double dbj = gb[j*n+v];
+                      ga[j*n+v] = da * ga[j*n+v] + (dbj != 0 ? db * dbj : 0);
+                    }
+                  a[v] = p;
+                }
+              break;
+            default:
+              assert(false);
+            }
+        }
+      assert(top == 0);
+
+      // Delta method: g' C g over the parameters used
+      copy(&val[0], &val[0] + n, values + size_t(e)*stride);
+      double* var = vars + size_t(e)*stride;
+      for (int v = 0; v < n; v++)
+        {
+          const double* c = cov + size_t(v)*nParams*nParams;
+          double sum = 0;
+          for (int j = 0; j < nUsed; j++)
+            {
+              const double gj = grad[j*n+v];
+              if (gj == 0) continue;
+              const double* cj = c + size_t(ex.params[j])*nParams;
+              for (int k = 0; k < nUsed; k++)
+                sum += gj * grad[k*n+v] * cj[ex.params[k]];
+            }
+          var[v] = sum;
+        }
+    }
+}
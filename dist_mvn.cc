@@ -67,6 +67,9 @@
     innovation@isis.ox.ac.uk quoting reference DE/9564. */
 
 #include "dist_mvn.h"
+#include "mvnfile.h"
+#include "maskedfile.h"
+#include "niftiwriter.h"
 #include "easyoptions.h"
 #include "miscmaths/miscmaths.h"
 
@@ -319,13 +322,32 @@ void MVNDist::Load(const string& filename)
 void MVNDist::Load(vector<MVNDist*>& mvns, const string& filename, const volume<float>& mask)
 {
     Tracer_Plus tr("MVNDist::Load (static)");
+
+    if (IsMVNFile(filename))
+      {
+        LOG_ERR("Reading MVNs from " << filename << endl);
+        MVNFile file(filename);
+        file.CheckMask(mask);
+        file.ReadAll(mvns);
+        return;
+      }
     
     Matrix vols; 
     LOG_ERR("Reading MVNs from " << filename << endl);
  
-    volume4D<float> input;
-    read_volume4D(input,filename);
-    vols=input.matrix(mask);
+    if (IsMaskedFile(filename))
+      {
+        MaskedFile file(filename);
+        if (NiftiWriter(mask).MaskIndex() != file.MaskIndex())
+          throw Invalid_option("The mask doesn't match the one " + filename + " was saved with");
+        vols = file.AsMatrix();
+      }
+    else
+      {
+        volume4D<float> input;
+        read_volume4D(input,filename);
+        vols=input.matrix(mask);
+      }
     
     const int nVoxels = vols.Ncols();
     for (unsigned i = 0; i < mvns.size(); i++) 
@@ -368,6 +390,12 @@ void MVNDist::Load(vector<MVNDist*>& mvns, const string& filename, const volume<
 void MVNDist::Save(const vector<MVNDist*>& mvns, const string& filename, const volume<float>& mask)
 {    
     Tracer_Plus tr("MVNDist::Save");
+
+    if (IsMVNFile(filename))
+      {
+        MVNFile::Save(mvns, filename, mask, vector<string>(), 0);
+        return;
+      }
      
     // Save the MVNs in a NIFTI file as a single NIFTI_INTENT_SYMMATRIX 
     // last row/col is the means (1 in the corner).
@@ -395,6 +423,19 @@ void MVNDist::Save(const vector<MVNDist*>& mvns, const string& filename, const v
         // as NIFTI_INTENT_SYMMATRIX specifies: (1,1) (2,1) (2,2) (3,1)...
       }
     // Write the file
+    if (IsMaskedFile(filename))
+      {
+        NiftiWriter::Format format;
+        format.masked = true;
+        format.level = filename.substr(filename.size() - 3) == ".gz" ? 6 : 0;
+        const NiftiWriter writer(mask);
+        NiftiWriter::FrameStream file(writer, filename, vols.Nrows(),
+                                      NIFTI_INTENT_SYMMATRIX, vols.Minimum(),
+                                      vols.Maximum(), format);
+        file.Put(vols.Store(), vols.Nrows()); // row-major, so frame by frame
+        file.Close();
+        return;
+      }
     volume4D<float> output(mask.xsize(),mask.ysize(),mask.zsize(),vols.Nrows());
     output.setmatrix(vols,mask);
     output.set_intent(NIFTI_INTENT_SYMMATRIX,0,0,0);
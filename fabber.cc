@@ -249,20 +249,50 @@ void Usage(const string& errorString)
      << "  --output=/path/to/output : put output here (including logfile)\n"
      << "  --method={vb|spatialvb} : use VB (or VB with spatial priors)\n"
      << "  [--max-iterations=NN] : number of iterations of VB to use (default: 10)\n"
+     << "  [--convergence={maxits|pointzeroone|freduce|trialmode|lm|trustregion|adaptive}] : when to stop iterating (default: maxits)\n"
+     << "    trustregion: like lm, but trial steps cost one model evaluation and the Jacobian is only updated on acceptance\n"
+     << "    adaptive: stop when the means and F have both settled, or at --max-iterations\n"
+     << "      [--param-change-tol=<tol>] : largest relative change in a parameter mean (default: 0.001; 0 to ignore)\n"
+     << "      [--f-change-tol=<tol>] : change in free energy (default: 0.01; 0 to ignore, which also skips calculating F)\n"
      << "  [--data-order={interleave|concatenate|singlefile}] : should time points from multiple data "
      << "be interleaved (e.g. TE1/TE2) or left in order? (default: interleave)\n"
      << "  --data1=file1, [--data2=file2]. (use --data=file instead if --data-order=singlefile)\n"
      << "  --mask=maskfile : inference will only be performed where mask value > 0\n"
      << "  --model={quipss2|q2tips-dualecho|pcasl-dualecho} : forward model to use. "
      << "For model parameters use fabber --help --model=<model_of_interest>\n"
-     << "  --noise={ar1|white} : Noise model to use\n"
+     << "  --noise={ar1|white|groups|studentt} : Noise model to use\n"
      << "    ar1: two AR(1) models (optional cross-linking between TE1 & TE2)\n"
      << "      [--ar1-cross-terms={dual|same|none}] : two types of cross-linking, or none (default: dual)\n"
      << "    white: white noise model, optionally with different noise variances at some data points\n"
      << "      [--noise-pattern=<phi_index_pattern>] : repeating pattern of noise variances for each data point "
      << "(e.g. --noise-pattern=12 gives odd and even data points different noise variances)\n"
-     << "  [--save-model-fit] and [--save-residuals] : Save model fit/residuals files\n"
+     << "    groups: white noise model with one noise variance per group of volumes\n"
+     << "      --noise-groups=<group_file> : text file giving the group (1, 2, ...) of each volume; "
+     << "a noise precision map is saved for each group\n"
+     << "    studentt: robust Student-t noise, down-weighting outlying data points\n"
+     << "      [--noise-dof=<nu>] : degrees of freedom of the t distribution (default: 4)\n"
+     << "  [--outputs=<list>] : comma-separated results to write, from mvn, mean, std, zstat,\n"
+     << "      freeenergy, noise, fit, residuals (default: mvn,mean,zstat,freeenergy,noise)\n"
+     << "  [--save-model-fit] and [--save-residuals] : Save model fit/residuals files (same as adding fit/residuals to --outputs)\n"
+     << "  [--save-samples=<n>] : draw n samples per voxel from the posterior over the model parameters,\n"
+     << "      saved to posterior.samples with pct<p>_<param> percentile maps\n"
+     << "      [--samples-seed=<n>] (default: 1), [--sample-percentiles=<p1,p2...>] (default: 2.5,50,97.5)\n"
+     << "  [--derived-params=<file>] : lines of name = expression (e.g. k = exp(logk)) in the model parameters;\n"
+     << "      mean_<name> and delta-method std_<name> maps are saved for each\n"
+     << "  [--output-threads=<n>] : number of output files to write at once (default: 4)\n"
+     << "  [--output-dtype=<list>] : float32 (default) or float64, for all outputs and/or per product,\n"
+     << "      e.g. float32,mvn:float64; mvn:float16 is allowed with --mvn-format=mvn\n"
+     << "  [--output-compression=<list>] : none, fast or best gzip, for all outputs and/or per product\n"
+     << "      (products as for --outputs, plus pct; default: as $FSLOUTPUTTYPE)\n"
+     << "  [--output-layout=<list>] : nifti (default) or masked, for all outputs and/or per product; masked\n"
+     << "      files hold only the voxels in the mask and are turned back into NIFTI by fabber_expand\n"
+     << "  [--output-uncompressed-temp] : write plain .nii files, for results that will be read straight back\n"
+     << "  [--output-async] : write the per-voxel output files in the background as voxels are finished\n"
+     << "  [--mvn-format={nifti|mvn}] : save finalMVN as a NIFTI volume or as a compact masked .mvn file (default: nifti)\n"
+     << "  [--mvn-precision={32|16}] : bits per stored correlation in .mvn files (default: 32)\n"
      << "  [--print-free-energy] : Calculate & dump F to the logfile after each update\n"
+     << "  [--accelerate={none|squarem}] : extrapolate the VB iterations, keeping a jump only if it doesn't reduce F (default: none)\n"
+     << "  [--sparse-jacobian] : probe the model for Jacobian entries that are always zero and skip them\n"
      << "  [--allow-bad-voxels] : Skip to next voxel if a numerical exception occurs (don't stop)\n"
      << "For spatial priors (using --method=spatialvb):\n"
      << "  --param-spatial-priors=<choice_of_prior_forms>: Specify a type of prior to use for each"
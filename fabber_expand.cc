@@ -0,0 +1,174 @@
+/*  fabber_expand.cc - Turns masked FABBER outputs back into NIFTI
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include <iostream>
+using namespace std;
+
+#ifdef __FABBER_LIBRARYONLY // Skip entire file if making fabber_library
+int main() {cout << "FABBER_EXPAND not built; compiled with __FABBER_LIBRARYONLY option." << endl; return 2;}
+#else
+
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include "maskedfile.h"
+#include "niftiwriter.h"
+#include "easyoptions.h"
+
+/* Function declarations */
+void Usage(const string& errorString = "");
+
+// The input's name without its .masked[.gz] extension
+string BaseName(const string& filename)
+{
+  const char* exts[] = { ".masked.gz", ".masked" };
+  for (int i = 0; i < 2; i++)
+    {
+      const string ext = exts[i];
+      if (filename.size() > ext.size() 
+          && filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0)
+        return filename.substr(0, filename.size() - ext.size());
+    }
+  return filename;
+}
+
+int main(int argc, char** argv)
+{
+	try
+	  {
+	    EasyOptions args(argc, argv);
+
+	    if (args.ReadBool("help"))
+	      {
+		Usage();
+		return 0;
+	      }
+
+	    const string infile = args.Read("input");
+	    if (!IsMaskedFile(infile))
+	      throw Invalid_option(infile + " isn't a .masked or .masked.gz file");
+	    const string outfile = args.ReadWithDefault("output", BaseName(infile));
+	    const bool verbose = args.ReadBool("v");
+	    args.CheckEmpty();
+
+	    MaskedFile in(infile);
+	    const MaskedFileHeader& hdr = in.Header();
+	    if (verbose) 
+	      cout << infile << ": " << in.NumVoxels() << " voxels, " 
+		   << in.NumFrames() << " frames" << endl;
+
+	    /* Same grid, values and type as the original output would have had */
+	    const NiftiWriter writer(hdr.grid, in.MaskIndex());
+	    NiftiWriter::Format format;
+	    format.datatype = hdr.datatype;
+	    NiftiWriter::FrameStream out(writer, outfile, hdr.nFrames, hdr.intent, 
+					 hdr.lo, hdr.hi, format);
+	    const vector<double>& values = in.Values();
+	    out.Put(values.empty() ? NULL : &values[0], in.NumFrames()); // zeros if mask is empty
+	    out.Close();
+
+	    if (verbose) cout << "Done." << endl;
+	    return 0;
+	  }
+	catch (const Invalid_option& e)
+	  {
+	    cout << Exception::what() << endl;
+	    Usage();
+	  }
+	catch (Exception)
+	  {
+	    cout << Exception::what() << endl;
+	  }
+	catch (const exception& e)
+	  {
+	    cout << e.what() << endl;
+	  }
+	catch (...)
+	  {
+	    cout << "There was an error!" << endl;
+	  }
+
+	return 1;
+}
+
+void Usage(const string& errorString)
+{
+  cout << "\nUsage: fabber_expand <arguments>\n"
+       << "Arguments are mandatory unless they appear in [brackets].\n\n";
+
+  cout << " --help : Prints this information." << endl
+       << " --input=<file> : A .masked or .masked.gz file, as written with fabber --output-layout=masked." << endl
+       << " [--output=<NIFTIfile>] : Name of the NIFTI file to write (default: the input's name," << endl
+       << "     compressed according to $FSLOUTPUTTYPE)." << endl
+       << " [--v] : Verbose." << endl << endl;
+
+  if (errorString.length() > 0)
+    cout << "\nError: " << errorString << endl;
+}
+
+#endif //__FABBER_LIBRARYONLY
@@ -83,6 +83,19 @@ string FwdModel::ModelVersion() const
   // It should probably go in your .cc file, not the header.
 }
 
+void FwdModel::EvaluateMany(const Matrix& params, Matrix& results) const
+{
+  ColumnVector param, result;
+  for (int v = 1; v <= params.Ncols(); v++)
+    {
+      param = params.Column(v);
+      Evaluate(param, result);
+      if (v == 1) results.ReSize(result.Nrows(), params.Ncols());
+      results.Column(v) = result;
+    }
+  if (params.Ncols() == 0) results.ReSize(0, 0);
+}
+
 int FwdModel::Gradient(const ColumnVector& params, Matrix& grad) const
 {
   // by default return false -> no gradient is supplied by this model
@@ -125,6 +138,7 @@ void FwdModel::pass_in_coords( const ColumnVector& coords )
 #include "fwdmodel_custom.h"
 
 #include "fwdmodel_cest.h"
+#include "fwdmodel_dsc.h"
 #ifdef __OXASL
 // models associated with Oxford_asl components
 #include "fwdmodel_asl_grase.h"
@@ -136,7 +150,6 @@ void FwdModel::pass_in_coords( const ColumnVector& coords )
 
 #ifdef __DEVEL
 // development models (not to be complied in FSL)
-#include "fwdmodel_dsc.h"
 #include "fwdmodel_asl_devel.h"
 //#include "fwdmodel_asl_2cpt.h"
 //#include "fwdmodel_asl_multite.h"
@@ -197,6 +210,10 @@ FwdModel* FwdModel::NewFromName(const string& name, ArgsType& args)
       {
 	return new CESTFwdModel(args);
       }
+    else if (name == "dsc")
+      {
+	return new DSCFwdModel(args);
+      }
 	
 #ifdef __OXASL
 	//models associated with Oxford_asl components
@@ -224,10 +241,6 @@ FwdModel* FwdModel::NewFromName(const string& name, ArgsType& args)
 	
 #ifdef __DEVEL
 // development models (not to be complied in FSL)
-    else if (name == "dsc")
-      {
-	return new DSCFwdModel(args);
-      }
     else if (name == "devel")
       {
 	return new DevelFwdModel(args);
@@ -104,6 +104,11 @@ public:
 			      ColumnVector& result) const = 0;
   // Evaluate the forward model
 
+  virtual void EvaluateMany(const Matrix& params, Matrix& results) const;
+  // Evaluate the forward model for each column of params (all for the
+  // current voxel); column v of results is the output for column v.
+  // Default implementation calls Evaluate once per column.
+
   virtual int Gradient(const ColumnVector& params, Matrix& grad) const;
   // evaluate the gradient, the int return is to indicate whether a valid gradient is returned by the model
                   
@@ -71,6 +71,7 @@
 #include <iostream>
 #include <newmatio.h>
 #include <stdexcept>
+#include <algorithm>
 #include "newimage/newimageall.h"
 using namespace NEWIMAGE;
 #include "easylog.h"
@@ -140,113 +141,138 @@ void BuxtonFwdModel::HardcodedInitialDists(MVNDist& prior,
     
     
 
+// params(i,v) with the negative check applied
+static inline float paramcpy(const Matrix& params, int i, int v)
+{
+  return params(i,v)<0 ? 0 : params(i,v);
+}
+
 void BuxtonFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
   Tracer_Plus tr("BuxtonFwdModel::Evaluate");
 
-    // ensure that values are reasonable
-    // negative check
-  ColumnVector paramcpy = params;
-  for (int i=1;i<=NumParams();i++) {
-      if (params(i)<0) { paramcpy(i) = 0; }
+  ColumnParams p;
+  UnpackParams(params, 1, p);
+
+  // loop over tis
+  float ti;
+  result.ReSize(tis.Nrows()*repeats);
+  for(int it=1; it<=tis.Nrows(); it++)
+    {
+      ti = tis(it);
+      Real signal = Signal(ti, p);
+
+      /* output */
+      // loop over the repeats
+      for (int rpt=1; rpt<=repeats; rpt++)
+	result((it-1)*repeats+rpt) = signal;
     }
+}
 
-     // sensible limits on transit times
-     if (params(tiss_index()+1)>timax-0.2) { paramcpy(tiss_index()+1) = timax-0.2; }
- 
-  // parameters that are inferred - extract and give sensible names
-  float ftiss;
-  float delttiss;
-  float tautiss;
-  float T_1;
-  float T_1b;
+void BuxtonFwdModel::EvaluateMany(const Matrix& params, Matrix& results) const
+{
+  Tracer_Plus tr("BuxtonFwdModel::EvaluateMany");
 
-  float ftiss2 = 0;
-  float delttiss2 = 0;
+  // unpack the parameters of every column, then run the TI loop over the
+  // columns
+  const int nv = params.Ncols();
+  vector<ColumnParams> p(nv);
+  for (int v=0; v<nv; v++)
+    UnpackParams(params, v+1, p[v]);
+
+  // loop over tis
+  float ti;
+  results.ReSize(tis.Nrows()*repeats, nv);
+  Real* out = results.Store();
+
+  for(int it=1; it<=tis.Nrows(); it++)
+    {
+      ti = tis(it);
+      Real* row = out + (it-1)*repeats*nv;
+
+      for (int v=0; v<nv; v++)
+	row[v] = Signal(ti, p[v]);
+
+      /* output */
+      // loop over the repeats
+      for (int rpt=2; rpt<=repeats; rpt++)
+	copy(row, row+nv, row + (rpt-1)*nv);
+    }
+}
+
+void BuxtonFwdModel::UnpackParams(const Matrix& params, int v, ColumnParams& p) const
+{
+  p.ftiss=paramcpy(params,tiss_index(),v);
 
-  ftiss=paramcpy(tiss_index());
-  delttiss=paramcpy(tiss_index()+1);
+  // sensible limits on transit times
+  float delttiss=paramcpy(params,tiss_index()+1,v);
+  if (params(tiss_index()+1,v)>timax-0.2) { delttiss = timax-0.2; }
 
-  if (infertau) { tautiss=paramcpy(tau_index()); }
+  float tautiss;
+  if (infertau) { tautiss=paramcpy(params,tau_index(),v); }
   else { tautiss = seqtau; }
-  
+
+  float T_1;
+  float T_1b;
   if (infert1) {
-    T_1 = paramcpy(t1_index());
-    T_1b = paramcpy(t1_index()+1);
+    T_1 = paramcpy(params,t1_index(),v);
+    T_1b = paramcpy(params,t1_index()+1,v);
   }
   else {
     T_1 = t1;
     T_1b = t1b;
   }
 
+  p.ftiss2 = 0;
+  float delttiss2 = 0;
   if (twobol) {
-    ftiss2 = paramcpy(tiss2_index());
-    delttiss2 = paramcpy(tiss2_index()+1);
+    p.ftiss2 = paramcpy(params,tiss2_index(),v);
+    delttiss2 = paramcpy(params,tiss2_index()+1,v);
   }
-    
 
-  //float lambda = 0.9;
+  p.T_1app = 1/( 1/T_1 + 0.01/lambda );
+  p.R = 1/p.T_1app - 1/T_1b;
 
-    float T_1app = 1/( 1/T_1 + 0.01/lambda );
-    float R = 1/T_1app - 1/T_1b;
+  p.tau1 = delttiss;
+  p.tau2 = delttiss + tautiss;
 
-    float tau1 = delttiss;
-    float tau2 = delttiss + tautiss;
+  // for second bolus
+  p.tau3 = delttiss2;
+  p.tau4 = delttiss2 + tautiss;
+}
 
-    // for second bolus
-    float tau3 = delttiss2;
-    float tau4 = delttiss2 + tautiss;
+Real BuxtonFwdModel::Signal(float ti, const ColumnParams& p) const
+{
+  float F=0;float F2=0;
+  float kctissue; float kctissue2;
 
-    float F=0;float F2=0;
-    float kctissue; float kctissue2;
- 
+  // 1st bolus
+  F = 2*p.ftiss * exp(-ti/p.T_1app);
 
-    // loop over tis
-    float ti;
-    result.ReSize(tis.Nrows()*repeats);
-
-    for(int it=1; it<=tis.Nrows(); it++)
-      {
-	ti = tis(it);
-
-	// 1st bolus
-	F = 2*ftiss * exp(-ti/T_1app);
-
-	/* tissue contribution */
-	if(ti < tau1)
-	  { kctissue = 0;}
-	else if(ti >= tau1 && ti <= tau2)
-	  {
-	    kctissue = F/R * (exp(R*ti) - exp(R*tau1));
-	  }
-	else /*(ti > tau2)*/
-	  {kctissue = F/R * (exp(R*tau2) - exp(R*tau1)); }
-
-	// 2nd bolus
-	F2 = 2*ftiss2/lambda * exp(-ti/T_1app);
-
-	/* tissue contribution */
-	if(ti < tau3)
-	  { kctissue2 = 0;}
-	else if(ti >= tau3 && ti <= tau4)
-	  {
-	    kctissue2 = F2/R * (exp(R*ti) - exp(R*tau3));
-	  }
-	else /*(ti > tau2)*/
-	  {kctissue2 = F2/R * (exp(R*tau4) - exp(R*tau3)); }
-	
-	/* output */
-	// loop over the repeats
-	for (int rpt=1; rpt<=repeats; rpt++)
-	  {
-	    result( (it-1)*repeats+rpt ) = kctissue + kctissue2;
-	  }
-
-
-      }
+  /* tissue contribution */
+  if(ti < p.tau1)
+    { kctissue = 0;}
+  else if(ti >= p.tau1 && ti <= p.tau2)
+    {
+      kctissue = F/p.R * (exp(p.R*ti) - exp(p.R*p.tau1));
+    }
+  else /*(ti > tau2)*/
+    {kctissue = F/p.R * (exp(p.R*p.tau2) - exp(p.R*p.tau1)); }
 
+  // 2nd bolus
+  F2 = 2*p.ftiss2/lambda * exp(-ti/p.T_1app);
 
-  return;
+  /* tissue contribution */
+  if(ti < p.tau3)
+    { kctissue2 = 0;}
+  else if(ti >= p.tau3 && ti <= p.tau4)
+    {
+      kctissue2 = F2/p.R * (exp(p.R*ti) - exp(p.R*p.tau3));
+    }
+  else /*(ti > tau2)*/
+    {kctissue2 = F2/p.R * (exp(p.R*p.tau4) - exp(p.R*p.tau3)); }
+
+  return kctissue + kctissue2;
 }
 
 BuxtonFwdModel::BuxtonFwdModel(ArgsType& args)
@@ -71,6 +71,7 @@
 #include <iostream>
 #include <newmatio.h>
 #include <stdexcept>
+#include <algorithm>
 #include "newimage/newimageall.h"
 #include "miscmaths/miscprob.h"
 using namespace NEWIMAGE;
@@ -157,281 +158,183 @@ void GraseFwdModel::HardcodedInitialDists(MVNDist& prior,
     
     
 
+// params(i,v) with the negative check applied
+static inline float paramcpy(const Matrix& params, int i, int v)
+{
+  return params(i,v)<0 ? 0 : params(i,v);
+}
+
 void GraseFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
   Tracer_Plus tr("GraseFwdModel::Evaluate");
 
-    // ensure that values are reasonable
-    // negative check
-  ColumnVector paramcpy = params;
-   for (int i=1;i<=NumParams();i++) {
-      if (params(i)<0) { paramcpy(i) = 0; }
-      }
-  
-     // sensible limits on transit times
-   if (!singleti) {
-  if (params(tiss_index()+1)>timax-0.2) { paramcpy(tiss_index()+1) = timax-0.2; }
-   }
-  if (inferart) {
-    if (params(art_index()+1)>timax-0.2) { paramcpy(art_index()+1) = timax-0.2; }
-  }
+  ColumnParams p;
+  UnpackParams(params, 1, p);
 
+  // loop over tis
+  float ti;
+  result.ReSize(tis.Nrows()*repeats);
+  for(int it=1; it<=tis.Nrows(); it++)
+    {
+      ti = tis(it) + slicedt*coord_z; //account here for an increase in the TI due to delays between slices
+      Real signal = Signal(ti, p);
+
+      /* output */
+      // loop over the repeats
+      for (int rpt=1; rpt<=repeats; rpt++)
+	result((it-1)*repeats+rpt) = signal;
+    }
+}
+
+void GraseFwdModel::EvaluateMany(const Matrix& params, Matrix& results) const
+{
+  Tracer_Plus tr("GraseFwdModel::EvaluateMany");
 
-  // parameters that are inferred - extract and give sensible names
-  float ftiss;
-  float delttiss;
-  float tauset; //the value of tau set by the sequence (may be effectively infinite)
-  float taubset;
-  float fblood;
-  float deltblood;
-  float T_1;
-  float T_1b;
+  // unpack the parameters of every column, then run the TI loop over the
+  // columns
+  const int nv = params.Ncols();
+  vector<ColumnParams> p(nv);
+  for (int v=0; v<nv; v++)
+    UnpackParams(params, v+1, p[v]);
 
+  // loop over tis
+  float ti;
+  results.ReSize(tis.Nrows()*repeats, nv);
+  Real* out = results.Store();
 
-  ftiss=paramcpy(tiss_index());
+  for(int it=1; it<=tis.Nrows(); it++)
+    {
+      ti = tis(it) + slicedt*coord_z; //account here for an increase in the TI due to delays between slices
+      Real* row = out + (it-1)*repeats*nv;
+
+      for (int v=0; v<nv; v++)
+	row[v] = Signal(ti, p[v]);
+
+      /* output */
+      // loop over the repeats
+      for (int rpt=2; rpt<=repeats; rpt++)
+	copy(row, row+nv, row + (rpt-1)*nv);
+    }
+}
+
+void GraseFwdModel::UnpackParams(const Matrix& params, int v, ColumnParams& p) const
+{
+  p.ftiss=paramcpy(params,tiss_index(),v);
   if (!singleti) {
-  delttiss=paramcpy(tiss_index()+1);
+    p.delttiss=paramcpy(params,tiss_index()+1,v);
+    // sensible limits on transit times
+    if (params(tiss_index()+1,v)>timax-0.2) { p.delttiss = timax-0.2; }
   }
   else {
     //only inferring on tissue perfusion, assume fixed value for tissue arrival time
-    delttiss = setdelt;
+    p.delttiss = setdelt;
   }
 
-  if (infertau) { 
-    tauset=paramcpy(tau_index()); 
+  if (infertau) {
+    p.tauset=paramcpy(params,tau_index(),v);
   }
-  else { tauset = seqtau;
+  else { p.tauset = seqtau;
   }
-  
+
   if (infertaub) {
-    taubset = paramcpy(taub_index());
+    p.taubset = paramcpy(params,taub_index(),v);
   }
   else
-    { taubset = tauset; }
+    { p.taubset = p.tauset; }
 
   if (inferart) {
-    fblood=paramcpy(art_index());
-    deltblood=paramcpy(art_index()+1);
+    p.fblood=paramcpy(params,art_index(),v);
+    p.deltblood=paramcpy(params,art_index()+1,v);
+    if (params(art_index()+1,v)>timax-0.2) { p.deltblood = timax-0.2; }
   }
   else {
-    fblood = 0;
-    deltblood = 0;
+    p.fblood = 0;
+    p.deltblood = 0;
   }
 
   if (infert1) {
-    T_1 = paramcpy(t1_index());
-    T_1b = paramcpy(t1_index()+1);
+    p.T_1 = paramcpy(params,t1_index(),v);
+    p.T_1b = paramcpy(params,t1_index()+1,v);
 
     //T1 cannot be zero!
-    if (T_1<1e-12) T_1=0.01;
-    if (T_1b<1e-12) T_1b=0.01;
+    if (p.T_1<1e-12) p.T_1=0.01;
+    if (p.T_1b<1e-12) p.T_1b=0.01;
   }
   else {
-    T_1 = t1;
-    T_1b = t1b;
+    p.T_1 = t1;
+    p.T_1b = t1b;
   }
 
+  float f_calib;
+  // if we are using calibrated data then we can use ftiss to calculate T_1app
+  if (calib) f_calib = p.ftiss;
+  else       f_calib = 0.01; //otherwise assume sensible value (units of s^-1)
 
-  // float lambda = 0.9;
-
-    float f_calib;
-    // if we are using calibrated data then we can use ftiss to calculate T_1app
-    if (calib) f_calib = ftiss;
-    else       f_calib = 0.01; //otherwise assume sensible value (units of s^-1)
-
-    float T_1app = 1/( 1/T_1 + f_calib/lambda );
-    float R = 1/T_1app - 1/T_1b;
+  p.T_1app = 1/( 1/p.T_1 + f_calib/lambda );
+  p.R = 1/p.T_1app - 1/p.T_1b;
+}
 
-    float tau; //bolus length as seen by kintic curve
-    float taub; //bolus length of blood as seen in signal
-    
+Real GraseFwdModel::Signal(float ti, const ColumnParams& p) const
+{
+  float tau; //bolus length as seen by kintic curve
+  float taub; //bolus length of blood as seen in signal
 
-    float F=0;
-    float kctissue;
-    float kcblood;
+  float F=0;
+  float kctissue;
+  float kcblood;
 
+  if (casl)  F = 2*p.ftiss;
+  else	     F = 2*p.ftiss * exp(-ti/p.T_1app);
 
-    // loop over tis
-    float ti;
-    result.ReSize(tis.Nrows()*repeats);
+  // Deal with saturation of the bolus before the TI - defined by pretisat
+  if(p.tauset < ti - pretisat)
+    { tau = p.tauset; }
+  else
+    { tau = ti -  pretisat; }
 
+  if(p.taubset < ti -  pretisat)
+    {taub = p.taubset; }
+  else
+    {taub = ti -  pretisat; }
 
-    for(int it=1; it<=tis.Nrows(); it++)
-      {
-	ti = tis(it) + slicedt*coord_z; //account here for an increase in the TI due to delays between slices
-	//cout << coord_z << " : " << ti << endl;
-	if (casl)  F = 2*ftiss;
-	else	   F = 2*ftiss * exp(-ti/T_1app);
-
-	/* According to EAGLE GRASE sequence bolus length is current TI - 0.1s (assuming infite length 'true' bolus)
-	   However, also allow here bolus length to be finite as recorded in tauset
-	   NB tauset is the 'true' bolus length, tau is what the tissue actually sees as a result of the sequence
-	   25-3-2009 now deal with this scenario via pretisat parameter
-	*/
-
-	/*	if (grase)
-	  {
-	  //GRASE -  deal with bolus length (see above) */
-
-	// Deal with saturation of the bolus before the TI - defined by pretisat
-	if(tauset < ti - pretisat)
-	  { tau = tauset; }
-	else
-	  { tau = ti -  pretisat; }
-	
-	if(taubset < ti -  pretisat)
-	  {taub = taubset; }
-	else
-	  {taub = ti -  pretisat; }
-
-	/* }
-    	else {
-	  tau = tauset;
-	  taub = taubset;
-	}
-	*/
-    
-	/*	if (infertrailing)
-	  {
-	    ///////////////// New bolus length & trailing edge model //////////////
-	    // tau is now defined as the point where inv eff starts to drop
-	    // bt1 is start of bolus trailing edge, bt2 is end of bolus trailing edge
-
-	    // constrain trailing epriod to sensible limits
-	    if (trailingperiod < 1e-6) trailingperiod=1e-6;
-	    //if (trailingperiod > 2*tau) trailingperiod = 2*tau;
-
-
-	    // define bolus trailgin edge start and stop times
-	    float bt1 = delttiss + tau ;
-	    float bt2 = delttiss + tau + trailingperiod;
-	    
-	    // tissue contribution 
-	    if(ti < delttiss)
-	      { kctissue = 0;}
-
-	    // once bolus is arriving, but before the trailing edge has arrived
-	    else if(ti >= delttiss && ti <= (delttiss + bt1))
-	      {
-		kctissue = F/R * (exp(R*ti)-exp(R*delttiss) );
-	      }
-
-	    // once the trailing edge of the bolus is arriving
-	    else if(ti >= bt1 && ti <= bt2)
-	      {
-		kctissue = F/R * ( (exp(R*bt1)-exp(R*delttiss)) + (exp(R*ti)-exp(R*bt1))*(1+inveffslope*bt1+inveffslope/R) - inveffslope*(ti*exp(R*ti) - bt1*exp(R*bt1)) );
-		if (kctissue<0) {kctissue = 0; } //dont allow negative values (shoudld be redundant)
-	      }
-
-	    // once the trailing edge of the bolus is past
-	    else //(ti > delttiss + bt2)
-	      {
-		kctissue = F/R * ( (exp(R*bt1)-exp(R*delttiss)) + (exp(R*bt2)-exp(R*bt1))*(1+inveffslope*bt1+inveffslope/R) - inveffslope*(bt2*exp(R*bt2) - bt1*exp(R*bt1)) );
-		if (kctissue<0) { kctissue = 0; } //dont allow negative values
-	      }
+  // --[tissue contribution]------
+  if(ti < p.delttiss)
+    { kctissue = 0;}
+  else if(ti >= p.delttiss && ti <= (p.delttiss + tau))
+    {
+      if (casl)  kctissue = F * p.T_1app * exp(-p.delttiss/p.T_1b) * (1 - exp(-(ti-p.delttiss)/p.T_1app));
+      else	 kctissue = F/p.R * ( (exp(p.R*ti) - exp(p.R*p.delttiss)) ) ;
+    }
+  else //(ti > delttiss + tau)
+    {
+      if (casl)  kctissue = F * p.T_1app * exp(-p.delttiss/p.T_1b) * exp(-(ti-tau-p.delttiss)/p.T_1app) * (1 - exp(-tau/p.T_1app));
+      else       kctissue = F/p.R * ( (exp(p.R*(p.delttiss+tau)) - exp(p.R*p.delttiss))  );
+    }
 
-	
-	    // arterial contribution
-	    // calc the correct bt1 for the arterial bolus
-	    bt1 = deltblood + tau ;
-	    //bt2 = deltblood + tau + trailingperiod;
-
-	    if(ti < deltblood)
-	      { 
-		//kcblood = 0;
-		// use a artifical lead in period for arterial bolus to improve model fitting
-		kcblood = fblood * exp(-deltblood/T_1b) * (0.98 * exp( (ti-deltblood)/0.1 ) + 0.02 * ti/deltblood );
-	      }
-
-	    // once bolus is arriving, but before the trailing edge has arrived
-	    else if(ti >= deltblood && ti <= bt1)
-	      {
-		kcblood = fblood * exp(-ti/T_1b);
-	      }
-	
-	    // Once we are into the trailing edge of the bolus
-	    else if(ti >= bt1 && ti <= bt2)
-	      { 
-		kcblood = fblood * exp(-ti/T_1b); 
-		kcblood = kcblood * (1 - 1/trailingperiod*(ti- bt1));
-		if (kcblood<0) { kcblood = 0; } //dont allow negative values
-	      }
-
-	    // Once the trailing edge of the bolus has passed
-	    else //(ti >  bt2) 
-	      {
-		kcblood = 0; //end of bolus
-	      }
-	  }
-
-
-
-
-	/////////// Older version of model (implements Inversion efficiency slope) /////////
-	else
-	{*/
-	    //deal with the case where the inveffslope is severe and cuts off the bolus)
-	    //if (tau>bollen) tau=bollen;
-	    //if (taub>bollen) taub=bollen;
-	    
-
-	    // --[tissue contribution]------
-	    if(ti < delttiss)
-	      { kctissue = 0;}
-	    else if(ti >= delttiss && ti <= (delttiss + tau))
-	      {
-
-		if (casl)  kctissue = F * T_1app * exp(-delttiss/T_1b) * (1 - exp(-(ti-delttiss)/T_1app));
-		else	   kctissue = F/R * ( (exp(R*ti) - exp(R*delttiss)) ) ;
-
-	      }
-	    else //(ti > delttiss + tau)
-	      {
-		if (casl)  kctissue = F * T_1app * exp(-delttiss/T_1b) * exp(-(ti-tau-delttiss)/T_1app) * (1 - exp(-tau/T_1app));
-		else       kctissue = F/R * ( (exp(R*(delttiss+tau)) - exp(R*delttiss))  );
-
-	      }
-	
-	    // --[arterial contribution]------
-	    if(ti < deltblood)
-	      { 
-		
-		kcblood = fblood * exp(-deltblood/T_1b) * (0.98 * exp( (ti-deltblood)/0.05 ) + 0.02 * ti/deltblood );
-		// use a artifical lead in period for arterial bolus to improve model fitting
-		//NB same equation for PASL and CASL
-	      }
-	    else if(ti >= deltblood && ti <= (deltblood + taub))
-	      { 
-		if (casl)  kcblood = fblood * exp(-deltblood/T_1b);
-		else       kcblood = fblood * exp(-ti/T_1b); 
-	      }
-	    else //(ti > deltblood + tau)
-	      {
-		kcblood = 0; //end of bolus
-		if (casl)  kcblood = fblood * exp(-deltblood/T_1b);
-		else	   kcblood = fblood * exp(-(deltblood+taub)/T_1b);
-		kcblood *= (0.98 * exp( -(ti - deltblood - taub)/0.05) + 0.02 * (1-(ti - deltblood - taub)/5));
-		// artifical lead out period for taub model fitting
-		if (kcblood<0) kcblood=0; //negative values are possible with the lead out period equation
-									   
-	      }
-
-	    if (isnan(kctissue)) { kctissue=0; LOG << "Warning NaN in tissue curve at TI:" << ti << " with f:" << ftiss << " delt:" << delttiss << " tau:" << tau << " T1:" << T_1 << " T1b:" << T_1b << endl; }
-	    //}
-
-	/* output */
-	// loop over the repeats
-	for (int rpt=1; rpt<=repeats; rpt++)
-	  {
-	    result( (it-1)*repeats+rpt ) = kctissue + kcblood;
-	  }
+  // --[arterial contribution]------
+  if(ti < p.deltblood)
+    {
+      kcblood = p.fblood * exp(-p.deltblood/p.T_1b) * (0.98 * exp( (ti-p.deltblood)/0.05 ) + 0.02 * ti/p.deltblood );
+      // use a artifical lead in period for arterial bolus to improve model fitting
+      //NB same equation for PASL and CASL
+    }
+  else if(ti >= p.deltblood && ti <= (p.deltblood + taub))
+    {
+      if (casl)  kcblood = p.fblood * exp(-p.deltblood/p.T_1b);
+      else       kcblood = p.fblood * exp(-ti/p.T_1b);
+    }
+  else //(ti > deltblood + tau)
+    {
+      if (casl)  kcblood = p.fblood * exp(-p.deltblood/p.T_1b);
+      else	 kcblood = p.fblood * exp(-(p.deltblood+taub)/p.T_1b);
+      kcblood *= (0.98 * exp( -(ti - p.deltblood - taub)/0.05) + 0.02 * (1-(ti - p.deltblood - taub)/5));
+      // artifical lead out period for taub model fitting
+      if (kcblood<0) kcblood=0; //negative values are possible with the lead out period equation
+    }
 
- 
-      }
-    //cout << result.t();
-    
+  if (isnan(kctissue)) { kctissue=0; LOG << "Warning NaN in tissue curve at TI:" << ti << " with f:" << p.ftiss << " delt:" << p.delttiss << " tau:" << tau << " T1:" << p.T_1 << " T1b:" << p.T_1b << endl; }
 
-  return;
+  return kctissue + kcblood;
 }
 
 GraseFwdModel::GraseFwdModel(ArgsType& args)
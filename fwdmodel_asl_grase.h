@@ -76,6 +76,7 @@ public:
   // Virtual function overrides
   virtual void Evaluate(const ColumnVector& params, 
 			      ColumnVector& result) const;
+  virtual void EvaluateMany(const Matrix& params, Matrix& results) const;
   static void ModelUsage();
   virtual string ModelVersion() const;
                   
@@ -121,6 +122,15 @@ protected: // Constants
 
   // index for the parameter to expereicne ARD (this is the arterial perfusion flow)
   int ard_index() const { return 2 + (infertau?1:0) + (inferart?1:0); }
+
+  // parameters of one column, unpacked once for the TI loop
+  struct ColumnParams {
+    float ftiss, delttiss, tauset, taubset, fblood, deltblood;
+    float T_1, T_1b, T_1app, R;
+  };
+  void UnpackParams(const Matrix& params, int v, ColumnParams& p) const;
+  // kinetic curve at one TI; shared by Evaluate and EvaluateMany
+  Real Signal(float ti, const ColumnParams& p) const;
   
   // scan parameters
   double seqtau; //bolus length as set by the sequence
@@ -71,6 +71,7 @@
 #include <iostream>
 #include <newmatio.h>
 #include <stdexcept>
+#include <algorithm>
 #include "newimage/newimageall.h"
 #include "miscmaths/miscprob.h"
 using namespace NEWIMAGE;
@@ -210,285 +211,243 @@ void ASL_PVC_FwdModel::HardcodedInitialDists(MVNDist& prior,
     
     
 
+// params(i,v) with the negative check applied
+static inline float paramcpy(const Matrix& params, int i, int v)
+{
+  return params(i,v)<0 ? 0 : params(i,v);
+}
+
 void ASL_PVC_FwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
   Tracer_Plus tr("ASL_PVC_FwdModel::Evaluate");
 
-    // ensure that values are reasonable
-    // negative check
-  ColumnVector paramcpy = params;
-   for (int i=1;i<=NumParams();i++) {
-      if (params(i)<0) { paramcpy(i) = 0; }
-      }
-  
-     // sensible limits on transit times
-   if (infertiss) {
-  if (params(tiss_index()+1)>timax-0.2) { paramcpy(tiss_index()+1) = timax-0.2; }
-   }
-  if (inferart) {
-    if (params(art_index()+1)>timax-0.2) { paramcpy(art_index()+1) = timax-0.2; }
-  }
+  ColumnParams p;
+  UnpackParams(params, 1, p);
+
+  // loop over tis
+  float ti;
+  result.ReSize(tis.Nrows()*repeats);
+  for(int it=1; it<=tis.Nrows(); it++)
+    {
+      ti = tis(it) + slicedt*coord_z; //account here for an increase in the TI due to delays between slices;
+      Real signal = Signal(ti, p);
+
+      /* output */
+      // loop over the repeats
+      for (int rpt=1; rpt<=repeats; rpt++)
+	result((it-1)*repeats+rpt) = signal;
+    }
+}
+
+void ASL_PVC_FwdModel::EvaluateMany(const Matrix& params, Matrix& results) const
+{
+  Tracer_Plus tr("ASL_PVC_FwdModel::EvaluateMany");
+
+  // unpack the parameters of every column, then run the TI loop over the
+  // columns
+  const int nv = params.Ncols();
+  vector<ColumnParams> p(nv);
+  for (int v=0; v<nv; v++)
+    UnpackParams(params, v+1, p[v]);
 
+  // loop over tis
+  float ti;
+  results.ReSize(tis.Nrows()*repeats, nv);
+  Real* out = results.Store();
 
-  // parameters that are inferred - extract and give sensible names
-  float ftiss;
-  float delttiss;
-  float tauset; //the value of tau set by the sequence (may be effectively infinite)
-  float taubset;
-  float fblood;
-  float deltblood;
-  float T_1;
-  float T_1b;
+  for(int it=1; it<=tis.Nrows(); it++)
+    {
+      ti = tis(it) + slicedt*coord_z; //account here for an increase in the TI due to delays between slices;
+      Real* row = out + (it-1)*repeats*nv;
 
-  float pv_gm;
-  float pv_wm;
+      for (int v=0; v<nv; v++)
+	row[v] = Signal(ti, p[v]);
 
-  float fwm;
-  float deltwm;
-  float tauwmset;
-  float T_1wm;
+      /* output */
+      // loop over the repeats
+      for (int rpt=2; rpt<=repeats; rpt++)
+	copy(row, row+nv, row + (rpt-1)*nv);
+    }
+}
 
-  //  float RR;
-  //  float inveffslope;
-  //float trailingperiod;
+void ASL_PVC_FwdModel::UnpackParams(const Matrix& params, int v, ColumnParams& p) const
+{
+  float lambdagm = 0.98;
+  float lambdawm = 0.82;
 
   if (infertiss) {
-  ftiss=paramcpy(tiss_index());
-  //if (!singleti) {
-  delttiss=paramcpy(tiss_index()+1);
-  //}
-  //else {
-    //only inferring on tissue perfusion, assume fixed value for tissue arrival time
-    //delttiss = 0;
-    //}
+    p.ftiss=paramcpy(params,tiss_index(),v);
+    p.delttiss=paramcpy(params,tiss_index()+1,v);
+    // sensible limits on transit times
+    if (params(tiss_index()+1,v)>timax-0.2) { p.delttiss = timax-0.2; }
   }
   else {
-    ftiss=0;
-    delttiss=0;
+    p.ftiss=0;
+    p.delttiss=0;
   }
 
-  if (infertau && infertiss) { 
-    tauset=paramcpy(tau_index()); 
+  if (infertau && infertiss) {
+    p.tauset=paramcpy(params,tau_index(),v);
   }
-  else { tauset = seqtau;
+  else { p.tauset = seqtau;
   }
-  
+
   if (infertaub) {
-    taubset = paramcpy(taub_index());
+    p.taubset = paramcpy(params,taub_index(),v);
   }
   else
-    { taubset = tauset; }
+    { p.taubset = p.tauset; }
 
   if (inferart) {
-    fblood=paramcpy(art_index());
-    deltblood=paramcpy(art_index()+1);
+    p.fblood=paramcpy(params,art_index(),v);
+    p.deltblood=paramcpy(params,art_index()+1,v);
+    if (params(art_index()+1,v)>timax-0.2) { p.deltblood = timax-0.2; }
   }
   else {
-    fblood = 0;
-    deltblood = 0;
+    p.fblood = 0;
+    p.deltblood = 0;
   }
 
   if (infert1) {
-    T_1 = paramcpy(t1_index());
-    T_1b = paramcpy(t1_index()+1);
+    p.T_1 = paramcpy(params,t1_index(),v);
+    p.T_1b = paramcpy(params,t1_index()+1,v);
 
     //T1 cannot be zero!
-    if (T_1<0.01) T_1=0.01;
-    if (T_1b<0.01) T_1b=0.01;
+    if (p.T_1<0.01) p.T_1=0.01;
+    if (p.T_1b<0.01) p.T_1b=0.01;
   }
   else {
-    T_1 = t1;
-    T_1b = t1b;
+    p.T_1 = t1;
+    p.T_1b = t1b;
   }
 
-  /*if (inferart) {
-    RR = exp( paramcpy(R_index()) );
-    if (RR<1) RR=1;
-    }*/
-
   if (inferwm) {
-    fwm=paramcpy(wm_index());
-    //fwm=20;
-    deltwm=paramcpy(wm_index()+1);
+    p.fwm=paramcpy(params,wm_index(),v);
+    p.deltwm=paramcpy(params,wm_index()+1,v);
 
     if (infertau) {
-      tauwmset = paramcpy(wm_index()+2);
+      p.tauwmset = paramcpy(params,wm_index()+2,v);
     }
-    else tauwmset = seqtau;
+    else p.tauwmset = seqtau;
 
     if (infert1) {
-      T_1wm = paramcpy(wm_index()+3);
-      if (T_1<0.01) T_1=0.01;
+      p.T_1wm = paramcpy(params,wm_index()+3,v);
     }
-    else T_1wm = t1wm;
+    else p.T_1wm = t1wm;
 
     if (usepve) {
-      pv_gm = paramcpy(pv_index());
-      pv_wm = paramcpy(pv_index()+1);
+      p.pv_gm = paramcpy(params,pv_index(),v);
+      p.pv_wm = paramcpy(params,pv_index()+1,v);
     }
     else {
-      pv_gm=1;pv_wm=1;
+      p.pv_gm=1;p.pv_wm=1;
     }
   }
   else {
-    fwm=0;
-    deltwm=0;
-    T_1wm=t1wm;
+    p.fwm=0;
+    p.deltwm=0;
+    p.tauwmset=seqtau;
+    p.T_1wm=t1wm;
 
-    pv_gm=1;
-    pv_wm=1;
+    p.pv_gm=1;
+    p.pv_wm=1;
   }
 
+  p.T_1app = 1/( 1/p.T_1 + 0.01/lambdagm );
+  p.T_1appwm = 1/( 1/p.T_1wm + 0.003/lambdawm );
+  p.R = 1/p.T_1app - 1/p.T_1b;
+  p.Rwm = 1/p.T_1appwm - 1/p.T_1b;
+}
 
-    float lambdagm = 0.98;
-    float lambdawm = 0.82;
-
-    float T_1app = 1/( 1/T_1 + 0.01/lambdagm );
-    float T_1appwm = 1/( 1/T_1wm + 0.003/lambdawm );
-    float R = 1/T_1app - 1/T_1b;
-    float Rwm = 1/T_1appwm - 1/T_1b;
-
-    float tau; //bolus length as seen by kintic curve
-    float taub; //bolus length of blood as seen in signal
-    float tauwm;
-    
-
-    float F=0;
-    float Fwm=0;
-    float kctissue;
-    float kcblood;
-    float kcwm;
+Real ASL_PVC_FwdModel::Signal(float ti, const ColumnParams& p) const
+{
+  float tau; //bolus length as seen by kintic curve
+  float taub; //bolus length of blood as seen in signal
+  float tauwm;
+
+  float F=0;
+  float Fwm=0;
+  float kctissue;
+  float kcblood;
+  float kcwm;
+
+  if (casl)  {
+    F = 2*p.ftiss;
+    Fwm = 2*p.fwm;
+  }
+  else {
+    F = 2*p.ftiss * exp(-ti/p.T_1app);
+    Fwm = 2*p.fwm * exp(-ti/p.T_1appwm);
+  }
 
+  // Deal with saturation of the bolus before the TI - defined by pretisat
+  if(p.tauset < ti - pretisat)
+    { tau = p.tauset; }
+  else
+    { tau = ti -  pretisat; }
 
-    // loop over tis
-    float ti;
-    result.ReSize(tis.Nrows()*repeats);
+  if(p.taubset < ti -  pretisat)
+    {taub = p.taubset; }
+  else
+    {taub = ti -  pretisat; }
 
-    for(int it=1; it<=tis.Nrows(); it++)
-      {
-	ti = tis(it) + slicedt*coord_z; //account here for an increase in the TI due to delays between slices;
+  if(p.tauwmset < ti -  pretisat)
+    {tauwm = p.tauwmset; }
+  else
+    {tauwm = ti -  pretisat; }
 
-	if (casl)  {
-	  F = 2*ftiss;
-	  Fwm = 2*fwm;
-	}
-	else {
-	  F = 2*ftiss * exp(-ti/T_1app);
-	  Fwm = 2*fwm * exp(-ti/T_1appwm);
-	}
-	
+  // (1) tissue contribution
+  if(ti < p.delttiss)
+    { kctissue = 0;}
+  else if(ti >= p.delttiss && ti <= (p.delttiss + tau))
+    {
+      if (casl)  kctissue = F * p.T_1app * exp(-p.delttiss/p.T_1b) * (1 - exp(-(ti-p.delttiss)/p.T_1app));
+      else	 kctissue = F/p.R * ( (exp(p.R*ti) - exp(p.R*p.delttiss)) ) ;
+    }
+  else //(ti > delttiss + tau)
+    {
+      if (casl)  kctissue = F * p.T_1app * exp(-p.delttiss/p.T_1b) * exp(-(ti-tau-p.delttiss)/p.T_1app) * (1 - exp(-tau/p.T_1app));
+      else       kctissue = F/p.R * ( (exp(p.R*(p.delttiss+tau)) - exp(p.R*p.delttiss))  );
+    }
 
-	  //GRASE -  deal with bolus length (see above) */
+  // (2) arterial contribution
+  if(ti < p.deltblood)
+    {
+      // use a artifical lead in period for arterial bolus to improve model fitting
+      kcblood = p.fblood * exp(-p.deltblood/p.T_1b) * (0.98 * exp( (ti-p.deltblood)/0.05 ) + 0.02 * ti/p.deltblood );
+    }
+  else if(ti >= p.deltblood && ti <= (p.deltblood + taub))
+    {
+      if (casl)  kcblood = p.fblood * exp(-p.deltblood/p.T_1b);
+      else       kcblood = p.fblood * exp(-ti/p.T_1b);
+    }
+  else //(ti > deltblood + tau)
+    {
+      if (casl)  kcblood = p.fblood * exp(-p.deltblood/p.T_1b);
+      else	 kcblood = p.fblood * exp(-(p.deltblood+taub)/p.T_1b);
+      kcblood *= (0.98 * exp( -(ti - p.deltblood - taub)/0.05) + 0.02 * (1-(ti - p.deltblood - taub)/5));
+      // artifical lead out period for taub model fitting
+      if (kcblood<0) kcblood=0; //negative values are possible with the lead out period equation
+    }
 
-	// Deal with saturation of the bolus before the TI - defined by pretisat
-	if(tauset < ti - pretisat)
-	  { tau = tauset; }
-	else
-	  { tau = ti -  pretisat; }
-	
-	if(taubset < ti -  pretisat)
-	  {taub = taubset; }
-	else
-	  {taub = ti -  pretisat; }
-
-	if(tauwmset < ti -  pretisat)
-	  {tauwm = tauwmset; }
-	else
-	  {tauwm = ti -  pretisat; }
-
-	    
-
-	// (1) tissue contribution 
-	    if(ti < delttiss)
-	      { kctissue = 0;}
-	    else if(ti >= delttiss && ti <= (delttiss + tau))
-	      {
-		
-		if (casl)  kctissue = F * T_1app * exp(-delttiss/T_1b) * (1 - exp(-(ti-delttiss)/T_1app));
-		else	   kctissue = F/R * ( (exp(R*ti) - exp(R*delttiss)) ) ;
-
-	      }
-	    else //(ti > delttiss + tau)
-	      {
-		if (casl)  kctissue = F * T_1app * exp(-delttiss/T_1b) * exp(-(ti-tau-delttiss)/T_1app) * (1 - exp(-tau/T_1app));
-		else       kctissue = F/R * ( (exp(R*(delttiss+tau)) - exp(R*delttiss))  );
-			      }
-	
-	    // (2) arterial contribution
-	    if(ti < deltblood)
-	      { 
-		//kcblood = 0;
-		// use a artifical lead in period for arterial bolus to improve model fitting
-		kcblood = fblood * exp(-deltblood/T_1b) * (0.98 * exp( (ti-deltblood)/0.05 ) + 0.02 * ti/deltblood );
-	      }
-	    else if(ti >= deltblood && ti <= (deltblood + taub))
-	      { 
-		if (casl)  kcblood = fblood * exp(-deltblood/T_1b);
-		else       kcblood = fblood * exp(-ti/T_1b); 
-	      }
-	    else //(ti > deltblood + tau)
-	      {
-		kcblood = 0; //end of bolus
-		if (casl)  kcblood = fblood * exp(-deltblood/T_1b);
-		else	   kcblood = fblood * exp(-(deltblood+taub)/T_1b);
-		kcblood *= (0.98 * exp( -(ti - deltblood - taub)/0.05) + 0.02 * (1-(ti - deltblood - taub)/5));
-		// artifical lead out period for taub model fitting
-		if (kcblood<0) kcblood=0; //negative values are possible with the lead out period equation
-									   
-	      }
-	    // full model for arterial cpt
-	    /*	    if(ti < deltblood)
-	      { 
-		kcblood = 0;
-	      }
-	    else if(ti >= deltblood && ti <= (deltblood + taub))
-	      { 
-		
-		kcblood = fblood * exp(-ti/T_1b) * (1 - exp( -RR*(ti-deltblood) ) ); 
-		
-	      }
-	    else //(ti > deltblood + tau)
-	      {
-		kcblood = 0; //end of bolus
-		
-									   
-		}*/
-
-	    // (3) WM contribution
-	    if(ti < deltwm)
-	      { kcwm = 0;}
-	    else if(ti >= deltwm && ti <= (deltwm + tauwm))
-	      {
-		if (casl)  kcwm = Fwm * T_1appwm * exp(-deltwm/T_1b) * (1 - exp(-(ti-deltwm)/T_1appwm));
-		else	   kcwm = Fwm/Rwm * ( (exp(Rwm*ti) - exp(Rwm*deltwm)) ) ;
-
-	      }
-	    else //(ti > delttiss + tau)
-	      {
-		if (casl)  kcwm = Fwm * T_1appwm * exp(-deltwm/T_1b) * exp(-(ti-tauwm-deltwm)/T_1appwm) * (1 - exp(-tauwm/T_1appwm));
-		else       kcwm = Fwm/Rwm * ( (exp(Rwm*(deltwm+tauwm)) - exp(Rwm*deltwm))  );
-		
-	      }
-
-
-
-	    if (isnan(kctissue)) { kctissue=0; LOG << "Warning NaN in tissue curve at TI:" << ti << " with f:" << ftiss << " delt:" << delttiss << " tau:" << tau << " T1:" << T_1 << " T1b:" << T_1b << endl; }
-	    if (isnan(kcwm)) { kcwm=0; LOG << "Warning NaN in WM curve at TI:" << ti << " with f:" << fwm << " delt:" << deltwm << " tau:" << tauwm << " T1wm:" << T_1wm << " T1b:" << T_1b << endl; }
-	    //}
-
-	/* output */
-	// loop over the repeats
-	for (int rpt=1; rpt<=repeats; rpt++)
-	  {
-	    result( (it-1)*repeats+rpt ) = pv_gm*kctissue + kcblood + pv_wm*kcwm;
-	  }
+  // (3) WM contribution
+  if(ti < p.deltwm)
+    { kcwm = 0;}
+  else if(ti >= p.deltwm && ti <= (p.deltwm + tauwm))
+    {
+      if (casl)  kcwm = Fwm * p.T_1appwm * exp(-p.deltwm/p.T_1b) * (1 - exp(-(ti-p.deltwm)/p.T_1appwm));
+      else	 kcwm = Fwm/p.Rwm * ( (exp(p.Rwm*ti) - exp(p.Rwm*p.deltwm)) ) ;
+    }
+  else //(ti > delttiss + tau)
+    {
+      if (casl)  kcwm = Fwm * p.T_1appwm * exp(-p.deltwm/p.T_1b) * exp(-(ti-tauwm-p.deltwm)/p.T_1appwm) * (1 - exp(-tauwm/p.T_1appwm));
+      else       kcwm = Fwm/p.Rwm * ( (exp(p.Rwm*(p.deltwm+tauwm)) - exp(p.Rwm*p.deltwm))  );
+    }
 
- 
-      }
-    //cout << result.t();
-    
+  if (isnan(kctissue)) { kctissue=0; LOG << "Warning NaN in tissue curve at TI:" << ti << " with f:" << p.ftiss << " delt:" << p.delttiss << " tau:" << tau << " T1:" << p.T_1 << " T1b:" << p.T_1b << endl; }
+  if (isnan(kcwm)) { kcwm=0; LOG << "Warning NaN in WM curve at TI:" << ti << " with f:" << p.fwm << " delt:" << p.deltwm << " tau:" << tauwm << " T1wm:" << p.T_1wm << " T1b:" << p.T_1b << endl; }
 
-  return;
+  return p.pv_gm*kctissue + kcblood + p.pv_wm*kcwm;
 }
 
 
@@ -76,6 +76,7 @@ public:
   // Virtual function overrides
   virtual void Evaluate(const ColumnVector& params, 
 			      ColumnVector& result) const;
+  virtual void EvaluateMany(const Matrix& params, Matrix& results) const;
   static void ModelUsage();
   virtual string ModelVersion() const;
                   
@@ -128,6 +129,16 @@ protected: // Constants
   // vector indices for the parameters to expereicne ARD
   vector<int> ard_index;
 
+  // parameters of one column, unpacked once for the TI loop
+  struct ColumnParams {
+    float ftiss, delttiss, tauset, taubset, fblood, deltblood, T_1, T_1b;
+    float pv_gm, pv_wm, fwm, deltwm, tauwmset, T_1wm;
+    float T_1app, T_1appwm, R, Rwm;
+  };
+  void UnpackParams(const Matrix& params, int v, ColumnParams& p) const;
+  // kinetic curve at one TI; shared by Evaluate and EvaluateMany
+  Real Signal(float ti, const ColumnParams& p) const;
+
 
   // scan parameters
   double seqtau; //bolus length as set by the sequence
@@ -71,8 +71,10 @@
 #include <iostream>
 #include <newmatio.h>
 #include <stdexcept>
+#include <algorithm>
 #include "newimage/newimageall.h"
 #include "miscmaths/miscprob.h"
+#include "asl_models.h"
 using namespace NEWIMAGE;
 #include "easylog.h"
 
@@ -471,7 +473,11 @@ void QuasarFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
 
     //cout << T_1 << " " << FAtrue << " ";
 
-    float T_1app = 1/( 1/T_1 + 0.01/lambdagm - log(cos(FAtrue))/dti);
+    // Look-Locker correction (precomputed unless the flip angle is calibrated)
+    float llfa = llcorr;
+    if (calibon) llfa = log(cos(FAtrue))/dti;
+
+    float T_1app = 1/( 1/T_1 + 0.01/lambdagm - llfa);
     //float T_1appwm = 1/( 1/T_1wm + 0.01/lambdawm - log(cos(FAtrue))/dti);
 
     // Need to be careful with T1 values
@@ -480,7 +486,7 @@ void QuasarFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
     if (fabs(T_1app - T_1b)<0.01) T_1app += 0.01;
 
     // calculate the 'LL T1' of the blood
-    float T_1ll = 1/( 1/T_1b - log(cos(FAtrue))/dti);
+    float T_1ll = 1/( 1/T_1b - llfa);
     float deltll = deltblood; //the arrival time of the blood within the readout region i.e. where it sees the LL pulses.
 
     float tau=tauset; //bolus length as seen by kintic curve
@@ -495,9 +501,7 @@ void QuasarFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
     ColumnVector kcblood(tis.Nrows()); kcblood=0.0;
     ColumnVector kcwm(tis.Nrows()); kcwm=0.0;
 
-    ColumnVector thetis;
-    thetis=tis;
-    thetis += slicedt*coord_z; //account here for an increase in delay between slices
+    // thetis accounts for the increase in delay between slices (see pass_in_coords)
 
     // generate the kinetic curves
     if (disptype=="none") {
@@ -584,66 +588,53 @@ void QuasarFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
     if (onephase) nphases=1;
     result.ReSize(tis.Nrows()*repeats*nphases);
 
-
-    ColumnVector artweight(crushdir.Nrows());
-    if (artdir) {
+    // arterial weighting for each phase
+    // phases: C1, C2, NC, C3, C4, NC, (NC LFA)
+    double bloodw[6];
+    if (onephase) {
+      bloodw[0] = fblood;
+    }
+    else if (artdir) {
       //sot out the arterial weightings for all the crushed images
-      artweight=1.0;
-      //float angle;
-      ColumnVector artdir(3);
-      artdir(1) = sin(bloodphi)*cos(bloodth);
-      artdir(2) = sin(bloodphi)*sin(bloodth);
-      artdir(3) = cos(bloodphi);
-
-      for (int i=1; i<=crushdir.Nrows(); i++) {
-	artweight(i) = 1.0 - std::max(DotProduct(artdir,crushdir.Row(i)),0.0);
-	//angle = fabs(crushdir(i) - blooddir);
-	//if (angle<M_PI/2) {
-	//  artweight(i) = crusheff*sin(angle) + 1.0 - crusheff;
-	//}
+      double artweight[ncrush];
+      double artdir[3];
+      artdir[0] = sin(bloodphi)*cos(bloodth);
+      artdir[1] = sin(bloodphi)*sin(bloodth);
+      artdir[2] = cos(bloodphi);
+
+      for (int i=0; i<ncrush; i++) {
+	double dot = 0.0;
+	for (int j=0; j<3; j++) dot += artdir[j]*crushdir[i][j];
+	artweight[i] = 1.0 - std::max(dot,0.0);
       }
+      bloodw[0] = artweight[0]*fblood;
+      bloodw[1] = artweight[1]*fblood;
+      bloodw[2] = fblood;
+      bloodw[3] = artweight[2]*fblood;
+      bloodw[4] = artweight[3]*fblood;
+      bloodw[5] = fblood;
+    }
+    else {
+      bloodw[0] = fbloodc1;
+      bloodw[1] = fbloodc2;
+      bloodw[2] = fblood;
+      bloodw[3] = fbloodc3;
+      bloodw[4] = fbloodc4;
+      bloodw[5] = fblood;
     }
 
-
-    for(int it=1; it<=tis.Nrows(); it++)
+    // each phase block is nti x repeats, the repeats of a TI being identical
+    Real* out = result.Store();
+    for(int it=1; it<=nti; it++)
       {
-
-
-	/* output */
-	// loop over the repeats
-	for (int rpt=1; rpt<=repeats; rpt++)
+	double tisscpt = pv_gm*ftiss*kctissue(it);
+	double wmcpt = pv_wm*fwm*kcwm(it);
+	double bloodcpt = kcblood(it);
+	for (int ph=0; ph<nphases; ph++)
 	  {
-
-
-	    // go through all the phases
-	    // phases: C1, C2, NC, C3, C4, NC, (NC LFA)
-	    int tiref = (it-1)*repeats+rpt;
-	    	    
-	    if (onephase) {
-	      result(tiref) = pv_gm*ftiss*kctissue(it) + fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-	    }
-	    else if (artdir) {
-	      result( tiref )                 = pv_gm*ftiss*kctissue(it) + artweight(1)*fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-	      result( nti*repeats + tiref )   = pv_gm*ftiss*kctissue(it) + artweight(2)*fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-	      result( 2*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-	      result( 3*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + artweight(3)*fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-	      result( 4*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + artweight(4)*fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-	      result( 5*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-	      //result( 6*nti*repeats + tiref ) = pv_gm*ftiss*kctissue + fblood*kcblood + pv_wm*fwm*kcwm;
-	    }
-	    else 
-	      {
-		result( tiref )                 = pv_gm*ftiss*kctissue(it) + fbloodc1*kcblood(it) + pv_wm*fwm*kcwm(it);
-		result( nti*repeats + tiref )   = pv_gm*ftiss*kctissue(it) + fbloodc2*kcblood(it) + pv_wm*fwm*kcwm(it);
-		result( 2*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-		result( 3*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + fbloodc3*kcblood(it) + pv_wm*fwm*kcwm(it);
-		result( 4*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + fbloodc4*kcblood(it) + pv_wm*fwm*kcwm(it);
-		result( 5*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-		//result( 6*nti*repeats + tiref ) = pv_gm*ftiss*kctissue + fblood*kcblood + pv_wm*fwm*kcwm;
-	      }
+	    Real* dst = out + ph*nti*repeats + (it-1)*repeats;
+	    std::fill(dst, dst+repeats, tisscpt + bloodw[ph]*bloodcpt + wmcpt);
 	  }
-
- 
       }
     //cout << result.t();
 
@@ -657,6 +648,7 @@ void QuasarFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
 
 QuasarFwdModel::QuasarFwdModel(ArgsType& args)
 {
+    igamctable = NULL;
     string scanParams = args.ReadWithDefault("scan-params","cmdline");
     
     if (scanParams == "cmdline")
@@ -664,6 +656,14 @@ QuasarFwdModel::QuasarFwdModel(ArgsType& args)
       // specify command line parameters here
       //dispersion model
       disptype=args.ReadWithDefault("disp","gamma");
+      // tabulate igamc for the gamma and gvf kernels to within this
+      // absolute error; opt-in, since no tolerance has been checked
+      // against fitted results (0: call igamc every time)
+      double igamctol = convertTo<double>(args.ReadWithDefault("igamc-tol","0"));
+      if (igamctol < 0)
+	throw Invalid_option("--igamc-tol must not be negative");
+      if (igamctol > 0)
+	igamctable = OXASL::IgamcTable::Get(igamctol);
 
       repeats = convertTo<int>(args.Read("repeats")); // number of repeats in data
       t1 = convertTo<double>(args.ReadWithDefault("t1","1.3"));
@@ -748,24 +748,23 @@ QuasarFwdModel::QuasarFwdModel(ArgsType& args)
 
 	}
       timax = tis.Maximum(); //dtermine the final TI
+      thetis = tis;
       //determine the TI interval (assume it is even throughout)
       dti = tis(2)-tis(1);
 
       float fadeg = convertTo<double>(args.ReadWithDefault("fa","30"));
       FA = fadeg * M_PI/180;
+      llcorr = log(cos(FA))/dti;
       
       //setup crusher directions
       //crushdir.ReSize(4);
       //crushdir << 45.0 << -45.0 << 135.0 << -135.0; //in degees
       //crushdir = crushdir * M_PI/180;
       //cout << crushdir << endl;
-      crushdir.ReSize(4,3);
-      crushdir << 1 << 1 << 1
-       << -1 << 1 << 1
-       << 1 << -1 << 1
-       << -1 << -1 << 1;
-
-      crushdir /= sqrt(3); //make unit vectors;
+      const double crushdirs[ncrush][3] = { {1,1,1}, {-1,1,1}, {1,-1,1}, {-1,-1,1} };
+      for (int i=0; i<ncrush; i++)
+	for (int j=0; j<3; j++)
+	  crushdir[i][j] = crushdirs[i][j]/sqrt(3); //make unit vectors
 
       
       singleti = false; //normally we do multi TI ASL
@@ -815,9 +814,18 @@ QuasarFwdModel::QuasarFwdModel(ArgsType& args)
  
 }
 
+void QuasarFwdModel::pass_in_coords( const ColumnVector& coords )
+{
+  FwdModel::pass_in_coords(coords);
+
+  thetis = tis;
+  thetis += slicedt*coord_z; //account here for an increase in delay between slices
+}
+
 void QuasarFwdModel::ModelUsage()
 { 
-  cout << "To be added"
+  cout << "To be added\n"
+       << "--igamc-tol=<abs_error> : tabulate igamc for the gamma and gvf dispersion kernels to this absolute accuracy (default: 0, off - igamc is called directly)"
        << endl
     ;
 }
@@ -1025,11 +1033,11 @@ ColumnVector QuasarFwdModel::kcblood_gammadisp(const ColumnVector& tis, float de
 	}
       else if(ti >= deltblood && ti <= (deltblood + taub))
 	{ 
-	  kcblood(it) = 2 * exp(-ti/T_1b) * ( 1 - igamc(k,s*(ti-deltblood))  ); 
+	  kcblood(it) = 2 * exp(-ti/T_1b) * ( 1 - OXASL::igamc_tab(igamctable,k,s*(ti-deltblood))  ); 
 	}
       else //(ti > deltblood + taub)
 	{
-	  kcblood(it) = 2 * exp(-ti/T_1b) * ( igamc(k,s*(ti-deltblood-taub)) - igamc(k,s*(ti-deltblood)) ) ; 
+	  kcblood(it) = 2 * exp(-ti/T_1b) * ( OXASL::igamc_tab(igamctable,k,s*(ti-deltblood-taub)) - OXASL::igamc_tab(igamctable,k,s*(ti-deltblood)) ) ; 
 	  
 	}
       //if (isnan(kcblood(it))) { kcblood(it)=0.0; cout << "Warning NaN in blood KC"; }
@@ -1164,17 +1172,17 @@ ColumnVector QuasarFwdModel::kctissue_gammadisp(const ColumnVector& tis, float d
       else if(ti >= delttiss && ti <= (delttiss + tau))
 	{
 	  kctissue(it) = 2* 1/A * exp( -(T_1app*delttiss + (T_1app+T_1b)*ti)/(T_1app*T_1b) )*T_1app*T_1b*pow(B,-k)*
-	    (  exp(delttiss/T_1app + ti/T_1b) * pow(s*T_1app*T_1b,k) * ( 1 - igamc(k,B/(T_1app*T_1b)*(ti-delttiss)) ) +
-	       exp(delttiss/T_1b + ti/T_1app) * pow(B,k) * ( -1 + igamc(k,s*(ti-delttiss)) )  );  
+	    (  exp(delttiss/T_1app + ti/T_1b) * pow(s*T_1app*T_1b,k) * ( 1 - OXASL::igamc_tab(igamctable,k,B/(T_1app*T_1b)*(ti-delttiss)) ) +
+	       exp(delttiss/T_1b + ti/T_1app) * pow(B,k) * ( -1 + OXASL::igamc_tab(igamctable,k,s*(ti-delttiss)) )  );  
 	  
 	}
       else //(ti > delttiss + tau)
 	{
 	  kctissue(it) = 2* 1/(A*B) *
 	    (  exp(-A/(T_1app*T_1b)*(delttiss+tau) - ti/T_1app)*T_1app*T_1b/C*
-	       (  pow(s,k)*T_1app*T_1b* ( -1 + exp( (-1/T_1app+1/T_1b)*tau )*( 1 - igamc(k,B/(T_1app*T_1b)*(ti-delttiss)) ) +
-					  igamc(k,B/(T_1app*T_1b)*(ti-delttiss-tau)) ) - 
-		  exp( -A/(T_1app*T_1b)*(ti-delttiss-tau) )*C*B * ( igamc(k,s*(ti-delttiss-tau)) - igamc(k,s*(ti-delttiss)) ) )  );
+	       (  pow(s,k)*T_1app*T_1b* ( -1 + exp( (-1/T_1app+1/T_1b)*tau )*( 1 - OXASL::igamc_tab(igamctable,k,B/(T_1app*T_1b)*(ti-delttiss)) ) +
+					  OXASL::igamc_tab(igamctable,k,B/(T_1app*T_1b)*(ti-delttiss-tau)) ) - 
+		  exp( -A/(T_1app*T_1b)*(ti-delttiss-tau) )*C*B * ( OXASL::igamc_tab(igamctable,k,s*(ti-delttiss-tau)) - OXASL::igamc_tab(igamctable,k,s*(ti-delttiss)) ) )  );
 	  
 	}
       //if (isnan(kctissue(it))) { kctissue(it)=0.0; cout << "Warning NaN in tissue KC"; }
@@ -1211,7 +1219,7 @@ ColumnVector QuasarFwdModel::kctissue_gvf(const ColumnVector& tis, float delttis
 	{ kctissue(it) = 0.0;}
       else //if(ti >= delttiss && ti <= (delttiss + tau))
 	{
-	  kctissue(it) = 2* 1/(B*C) * exp(-(ti-delttiss)/T_1app)*sps*T_1app*T_1b * (1 - igamc(k,(s-1/T_1app-1/T_1b)*(ti-delttiss)));
+	  kctissue(it) = 2* 1/(B*C) * exp(-(ti-delttiss)/T_1app)*sps*T_1app*T_1b * (1 - OXASL::igamc_tab(igamctable,k,(s-1/T_1app-1/T_1b)*(ti-delttiss)));
 	}
       // bolus duraiton is specified by the CVF AIF shape and is not an explicit parameter
       //else //(ti > delttiss + tau)
@@ -69,6 +69,8 @@
 #include "fwdmodel.h"
 #include "inference.h"
 #include <string>
+
+namespace OXASL { class IgamcTable; }
 using namespace std;
 
 class QuasarFwdModel : public FwdModel {
@@ -93,6 +95,8 @@ public:
 
   virtual void HardcodedInitialDists(MVNDist& prior, MVNDist& posterior) const;
 
+  virtual void pass_in_coords( const ColumnVector& coords);
+
   using FwdModel::SetupARD;
   virtual void SetupARD(const MVNDist& posterior, MVNDist& prior, double& Fard);
   virtual void UpdateARD(const MVNDist& posterior, MVNDist& prior, double& Fard) const;
@@ -162,6 +166,7 @@ protected: // Constants
   bool onephase;
 
   string disptype;
+  const OXASL::IgamcTable* igamctable; // igamc for the gamma/gvf kernels; NULL to call it directly
 
   // ard flags
   bool doard;
@@ -170,9 +175,12 @@ protected: // Constants
   bool wmard;
 
   ColumnVector tis;
+  ColumnVector thetis; //tis for the current slice
   Real timax;
+  float llcorr; //Look-Locker correction log(cos(FA))/dti at the nominal flip angle
   //ColumnVector crushdir;
-  Matrix crushdir;
+  static const int ncrush = 4;
+  double crushdir[ncrush][3]; //crusher directions (unit vectors)
 
   //kinetic curve functions
   ColumnVector kcblood_nodisp(const ColumnVector& tis, float deltblood, float taub, float T_1b, float deltll, float T_1ll) const;
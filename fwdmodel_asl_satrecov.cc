@@ -71,6 +71,7 @@
 #include <iostream>
 #include <newmatio.h>
 #include <stdexcept>
+#include <algorithm>
 #include "newimage/newimageall.h"
 #include "miscmaths/miscprob.h"
 using namespace NEWIMAGE;
@@ -119,82 +120,126 @@ void SatrecovFwdModel::HardcodedInitialDists(MVNDist& prior,
     
     
 
+// params(i,v) with the negative check applied
+static inline float paramcpy(const Matrix& params, int i, int v)
+{
+  return params(i,v)<0 ? 0 : params(i,v);
+}
+
 void SatrecovFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
   Tracer_Plus tr("SatrecovFwdModel::Evaluate");
 
-    // ensure that values are reasonable
-    // negative check
-  ColumnVector paramcpy = params;
-   for (int i=1;i<=NumParams();i++) {
-      if (params(i)<0) { paramcpy(i) = 0; }
-      }
-  
-   float M0t;
-   float T1t;
-   float A;
-   float FA;
-   float lFA;
-   float g;
-
-   M0t = paramcpy(1);
-   T1t = paramcpy(2);
-   A = paramcpy(3);
-
-   if (LFAon) {
-     g = paramcpy(4);
-   }
-   else g=1.0;
-
-   //if (g<0.5) g=0.5;
-   //if (g>1.5) g=1.5;
-
-   FA =(g+dg)* FAnom;
-   lFA = (g+dg)* LFA;
-
-   float T1tp = T1t;
-   float M0tp = M0t;
-
-   if (looklocker) {
-     T1tp = 1/( 1/T1t - log(cos(FA))/dti );
-     M0tp = M0t*(1 - exp(-dti/T1t) )/(1 - cos(FA)*exp(-dti/T1t));
-     // note that we do not have sin(FA) here - we actually estiamte the M0 at the flip angle used for the readout!
-   }
-
-    // loop over tis
-    //float ti;
-   if (LFAon) result.ReSize(tis.Nrows()*(nphases+1)*repeats);
-   else result.ReSize(tis.Nrows()*nphases*repeats);
-
-   int nti=tis.Nrows();
-   double ti;
-
-    for (int ph=1; ph<=nphases; ph++) {
-      for (int it=1; it<=tis.Nrows(); it++) {
-	for (int rpt=1; rpt<=repeats; rpt++)
-	  {
-	    ti = tis(it) + slicedt*coord_z; //account here for an increase in delay between slices
-	    result( (ph-1)*(nti*repeats) + (it-1)*repeats+rpt ) = M0tp*(1-A*exp(-ti/T1tp));
-	  }
-      }
+  ColumnParams p;
+  UnpackParams(params, 1, p);
+
+  int nti=tis.Nrows();
+  if (LFAon) result.ReSize(nti*(nphases+1)*repeats);
+  else result.ReSize(nti*nphases*repeats);
+
+  double ti;
+  for (int it=1; it<=nti; it++) {
+    ti = tis(it) + slicedt*coord_z; //account here for an increase in delay between slices
+    Real signal = Signal(ti, p);
+    for (int ph=1; ph<=nphases; ph++)
+      for (int rpt=1; rpt<=repeats; rpt++)
+	result((ph-1)*(nti*repeats) + (it-1)*repeats+rpt) = signal;
+  }
+
+  if (LFAon) {
+    int ph=nphases+1;
+    for (int it=1; it<=nti; it++) {
+      Real signal = LowFASignal(tis(it), p);
+      for (int rpt=1; rpt<=repeats; rpt++)
+	result((ph-1)*(nti*repeats) + (it-1)*repeats+rpt) = signal;
     }
-    if (LFAon) {
-      int ph=nphases+1;
-      T1tp = 1/( 1/T1t - log(cos(lFA))/dti );
-      M0tp = M0t*(1 - exp(-dti/T1t) )/(1 - cos(lFA)*exp(-dti/T1t));
-      for (int it=1; it<=tis.Nrows(); it++) {
-	for (int rpt=1; rpt<=repeats; rpt++)
-	  {
-	    ti = tis(it) + slicedt*coord_z; //account here for an increase in delay between slices
-	    result( (ph-1)*(nti*repeats) + (it-1)*repeats+rpt ) = M0tp*sin(lFA)/sin(FA)*(1-A*exp(-tis(it)/T1tp));
-	    //note the sin(LFA)/sin(FA) term since the M0 we estimate is actually MOt*sin(FA)
-	  }
-      }
+  }
+}
+
+void SatrecovFwdModel::EvaluateMany(const Matrix& params, Matrix& results) const
+{
+  Tracer_Plus tr("SatrecovFwdModel::EvaluateMany");
+
+  // unpack the parameters of every column, then run the TI loops over the
+  // columns
+  const int nv = params.Ncols();
+  vector<ColumnParams> p(nv);
+  for (int v=0; v<nv; v++)
+    UnpackParams(params, v+1, p[v]);
+
+  int nti=tis.Nrows();
+  if (LFAon) results.ReSize(nti*(nphases+1)*repeats, nv);
+  else results.ReSize(nti*nphases*repeats, nv);
+  Real* out = results.Store();
+
+  double ti;
+  for (int it=1; it<=nti; it++) {
+    ti = tis(it) + slicedt*coord_z; //account here for an increase in delay between slices
+    Real* row = out + (it-1)*repeats*nv;
+    for (int v=0; v<nv; v++)
+      row[v] = Signal(ti, p[v]);
+
+    // the same curve for every phase and repeat
+    for (int ph=1; ph<=nphases; ph++)
+      for (int rpt=1; rpt<=repeats; rpt++)
+	if (ph>1 || rpt>1)
+	  copy(row, row+nv, out + ((ph-1)*(nti*repeats) + (it-1)*repeats+rpt-1)*nv);
+  }
+
+  if (LFAon) {
+    int ph=nphases+1;
+    for (int it=1; it<=nti; it++) {
+      Real* row = out + ((ph-1)*(nti*repeats) + (it-1)*repeats)*nv;
+      for (int v=0; v<nv; v++)
+	row[v] = LowFASignal(tis(it), p[v]);
+      for (int rpt=2; rpt<=repeats; rpt++)
+	copy(row, row+nv, row + (rpt-1)*nv);
     }
+  }
+}
 
-    
+void SatrecovFwdModel::UnpackParams(const Matrix& params, int v, ColumnParams& p) const
+{
+  float M0t = paramcpy(params,1,v);
+  float T1t = paramcpy(params,2,v);
+  p.A = paramcpy(params,3,v);
+
+  float g;
+  if (LFAon) {
+    g = paramcpy(params,4,v);
+  }
+  else g=1.0;
+
+  //if (g<0.5) g=0.5;
+  //if (g>1.5) g=1.5;
+
+  p.FA =(g+dg)* FAnom;
+  p.lFA = (g+dg)* LFA;
+
+  p.T1tp = T1t;
+  p.M0tp = M0t;
+
+  if (looklocker) {
+    p.T1tp = 1/( 1/T1t - log(cos(p.FA))/dti );
+    p.M0tp = M0t*(1 - exp(-dti/T1t) )/(1 - cos(p.FA)*exp(-dti/T1t));
+    // note that we do not have sin(FA) here - we actually estiamte the M0 at the flip angle used for the readout!
+  }
+
+  if (LFAon) {
+    p.lT1tp = 1/( 1/T1t - log(cos(p.lFA))/dti );
+    p.lM0tp = M0t*(1 - exp(-dti/T1t) )/(1 - cos(p.lFA)*exp(-dti/T1t));
+  }
+}
 
-  return;
+Real SatrecovFwdModel::Signal(double ti, const ColumnParams& p) const
+{
+  return p.M0tp*(1-p.A*exp(-ti/p.T1tp));
+}
+
+Real SatrecovFwdModel::LowFASignal(double ti, const ColumnParams& p) const
+{
+  //note the sin(LFA)/sin(FA) term since the M0 we estimate is actually MOt*sin(FA)
+  return p.lM0tp*sin(p.lFA)/sin(p.FA)*(1-p.A*exp(-ti/p.lT1tp));
 }
 
 
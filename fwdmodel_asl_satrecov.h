@@ -76,6 +76,7 @@ public:
   // Virtual function overrides
   virtual void Evaluate(const ColumnVector& params, 
 			      ColumnVector& result) const;
+  virtual void EvaluateMany(const Matrix& params, Matrix& results) const;
   static void ModelUsage();
   virtual string ModelVersion() const;
                   
@@ -104,6 +105,16 @@ protected: // Constants
   // vector indices for the parameters to expereicne ARD
   vector<int> ard_index;
 
+  // parameters of one column, unpacked once for the TI loops
+  struct ColumnParams {
+    float A, FA, lFA, T1tp, M0tp;
+    float lT1tp, lM0tp; // only with LFAon
+  };
+  void UnpackParams(const Matrix& params, int v, ColumnParams& p) const;
+  // saturation recovery at one TI, and in the low flip angle phase;
+  // shared by Evaluate and EvaluateMany
+  Real Signal(double ti, const ColumnParams& p) const;
+  Real LowFASignal(double ti, const ColumnParams& p) const;
 
   // scan parameters
   int repeats;
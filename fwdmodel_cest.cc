@@ -266,6 +266,44 @@ void CESTFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) co
 {
   Tracer_Plus tr("CESTFwdModel::Evaluate");
 
+   ColumnVector M0, w1;
+   Matrix kij, T12, wimat;
+   ModelMatrices(params, M0, kij, T12, wimat, w1);
+
+   /*
+	 if (pvcorr) {
+	   ColumnVector GM_result;
+	   GM_result = Mz_spectrum(wvec[n],w1,t[n],M0,wi,kij,T12);
+	   ColumnVector WM_result;
+	   WM_result = Mz_spectrum(wvec[n],w1,t[n],M0_WM,wi,kij_WM,T12_WM);
+	   ColumnVector CSF_result;
+	   CSF_result = Mz_spectrum(wvec[n],w1,t[n],M0_CSF,wi.Row(1),kij.SubMatrix(1,1,1,1),T12_CSF);
+
+	   thisresult = PV_GM*GM_result + PV_WM*WM_result + PV_CSF*CSF_result;
+	 }
+   */
+
+   if (lorentz) {
+     result = Mz_spectrum_lorentz(wvec,w1,tsatvec,M0,wimat,kij,T12);
+   }
+   else {
+     Mz_spectrum(result,wvec,w1,tsatvec,M0,wimat,kij,T12);
+   }
+
+   //for (int i=1; i<=result.Nrows(); i++) {
+   //  if(result(i) < floorval) result(i) = floorval;
+   //}
+
+   //result &= nosat;
+
+
+   //cout << cest_result.t() << endl;
+
+  return;
+}
+
+void CESTFwdModel::ModelMatrices(const ColumnVector& params, ColumnVector& M0, Matrix& kij, Matrix& T12, Matrix& wimat, ColumnVector& w1) const
+{
     // ensure that values are reasonable
     // negative check
   ColumnVector paramcpy = params;
@@ -274,9 +312,9 @@ void CESTFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) co
       }
 
    //model matrices
-   ColumnVector M0(npool);
-   Matrix kij(npool,npool);
-   Matrix T12(2,npool);
+   M0.ReSize(npool);
+   kij.ReSize(npool,npool);
+   T12.ReSize(2,npool);
 
    // extract values from params
    // M0 comes first
@@ -437,7 +475,7 @@ void CESTFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) co
    // deal with frequencies
    //ColumnVector wi(npool);
    int nsamp = wvec.Nrows();
-   Matrix wimat(npool,nsamp);
+   wimat.ReSize(npool,nsamp);
 
    //float wlocal = wlam*ppmvec(1)/1e6; //local water frequency
    //cout << wlocal << endl;
@@ -459,38 +497,87 @@ void CESTFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) co
    //deal with B1
    if (B1off<-0.5) B1off=-0.5; // B1 cannot go too small
    if (B1off>10) B1off=10; //unlikely to get this big (hardlimit in case of convergence problems)
-   ColumnVector w1 = w1vec * (1+B1off); // w1 in radians!
-
-   /*
-	 if (pvcorr) {
-	   ColumnVector GM_result;
-	   GM_result = Mz_spectrum(wvec[n],w1,t[n],M0,wi,kij,T12);
-	   ColumnVector WM_result;
-	   WM_result = Mz_spectrum(wvec[n],w1,t[n],M0_WM,wi,kij_WM,T12_WM);
-	   ColumnVector CSF_result;
-	   CSF_result = Mz_spectrum(wvec[n],w1,t[n],M0_CSF,wi.Row(1),kij.SubMatrix(1,1,1,1),T12_CSF);
-
-	   thisresult = PV_GM*GM_result + PV_WM*WM_result + PV_CSF*CSF_result;
-	 }
-   */
-
-   if (lorentz) {
-     result = Mz_spectrum_lorentz(wvec,w1,tsatvec,M0,wimat,kij,T12);
-   }
-   else {
-     Mz_spectrum(result,wvec,w1,tsatvec,M0,wimat,kij,T12);
-   }
-
-   //for (int i=1; i<=result.Nrows(); i++) {
-   //  if(result(i) < floorval) result(i) = floorval;
-   //}
-
-   //result &= nosat;
-
+   w1 = w1vec * (1+B1off); // w1 in radians!
+}
 
-   //cout << cest_result.t() << endl;
+int CESTFwdModel::Gradient(const ColumnVector& params, Matrix& grad) const
+{
+  Tracer_Plus tr("CESTFwdModel::Gradient");
+
+  // the one pool analytic solution is cheap enough to difference
+  if (lorentz || numgrad) return false;
+
+  ColumnVector M0, w1;
+  Matrix kij, T12, wimat;
+  ModelMatrices(params, M0, kij, T12, wimat, w1);
+  const BlochMcConnell bm(M0, kij, T12);
+
+  // The parameters as laid out in ModelMatrices.  Where one is held at a 
+  // limit there it has no local effect, which the slopes below reflect.
+  const int pRatio = 2, pK = npool + 1, pPpm = 2 * npool, pB1 = 3 * npool;
+  const int pDrift = pB1 + 1, pT1 = pB1 + 1 + (inferdrift ? 1 : 0), pT2 = pT1 + npool;
+
+  const double dM0w = (params(1) > 1e-4) ? 1 : 0;
+  const float B1off = params(pB1) * 1e6;
+  const double dB1 = (B1off > -0.5 && B1off < 10) ? 1e6 : 0;
+
+  const int nsamp = wvec.Nrows();
+  grad.ReSize(nsamp, NumParams());
+  grad = 0.0;
+  BlochMcConnell::Sensitivity g;
+  double wik[bmMaxPools];
+  for (int k = 1; k <= nsamp; k++)
+    {
+      if (w1(k) == 0.0)
+        {
+          grad(k, 1) = dM0w; // no saturation: Mz is M0 of water
+          continue;
+        }
+      for (int i = 0; i < npool; i++) wik[i] = wimat(i+1, k);
+      if (steadystate)
+        bm.SteadyStateGradient(wik, wvec(k), w1(k), g);
+      else
+        bm.PulsedGradient(pulse, wik, wvec(k), w1(k), tsatvec(k), g);
+
+      // M0 of each pool is its ratio times that of water, and the exchange
+      // from water kij(1,j) is kij(j,1) times the same ratio
+      double dM0 = g.dM0[0];
+      for (int j = 2; j <= npool; j++)
+        {
+          const double ratio = M0(j) / M0(1);
+          const double r = params(pRatio + j - 2);
+          dM0 += g.dM0[j-1] * ratio;
+          if (r > 0 && r < 1)
+            grad(k, pRatio + j - 2) = g.dM0[j-1] * M0(1) + g.dk[0][j-1] * kij(j,1);
+          if (kij(j,1) < 1e6)
+            grad(k, pK + j - 2) = (g.dk[j-1][0] + g.dk[0][j-1] * ratio) * kij(j,1);
+        }
+      grad(k, 1) = dM0 * dM0w;
+
+      // Every pool's frequency moves with that of water
+      double dwater = g.dwi[0];
+      for (int i = 2; i <= npool; i++)
+        {
+          dwater += g.dwi[i-1] * (1 + params(pPpm + i - 1) / 1e6);
+          grad(k, pPpm + i - 1) = g.dwi[i-1] * (wlam + wimat(1,k)) / 1e6;
+        }
+      grad(k, pPpm) = dwater * wlam / 1e6;
+      if (inferdrift) 
+        grad(k, pDrift) = dwater * wlam * (k - 1);
+
+      grad(k, pB1) = g.dw1 * w1vec(k) * dB1;
+
+      if (t12soft)
+        for (int i = 1; i <= npool; i++)
+          {
+            if (params(pT1 + i - 1) > 1e-12 && params(pT1 + i - 1) < 10)
+              grad(k, pT1 + i - 1) = -g.dR1[i-1] / (T12(1,i) * T12(1,i));
+            if (params(pT2 + i - 1) > 1e-12 && params(pT2 + i - 1) < 1)
+              grad(k, pT2 + i - 1) = -g.dR2[i-1] / (T12(2,i) * T12(2,i));
+          }
+    }
 
-  return;
+  return true;
 }
 
 
@@ -532,6 +619,10 @@ CESTFwdModel::CESTFwdModel(ArgsType& args)
       // alternatives to Matrix exponential solution to Bloch equations
       lorentz = args.ReadBool("lorentz"); //NB only compatible with single pool
       steadystate = args.ReadBool("steadystate");
+      // solve for one frequency at a time, rather than several at once (for checking)
+      bmreference = args.ReadBool("bm-reference");
+      // difference the model numerically for the linearisation (for checking)
+      numgrad = args.ReadBool("numgrad");
 
     }
 
@@ -554,6 +645,7 @@ CESTFwdModel::CESTFwdModel(ArgsType& args)
 
       // check that the method chosen is possible
       if ((npool>1) & lorentz) throw invalid_argument("Lorentzian (analytic) solution only compatible with single pool");
+      if (npool>bmMaxPools) throw invalid_argument("Too many pools in the pool specification file (at most " + stringify(int(bmMaxPools)) + ")");
 
       /* OLD
     //initialization
@@ -632,6 +724,7 @@ CESTFwdModel::CESTFwdModel(ArgsType& args)
 	LOG << " Durations (s): " << ptvec.t() << endl;
 	
       }
+      pulse = CESTPulse(pmagvec, ptvec);
 
       /* OLD
     //deal with water centre frequency *in radians!*
@@ -807,12 +900,6 @@ void CESTFwdModel::UpdateARD(
 
   }
 
-ReturnMatrix CESTFwdModel::expm(Matrix inmatrix) const
-{
-  // to set the routine we use to do expm
-  return expm_pade(inmatrix);
-}
-
 ReturnMatrix CESTFwdModel::expm_eig(Matrix inmatrix) const
 {
   // Do matrix exponential using eigen decomposition of the matrix
@@ -839,357 +926,21 @@ ReturnMatrix CESTFwdModel::expm_eig(Matrix inmatrix) const
 
 }
 
-ReturnMatrix CESTFwdModel::expm_pade(Matrix inmatrix) const
-{
-  // Do matrix exponential
-  // Algorithm from Higham, SIAM J. Matrix Analysis App. 24(4) 2005, 1179-1193
-  Tracer_Plus tr("CESTFwdModel::expm");
-
-  Matrix A = inmatrix;
-  Matrix X(A.Nrows(),A.Ncols());
-
-    //Coeff of degree 13 Pade approximant
-  //ColumnVector b(13);
-  //  b= PadeCoeffs(13);
-  
-    int metflag=0;
-  int mvals[5] = {3, 5, 7, 9, 13};
-  //ColumnVector thetam(5);
-  float thetam[5] = {1.495585217958292e-002, 2.539398330063230e-001, 9.504178996162932e-001, 2.097847961257068e+000, 5.371920351148152e+000};
-  int i=0;
-
-  while (metflag<1)
-    {
-      if (i<4) {
-	//cout << "Try m = " << mvals[i] << endl;
-	if (A.Norm1() <= thetam[i]) {
-	  X = PadeApproximant(A,mvals[i]);
-	  metflag=1;
-	}
-      }
-      else {
-	// Using Pade Approximant degree 13 and scaling and squaring
-	//cout << "Doing m = 13" << endl;
-	int s = ceil(log2(A.Norm1()/thetam[4]));
-	//cout << s << endl;
-	float half=0.5;
-	A *= MISCMATHS::pow(half,s);
-	X = PadeApproximant(A,13);
-	for (int i=1; i<=s; i++) {
-	  X *= X;
-	}
-	metflag=1;
-      }
-      i++;
-  }
- 
-
-  return X;
-}
-
-ReturnMatrix CESTFwdModel::PadeApproximant(Matrix inmatrix, int m) const
-{
-  Tracer_Plus tr("CESTFwdModel::PadeApproximant");
-
-  //cout << "PadeApproximant" << endl;
-  //cout << inmatrix << endl;
-  assert(inmatrix.Nrows()==inmatrix.Ncols());
-  int n=inmatrix.Nrows();
-  IdentityMatrix I(n);
-  ColumnVector coeff = PadeCoeffs(m);
-  Matrix X(n,n);
-  Matrix U(n,n); Matrix V(n,n);
-  vector<Matrix> Apowers;
-
-  //cout << coeff << endl;
-
-  switch (m)
-    {
-    case 3:
-    case 5:
-    case 7:
-    case 9:
-      //cout << "case " << m << endl;
-      Apowers.push_back(I);
-      Apowers.push_back(inmatrix*inmatrix);
-      for (int j=3; j<=ceil((m+1/2)); j++) {
-	Apowers.push_back(Apowers[j-2]*Apowers[1]);
-      }
-      U=0.0; V=0.0;
-      //cout << "Apowers" <<endl;
-      for (int j=m+1; j>=2; j -= 2) {
-	U += coeff(j)*Apowers[j/2-1];
-      }
-      U = inmatrix*U;
-      for (int j=m; j>=1; j -= 2) {
-	V += coeff(j)*Apowers[(j+1)/2-1];
-      }
-      //cout << U << endl << V << endl;
-      X = (U+V)*(-U+V).i();
-      //cout << X<< endl;
-      break;
-    case 13:
-      //cout << "case 13" << endl;
-      Matrix A2(n,n); Matrix A4(n,n); Matrix A6(n,n);
-      A2 = inmatrix*inmatrix; A4 = A2*A2; A6 = A2*A4;
-      U = inmatrix * (A6*(coeff(14)*A6 + coeff(12)*A4 + coeff(10)*A2) + coeff(8)*A6 + coeff(6)*A4 + coeff(4)*A2 + coeff(2)*I );
-      //cout << U;
-      V = A6*(coeff(13)*A6 + coeff(11)*A4 + coeff(9)*A2) + coeff(7)*A6 + coeff(5)*A4 + coeff(3)*A2 + coeff(1)*I;
-      //cout << V;
-      X = (U+V)*(-U+V).i();
-      //cout << X <<endl;
-      break;
-    }
-
-  return X;
-}
-
-ReturnMatrix CESTFwdModel::PadeCoeffs(int m) const {
-
-  Tracer_Plus tr("CESTFwdModel::PadeCoeffs");
-  ColumnVector C;
-  C.ReSize(m+1);
-
-  //cout << "PadeCoeffs" << endl;
-
-switch (m)
-    {
-    case 3:
-      C << 120 << 60 << 12 << 1;
-      break;
-    case 5:
-      C << 30240 << 15120 << 3360 << 420 << 30 << 1;
-      break;
-    case 7:
-	C << 17297280 << 8648640 << 1995840 << 277200 << 25200 << 1512 << 56 << 1;
-      break;
-    case 9:
-	C << 1.7643225600e10 << 8.821612800e9 << 2.075673600e9 << 3.02702400e8 << 30270240 << 2162160 << 110880 <<3960 << 90 << 1;
-      break;
-    case 13:
-      C << 6.4764752532480000e16 << 3.2382376266240000e16 << 7.771770303897600e15 << 1.187353796428800e15 <<  1.29060195264000e14 <<   1.0559470521600e13 <<  6.70442572800e11 <<      3.3522128640e10 << 1323241920 << 40840800 << 960960 << 16380 << 182 << 1;
-      break;
-    }
- return C;
-}
-
-
 void CESTFwdModel::Mz_spectrum(ColumnVector& Mz, const ColumnVector& wvec, const ColumnVector& w1, const ColumnVector& t, const ColumnVector& M0, const Matrix& wi, const Matrix& kij, const Matrix& T12) const {
 
   Tracer_Plus tr("CESTFwdModel::Mz_spectrum");
 
-
-  int nfreq = wvec.Nrows(); // total number of samples collected
-  int mpool=M0.Nrows();
-
-  Mz.ReSize(nfreq); Mz = 0.0;
-
-  //assmeble model matrices
-  ColumnVector k1i(mpool);
-   ColumnVector k2i(mpool);
-   for (int i=1; i<=mpool; i++) {
-     k1i(i) = 1/T12(1,i) + (kij.Row(i)).Sum();
-     k2i(i) = 1/T12(2,i) + (kij.Row(i)).Sum();
-   }
-
-   //cout << "k matrices generated" << endl;
-   //cout << k1i << endl << k2i << endl;
-
-   // first population of A (with w=0)
-   Matrix A(mpool*3,mpool*3);
-   A = 0.0; int st=0;
-   for (int i=1; i<=mpool; i++) {
-     Matrix D(3,3);
-     D=0.0;
-     D(1,1) = -k2i(i); D(2,2) = -k2i(i);
-     D(1,2) = -(wi(i,1)); D(2,1) = wi(i,1);
-     //D(2,3) = -w1; D(3,2) = w1;
-     D(3,3) = -k1i(i);
-     //cout << D << endl;
-     st = (i-1)*3;
-     A.SubMatrix(st+1,st+3,st+1,st+3) = D;
-   }
-   //cout << A << endl;
-
-   int st2=0; IdentityMatrix I(3);
-   for (int i=1; i<=mpool; i++) {
-     for (int j=1; j<=mpool; j++) {
-       if (i!=j) {
-	 st = (i-1)*3;
-	 st2 = (j-1)*3;
-	 A.SubMatrix(st+1,st+3,st2+1,st2+3) = I*kij(j,i); //NB 'reversal' of indices is correct here
-       }
-     }
-   }
-
-   //cout << "Inital A matrix populated" << endl;
-   //cout << A << endl;
-
-   ColumnVector M0i(mpool*3);
-   ColumnVector B(mpool*3);
-   B = 0.0; M0i=0.0;
-   for (int i=1; i<=mpool; i++) {
-     M0i(i*3) = M0(i);
-     B(i*3) = M0(i)/T12(1,i);
-   }
-
-   Matrix M(mpool*3,nfreq);
-   M=0.0;
-
-   Matrix AinvB(mpool,mpool); AinvB=0.0; Matrix ExpmAt;
-   for (int k=1; k<=nfreq; k++) {
-     if (w1(k)==0.0) {
-       // no saturation image - the z water magnetization is just M0
-       // (save doing the expm calculation here)
-       M(3,k)=M0(1);
-       //Mz(k) = M0(1);
-     }
-     else {
-     //Calculate new A matrix for this sample
-     for (int i=1; i<=mpool; i++) {
-     st = (i-1)*3;
-     // terms that involve the saturation frequency (wvec)
-     A(st+1,st+2) = -(wi(i,k)-wvec(k));
-     A(st+2,st+1) = wi(i,k)-wvec(k);
-
-     if (steadystate) {
-     // terms that involve the B1 (w1) value - now done below for the pulsed case
-       A(st+2,st+3) = -w1(k);
-       A(st+3,st+2) = w1(k);
-     }
-   }
-
-     if (abs(A.Determinant())<1e-12) {
-       cout << A << endl;
-     }
-
-     M.Column(k) = M0i; //set result as the intial conditions
-
-     if (steadystate) {
-       Matrix Ai; 
-       Ai = A.i();
-       //Mz(k) = -(Ai.Row(3)*B).AsScalar(); //Only want the z-component of the water pool
-       M.Column(k) = -Ai*B;
-     }
-     else {
-       //work through the segments of the saturation
-       int npulse;
-
-       // first: go once through the full pulse and calcualte all the required matrices
-       vector<Matrix> AiBseg;
-       vector<Matrix> expmAseg;
-       for (int s=1; s<=nseg; s++) {
-	 //assemble the appropriate A matrix
-	 Matrix Atemp(A);
-	 for (int i=1; i<=mpool; i++) {
-	   st = (i-1)*3;
-	   Atemp(st+2,st+3) = -w1(k)*pmagvec(s);
-	   Atemp(st+3,st+2) = w1(k)*pmagvec(s);
-	 }
-
-	 // Make the AinvB term
-	 Matrix AiBtemp;
-	 AiBtemp = Atemp.i()*B;
-	 AiBseg.push_back(AiBtemp);
-
-	 // make matrix exponential term
-	 Matrix expmAtemp;
-	 float tseg;
-	 // sort out the duration of the pulse
-	 if (ptvec(s)>1e6) {
-	     //a 'continuous' pulse - find duration from dataspec
-	     tseg = t(k);
-	     npulse=1;
-	   }
-	 else {
-	   // short duration pulse segment - duration from the pulse specification
-	   tseg = ptvec(s);
-
-	   // t now contains the number of times this pulse is repeated
-	   npulse=t(k);
-	 }
-
-	 expmAtemp = expm(Atemp*tseg);
-	 expmAseg.push_back(expmAtemp);
-       }
-
-       // now we step through all the pulses
-       ColumnVector Mtemp;
-       Mtemp = M.Column(k);
-       for (int p=1; p<=npulse; p++) {
-	 for (int s=1; s<=nseg; s++) {
-
-	   //Crusher gradients - force transverse magentizations to zero at the very start of a new pulse
-	   if (s == 1) {
-	     for (int i=1; i<=mpool; i++) {
-	       Mtemp((i-1)*3+1) = 0.0; //x
-	       Mtemp((i-1)*3+2) = 0.0; //y
-	     }
-	   }
-	   Mtemp = expmAseg[s-1]*(Mtemp + AiBseg[s-1]) - AiBseg[s-1];
-	 }
-       }
-       M.Column(k) = Mtemp;
-
-       /*
-       //segment 1 - from the initial conditions
-       int s=1;
-       float tcum = 0;
-
-       for (int i=1; i<=mpool; i++) {
-	 st = (i-1)*3;
-	 A(st+2,st+3) = -w1(k)*pmagvec(s);
-	 A(st+3,st+2) = w1(k)*pmagvec(s);
-       }
-       AinvB = A.i()*B;
-       //ExpmAt = expm(A*t(k,1));
-       //Mz(k) = (ExpmAt.Row(3) * (M0i + AinvB) - AinvB).AsScalar();
-       M.Column(k) = expm(A*ptvec(s)) * (M0i + AinvB) - AinvB;
-
-       tcum += ptvec(s);
-       cout << "Finished segment 1, saturation time completed is:" <<tcum << endl;
-       s++;
-
-       while (tcum<t(k)) { 
-	 // terms in A the involve the B1 (w1) value
-	 for (int i=1; i<=mpool; i++) {
-	   st = (i-1)*3;
-	   A(st+2,st+3) = -w1(k)*pmagvec(s);
-	   A(st+3,st+2) = w1(k)*pmagvec(s);
-	 }
-
-	 /
-	 if (pmagvec(s)<1e-12) { //crush the transverse components during the zero saturation phases
-	   for (int i=1; i<=mpool; i++) {
-	     st = (i-1)*3;
-	     M(i+1,k)=0.0;
-	     M(i+2,k)=0.0;
-	   }
-	 }
-	 /
-
-	 AinvB = A.i()*B;
-	 //ExpmAt = expm(A*t(k,s));
-	 //Mz(k) = (ExpmAt.Row(3) * (M0i + AinvB) - AinvB).AsScalar();
-	 M.Column(k) = expm(A*ptvec(s)) * (M.Column(k) + AinvB) - AinvB;
-
-	 tcum += ptvec(s);
-	 //cout << "Finished segment " << s << ", saturation time completed is:" <<tcum << endl;
-	 s++;
-	 if (s>nseg) s=1; //reset back tot he first segment of the pulsetrain
-       }
-*/
-     }
-     }
-   }
-
-   Mz = (M.Row(3)).AsColumn();
-
-   //ColumnVector result;
-   //cout << M.Row(3);
-   //result = (M.Row(3)).AsColumn();
-   //result = Mz;
-   //return result;
+  // model matrices - set up once, only the frequency and B1 terms change
+  // with each sample (see blochmcconnell.h)
+  const BlochMcConnell bm(M0, kij, T12);
+
+  // t is the saturation time, or for a pulse train the number of times the
+  // pulse is repeated
+  const CESTPulse* train = steadystate ? NULL : &pulse;
+  if (bmreference)
+    bm.Spectrum(Mz, wvec, w1, t, wi, train);
+  else
+    bm.SpectrumBatch(Mz, wvec, w1, t, wi, train);
 }
 
 
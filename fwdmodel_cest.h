@@ -68,6 +68,7 @@
 
 #include "fwdmodel.h"
 #include "inference.h"
+#include "blochmcconnell.h"
 #include <string>
 using namespace std;
 
@@ -77,6 +78,7 @@ public:
   virtual void Evaluate(const ColumnVector& params, 
 			      ColumnVector& result) const;
   void Initialise(MVNDist& posterior) const;
+  virtual int Gradient(const ColumnVector& params, Matrix& grad) const;
 
    static void ModelUsage();
   virtual string ModelVersion() const;
@@ -104,16 +106,13 @@ public:
 
 protected: 
   //specific functions
+  void ModelMatrices(const ColumnVector& params, ColumnVector& M0, Matrix& kij, Matrix& T12, Matrix& wimat, ColumnVector& w1) const;
   void Mz_spectrum(ColumnVector& Mz, const ColumnVector& wvec, const ColumnVector& w1, const ColumnVector& t, const ColumnVector& M0, const Matrix& wi, const Matrix& kij, const Matrix& T12) const;
   ReturnMatrix Mz_spectrum_lorentz(const ColumnVector& wvec, const ColumnVector& w1, const ColumnVector& t, const ColumnVector& M0, const Matrix& wi, const Matrix& kij, const Matrix& T12) const;
 
   //maths functions
   void Ainverse(const Matrix A, RowVector& Ai) const;
-  ReturnMatrix expm(Matrix inmatrix) const;
   ReturnMatrix expm_eig(Matrix inmatrix) const;
-  ReturnMatrix expm_pade(Matrix inmatrix) const;
-  ReturnMatrix PadeApproximant(Matrix inmatrix, int m) const;
-  ReturnMatrix PadeCoeffs(int m) const;
 
 // Constants
 
@@ -129,6 +128,8 @@ protected:
   //bool pvcorr;
   bool lorentz;
   bool steadystate;
+  bool bmreference;
+  bool numgrad;
 
   // scan parameters
   vector<float> t;
@@ -152,10 +153,8 @@ protected:
   ColumnVector pmagvec;
   ColumnVector ptvec;
   int nseg;
+  CESTPulse pulse; // the same, with repeated segments found
 
-  // processing flags
-  mutable bool fastgrad; //use a fast approximation to the expm because we are caculating the gradient
-  
   // ard flags
   bool doard;
  
@@ -301,59 +301,15 @@ void DSCFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) con
      }*/
 
    // Do the convolution
-   // form the convolution matrix (there is probably a better way!)
-   
-   //aifnew = aif;
-   
    //cout << "--------------------" << endl;
    //cout << "cbf: " << cbf << " gmu: " << gmu << " log(lambda): " << lambda << " delta: " << delta << " sig0: " << sig0 << endl;
 
    //cout << "residue: " << residue.t() << endl;
    //cout << "aifnew: " << aifnew.t() << endl;
 
-   LowerTriangularMatrix A(nhtpts); A=0.0;
-
-   if (convmtx=="simple")
-     {
-       // Simple convolution matrix
-       for (int i=1; i<=nhtpts; i++) {
-	 for (int j=1; j <= i; j++) {
-	   A(i,j) = aifnew(i-j+1); //note we are using the local aifnew here! (i.e. it has been suitably time shifted)
-	 }
-       }
-     }
-   //cout << "new run" << endl;
-   //cout << A << endl;
-
-   else if (convmtx=="voltera")
-     {
-       ColumnVector aifextend(nhtpts+2);
-       ColumnVector zero(1);
-       zero=0;
-       aifextend = zero & aifnew & zero;
-       int x, y, z;
-       //voltera convolution matrix (as defined by Sourbron 2007) - assume zeros outside aif range
-       for (int i=1; i<=nhtpts; i++) {
-	 for (int j=1; j <= i; j++) {
-	   //cout << i << "  " << j << endl;
-	   x = i+1;y=j+1; z = i-j+1;
-	   if (j==1) { A(i,j) =(2*aifextend(x) + aifextend(x-1))/6; }
-	   else if (j==i) { A(i,j) = (2*aifextend(2) + aifextend(3))/6; }
-	   else { 
-	     A(i,j) =  (4*aifextend(z) + aifextend(z-1) + aifextend(z+1))/6; 
-	     //cout << x << "  " << y << "  " << z << "  " << ( 4*aifextend(z) + aifextend(z-1) + aifextend(z+1) )/6 << "  " << 1/6*(4*aifextend(z) + aifextend(z-1) + aifextend(z+1)) << endl;
-	     // cout << aifextend(z) << "  " << aifextend(z-1) << "  " << aifextend(z+1) << endl;
-	   }
-	   //cout << i << "  " << j << "  " << aifextend(z) << "  " << A(i,j) << endl<<endl;
-	 }
-       }
-     }
-
-   //cout << A << endl;
-
-   // do the multiplication
-   ColumnVector C; 
-   C = cbf*hdelt*A*residue;
+   ColumnVector C;
+   convolve(aifnew,residue,C); //note we are using the local aifnew here! (i.e. it has been suitably time shifted)
+   C *= cbf*hdelt;
    //convert to the DSC signal
 
    //cout  << "C: " << C.t() << endl;
@@ -424,6 +380,8 @@ DSCFwdModel::DSCFwdModel(ArgsType& args)
       inferret = args.ReadBool("inferret");
 
       convmtx = args.ReadWithDefault("convmtx","simple");
+      if (convmtx != "simple" && convmtx != "voltera")
+	throw invalid_argument("Unrecognised --convmtx=" + convmtx + " (use simple or voltera)");
       
       // Read in the arterial signal
       ColumnVector artsig;
@@ -534,6 +492,48 @@ ColumnVector DSCFwdModel::aifshift( const ColumnVector& aif, const float delta,
 }
 
 
+void DSCFwdModel::convolve( const ColumnVector& aif, const ColumnVector& residue, ColumnVector& C ) const
+{
+  // Convolve the (shifted) aif with the residue function: C = A*residue where
+  // A is the lower triangular convolution matrix selected by convmtx.  A is
+  // Toeplitz (apart from the first column and diagonal for voltera), so
+  // the sums are done directly on the aif rather than forming A.
+  const int n = nhtpts;
+  const Real* a = aif.Store();
+  const Real* r = residue.Store();
+  C.ReSize(n);
+  Real* c = C.Store();
+
+  if (convmtx=="simple")
+    {
+      // A(i,j) = aif(i-j+1)
+      for (int i=0; i<n; i++) {
+	double sum = 0;
+	for (int j=0; j<=i; j++) sum += a[i-j]*r[j];
+	c[i] = sum;
+      }
+    }
+  else if (convmtx=="voltera")
+    {
+      // voltera convolution matrix (as defined by Sourbron 2007) - assume zeros outside aif range
+      // A(i,1) = (2*aif(i) + aif(i-1))/6
+      // A(i,i) = (2*aif(1) + aif(2))/6                        (i>1)
+      // A(i,j) = (4*aif(i-j) + aif(i-j-1) + aif(i-j+1))/6     (1<j<i)
+      vector<double> k(n, 0.0);
+      for (int m=1; m<=n-2; m++) {
+	k[m] = (4*a[m-1] + (m>1 ? a[m-2] : 0.0) + a[m])/6;
+      }
+      const double diag = n>1 ? (2*a[0] + a[1])/6 : 0.0;
+
+      for (int i=0; i<n; i++) {
+	double sum = (2*a[i] + (i>0 ? a[i-1] : 0.0))/6*r[0];
+	if (i>0) sum += diag*r[i];
+	for (int j=1; j<i; j++) sum += k[i-j]*r[j];
+	c[i] = sum;
+      }
+    }
+}
+
 void DSCFwdModel::SetupARD( const MVNDist& theta, MVNDist& thetaPrior, double& Fard)
 {
   Tracer_Plus tr("ASL_PVC_FwdModel::SetupARD");
@@ -99,6 +99,7 @@ public:
 protected: 
 
   ColumnVector aifshift( const ColumnVector& aif, const float delta, const float hdelt ) const;
+  void convolve( const ColumnVector& aif, const ColumnVector& residue, ColumnVector& C ) const;
   
 // Constants
 
@@ -141,78 +141,173 @@ void FASLFwdModel::HardcodedInitialDists(MVNDist& prior,
 
 }    
 
+void FASLFwdModel::Timecourses(const ColumnVector& params, ColumnVector& CBF,
+				ColumnVector& DelT, ColumnVector& StatMag) const
+{
+    const int npoints = Qbasis.Nrows();
+    const int nQ = Qbasis.Ncols(), nD = Dbasis.Ncols(), nM = Mbasis.Ncols();
+    const Real* qb = Qbasis.Store();
+    const Real* db = Dbasis.Store();
+    const Real* mb = Mbasis.Store();
+    const Real* qn = params.Store() + Q0index(); // Qn(1) is params(Q0index()+1)
+    const Real* dn = params.Store() + D0index();
+    const Real* mn = params.Store() + M0index();
+
+    // Absolute M and Q change (same units as M0 or Q0)
+    const double Q0 = params(Q0index());
+    double D0cpy = params(D0index()); if (D0cpy<0) D0cpy=0; //D0 cannot be negative
+    CBF.ReSize(npoints);
+    DelT.ReSize(npoints);
+    for (int i=0; i<npoints; i++) {
+      double q = 0;
+      for (int j=0; j<nQ; j++)
+	q += qb[i*nQ+j]*qn[j];
+      CBF(i+1) = Q0 + q;
+
+      double d = 0;
+      for (int j=0; j<nD; j++)
+	d += db[i*nD+j]*(100*dn[j]); //Note scaling of arrival time changes here!
+      DelT(i+1) = D0cpy + d;
+    }
+
+    if (dataisdiff) {
+      StatMag.ReSize(0);
+      return;
+    }
+
+    const double M0 = params(M0index());
+    StatMag.ReSize(npoints);
+    for (int i=0; i<npoints; i++) {
+      double m = 0;
+      for (int j=0; j<nM; j++)
+	m += mb[i*nM+j]*mn[j];
+      StatMag(i+1) = M0 - m;
+    }
+}
+
 void FASLFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
     Tracer_Plus tr("FASLFwdModel::Evaluate");
     
-    // Parameterization used in most recent results:
-    // Absolute M and Q change (same units as M0 or Q0):
-    ColumnVector StatMag = params(M0index()) - Mbasis * MnOf(params);
-    ColumnVector CBF = params(Q0index()) + Qbasis * QnOf(params);
-    double D0cpy = params(D0index()); if (D0cpy<0) D0cpy=0; //D0 cannot be negative
-    ColumnVector DelT = D0cpy + Dbasis * 100*DnOf(params); //Note scaling of arrival time changes here!
-
-    /* THIS SECTION FOR MULTI ECHO
-    // Fractional change in BOLD effect (at TE_2), rather than using % R2* change 
-    ColumnVector R2s = -1/echoTime(2) * log( 
-        Rbasis * RnOf(params) + exp(-echoTime(2)*params(R0index())));
-    */
+    ColumnVector CBF, DelT, StatMag;
+    Timecourses(params, CBF, DelT, StatMag);
 
     double T1b = (stdevT1b>0 ? params(T1bIndex()) : fixedT1b);
     double T1 = (stdevT1>0 ? params(T1Index()) : fixedT1);
     double invEfficiency = (stdevInvEff>0 ? params(InvEffIndex()) : fixedInvEff);
+    double A = (dataisdiff ? 0 : params(AIndex()));
 
     //kinetic curve modelling
     int npoints = CBF.Nrows();
-    ColumnVector Sb(npoints);
-    Sb=0.0;
     float lambda=0.9;
     float T_1app = 1/( 1/T1 + 0.01/lambda);
+    result.ReSize(npoints);
     for (int i=1; i<=npoints; i++) {
-      if (dataisdiff) {
-	Sb(i) = CBF(i)*2*invEfficiency*kctissue_nodisp(tivec(i),DelT(i),tau,T1b,T_1app);
+      double Sb = 0.0;
+      if (labelsign(i) != 0) {
+	Sb = labelsign(i)*CBF(i)*2*invEfficiency*kctissue_nodisp(tivec(i),DelT(i),tau,T1b,T_1app);
       }
-      else {
-	if (rho(i) < 0) {
-	  //Sb(i) = 0.0;
-	  Sb(i) = -CBF(i)*2*invEfficiency*kctissue_nodisp(tivec(i),DelT(i),tau,T1b,T_1app);
-	}
+
+      //saturation recovery of static magnetization
+      double Sm = 0.0;
+      if (!dataisdiff) {
+	double decay = (stdevT1>0 ? exp(-tivec(i)/T1) : satdecay(i));
+	Sm = StatMag(i)*(1.0 - A*decay);
       }
-    }
 
-    if (dataisdiff) {
-      StatMag=0;
+      result(i) = Sm + Sb;
     }
-    else {
-    //saturation recovery of static magnetization
-    double A = params(AIndex());
+
+  return;
+}
+
+// The kinetic curve of kctissue_nodisp and its derivatives wrt the arrival
+// time and T_1app.  After the bolus has started arriving it can be written
+//   2*T_1app*exp(-delttiss/T_1b)*(exp(-lo/T_1app) - exp(-hi/T_1app))
+// with lo = ti during the bolus and 2*ti-tau-delttiss after, and
+// hi = 2*ti-delttiss.
+static void kctissue_nodisp_deriv(double ti, double delttiss, double tau, 
+				  double T_1b, double T_1app, double& kc,
+				  double& dkc_ddelt, double& dkc_dT1app)
+{
+  kc = dkc_ddelt = dkc_dT1app = 0;
+  if (ti < delttiss) return;
+
+  const bool during = (ti <= delttiss + tau);
+  const double lo = during ? ti : 2*ti - tau - delttiss;
+  const double hi = 2*ti - delttiss;
+  const double eb = 2*exp(-delttiss/T_1b);
+  const double elo = exp(-lo/T_1app);
+  const double ehi = exp(-hi/T_1app);
+
+  kc = eb*T_1app*(elo - ehi);
+  dkc_ddelt = -kc/T_1b + eb*((during ? 0 : elo) - ehi);
+  dkc_dT1app = eb*(elo*(1 + lo/T_1app) - ehi*(1 + hi/T_1app));
+}
+
+int FASLFwdModel::Gradient(const ColumnVector& params, Matrix& grad) const
+{
+    Tracer_Plus tr("FASLFwdModel::Gradient");
+
+    ColumnVector CBF, DelT, StatMag;
+    Timecourses(params, CBF, DelT, StatMag);
+
+    double T1b = (stdevT1b>0 ? params(T1bIndex()) : fixedT1b);
+    double T1 = (stdevT1>0 ? params(T1Index()) : fixedT1);
+    double invEfficiency = (stdevInvEff>0 ? params(InvEffIndex()) : fixedInvEff);
+    double A = (dataisdiff ? 0 : params(AIndex()));
+    double dD0 = (params(D0index()) < 0 ? 0 : 1); // held at zero below that
+
+    int npoints = CBF.Nrows();
+    float lambda=0.9;
+    float T_1app = 1/( 1/T1 + 0.01/lambda);
+    double dT1app = double(T_1app)*T_1app/(T1*T1); // dT_1app/dT1
+
+    grad.ReSize(npoints, NumParams());
+    grad = 0.0;
     for (int i=1; i<=npoints; i++) {
-      StatMag(i) = StatMag(i)*(1.0 - A*exp(-tivec(i)/T1));
-	}
-    }
+      const double ti = tivec(i);
+
+      // kinetic curve: CBF, arrival time, inversion efficiency, T1b, T1
+      if (labelsign(i) != 0) {
+	double kc, dkc_ddelt, dkc_dT1app;
+	kctissue_nodisp_deriv(ti, DelT(i), tau, T1b, T_1app, 
+			      kc, dkc_ddelt, dkc_dT1app);
+	const double dSb_dCBF = labelsign(i)*2*invEfficiency*kc;
+	const double dSb_dDelT = labelsign(i)*CBF(i)*2*invEfficiency*dkc_ddelt;
+
+	grad(i, Q0index()) = dSb_dCBF;
+	for (int j=1; j<=Qbasis.Ncols(); j++)
+	  grad(i, Q0index()+j) = Qbasis(i,j)*dSb_dCBF;
+
+	grad(i, D0index()) = dSb_dDelT*dD0;
+	for (int j=1; j<=Dbasis.Ncols(); j++)
+	  grad(i, D0index()+j) = Dbasis(i,j)*100*dSb_dDelT;
+
+	if (stdevInvEff>0)
+	  grad(i, InvEffIndex()) = labelsign(i)*CBF(i)*2*kc;
+	if (stdevT1b>0)
+	  grad(i, T1bIndex()) = CBF(i)*dSb_dCBF*DelT(i)/(T1b*T1b);
+	if (stdevT1>0)
+	  grad(i, T1Index()) = labelsign(i)*CBF(i)*2*invEfficiency*dkc_dT1app*dT1app;
+      }
 
-    ColumnVector S = StatMag + Sb;
-    result = S;
-      
-    //int Ntimes = S.Nrows();
-  //int Nte = echoTime.Nrows();
-  //if (result.Nrows() != Nte*Ntimes)
-  //  result.ReSize(Nte*Ntimes);
-  
-  /* ASSEMBLE multi TE result  
-for (int te = 1; te <= Nte; te++)
-    {
-      ColumnVector nuisance = Nbasis * NnOf(te, params);
-      // Will be all-zero if there are no nuisance regressors
-        
-      for (int i = 1; i <= Ntimes; i++)
-        result( Nte*(i-1) + te ) = 
-            S(i) * exp(-echoTime(te) * R2s(i)) + nuisance(i);
-      // Fill order: te1 te2 te1 te2 te1 te2 te1 te2 ...
+      // saturation recovery of static magnetization: M, A, T1
+      if (!dataisdiff) {
+	double decay = (stdevT1>0 ? exp(-ti/T1) : satdecay(i));
+	double recovery = 1.0 - A*decay;
+
+	grad(i, M0index()) = recovery;
+	for (int j=1; j<=Mbasis.Ncols(); j++)
+	  grad(i, M0index()+j) = -Mbasis(i,j)*recovery;
+
+	grad(i, AIndex()) = -StatMag(i)*decay;
+	if (stdevT1>0)
+	  grad(i, T1Index()) += -StatMag(i)*A*decay*ti/(T1*T1);
+      }
     }
-  */
 
-  return;
+    return true;
 }
 
 void FASLFwdModel::ModelUsage()
@@ -350,6 +445,8 @@ echoTime.ReSize(2);
         Mbasis = read_vest(mb);
 
 	const int numTR = Qbasis.Nrows();
+	if (Dbasis.Nrows() != numTR || Mbasis.Nrows() != numTR)
+	  throw Invalid_option("CBF, arrival time and static magnetization bases must have the same number of rows");
 	/*
     LOG_ERR( "    Reading Nuisance basis functions: " << nb << endl );
     if (nb != "null")
@@ -384,6 +481,19 @@ echoTime.ReSize(2);
     tivec = tivectemp.Rows(ndiscarded+1,numTR+ndiscarded);
 
     LOG << "Full TIs used: " << tivec.t() << endl;
+
+    // Constant parts of the signal in each TR: the kinetic curve appears
+    // in tag TRs (or all of them for difference data) and the saturation
+    // recovery depends only on the TI unless T1 is a parameter
+    labelsign.ReSize(numTR);
+    for (int i=1; i<=numTR; i++)
+      labelsign(i) = dataisdiff ? 1 : (rho(i) < 0 ? -1 : 0);
+
+    if (stdevT1 <= 0) {
+      satdecay.ReSize(numTR);
+      for (int i=1; i<=numTR; i++)
+	satdecay(i) = exp(-tivec(i)/fixedT1);
+    }
 }
 
 void FASLFwdModel::DumpParameters(const ColumnVector& vec,
@@ -80,6 +80,8 @@ public:
   // Virtual function overrides
   virtual void Evaluate(const ColumnVector& params, 
 			      ColumnVector& result) const;
+  virtual int Gradient(const ColumnVector& params, Matrix& grad) const;
+  // analytic; like the rest of this model it is only built with __DEVEL
                   
   virtual void DumpParameters(const ColumnVector& vec,
                                 const string& indents = "") const;
@@ -105,6 +107,11 @@ public:
 protected: // Constants
   
   float kctissue_nodisp(const float ti, const float delttiss, const float tau, const float T_1b, const float T_1app) const;
+
+  void Timecourses(const ColumnVector& params, ColumnVector& CBF,
+		   ColumnVector& DelT, ColumnVector& StatMag) const;
+  // CBF, arrival time and static magnetization for each TR from their
+  // bases (StatMag is left empty for difference data)
   
   int Q0index() const { return 1; }
   int M0index() const { return Q0index()+Qbasis.Ncols()+1; }
@@ -140,6 +147,8 @@ protected: // Constants
   ColumnVector rho;
 //ColumnVector echoTime;
 ColumnVector tivec;
+ ColumnVector labelsign; // sign of the kinetic curve in each TR (0 if none)
+ ColumnVector satdecay; // exp(-ti/T1) for each TR, when T1 is fixed
 float tau;
   
  bool dataisdiff;
@@ -157,80 +157,128 @@ void FLEXFwdModel::HardcodedInitialDists(MVNDist& prior,
     
     
 
+void FLEXFwdModel::Components(const ColumnVector& params, 
+			      vector<Component>& comps) const
+{
+  comps.resize(ncomp);
+  for (int s=1; s<=ncomp; s++) {
+    Component& c = comps[s-1];
+    c.ptr = params(npoly+s);
+
+    // deltw, kept away from the poles of tan
+    double pw = params(npoly+ncomp+s);
+    c.dwdp = 1;
+    if (pw>M_PI/2-1e-12) { pw = M_PI/2-1e-12; c.dwdp = 0; }
+    if (pw<-M_PI/2+1e-12) { pw = -M_PI/2+1e-12; c.dwdp = 0; }
+    c.w = compspec(s,1) + tan(pw);
+    c.w /= 1e6; // starts out in ppm
+    c.w *= field; //into Hz
+    c.w = o1 - c.w; //offset from o1 frequency
+    c.w *= 2*M_PI; //into radians/s
+    c.dwdp *= -2*M_PI*field/1e6/(cos(pw)*cos(pw));
+
+    // kevol = (ksw-1/T*_2s)
+    c.k = exp(params(npoly+2*ncomp+s)); //infer log(kevol)
+
+    c.phase = params(npoly+3*ncomp+s);
+  }
+}
+
+void FLEXFwdModel::Oscillation(const Component& c, double* re, double* im) const
+{
+  const Real* t = tevol.Store();
+
+  if (tstep == 0) {
+    for (int i=0; i<ntpts; i++) {
+      const double e = exp(-c.k*t[i]);
+      const double th = c.w*t[i] + c.phase;
+      re[i] = e*cos(th);
+      im[i] = e*sin(th);
+    }
+    return;
+  }
+
+  // Uniform tevol: step along by multiplying by the one-step factor,
+  // going back to the exact value every few points so that rounding
+  // errors don't build up
+  const int reseed = 16;
+  const double er = exp(-c.k*tstep);
+  const double cr = er*cos(c.w*tstep);
+  const double sr = er*sin(c.w*tstep);
+  for (int i=0; i<ntpts; i++) {
+    if (i % reseed == 0) {
+      const double e = exp(-c.k*t[i]);
+      const double th = c.w*t[i] + c.phase;
+      re[i] = e*cos(th);
+      im[i] = e*sin(th);
+    }
+    else {
+      re[i] = re[i-1]*cr - im[i-1]*sr;
+      im[i] = im[i-1]*cr + re[i-1]*sr;
+    }
+  }
+}
+
 void FLEXFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
   Tracer_Plus tr("FLEXFwdModel::Evaluate");
 
-    // ensure that values are reasonable
-    // negative check
-  ColumnVector paramcpy = params;
-   for (int i=1;i<=NumParams();i++) {
-      if (params(i)<0) { paramcpy(i) = 0; }
-      }
+  vector<Component> comps;
+  Components(params, comps);
 
-   //model matrices
-   ColumnVector baseline(npoly);
-   ColumnVector PTR(ncomp);
-   ColumnVector deltw(ncomp);
-   ColumnVector kevol(ncomp);
-   ColumnVector phase(ncomp);
-
-   // extract values from params
-   int place=1;
-   baseline = params.Rows(place,place+npoly-1);
-   place += npoly;
-
-   // PTR
-   PTR = params.Rows(place,place+ncomp-1);
-   place += ncomp;
-
-   // deltw
-   //deltw = params.Rows(place,place+ncomp-1);
-   ColumnVector pw;
-   pw = params.Rows(place,place+ncomp-1);
-   for (int i=1; i<=ncomp; i++) {
-     if (pw(i)>M_PI/2-1e-12) pw(i) = M_PI/2-1e-12;
-     if (pw(i)<-M_PI/2+1e-12) pw(i) = -M_PI/2+1e-12;
-     deltw(i) = compspec(i,1) + tan(pw(i));
-     //deltw(i) = compspec(i,1) + pw(i);
-   }
-   
-
-   place += ncomp;
-   deltw /= 1e6; // starts out in ppm
-   deltw *= field; //into Hz
-   deltw = o1 - deltw; //offset from o1 frequency
-   deltw *= 2*M_PI; //into radians/s
-
-   // kevol = (ksw-1/T*_2s)
-   kevol = exp( params.Rows(place,place+ncomp-1) ); //infer log(kevol)
-   place += ncomp;
-
-   //phase
-   phase = params.Rows(place,place+ncomp-1);
-   place += ncomp;
-
-
-    result.ReSize(ntpts);
-    result = 0.0;
-    
-    //baseline
-    ColumnVector tpower(tevol);
-    tpower=1;
-    for (int i=1; i<=npoly; i++) {
-      result += baseline(i)*tpower;
-      tpower = SP(tpower,tevol);
-    }
+  result.ReSize(ntpts);
+  Real* r = result.Store();
 
-    for (int s=1; s<=ncomp; s++) {
-      for (int i=1; i<=ntpts; i++) {
-	result.Row(i) += PTR.Row(s)*exp( -kevol.Row(s)*tevol.Row(i) )*cos( (deltw.Row(s)*tevol.Row(i) + phase.Row(s)).AsScalar());
-      }
-    }
+  //baseline
+  const Real* baseline = params.Store();
+  const Real* tp = tpower.Store();
+  for (int i=0; i<ntpts; i++) {
+    double sum = 0;
+    for (int p=0; p<npoly; p++)
+      sum += baseline[p]*tp[i*npoly+p];
+    r[i] = sum;
+  }
+
+  vector<double> re(ntpts), im(ntpts);
+  for (int s=0; s<ncomp; s++) {
+    Oscillation(comps[s], &re[0], &im[0]);
+    const double ptr = comps[s].ptr;
+    for (int i=0; i<ntpts; i++)
+      r[i] += ptr*re[i];
+  }
 
   return;
 }
 
+int FLEXFwdModel::Gradient(const ColumnVector& params, Matrix& grad) const
+{
+  Tracer_Plus tr("FLEXFwdModel::Gradient");
+
+  vector<Component> comps;
+  Components(params, comps);
+
+  grad.ReSize(ntpts, NumParams());
+  grad = 0.0;
+  if (npoly > 0)
+    grad.Columns(1,npoly) = tpower;
+
+  const Real* t = tevol.Store();
+  vector<double> re(ntpts), im(ntpts);
+  for (int s=1; s<=ncomp; s++) {
+    const Component& c = comps[s-1];
+    Oscillation(c, &re[0], &im[0]);
+    for (int i=1; i<=ntpts; i++) {
+      const double ti = t[i-1];
+      grad(i, npoly+s) = re[i-1];
+      grad(i, npoly+ncomp+s) = -c.ptr*im[i-1]*ti*c.dwdp;
+      grad(i, npoly+2*ncomp+s) = -c.ptr*c.k*ti*re[i-1];
+      grad(i, npoly+3*ncomp+s) = -c.ptr*im[i-1];
+    }
+  }
+
+  return true;
+}
+
 
 FLEXFwdModel::FLEXFwdModel(ArgsType& args)
 {
@@ -266,6 +314,27 @@ FLEXFwdModel::FLEXFwdModel(ArgsType& args)
     ncomp = compspec.Nrows();
     ntpts = tevol.Nrows();
 
+    // powers of tevol for the baseline
+    tpower.ReSize(ntpts,npoly);
+    for (int i=1; i<=ntpts; i++) {
+      double tp = 1;
+      for (int p=1; p<=npoly; p++) {
+	tpower(i,p) = tp;
+	tp *= tevol(i);
+      }
+    }
+
+    // the oscillations can be stepped along a uniform grid
+    tstep = 0;
+    if (ntpts > 2) {
+      tstep = tevol(2) - tevol(1);
+      for (int i=2; i<ntpts; i++)
+	if (fabs(tevol(i+1) - tevol(i) - tstep) > 1e-12*fabs(tstep)) {
+	  tstep = 0;
+	  break;
+	}
+    }
+
     //ARD on baseline parameters (except DC term)
     if (npoly>1) {
     for (int i=1; i<npoly; i++) {
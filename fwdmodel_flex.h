@@ -76,6 +76,8 @@ public:
   // Virtual function overrides
   virtual void Evaluate(const ColumnVector& params, 
 			      ColumnVector& result) const;
+  virtual int Gradient(const ColumnVector& params, Matrix& grad) const;
+  // analytic; like the rest of this model it is only built with __DEVEL
   static void ModelUsage();
   virtual string ModelVersion() const;
                   
@@ -102,6 +104,15 @@ virtual void SetupARD(const MVNDist& posterior, MVNDist& prior, double& Fard);
 protected: 
   //specific functions
 
+  // One component's terms, derived from the parameters: amplitude,
+  // frequency offset from o1 (rad/s) and its derivative wrt the deltw
+  // parameter, decay rate kevol, phase
+  struct Component { double ptr, w, dwdp, k, phase; };
+  void Components(const ColumnVector& params, vector<Component>& comps) const;
+
+  void Oscillation(const Component& c, double* re, double* im) const;
+  // re + i*im = exp(-k*t) * exp(i*(w*t + phase)) at each of the tevol
+
 // Constants
 
   // Lookup the starting indices of the parameters
@@ -114,6 +125,8 @@ protected:
 
   // scan parameters
   ColumnVector tevol;
+  Matrix tpower; // tevol.^(i-1) in column i, for the baseline polynomial
+  double tstep;  // spacing of tevol if it is uniform, otherwise 0
 
   //model parameters
   int ncomp; //number of components
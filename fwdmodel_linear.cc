@@ -70,6 +70,7 @@
 #include <iostream>
 #include "newmatio.h"
 #include <stdexcept>
+#include <algorithm>
 #include "easylog.h"
 #include "newimage/newimageall.h"
 using namespace NEWIMAGE;
@@ -88,6 +89,7 @@ void LinearFwdModel::ModelUsage()
 }
 
 LinearFwdModel::LinearFwdModel(ArgsType& args)
+  : sparsity(NULL)
 {
   Tracer_Plus tr("LinearFwdModel::LinearFwdModel(args)");
   string designFile = args.Read("basis");
@@ -136,17 +138,31 @@ void LinearFwdModel::Evaluate(const ColumnVector& params,
 void LinearizedFwdModel::ReCentre(const ColumnVector& about)
 {
   Tracer_Plus tr("LinearizedFwdModel::ReCentre");
+  MoveCentre(about);
+  UpdateJacobian();
+}
+
+void LinearizedFwdModel::MoveCentre(const ColumnVector& about)
+{
+  Tracer_Plus tr("LinearizedFwdModel::MoveCentre");
   assert(about == about); // isfinite
 
   // Store new centre & offset
   centre = about;
   fcn->Evaluate(centre, offset);
+  evaluations++;
   if (0*offset != 0*offset) 
     {
       LOG_ERR("about:\n" << about);
       LOG_ERR("offset:\n" << offset.t());
       throw overflow_error("ReCentre: Non-finite values found in offset");
     }
+}
+
+void LinearizedFwdModel::UpdateJacobian()
+{
+  Tracer_Plus tr("LinearizedFwdModel::UpdateJacobian");
+  const ColumnVector& about = centre;
 
   // Calculate the Jacobian numerically.  jacobian is len(y)-by-len(m)
   jacobian.ReSize(offset.Nrows(), centre.Nrows());
@@ -157,33 +173,46 @@ void LinearizedFwdModel::ReCentre(const ColumnVector& about)
   gradfrommodel = fcn->Gradient(centre,jacobian);
 
   if (!gradfrommodel) {
-  ColumnVector centre2, centre3;
-  ColumnVector offset2, offset3;
-  for (int i = 1; i <= centre.Nrows(); i++)
-    {
-      double delta = centre(i) * 1e-5;
-      if (delta<0) delta = -delta;
-      if (delta<1e-10) delta = 1e-10;
-
-      // Take derivative numerically
-      centre3 = centre;
-      centre2 = centre;
-      centre2(i) += delta;
-      centre3(i) -= delta;
-      fcn->Evaluate(centre2, offset2);
-      fcn->Evaluate(centre3, offset3);
-      jacobian.Column(i) = (offset2 - offset3) / (centre2(i) - centre3(i));
-
-      /*
-if (i==4)
-{LOG << "centre2 -centre3== \n" << 1e10*(centre2-centre3) << endl;
-LOG << "offset2-offset3 == \n" << offset2(33)-offset3(33) << endl;
-LOG << "offset2-offset3 == \n" << float(offset2(33)-offset3(33)) << endl;
-LOG << "offset2-offset3 == \n" << double(offset2(33)-offset3(33)) << endl;
-LOG << "Jac 33,4 == " << jacobian(33,4) << endl;
-}
-//*/
-    }   
+  // Take derivatives numerically.  All the perturbed parameter vectors
+  // are evaluated in one call so the model can batch them.  Parameters
+  // the sparsity pattern marks as unused get a zero column for free, 
+  // except the first time round and every few iterations after, so that
+  // the pattern gets a chance to widen to any dependence the probes 
+  // missed or that appears as the parameters move.
+  const int np = centre.Nrows();
+  vector<int> active;
+  for (int i = 1; i <= np; i++)
+    if (sparsity == NULL || fullJacobian || !sparsity->ZeroColumn(i))
+      active.push_back(i);
+  fullJacobian = (++jacobianUpdates % fullJacobianInterval == 0);
+  const int na = active.size();
+
+  jacobian = 0;
+  if (na > 0)
+    {
+      Matrix centres(np, 2*na), offsets;
+      for (int k = 1; k <= na; k++)
+	{
+	  const int i = active[k-1];
+	  double delta = centre(i) * 1e-5;
+	  if (delta<0) delta = -delta;
+	  if (delta<1e-10) delta = 1e-10;
+
+	  centres.Column(2*k-1) = centre;
+	  centres.Column(2*k) = centre;
+	  centres(i,2*k-1) += delta;
+	  centres(i,2*k) -= delta;
+	}
+      fcn->EvaluateMany(centres, offsets);
+      evaluations += 2*na;
+
+      for (int k = 1; k <= na; k++)
+	{
+	  const int i = active[k-1];
+	  jacobian.Column(i) = (offsets.Column(2*k-1) - offsets.Column(2*k))
+	    / (centres(i,2*k-1) - centres(i,2*k));
+	}
+    }
   }
 
   if (0*jacobian != 0*jacobian) 
@@ -193,6 +222,298 @@ LOG << "Jac 33,4 == " << jacobian(33,4) << endl;
       LOG << "offset':\n" << offset.t();    
       throw overflow_error("ReCentre: Non-finite values found in jacobian");
     }
+
+  // A new non-zero means the structure has changed, so look at the 
+  // unused parameters again next time too
+  if (sparsity != NULL && sparsity->Widen(jacobian))
+    fullJacobian = true;
+}
+
+void LinearFwdModel::WeightedJtJ(const DiagonalMatrix& X,
+				 SymmetricMatrix& out) const
+{
+  if (sparsity == NULL || sparsity->Dense())
+    out << jacobian.t() * X * jacobian;
+  else
+    sparsity->WeightedJtJ(jacobian, X.Store(), out);
+}
+
+void LinearFwdModel::JtJ(SymmetricMatrix& out) const
+{
+  if (sparsity != NULL && !sparsity->Dense())
+    {
+      ColumnVector w(jacobian.Nrows());
+      w = 1;
+      sparsity->WeightedJtJ(jacobian, w.Store(), out);
+    }
+  else
+    out << jacobian.t() * jacobian;
+}
+
+ReturnMatrix LinearFwdModel::WeightedJtv(const DiagonalMatrix& X,
+					 const ColumnVector& v) const
+{
+  if (sparsity != NULL && !sparsity->Dense())
+    return sparsity->WeightedJtv(jacobian, X.Store(), v);
+
+  ColumnVector out = jacobian.t() * X * v;
+  out.Release();
+  return out;
+}
+
+// X*J, where X = diag(w), by scaling the rows of J
+static void RowScale(const Matrix& J, const ColumnVector& w, Matrix& XJ)
+{
+  XJ = J;
+  const int nTimes = J.Nrows(), nTheta = J.Ncols();
+  Real* xjp = XJ.Store();
+  const Real* wp = w.Store();
+  for (int t = 0; t < nTimes; t++)
+    {
+      Real* row = xjp + t*nTheta;
+      for (int p = 0; p < nTheta; p++)
+	row[p] *= wp[t];
+    }
+}
+
+void LinearFwdModel::WeightedJtJ(const ColumnVector& w,
+				 SymmetricMatrix& out) const
+{
+  if (sparsity != NULL && !sparsity->Dense())
+    {
+      sparsity->WeightedJtJ(jacobian, w.Store(), out);
+      return;
+    }
+
+  Matrix XJ;
+  RowScale(jacobian, w, XJ);
+  out << jacobian.t() * XJ;
+}
+
+ReturnMatrix LinearFwdModel::WeightedJtv(const ColumnVector& w,
+					 const ColumnVector& v) const
+{
+  if (sparsity != NULL && !sparsity->Dense())
+    return sparsity->WeightedJtv(jacobian, w.Store(), v);
+
+  Matrix XJ;
+  RowScale(jacobian, w, XJ);
+  ColumnVector out = XJ.t() * v;
+  out.Release();
+  return out;
+}
+
+// Pseudo-random numbers in [-1,1] for the probe points; deterministic so
+// that runs are repeatable.
+static double ProbeNoise(unsigned long& seed)
+{
+  seed = (seed * 1103515245UL + 12345UL) & 0x7fffffffUL;
+  return (seed >> 8) / double(0x7fffffUL) * 2.0 - 1.0;
+}
+
+static void MaskToRuns(const vector<bool>& mask, int col, int nrows, int ncols,
+		       vector<pair<int,int> >& runs)
+{
+  runs.clear();
+  for (int r = 1; r <= nrows; r++)
+    {
+      if (!mask[(r-1)*ncols + col]) continue;
+      if (!runs.empty() && runs.back().second == r-1)
+	runs.back().second = r;
+      else
+	runs.push_back(make_pair(r, r));
+    }
+}
+
+string JacobianSparsity::ParamName(int i) const
+{
+  if (i < int(names.size()))
+    return names[i];
+  return "parameter " + stringify(i+1);
+}
+
+void JacobianSparsity::Probe(const FwdModel* model, const ColumnVector& about)
+{
+  Tracer_Plus tr("JacobianSparsity::Probe");
+  const int np = about.Nrows();
+  const int nprobes = 5;
+  vector<bool> mask;
+  int good = 0;
+  unsigned long seed = 2011;
+
+  dense = true;
+  runs.clear();
+
+  // The centre itself, then points scattered about it so that a
+  // derivative that happens to vanish at one point is not mistaken for
+  // a structural zero.
+  for (int k = 0; k < nprobes; k++)
+    {
+      ColumnVector p = about;
+      if (k > 0)
+	for (int i = 1; i <= np; i++)
+	  p(i) = p(i) * (1 + 0.5*ProbeNoise(seed)) + 0.1*ProbeNoise(seed);
+
+      LinearizedFwdModel lin(model);
+      try 
+	{
+	  lin.ReCentre(p);
+	}
+      catch (const overflow_error& e)
+	{
+	  LOG << "JacobianSparsity::Probe: skipping probe " << k 
+	      << " (" << e.what() << ")\n";
+	  continue;
+	}
+
+      const Matrix J = lin.Jacobian();
+      if (good == 0)
+	{
+	  model->NameParams(names);
+	  nrows = J.Nrows();
+	  mask.assign(nrows*np, false);
+	}
+      const Real* jp = J.Store();
+      for (int e = 0; e < nrows*np; e++)
+	if (jp[e] != 0) mask[e] = true;
+      good++;
+    }
+
+  if (good == 0)
+    {
+      LOG << "JacobianSparsity::Probe: no usable probes, treating the "
+	  << "Jacobian as dense\n";
+      return;
+    }
+
+  int nonzero = 0;
+  for (int e = 0; e < nrows*np; e++)
+    if (mask[e]) nonzero++;
+  if (nonzero == nrows*np)
+    {
+      LOG << "JacobianSparsity::Probe: Jacobian is dense\n";
+      return;
+    }
+
+  dense = false;
+  runs.resize(np);
+  for (int i = 0; i < np; i++)
+    MaskToRuns(mask, i, nrows, np, runs[i]);
+  Report();
+}
+
+bool JacobianSparsity::Widen(const Matrix& J)
+{
+  if (dense) return false;
+  assert(J.Nrows() == nrows && J.Ncols() == int(runs.size()));
+
+  const int np = runs.size();
+  const Real* jp = J.Store();
+  const int before = widenings;
+  for (int i = 0; i < np; i++)
+    {
+      // Walk the rows alongside the runs looking for a stray non-zero
+      Runs& rc = runs[i];
+      size_t k = 0;
+      bool stray = false;
+      for (int r = 1; r <= nrows && !stray; r++)
+	{
+	  while (k < rc.size() && rc[k].second < r) k++;
+	  if (k < rc.size() && rc[k].first <= r) continue;
+	  stray = (jp[(r-1)*np + i] != 0);
+	}
+      if (!stray) continue;
+
+      if (rc.empty())
+	LOG << "JacobianSparsity: " << ParamName(i)
+	    << " affects the output after all\n";
+
+      vector<bool> mask(nrows*np, false);
+      for (k = 0; k < rc.size(); k++)
+	for (int r = rc[k].first; r <= rc[k].second; r++)
+	  mask[(r-1)*np + i] = true;
+      for (int r = 1; r <= nrows; r++)
+	if (jp[(r-1)*np + i] != 0) mask[(r-1)*np + i] = true;
+      MaskToRuns(mask, i, nrows, np, rc);
+      widenings++;
+    }
+  return widenings > before;
+}
+
+void JacobianSparsity::WeightedJtJ(const Matrix& J, const Real* xp,
+				   SymmetricMatrix& out) const
+{
+  const int np = runs.size();
+  const Real* jp = J.Store();
+  out.ReSize(np);
+
+  for (int a = 0; a < np; a++)
+    for (int b = 0; b <= a; b++)
+      {
+	// Sum over the rows where both columns may be non-zero
+	const Runs& ra = runs[a];
+	const Runs& rb = runs[b];
+	size_t ia = 0, ib = 0;
+	double sum = 0;
+	while (ia < ra.size() && ib < rb.size())
+	  {
+	    const int lo = max(ra[ia].first, rb[ib].first);
+	    const int hi = min(ra[ia].second, rb[ib].second);
+	    for (int r = lo; r <= hi; r++)
+	      sum += jp[(r-1)*np + a] * xp[r-1] * jp[(r-1)*np + b];
+	    if (ra[ia].second < rb[ib].second) ia++; else ib++;
+	  }
+	out(a+1, b+1) = sum;
+      }
+}
+
+ReturnMatrix JacobianSparsity::WeightedJtv(const Matrix& J, const Real* xp,
+					   const ColumnVector& v) const
+{
+  const int np = runs.size();
+  const Real* jp = J.Store();
+  ColumnVector out(np);
+
+  for (int a = 0; a < np; a++)
+    {
+      double sum = 0;
+      for (size_t k = 0; k < runs[a].size(); k++)
+	for (int r = runs[a][k].first; r <= runs[a][k].second; r++)
+	  sum += jp[(r-1)*np + a] * xp[r-1] * v(r);
+      out(a+1) = sum;
+    }
+
+  out.Release();
+  return out;
+}
+
+void JacobianSparsity::Report() const
+{
+  if (dense)
+    {
+      LOG << "Jacobian sparsity: dense\n";
+      return;
+    }
+
+  int nonzero = 0, unused = 0;
+  for (size_t i = 0; i < runs.size(); i++)
+    {
+      if (runs[i].empty()) unused++;
+      for (size_t k = 0; k < runs[i].size(); k++)
+	nonzero += runs[i][k].second - runs[i][k].first + 1;
+    }
+  LOG << "Jacobian sparsity: " << nonzero << " of " << nrows*runs.size()
+      << " entries may be non-zero, " << unused << " unused parameter(s), "
+      << "pattern widened " << widenings << " time(s)\n";
+  if (unused > 0)
+    {
+      LOG << "  Unused (only differentiated on the first linearisation of"
+	  << " each voxel):";
+      for (size_t i = 0; i < runs.size(); i++)
+	if (runs[i].empty())
+	  LOG << " " << ParamName(i);
+      LOG << endl;
+    }
 }
 
 void LinearFwdModel::DumpParameters(const ColumnVector& vec,
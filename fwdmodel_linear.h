@@ -69,6 +69,53 @@
 #pragma once
 
 #include "fwdmodel.h"
+#include <vector>
+#include <utility>
+
+// Which entries of a model's Jacobian are exactly zero.  Each column
+// (parameter) keeps a sorted list of [first,last] runs of output rows
+// that may be non-zero; everything outside the runs is treated as
+// structurally zero.  The pattern is found numerically by Probe() and
+// only ever grows afterwards (Widen), so products formed with it agree
+// with the dense ones for every Jacobian it has been shown.  Columns it
+// marks as unused are skipped by LinearizedFwdModel except on each
+// object's first linearisation, every few after that and the one after
+// the pattern widens.  Those are complete so that a dependence the probes
+// missed, or one that only appears as the parameters move, still turns up.
+class JacobianSparsity {
+public:
+  JacobianSparsity() : nrows(0), dense(true), widenings(0) { return; }
+
+  void Probe(const FwdModel* model, const ColumnVector& about);
+  // Differentiate model about a few points around 'about' and record
+  // the entries that were zero in all of them
+
+  bool Dense() const { return dense; }
+  bool ZeroColumn(int i) const { return !dense && runs[i-1].empty(); }
+  // Parameter i never affects the output (1-based)
+
+  bool Widen(const Matrix& J);
+  // Add any non-zero entries of J that lie outside the pattern, returning
+  // true if there were any.  Logs any parameter that turns out not to be
+  // unused after all.
+
+  void WeightedJtJ(const Matrix& J, const Real* w, SymmetricMatrix& out) const;
+  ReturnMatrix WeightedJtv(const Matrix& J, const Real* w,
+			   const ColumnVector& v) const;
+  // J'*diag(w)*J and J'*diag(w)*v, visiting only the rows in the pattern
+
+  void Report() const;
+  // Log the density of the pattern and the parameters it treats as unused
+
+private:
+  typedef vector<pair<int,int> > Runs;
+  vector<Runs> runs;
+  vector<string> names; // parameter names, for the log
+  string ParamName(int i) const; // 0-based
+  int nrows;
+  bool dense;
+  int widenings;
+};
 
 class LinearFwdModel : public FwdModel {
  public:
@@ -87,7 +134,7 @@ class LinearFwdModel : public FwdModel {
   LinearFwdModel(const Matrix& jac, 
 		 const ColumnVector& ctr, 
 		 const ColumnVector& off) 
-    : jacobian(jac), centre(ctr), offset(off) 
+    : jacobian(jac), centre(ctr), offset(off), sparsity(NULL)
     { assert(jac.Nrows() == ctr.Ncols()); assert(jac.Ncols() == off.Ncols()); }
     
   // Upgrading to a full externally-accessible model type
@@ -96,13 +143,25 @@ class LinearFwdModel : public FwdModel {
   static void ModelUsage();
   virtual void HardcodedInitialDists(MVNDist& prior, MVNDist& posterior) const;
 
+  void WeightedJtJ(const DiagonalMatrix& X, SymmetricMatrix& out) const;
+  ReturnMatrix WeightedJtv(const DiagonalMatrix& X, const ColumnVector& v) const;
+  void WeightedJtJ(const ColumnVector& w, SymmetricMatrix& out) const;
+  ReturnMatrix WeightedJtv(const ColumnVector& w, const ColumnVector& v) const;
+  // J'*X*J and J'*X*v, skipping structurally zero blocks of J if a
+  // sparsity pattern is attached.  Without one, the DiagonalMatrix forms
+  // are the plain NEWMAT products and the weight vector forms scale the
+  // rows of J instead.
+  void JtJ(SymmetricMatrix& out) const;
+  // J'*J, likewise
+
  protected:
-  LinearFwdModel() { return; } // Leave uninitialized; derived classes only
+  LinearFwdModel() : sparsity(NULL) { return; } // Leave uninitialized; derived classes only
 
   Matrix jacobian;     // J (tranposed?)
   ColumnVector centre; // m
   ColumnVector offset; // g(m)
     // The amount to effectively subtract from Y is g(m)-J*m
+  JacobianSparsity* sparsity; // NULL: treat J as dense
 };
 
 class LinearizedFwdModel : public LinearFwdModel {
@@ -115,24 +174,50 @@ public:
   using FwdModel::ModelVersion; // Tell the compiler we want both ours and the base version
   string ModelVersion() { assert(fcn != NULL); return fcn->ModelVersion(); }
 
-  // Constructor (leaves centre, offset and jacobian empty)
-  LinearizedFwdModel(const FwdModel* model) : fcn(model) { return; }
+  // Constructor (leaves centre, offset and jacobian empty).  If a
+  // sparsity pattern is given, UpdateJacobian skips parameters it marks
+  // as unused (apart from the first time, every fullJacobianInterval 
+  // times and just after a widening) and widens it if a new non-zero 
+  // turns up.
+  LinearizedFwdModel(const FwdModel* model, JacobianSparsity* sp = NULL)
+    : fcn(model), evaluations(0), jacobianUpdates(0), fullJacobian(true) 
+    { sparsity = sp; }
   
   // Copy constructor (needed for using vector<LinearizedFwdModel>)
   // NOTE: This is a reference, not a pointer... and it *copies* the
   // given LinearizedFwdModel, rather than using it as its nonlinear model!
   LinearizedFwdModel(const LinearizedFwdModel& from) 
-    : LinearFwdModel(from), fcn(from.fcn) { return; }
+    : LinearFwdModel(from), fcn(from.fcn), evaluations(from.evaluations),
+      jacobianUpdates(from.jacobianUpdates), fullJacobian(from.fullJacobian)
+    { return; }
 
   void ReCentre(const ColumnVector& about);
   // centre=about; offset=fcn(about); 
   // jacobian = numerical differentiation about centre
 
+  void MoveCentre(const ColumnVector& about);
+  // centre=about; offset=fcn(about); jacobian is left alone.
+  // A single model evaluation, e.g. to try out a step.
+  void UpdateJacobian();
+  // jacobian = numerical differentiation about the current centre.
+  // ReCentre(x) is the same as MoveCentre(x) followed by UpdateJacobian().
+
+  void CopyLinearisation(const LinearizedFwdModel& from)
+    { centre = from.centre; offset = from.offset; jacobian = from.jacobian; }
+  // Restore a saved centre/offset/jacobian without any model evaluations
+
+  int Evaluations() const { return evaluations; }
+  // Number of calls to fcn->Evaluate made by this object so far
+
   virtual void HardcodedInitialDists(MVNDist& prior, MVNDist& posterior) const
     { assert(fcn); fcn->HardcodedInitialDists(prior, posterior); }
 
   
 private:
   const FwdModel* fcn;  
+  int evaluations;
+  int jacobianUpdates; // numerical UpdateJacobians so far
+  bool fullJacobian; // next UpdateJacobian differentiates every parameter
+  static const int fullJacobianInterval = 5;
 };
 
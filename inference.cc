@@ -68,6 +68,9 @@
 
 #include "inference.h"
 #include "newimage/newimageall.h"
+#include "niftiwriter.h"
+#include "mvnfile.h"
+#include "posteriorsamples.h"
  
 using namespace NEWIMAGE;
 using namespace std;
@@ -87,8 +90,7 @@ void InferenceTechnique::Setup(ArgsType& args)
 //  noise->LoadPrior(args.ReadWithDefault("noise-prior","hardcoded"));
 //  noise->Dump("  ");
 
-  saveModelFit = args.ReadBool("save-model-fit");
-  saveResiduals = args.ReadBool("save-residuals");
+  ReadOutputOptions(args);
 
   // Motion correction related setup
   Nmcstep = convertTo<int>(args.ReadWithDefault("mcsteps","0")); //by default no motion correction
@@ -96,7 +98,525 @@ void InferenceTechnique::Setup(ArgsType& args)
 
 
 
-void InferenceTechnique::SaveResults(const DataSet& data) const
+// Parse a list like "float32,mvn:float64" into settings by product, with
+// the default (if any) under ""
+static map<string,string> ParseProductSettings(const string& option, 
+                                               const string& spec)
+{
+  map<string,string> settings;
+  for (size_t start = 0; start < spec.size(); )
+    {
+      size_t end = spec.find(',', start);
+      if (end == string::npos) end = spec.size();
+      const string item = spec.substr(start, end - start);
+      const size_t colon = item.find(':');
+      string product, setting = item;
+      if (colon != string::npos)
+        {
+          product = item.substr(0, colon);
+          setting = item.substr(colon + 1);
+          if (product != "mvn" && product != "mean" && product != "std" 
+              && product != "zstat" && product != "freeenergy" && product != "noise"
+              && product != "fit" && product != "residuals" && product != "pct")
+            throw Invalid_option("Unrecognized output in --" + option + ": '" + product + "'");
+        }
+      if (settings.count(product))
+        throw Invalid_option("--" + option + " sets " 
+          + (product.empty() ? string("the default") : product) + " twice");
+      settings[product] = setting;
+      start = end + 1;
+    }
+  return settings;
+}
+
+void InferenceTechnique::ReadOutputOptions(ArgsType& args)
+{
+  Tracer_Plus tr("InferenceTechnique::ReadOutputOptions");
+
+  const bool saveModelFit = args.ReadBool("save-model-fit");
+  const bool saveResiduals = args.ReadBool("save-residuals");
+
+  // What to write: by default, what has always been written
+  string products = args.ReadWithDefault("outputs","mvn,mean,zstat,freeenergy,noise");
+  outputs.clear();
+  for (size_t start = 0; start <= products.size(); )
+    {
+      size_t end = products.find(',', start);
+      if (end == string::npos) end = products.size();
+      const string product = products.substr(start, end - start);
+      if (product != "mvn" && product != "mean" && product != "std" 
+          && product != "zstat" && product != "freeenergy" && product != "noise"
+          && product != "fit" && product != "residuals")
+        throw Invalid_option("Unrecognized output in --outputs: '" + product + "'");
+      outputs.insert(product);
+      start = end + 1;
+    }
+  if (saveModelFit) outputs.insert("fit");
+  if (saveResiduals) outputs.insert("residuals");
+
+  outputThreads = convertTo<int>(args.ReadWithDefault("output-threads","4"));
+  if (outputThreads < 1)
+    throw Invalid_option("--output-threads must be at least 1");
+
+  string format = args.ReadWithDefault("mvn-format","nifti");
+  if (format == "nifti")
+    mvnBinary = false;
+  else if (format == "mvn")
+    mvnBinary = true;
+  else
+    throw Invalid_option("Unrecognized --mvn-format: " + format);
+
+  nSamples = convertTo<int>(args.ReadWithDefault("save-samples","0"));
+  if (nSamples < 0)
+    throw Invalid_option("--save-samples can't be negative");
+  samplesSeed = convertTo<int>(args.ReadWithDefault("samples-seed","1"));
+  string pcts = args.ReadWithDefault("sample-percentiles","2.5,50,97.5");
+  samplePercentiles.clear();
+  for (size_t start = 0; start < pcts.size(); )
+    {
+      size_t end = pcts.find(',', start);
+      if (end == string::npos) end = pcts.size();
+      const double pct = convertTo<double>(pcts.substr(start, end - start));
+      if (pct < 0 || pct > 100)
+        throw Invalid_option("Percentiles must be between 0 and 100");
+      samplePercentiles.push_back(pct);
+      start = end + 1;
+    }
+
+  // Parse these now so that mistakes show up before the run, not after
+  const string derivedFile = args.ReadWithDefault("derived-params","");
+  delete derived;
+  derived = NULL;
+  if (!derivedFile.empty())
+    {
+      vector<string> paramNames;
+      model->NameParams(paramNames);
+      derived = new DerivedParams(derivedFile, paramNames);
+    }
+
+  outputAsync = args.ReadBool("output-async");
+
+  // How each product's files are stored.  Both options take a default
+  // and/or product:setting pairs, e.g. --output-dtype=float32,mvn:float64
+  outputBits.clear();
+  map<string,string> dtypes = ParseProductSettings("output-dtype",
+    args.ReadWithDefault("output-dtype",""));
+  for (map<string,string>::const_iterator it = dtypes.begin(); it != dtypes.end(); it++)
+    {
+      if (it->second == "float16") outputBits[it->first] = 16;
+      else if (it->second == "float32") outputBits[it->first] = 32;
+      else if (it->second == "float64") outputBits[it->first] = 64;
+      else throw Invalid_option("Unrecognized type in --output-dtype: '" + it->second + "'");
+    }
+  // There's no half-precision type in NIFTI-1, so float16 is only for the
+  // binary .mvn format (which already stores correlations that way)
+  for (map<string,int>::const_iterator it = outputBits.begin(); it != outputBits.end(); it++)
+    if (it->second == 16 && !(it->first == "mvn" && mvnBinary))
+      throw Invalid_option("--output-dtype=float16 is only available as mvn:float16 with --mvn-format=mvn");
+  if (mvnBinary && outputBits.count("mvn") && outputBits["mvn"] == 64)
+    throw Invalid_option("The .mvn format stores float32 or float16, not float64");
+
+  outputLevels.clear();
+  map<string,string> levels = ParseProductSettings("output-compression",
+    args.ReadWithDefault("output-compression",""));
+  for (map<string,string>::const_iterator it = levels.begin(); it != levels.end(); it++)
+    {
+      if (it->second == "none") outputLevels[it->first] = 0;
+      else if (it->second == "fast") outputLevels[it->first] = 1;
+      else if (it->second == "best") outputLevels[it->first] = 9;
+      else throw Invalid_option("Unrecognized setting in --output-compression: '" + it->second + "'");
+    }
+
+  // For results that are about to be read straight back in: skip gzip
+  // altogether, whatever $FSLOUTPUTTYPE says
+  if (args.ReadBool("output-uncompressed-temp"))
+    {
+      if (!outputLevels.empty())
+        throw Invalid_option("--output-uncompressed-temp can't be combined with --output-compression");
+      outputLevels[""] = 0;
+    }
+
+  // Masked files hold just the voxels in the mask, which for a thin slab
+  // or an ROI is a small fraction of the grid; fabber_expand restores NIFTI
+  outputMasked.clear();
+  map<string,string> layouts = ParseProductSettings("output-layout",
+    args.ReadWithDefault("output-layout",""));
+  for (map<string,string>::const_iterator it = layouts.begin(); it != layouts.end(); it++)
+    {
+      if (it->second == "nifti") outputMasked[it->first] = false;
+      else if (it->second == "masked") outputMasked[it->first] = true;
+      else throw Invalid_option("Unrecognized layout in --output-layout: '" + it->second + "'");
+    }
+  if (mvnBinary && layouts.count("mvn"))
+    throw Invalid_option("--output-layout doesn't apply to mvn with --mvn-format=mvn (which is already masked)");
+
+  mvnPrecision = convertTo<int>(args.ReadWithDefault("mvn-precision","32"));
+  if (mvnPrecision != 16 && mvnPrecision != 32)
+    throw Invalid_option("--mvn-precision must be 16 or 32");
+  if (mvnPrecision != 32 && !mvnBinary)
+    throw Invalid_option("--mvn-precision=16 needs --mvn-format=mvn");
+  if (outputBits.count("mvn") && outputBits["mvn"] == 16)
+    mvnPrecision = 16; // same thing
+}
+
+#ifndef __FABBER_LIBRARYONLY
+// Helpers for building up the NIFTI output jobs in SaveResults
+static NiftiWriter::Format ProductFormat(const map<string,int>& bits, 
+                                         const map<string,int>& levels,
+                                         const map<string,bool>& masked,
+                                         const string& product)
+{
+  NiftiWriter::Format format;
+  map<string,int>::const_iterator it = bits.find(product);
+  if (it == bits.end())
+    it = bits.find("");
+  if (it != bits.end() && it->second == 64)
+    format.datatype = DT_FLOAT64;
+  it = levels.find(product);
+  if (it == levels.end())
+    it = levels.find("");
+  if (it != levels.end())
+    format.level = it->second;
+  map<string,bool>::const_iterator m = masked.find(product);
+  if (m == masked.end())
+    m = masked.find("");
+  if (m != masked.end())
+    format.masked = m->second;
+  return format;
+}
+
+static int NewJob(vector<NiftiWriter::Job>& jobs, const NiftiWriter::Format& format,
+                  const string& filename, int nVoxels, int nFrames = 1, 
+                  int intent = NIFTI_INTENT_NONE)
+{
+  // Returns the new job's index, since references don't survive push_back
+  jobs.push_back(NiftiWriter::Job());
+  NiftiWriter::Job& job = jobs.back();
+  job.filename = filename;
+  job.nFrames = nFrames;
+  job.intent = intent;
+  job.format = format;
+  job.data.assign(nVoxels * nFrames, 0.0f);
+  return jobs.size() - 1;
+}
+
+// Write the model fit and/or residuals a block of frames at a time, 
+// so memory use doesn't grow with the length of the time series
+static void StreamFits(const NiftiWriter& writer, const VoxelSpool& fits, 
+                       const Matrix& datamtx, const string& outputDir,
+                       bool saveFit, bool saveResiduals, 
+                       const NiftiWriter::Format& fitFormat,
+                       const NiftiWriter::Format& resFormat)
+{
+  Tracer_Plus tr("StreamFits");
+  const int nVoxels = fits.NumVoxels();
+  const int nTimes = fits.Length();
+  const Real* y = datamtx.Store(); // row-major, so y[t*nVoxels + v]
+  assert(datamtx.Nrows() == nTimes && datamtx.Ncols() == nVoxels);
+
+  // The ranges go in the headers, so they're needed first
+  float fitLo = 0, fitHi = 0, resLo = 0, resHi = 0;
+  vector<float> f;
+  for (int v = 0; v < nVoxels; v++)
+    {
+      fits.Get(v+1, f);
+      for (int t = 0; t < nTimes; t++)
+        {
+          const float r = y[size_t(t)*nVoxels + v] - f[t];
+          if (v == 0 && t == 0)
+            { fitLo = fitHi = f[t]; resLo = resHi = r; }
+          fitLo = min(fitLo, f[t]); fitHi = max(fitHi, f[t]);
+          resLo = min(resLo, r); resHi = max(resHi, r);
+        }
+    }
+
+  NiftiWriter::FrameStream* fitOut = saveFit ? new NiftiWriter::FrameStream(
+    writer, outputDir + "/modelfit", nTimes, NIFTI_INTENT_NONE, fitLo, fitHi, 
+    fitFormat) : NULL;
+  NiftiWriter::FrameStream* resOut = saveResiduals ? new NiftiWriter::FrameStream(
+    writer, outputDir + "/residuals", nTimes, NIFTI_INTENT_NONE, resLo, resHi, 
+    resFormat) : NULL;
+
+  const size_t blockBytes = 32 << 20;
+  const int blockFrames = max(1, int(blockBytes / (sizeof(float) * max(nVoxels, 1))));
+  vector<float> block;
+  for (int t0 = 0; t0 < nTimes; t0 += blockFrames)
+    {
+      const int n = min(blockFrames, nTimes - t0);
+      fits.GetFrames(t0, n, block);
+      if (fitOut != NULL)
+        fitOut->Put(&block[0], n);
+      if (resOut != NULL)
+        {
+          for (size_t i = 0; i < block.size(); i++)
+            block[i] = y[size_t(t0)*nVoxels + i] - block[i];
+          resOut->Put(&block[0], n);
+        }
+    }
+  if (fitOut != NULL) fitOut->Close();
+  if (resOut != NULL) resOut->Close();
+  delete fitOut;
+  delete resOut;
+}
+
+// Same layout as MVNDist::Save: the lower triangle of the covariance row
+// by row (as NIFTI_INTENT_SYMMATRIX specifies), then the means, then a 1.
+static void PutMVN(NiftiWriter::Job& job, int vox, 
+                   const ColumnVector& means, const SymmetricMatrix& cov)
+{
+  const int nVoxels = job.data.size() / job.nFrames;
+  int frame = 0;
+  for (int r = 1; r <= means.Nrows(); r++)
+    for (int c = 1; c <= r; c++)
+      job.data[(frame++)*nVoxels + vox] = cov(r,c);
+  for (int r = 1; r <= means.Nrows(); r++)
+    job.data[(frame++)*nVoxels + vox] = means(r);
+  job.data[frame*nVoxels + vox] = 1;
+}
+
+// Derived parameters are evaluated this many voxels at a time, and the 
+// background writer is told about finished voxels in blocks of the same size
+static const int mapBlock = 256;
+
+// The maps made from each voxel's final MVN, filled in voxel by voxel
+struct InferenceTechnique::VoxelMaps {
+  VoxelMaps(const volume<float>& mask, int seed)
+    : writer(mask), mvnJob(-1), freeEnergyJob(-1), needCov(false), 
+      samplesOut(NULL), rng(seed), filled(0), background(NULL) { return; }
+  ~VoxelMaps() { delete background; delete samplesOut; }
+
+  NiftiWriter writer;
+  vector<NiftiWriter::Job> jobs; // mustn't move once started
+  int nParams, nNoise, nSym;
+  vector<int> meanJob, stdJob, zstatJob, noiseJob, pctJob;
+  vector<int> derivedMeanJob, derivedStdJob;
+  int mvnJob, freeEnergyJob;
+  bool needCov; // only invert the precisions if something needs the covariance
+  SampleFileWriter* samplesOut;
+  GaussianRandom rng;
+  vector<double> blockMeans, blockCov, blockValues, blockVars;
+  vector<double> sampleMeans, sampleChol, blockSamples; // voxel by voxel
+  int filled;   // voxels done so far
+  NiftiWriter::Background* background; // if --output-async
+};
+
+void InferenceTechnique::StartVoxelMaps(const DataSet& data)
+{
+  Tracer_Plus tr("InferenceTechnique::StartVoxelMaps");
+  assert(maps == NULL);
+
+  const int nVoxels = data.GetVoxelData().Ncols();
+  vector<string> paramNames, noiseNames;
+  model->NameParams(paramNames);
+  if (noise != NULL) // NLLS doesn't have one
+    noise->NameParams(noiseNames);
+  // The MVNs might not exist yet, in which case get their size from the
+  // noise model
+  int nAll = paramNames.size();
+  if (!resultMVNs.empty() && resultMVNs[0] != NULL)
+    nAll = resultMVNs[0]->means.Nrows();
+  else if (noise != NULL)
+    {
+      NoiseParams* params = noise->NewParams();
+      nAll += params->OutputAsMVN().GetSize();
+      delete params;
+    }
+
+  maps = new VoxelMaps(data.GetMask(), samplesSeed);
+  VoxelMaps& m = *maps;
+  const int nParams = m.nParams = paramNames.size();
+  const int nNoise = m.nNoise = noiseNames.size();
+  m.nSym = nAll*(nAll+1)/2 + nAll + 1;
+  const int nDerived = (derived != NULL) ? derived->Count() : 0;
+  vector<NiftiWriter::Job>& jobs = m.jobs;
+  const NiftiWriter::Format meanFormat = ProductFormat(outputBits, outputLevels, outputMasked, "mean");
+  const NiftiWriter::Format stdFormat = ProductFormat(outputBits, outputLevels, outputMasked, "std");
+  const NiftiWriter::Format zstatFormat = ProductFormat(outputBits, outputLevels, outputMasked, "zstat");
+  const NiftiWriter::Format noiseFormat = ProductFormat(outputBits, outputLevels, outputMasked, "noise");
+  const NiftiWriter::Format mvnFormat = ProductFormat(outputBits, outputLevels, outputMasked, "mvn");
+  const NiftiWriter::Format freeEnergyFormat = ProductFormat(outputBits, outputLevels, outputMasked, "freeenergy");
+  const NiftiWriter::Format pctFormat = ProductFormat(outputBits, outputLevels, outputMasked, "pct");
+
+  // Set up a job for each product that was asked for.  Reserve room for
+  // all of them so that adding jobs never has to copy the buffers.
+  jobs.reserve((3 + samplePercentiles.size())*nParams + nNoise + 2*nDerived + 2);
+  m.meanJob.assign(nParams, -1);
+  m.stdJob.assign(nParams, -1);
+  m.zstatJob.assign(nParams, -1);
+  for (int i = 0; i < nParams; i++)
+    {
+      if (WantOutput("mean"))
+        m.meanJob[i] = NewJob(jobs, meanFormat, outputDir + "/mean_" + paramNames[i], nVoxels);
+      if (WantOutput("std"))
+        m.stdJob[i] = NewJob(jobs, stdFormat, outputDir + "/std_" + paramNames[i], nVoxels);
+      if (WantOutput("zstat"))
+        m.zstatJob[i] = NewJob(jobs, zstatFormat, outputDir + "/zstat_" + paramNames[i], 
+                               nVoxels, 1, NIFTI_INTENT_ZSCORE);
+    }
+  // Noise parameters that the noise model wants mapped (e.g. one 
+  // precision per noise group) follow the model parameters in the MVN
+  m.noiseJob.assign(nNoise, -1);
+  for (int i = 0; i < nNoise; i++)
+    if (WantOutput("noise"))
+      m.noiseJob[i] = NewJob(jobs, noiseFormat, outputDir + "/mean_" + noiseNames[i], nVoxels);
+  if (WantOutput("mvn") && !mvnBinary) 
+    m.mvnJob = NewJob(jobs, mvnFormat, outputDir + "/finalMVN", nVoxels, 
+                      m.nSym, NIFTI_INTENT_SYMMATRIX);
+  if (WantOutput("freeenergy") && !resultFs.empty())
+    m.freeEnergyJob = NewJob(jobs, freeEnergyFormat, outputDir + "/freeEnergy", nVoxels);
+
+  // Posterior samples of the model parameters, and percentile maps 
+  // summarizing them
+  m.pctJob.assign(samplePercentiles.size() * nParams, -1);
+  if (nSamples > 0)
+    {
+      m.samplesOut = new SampleFileWriter(outputDir + "/posterior.samples", 
+                                          m.writer, paramNames, nSamples, samplesSeed);
+      m.sampleMeans.resize(nParams * mapBlock);
+      m.sampleChol.resize(nParams * nParams * mapBlock);
+      m.blockSamples.resize(size_t(nParams) * nSamples * mapBlock);
+      for (unsigned p = 0; p < samplePercentiles.size(); p++)
+        for (int i = 0; i < nParams; i++)
+          m.pctJob[p*nParams + i] = NewJob(jobs, pctFormat, outputDir + "/pct" 
+            + stringify(samplePercentiles[p]) + "_" + paramNames[i], nVoxels);
+    }
+
+  // Derived parameters (and their delta-method standard deviations) 
+  // are evaluated a block of voxels at a time
+  m.derivedMeanJob.resize(nDerived);
+  m.derivedStdJob.resize(nDerived);
+  if (nDerived > 0)
+    {
+      for (int d = 0; d < nDerived; d++)
+        {
+          m.derivedMeanJob[d] = NewJob(jobs, meanFormat, outputDir + "/mean_" + derived->Name(d), nVoxels);
+          m.derivedStdJob[d] = NewJob(jobs, stdFormat, outputDir + "/std_" + derived->Name(d), nVoxels);
+        }
+      m.blockMeans.resize(nParams * mapBlock);
+      m.blockCov.resize(nParams * nParams * mapBlock);
+      m.blockValues.resize(nDerived * mapBlock);
+      m.blockVars.resize(nDerived * mapBlock);
+    }
+
+  m.needCov = WantOutput("std") || WantOutput("zstat") 
+    || m.mvnJob >= 0 || m.samplesOut != NULL || nDerived > 0;
+}
+
+void InferenceTechnique::FillVoxelMaps(int upto)
+{
+  VoxelMaps& m = *maps;
+  vector<NiftiWriter::Job>& jobs = m.jobs;
+  const int nVoxels = m.writer.NumVoxels();
+  const int nParams = m.nParams;
+  const int nDerived = m.derivedMeanJob.size();
+  assert(upto <= nVoxels);
+
+  SymmetricMatrix cov;
+  for (int vox = m.filled; vox < upto; vox++)
+    {
+      const MVNDist& mvn = *resultMVNs.at(vox);
+      assert(m.nSym == mvn.means.Nrows()*(mvn.means.Nrows()+1)/2 + mvn.means.Nrows() + 1);
+      if (m.needCov)
+        cov = mvn.GetCovariance(); // only once per voxel
+      if (m.mvnJob >= 0)
+        PutMVN(jobs[m.mvnJob], vox, mvn.means, cov);
+      if (m.freeEnergyJob >= 0)
+        jobs[m.freeEnergyJob].data[vox] = resultFs.at(vox);
+      for (int i = 1; i <= nParams; i++)
+        {
+          if (m.meanJob[i-1] >= 0)
+            jobs[m.meanJob[i-1]].data[vox] = mvn.means(i);
+          if (m.stdJob[i-1] >= 0)
+            jobs[m.stdJob[i-1]].data[vox] = sqrt(cov(i,i));
+          if (m.zstatJob[i-1] >= 0)
+            jobs[m.zstatJob[i-1]].data[vox] = mvn.means(i) / sqrt(cov(i,i));
+        }
+      for (int i = 1; i <= m.nNoise; i++)
+        if (m.noiseJob[i-1] >= 0)
+          jobs[m.noiseJob[i-1]].data[vox] = mvn.means(nParams+i);
+
+      // Samples are drawn a block of voxels at a time, like the derived
+      // parameters
+      const int b = vox % mapBlock;
+      const bool blockDone = (b == mapBlock - 1 || vox == nVoxels - 1);
+      if (m.samplesOut != NULL)
+        {
+          for (int i = 0; i < nParams; i++)
+            m.sampleMeans[b*nParams + i] = mvn.means(i+1);
+          SampleFactor(cov.SymSubMatrix(1, nParams), &m.sampleChol[b*nParams*nParams]);
+          if (blockDone)
+            {
+              const int first = vox - b;
+              const size_t perVox = size_t(nParams) * nSamples;
+              DrawSampleBlock(nParams, b + 1, nSamples, &m.sampleMeans[0], 
+                              &m.sampleChol[0], m.rng, &m.blockSamples[0]);
+              m.samplesOut->Put(&m.blockSamples[0], b + 1);
+              vector<float> row(nSamples);
+              for (int v = 0; v <= b; v++)
+                for (int i = 0; i < nParams; i++)
+                  {
+                    const double* x = &m.blockSamples[v*perVox + i*nSamples];
+                    row.assign(x, x + nSamples);
+                    for (unsigned p = 0; p < samplePercentiles.size(); p++)
+                      jobs[m.pctJob[p*nParams + i]].data[first + v] = 
+                        Percentile(row, samplePercentiles[p]);
+                  }
+            }
+        }
+
+      if (nDerived > 0)
+        {
+          for (int i = 0; i < nParams; i++)
+            {
+              m.blockMeans[i*mapBlock + b] = mvn.means(i+1);
+              for (int j = 0; j < nParams; j++)
+                m.blockCov[(b*nParams + i)*nParams + j] = cov(i+1,j+1);
+            }
+          if (blockDone)
+            {
+              const int first = vox - b;
+              derived->Evaluate(&m.blockMeans[0], &m.blockCov[0], b + 1, mapBlock,
+                                &m.blockValues[0], &m.blockVars[0]);
+              for (int d = 0; d < nDerived; d++)
+                for (int v = 0; v <= b; v++)
+                  {
+                    jobs[m.derivedMeanJob[d]].data[first + v] = m.blockValues[d*mapBlock + v];
+                    jobs[m.derivedStdJob[d]].data[first + v] = sqrt(m.blockVars[d*mapBlock + v]);
+                  }
+            }
+        }
+    }
+  m.filled = max(m.filled, upto);
+
+  // Derived parameters and samples are only done for whole blocks
+  if (m.background != NULL)
+    m.background->VoxelsReady(m.filled == nVoxels ? nVoxels : m.filled - m.filled % mapBlock);
+}
+#endif // __FABBER_LIBRARYONLY
+
+void InferenceTechnique::StartBackgroundOutput(const DataSet& data)
+{
+#ifndef __FABBER_LIBRARYONLY
+  if (!outputAsync || EasyOptions::UsingMatrixIO())
+    return;
+  Tracer_Plus tr("InferenceTechnique::StartBackgroundOutput");
+  StartVoxelMaps(data);
+  LOG << "    Writing " << maps->jobs.size() << " files in the background using up to "
+      << outputThreads << " threads" << endl;
+  maps->background = new NiftiWriter::Background(maps->writer, maps->jobs, outputThreads);
+#endif // __FABBER_LIBRARYONLY
+}
+
+void InferenceTechnique::VoxelsDone(int n)
+{
+#ifndef __FABBER_LIBRARYONLY
+  if (maps != NULL && maps->background != NULL 
+      && (n % mapBlock == 0 || n == maps->writer.NumVoxels()))
+    FillVoxelMaps(n);
+#endif // __FABBER_LIBRARYONLY
+}
+
+void InferenceTechnique::SaveResults(const DataSet& data)
 {
   Tracer_Plus tr("InferenceTechnique::SaveResults");
     LOG << "    Preparing to save results..." << endl;
@@ -114,13 +634,19 @@ void InferenceTechnique::SaveResults(const DataSet& data) const
     const volume<float>& mask  = data.GetMask();
     int nVoxels = resultMVNs.size();
 
-    cout << "Saving!\n";
-    MVNDist::Save(resultMVNs, outputDir + "/finalMVN", mask);
+    // In NIFTI mode the per-voxel maps are collected during a single pass
+    // over the voxels (see FillVoxelMaps); anything else goes in here
+    vector<NiftiWriter::Job> jobs;
 
-    if (resultMVNsWithoutPrior.size() > 0)
+    cout << "Saving!\n";
+    if (EasyOptions::UsingMatrixIO() && WantOutput("mvn"))
       {
-	assert(resultMVNsWithoutPrior.size() == (unsigned)nVoxels);
-	MVNDist::Save(resultMVNsWithoutPrior, outputDir + "/finalMVNwithoutPrior", mask);
+        MVNDist::Save(resultMVNs, outputDir + "/finalMVN", mask);
+        if (resultMVNsWithoutPrior.size() > 0)
+          {
+	    assert(resultMVNsWithoutPrior.size() == (unsigned)nVoxels);
+	    MVNDist::Save(resultMVNsWithoutPrior, outputDir + "/finalMVNwithoutPrior", mask);
+          }
       }
 
     /* Some validation code -- checked, Save then Load 
@@ -174,33 +700,44 @@ void InferenceTechnique::SaveResults(const DataSet& data) const
 
     if (!EasyOptions::UsingMatrixIO())
     {
-      for (unsigned i = 1; i <= paramNames.size(); i++)
-      {
-        Matrix paramMean, paramZstat;
-    	paramMean.ReSize(1, nVoxels);
-	paramZstat.ReSize(1, nVoxels);
+      // Finish the per-voxel maps.  If DoCalculations handed voxels over
+      // as it went, most of these have already been written.
+      if (maps == NULL)
+        StartVoxelMaps(data);
+      LOG << "    Extracting per-parameter maps..." << endl;
+      FillVoxelMaps(nVoxels);
+      if (maps->samplesOut != NULL)
+        {
+          maps->samplesOut->Close();
+          delete maps->samplesOut;
+          maps->samplesOut = NULL;
+        }
 
-        for (int vox = 1; vox <= nVoxels; vox++)
+      if (WantOutput("mvn") && mvnBinary)
         {
-	    paramMean(1,vox) = resultMVNs[vox-1]->means(i);
-            paramZstat(1,vox) =
-              paramMean(1,vox) / 
-              sqrt(resultMVNs[vox-1]->GetCovariance()(i,i));
+          vector<string> names(paramNames), noiseNames;
+          if (noise != NULL) // NLLS doesn't have one
+            noise->NameParams(noiseNames);
+          names.insert(names.end(), noiseNames.begin(), noiseNames.end());
+          const int nAll = resultMVNs.at(0)->means.Nrows();
+          LOG << "    Writing finalMVN.mvn..." << endl;
+          MVNFile::Save(resultMVNs, outputDir + "/finalMVN.mvn", mask, 
+                        names, nAll - maps->nParams, mvnPrecision);
+          if (resultMVNsWithoutPrior.size() > 0)
+            MVNFile::Save(resultMVNsWithoutPrior, outputDir + "/finalMVNwithoutPrior.mvn", 
+                          mask, names, nAll - maps->nParams, mvnPrecision);
         }
-    	LOG << "    Writing means..." << endl;
-
-	volume4D<float> output(mask.xsize(),mask.ysize(),mask.zsize(),1);
-	output.setmatrix(paramMean,mask);
-	output.set_intent(NIFTI_INTENT_NONE,0,0,0);
-	output.setDisplayMaximumMinimum(output.max(),output.min());
-	save_volume4D(output,outputDir + "/mean_" + paramNames.at(i-1));
-
-	output.setmatrix(paramZstat,mask);
-        output.set_intent(NIFTI_INTENT_ZSCORE,0,0,0);
-	output.setDisplayMaximumMinimum(output.max(),output.min());
-	save_volume4D(output,outputDir + "/zstat_" + paramNames.at(i-1));
-      }
-    }        
+      else if (WantOutput("mvn") && resultMVNsWithoutPrior.size() > 0)
+        {
+	  assert(resultMVNsWithoutPrior.size() == (unsigned)nVoxels);
+          const int j = NewJob(jobs, ProductFormat(outputBits, outputLevels, outputMasked, "mvn"),
+                               outputDir + "/finalMVNwithoutPrior", nVoxels, 
+                               maps->nSym, NIFTI_INTENT_SYMMATRIX);
+          for (int vox = 0; vox < nVoxels; vox++)
+            PutMVN(jobs[j], vox, resultMVNsWithoutPrior[vox]->means,
+                   resultMVNsWithoutPrior[vox]->GetCovariance());
+        }
+    }
     else
     {
 	Matrix& paramMean = EasyOptions::OutMatrix("<means>"); // Creates matrix
@@ -235,91 +772,96 @@ void InferenceTechnique::SaveResults(const DataSet& data) const
     }
 
     // Save the Free Energy estimates
-    if (!resultFs.empty())
+    if (WantOutput("freeenergy") && !resultFs.empty())
       {
 	assert((int)resultFs.size() == nVoxels);
-	Matrix freeEnergy;
-	freeEnergy.ReSize(1, nVoxels);
-	for (int vox = 1; vox <= nVoxels; vox++)
-	  {
-	    freeEnergy(1,vox) = resultFs.at(vox-1);
-	  }
-	
 	if (EasyOptions::UsingMatrixIO())
 	{
+	  Matrix freeEnergy;
+	  freeEnergy.ReSize(1, nVoxels);
+	  for (int vox = 1; vox <= nVoxels; vox++)
+	    {
+	      freeEnergy(1,vox) = resultFs.at(vox-1);
+	    }
 	  EasyOptions::OutMatrix("<freeEnergy>") = freeEnergy;
         }
-        else
-        {
-	volume4D<float> output(mask.xsize(),mask.ysize(),mask.zsize(),1);
-	output.setmatrix(freeEnergy,mask);
-	output.set_intent(NIFTI_INTENT_NONE,0,0,0);
-	output.setDisplayMaximumMinimum(output.max(),output.min());
-	save_volume4D(output,outputDir + "/freeEnergy");
-        }
+        // Otherwise it's one of the voxel maps
       }
-    else
+    else if (WantOutput("freeenergy"))
       {
 	LOG_ERR("Free energy wasn't recorded, so no freeEnergy.nii.gz created.\n");
       }
     
-    if (saveModelFit || saveResiduals)
+    if (WantOutput("fit") || WantOutput("residuals"))
       {
         LOG << "    Writing model fit/residuals..." << endl;
         // Produce the model fit and residual volumeserieses
-	
-        Matrix modelFit, residuals, datamtx, coords;
-        modelFit.ReSize(model->NumOutputs(), nVoxels);
-	datamtx = data.GetVoxelData(); // it is just possible that the model needs the data in its calculations
-	coords = data.GetVoxelCoords();
-	ColumnVector tmp;
-        for (int vox = 1; vox <= nVoxels; vox++)
-        {
-	  // pass in stuff that the model might need
-	  ColumnVector y = datamtx.Column(vox);
-	  ColumnVector vcoords = coords.Column(vox);
-	  model->pass_in_data( y );
-	  model->pass_in_coords(vcoords);
-
-	  // do the evaluation
-	  model->Evaluate(resultMVNs.at(vox-1)->means.Rows(1,model->NumParams()), tmp);
-	  modelFit.Column(vox) = tmp;
-        }
+        const Matrix& datamtx = data.GetVoxelData();
 
-	volume4D<float> output(mask.xsize(),mask.ysize(),mask.zsize(),model->NumOutputs());
-	
-        if (saveResiduals)
-        {
-	  residuals = datamtx - modelFit;
-
-         if (EasyOptions::UsingMatrixIO())
-         {
-          EasyOptions::OutMatrix("<residuals>") = residuals;
-         }
-	 else
-	 { 
-	  output.setmatrix(residuals,mask);
-	  output.set_intent(NIFTI_INTENT_NONE,0,0,0);
-	  output.setDisplayMaximumMinimum(output.max(),output.min());
-	  save_volume4D(output,outputDir + "/residuals");
-	 }
-        }
-        if (saveModelFit)
-        {
-	 if (EasyOptions::UsingMatrixIO())
-	 {
-	  EasyOptions::OutMatrix("<modelfit>") = modelFit;
-	 }
-	 else
-	 {
- 	  output.setmatrix(modelFit,mask);
-	  output.set_intent(NIFTI_INTENT_NONE,0,0,0);
-	  output.setDisplayMaximumMinimum(output.max(),output.min());
-	  save_volume4D(output,outputDir + "/modelfit");
-	 }
-        }
+        // Use the predictions the inference technique kept, if it did, or 
+        // else evaluate the model now.  Either way they're kept on disk.
+        VoxelSpool* evaluated = NULL;
+        if (resultFits != NULL && resultFits->NumVoxels() == nVoxels)
+          LOG << "    Using the model predictions from the final iterations" << endl;
+        else
+          {
+            evaluated = new VoxelSpool(model->NumOutputs(), nVoxels);
+            const Matrix& coords = data.GetVoxelCoords();
+            ColumnVector tmp;
+            for (int vox = 1; vox <= nVoxels; vox++)
+              {
+                // pass in stuff that the model might need
+                ColumnVector y = datamtx.Column(vox);
+                ColumnVector vcoords = coords.Column(vox);
+                model->pass_in_data( y );
+                model->pass_in_coords(vcoords);
+
+                // do the evaluation
+                model->Evaluate(resultMVNs.at(vox-1)->means.Rows(1,model->NumParams()), tmp);
+                evaluated->Put(vox, tmp);
+              }
+          }
+        const VoxelSpool& fits = (evaluated != NULL) ? *evaluated : *resultFits;
+
+        if (EasyOptions::UsingMatrixIO())
+          {
+            // Matrix outputs have to be built whole
+            Matrix modelFit(fits.Length(), nVoxels);
+            vector<float> f;
+            for (int vox = 1; vox <= nVoxels; vox++)
+              {
+                fits.Get(vox, f);
+                for (int t = 1; t <= fits.Length(); t++)
+                  modelFit(t,vox) = f[t-1];
+              }
+            if (WantOutput("residuals"))
+              EasyOptions::OutMatrix("<residuals>") = datamtx - modelFit;
+            if (WantOutput("fit"))
+              EasyOptions::OutMatrix("<modelfit>") = modelFit;
+          }
+        else
+          {
+            StreamFits(NiftiWriter(mask), fits, datamtx, outputDir, 
+                       WantOutput("fit"), WantOutput("residuals"),
+                       ProductFormat(outputBits, outputLevels, outputMasked, "fit"),
+                       ProductFormat(outputBits, outputLevels, outputMasked, "residuals"));
+          }
+        delete evaluated;
+      }
 
-    }
+    if (maps != NULL && maps->background != NULL)
+      {
+        LOG << "    Finishing the files being written in the background..." << endl;
+        maps->background->Finish();
+      }
+    else if (maps != NULL)
+      {
+        LOG << "    Writing " << maps->jobs.size() << " files using up to " 
+            << outputThreads << " threads..." << endl;
+        maps->writer.WriteInParallel(maps->jobs, outputThreads);
+      }
+    if (!jobs.empty())
+      NiftiWriter(mask).WriteInParallel(jobs, outputThreads);
 
 #endif // __FABBER_LIBRARYONLY
     LOG << "    Done writing results." << endl;
@@ -471,6 +1013,11 @@ InferenceTechnique::~InferenceTechnique()
 { 
   delete model;
   delete noise;
+  delete resultFits;
+  delete derived;
+#ifndef __FABBER_LIBRARYONLY
+  delete maps;
+#endif // __FABBER_LIBRARYONLY
   while (!resultMVNs.empty())
     {
       delete resultMVNs.back();
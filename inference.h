@@ -73,6 +73,7 @@
 
 #pragma once
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 #include "fwdmodel.h"
@@ -80,6 +81,8 @@
 #include "easylog.h"
 #include "easyoptions.h"
 #include "dataset.h"
+#include "voxelspool.h"
+#include "derivedparams.h"
 #ifdef __FABBER_MOTION
  #include "Update_deformation.h"
 #endif //__FABBER_MOTION
@@ -92,24 +95,55 @@ class InferenceTechnique {
     // as determined by the name given in "method".
     
  public:
-  InferenceTechnique() : model(NULL), noise(NULL) { return; }
+  InferenceTechnique() : model(NULL), noise(NULL), outputThreads(1),
+    mvnBinary(false), mvnPrecision(32), nSamples(0), samplesSeed(1), 
+    derived(NULL), outputAsync(false), resultFits(NULL), maps(NULL) { return; }
   virtual void Setup(ArgsType& args);
   virtual void SetOutputFilenames(const string& output)
     { outputDir = output; }
   virtual void DoCalculations(const DataSet& data) = 0;
-  virtual void SaveResults(const DataSet& data) const;
+  virtual void SaveResults(const DataSet& data);
   virtual ~InferenceTechnique();
 
  protected:
   FwdModel* model;
   NoiseModel* noise;
   string outputDir;
-  bool saveModelFit;
-  bool saveResiduals;
+  int outputThreads; // for writing the NIFTI outputs
+  bool mvnBinary;    // save finalMVN as a .mvn file rather than NIFTI
+  int mvnPrecision;  // bits per correlation in .mvn files
+  set<string> outputs; // which products SaveResults writes (--outputs)
+  map<string,int> outputBits;   // bits per value of each product's files, 
+  map<string,int> outputLevels; // and gzip level (0 for none); "" is the default
+  map<string,bool> outputMasked; // .masked files rather than NIFTI
+  int nSamples;      // posterior samples to save per voxel (0 for none)
+  int samplesSeed;
+  vector<double> samplePercentiles; // maps of these are made from the samples
+  DerivedParams* derived; // extra parameters to map (--derived-params)
+  bool WantOutput(const string& product) const
+    { return outputs.count(product) > 0; }
+  void ReadOutputOptions(ArgsType& args);
+
+  // With --output-async, the per-voxel output files are written by 
+  // background threads while DoCalculations carries on.  It calls 
+  // StartBackgroundOutput once the results vectors are set up, then
+  // VoxelsDone(n) whenever the first n voxels have their final results.
+  // Techniques that don't (e.g. spatial VB) just get the usual SaveResults.
+  bool outputAsync;
+  void StartBackgroundOutput(const DataSet& data);
+  void VoxelsDone(int n);
   
   vector<MVNDist*> resultMVNs;
   vector<MVNDist*> resultMVNsWithoutPrior; // optional; used by Adrian's spatial priors research
   vector<double> resultFs;
+  VoxelSpool* resultFits; // model prediction at the final estimates, if the
+                          // technique kept it (and fits were wanted)
+
+  // The per-voxel maps (see inference.cc)
+  struct VoxelMaps;
+  VoxelMaps* maps;
+  void StartVoxelMaps(const DataSet& data);
+  void FillVoxelMaps(int upto); // voxels up to (not including) upto, from 0
 
   void InitMVNFromFile(vector<MVNDist*>& continueFromDists,string continueFromFile, const DataSet& allData, string paramFilename);
   
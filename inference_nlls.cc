@@ -77,6 +77,8 @@ void NLLSInferenceTechnique::Setup(ArgsType& args)
   //determine whether NLLS is being run in isolation or as a pre-step for VB (alters what we do if result is ill conditioned)
   vbinit = args.ReadBool("vb-init");
 
+  ReadOutputOptions(args);
+
   // option to load a 'posterior' which will allow the setting of intial parameter estmates for NLLS
   MVNDist* loadPosterior = new MVNDist( model->NumParams() );
   MVNDist* junk = new MVNDist( model->NumParams() );
@@ -107,6 +109,8 @@ void NLLSInferenceTechnique::DoCalculations(const DataSet& allData)
       + stringify(model->NumOutputs())
       + ")!");
 
+  StartBackgroundOutput(allData);
+
   for (unsigned int voxel = 1; voxel <= Nvoxels; voxel++)
     {
       ColumnVector y = data.Column(voxel);
@@ -210,6 +214,7 @@ catch (Exception)
 
       resultMVNs.push_back(new MVNDist(fwdPosterior));
       assert(resultMVNs.size() == voxel);
+      VoxelsDone(voxel);
     }
 }
 
@@ -287,6 +287,7 @@ void SpatialVariationalBayes::DoCalculations(const DataSet& allData)
     model->pass_in_data( data.Column(1) );
   }
   model->pass_in_coords(coords.Column(1));
+  ProbeJacobianSparsity();
 
 
   const int Nparams = model->NumParams();
@@ -409,7 +410,7 @@ else
   fwdPosteriorVox.resize(Nvoxels, *initialFwdPosterior);
 }
 
-linearVox.resize(Nvoxels, LinearizedFwdModel(model) );
+linearVox.resize(Nvoxels, LinearizedFwdModel(model, sparsity) );
 resultMVNs.resize(Nvoxels, NULL);
 
 if (alsoSaveWithoutPrior)
@@ -203,13 +203,36 @@ void VariationalBayesInferenceTechnique::Setup(ArgsType& args)
   }
   else if (convergence == "lm")
     conv = new LMConvergenceDetector(its,0.01);
+  else if (convergence == "trustregion")
+    conv = new TrustRegionConvergenceDetector(its,0.01);
+  else if (convergence == "adaptive") {
+    double paramTol = convertTo<double>(args.ReadWithDefault("param-change-tol","0.001"));
+    double FTol = convertTo<double>(args.ReadWithDefault("f-change-tol","0.01"));
+    if (paramTol <= 0 && FTol <= 0)
+      throw Invalid_option("--convergence=adaptive needs a positive --param-change-tol or --f-change-tol");
+    conv = new AdaptiveConvergenceDetector(its, paramTol, FTol);
+  }
   else
     throw Invalid_option("Unrecognized convergence detector: '" 
                            + convergence + "'");
 
+  // Extrapolated steps are only kept if they don't reduce F
+  string accel = args.ReadWithDefault("accelerate", "none");
+  if (accel == "none")
+    accelerate = false;
+  else if (accel == "squarem")
+    accelerate = true;
+  else
+    throw Invalid_option("Unrecognized --accelerate: '" + accel + "'");
+
+  // Skip the parts of J'*X*J (and the finite differences) that the model
+  // never touches.  Found numerically, so only used on request.
+  if (args.ReadBool("sparse-jacobian"))
+    sparsity = new JacobianSparsity;
+
   // Figure out if F needs to be calculated every iteration
   printF = args.ReadBool("print-free-energy");
-  needF = conv->UseF() || printF;
+  needF = conv->UseF() || printF || accelerate;
 
   haltOnBadVoxel = !args.ReadBool("allow-bad-voxels");
   if (haltOnBadVoxel)
@@ -249,7 +272,7 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
     model->pass_in_data( origdata.Column(1) );
   }
   model->pass_in_coords(coords.Column(1));
-
+  ProbeJacobianSparsity();
        
   int Nvoxels = origdata.Ncols();
   if (origdata.Nrows() != model->NumOutputs())
@@ -265,7 +288,16 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
 
   Matrix data(origdata.Nrows(),Nvoxels);
   data = origdata;
-  Matrix modelpred(model->NumOutputs(),Nvoxels); //use this to store the model predictions in to pass to motion correction routine
+  Matrix modelpred; //use this to store the model predictions in to pass to motion correction routine
+  if (Nmcstep > 0)
+    modelpred.ReSize(model->NumOutputs(),Nvoxels);
+  // The model fit and residual outputs use the same predictions, but keep
+  // them on disk as they're only needed at the end
+  if (WantOutput("fit") || WantOutput("residuals"))
+    {
+      delete resultFits;
+      resultFits = new VoxelSpool(model->NumOutputs(), Nvoxels);
+    }
 
   assert(resultMVNs.empty()); // Only call DoCalculations once
   resultMVNs.resize(Nvoxels, NULL);
@@ -273,6 +305,9 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
   assert(resultFs.empty());
   resultFs.resize(Nvoxels, 9999);  // 9999 is a garbage default value
 
+  // Output files can be written as the voxels are finished
+  StartBackgroundOutput(allData);
+
   // If we're continuing from previous saved results, load them here:
   bool continuingFromFile = (continueFromFile != "");
   vector<MVNDist*> continueFromDists;
@@ -314,6 +349,12 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
   }
  }
 
+  // Convergence statistics: how many iterations each voxel took, and how
+  // many times the forward model was evaluated in total.
+  vector<int> itsHistogram;
+  long totalEvaluations = 0;
+  int accelAccepted = 0, accelRejected = 0;
+
   // main loop over motion correction iterations and VB calculations
   bool continuefromprevious = false; //indicates that we should continue from a previous run (i.e. after a motion correction step)
   for (int step = 0; step <= Nmcstep; step++) {
@@ -390,7 +431,10 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
       MVNDist fwdPriorSave(fwdPrior);
 
       
-      LinearizedFwdModel linear( model );
+      LinearizedFwdModel linear( model, sparsity );
+      LinearizedFwdModel linearSave( model, sparsity ); // only used if conv->TrialSteps()
+      LinearizedFwdModel linearPlain( model, sparsity ); // only used if accelerate
+      bool jacobianStale = false; // centre moved by a trial step, J not updated
       
       // Setup for ARD (fwdmodel will decide if there is anything to be done)
       double Fard = 0;
@@ -414,6 +458,11 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
 	  noise->Precalculate( *noiseVox, *noiseVoxPrior, y );
 
 	  conv->Reset();
+	  conv->UpdateMeans(fwdPosterior.means);
+
+	  // Means at the start of the previous and current iterations, for
+	  // --accelerate.  Empty when there isn't enough history to extrapolate.
+	  ColumnVector accelPrev, accelStart;
 
 	  // START the VB updates and run through the relevant iterations (according to the convergence testing)
 	  int iteration = 0; //count the iterations
@@ -424,8 +473,18 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
 		  *noiseVox = *noiseVoxSave;  // copy values, not pointers!
 		  fwdPosterior = fwdPosteriorSave;
 		  fwdPrior = fwdPriorSave; // need to revert prior too (in case ARD is in place)
-		  linear.ReCentre( fwdPosterior.means );
+		  if (conv->TrialSteps())
+		    linear.CopyLinearisation(linearSave);
+		  else
+		    linear.ReCentre( fwdPosterior.means );
+		  accelStart.ReSize(0);
 		}
+	      else if (jacobianStale)
+		{
+		  // The trial step was accepted, so now it's worth the Jacobian
+		  linear.UpdateJacobian();
+		}
+	      jacobianStale = false;
 	      
 	      if (needF) { 
 		F = noise->CalcFreeEnergy( *noiseVox, 
@@ -434,6 +493,12 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
 	      if (printF) 
 		LOG << "      Fbefore == " << F << endl;
 
+	      if (accelerate)
+		{
+		  accelPrev = accelStart;
+		  accelStart = fwdPosterior.means;
+		}
+
  
               // Save old values if called for
 	      if ( conv->NeedSave() )
@@ -441,6 +506,8 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
 		*noiseVoxSave = *noiseVox;  // copy values, not pointers!
                 fwdPosteriorSave = fwdPosterior;
 		fwdPriorSave = fwdPrior;
+		if (conv->TrialSteps())
+		  linearSave.CopyLinearisation(linear);
               }
 
 	      // Do ARD updates (model will decide if there is anything to do here)
@@ -475,32 +542,132 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
 	      // Test of NoiseModel cloning:
 	      // NoiseModel* tmp = noise; noise = tmp->Clone(); delete tmp;
 
+	      // SQUAREM extrapolation: given the means at the start of the last
+	      // two iterations (x0, x1) and now (x2), jump to
+	      //   x0 - 2*a*r + a^2*v,  r = x1-x0,  v = x2-2*x1+x0,  a = -|r|/|v|
+	      // which is exactly x2 when a = -1.  Only every other iteration
+	      // extrapolates, so each jump is followed by a plain step.
+	      ColumnVector plainMeans;
+	      if (accelerate && accelPrev.Nrows() == fwdPosterior.means.Nrows())
+		{
+		  ColumnVector r = accelStart - accelPrev;
+		  ColumnVector v = fwdPosterior.means - 2*accelStart + accelPrev;
+		  double vv = v.SumSquare();
+		  if (vv > 0)
+		    {
+		      double alpha = -sqrt(r.SumSquare() / vv);
+		      if (alpha < -4) alpha = -4; // don't jump too far in one go
+		      if (alpha < -1)
+			{
+			  plainMeans = fwdPosterior.means;
+			  fwdPosterior.means = accelPrev - 2*alpha*r + alpha*alpha*v;
+			}
+		    }
+		  accelStart.ReSize(0);
+		}
+
 	      // Linearization update
 	      // Update the linear model before doing Free eneergy calculation (and ready for next round of theta and phi updates)
-	      linear.ReCentre( fwdPosterior.means );
-	      
+	      if (plainMeans.Nrows() > 0)
+		{
+		  // Safeguard: keep the extrapolated means only if F there is 
+		  // no worse than after the plain step.  Both Fs use this 
+		  // iteration's Jacobian, so each costs one model evaluation,
+		  // and only the one kept is differentiated.  (Only the theta
+		  // means are extrapolated; the noise posterior is the plain 
+		  // step's either way.)
+		  linear.MoveCentre( plainMeans );
+		  const double Fplain = noise->CalcFreeEnergy( *noiseVox, 
+		      *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y) + Fard;
+		  linearPlain.CopyLinearisation(linear);
+		  bool better = false;
+		  try
+		    {
+		      linear.MoveCentre( fwdPosterior.means );
+		      F = noise->CalcFreeEnergy( *noiseVox, 
+			  *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y) + Fard;
+		      better = (F >= Fplain);
+		    }
+		  catch (const overflow_error& e)
+		    {
+		      // extrapolated somewhere silly
+		    }
+		  if (better)
+		    accelAccepted++;
+		  else
+		    {
+		      accelRejected++;
+		      fwdPosterior.means = plainMeans;
+		      linear.CopyLinearisation(linearPlain);
+		      F = Fplain;
+		    }
+
+		  if (conv->TrialSteps())
+		    jacobianStale = true;
+		  else
+		    {
+		      linear.UpdateJacobian();
+		      F = noise->CalcFreeEnergy( *noiseVox, 
+			  *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y) + Fard;
+		    }
+		}
+	      else
+		{
+		  if (conv->TrialSteps())
+		    {
+		      linear.MoveCentre( fwdPosterior.means );
+		      jacobianStale = true;
+		    }
+		  else
+		    linear.ReCentre( fwdPosterior.means );
 	      
-	      if (needF) {
-		F = noise->CalcFreeEnergy( *noiseVox, 
-					   *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y);
-		F = F + Fard; }
+		  // With TrialSteps the Jacobian is still the one from the
+		  // start of the iteration.  That's deliberate: at the centre
+		  // F's data term is exact (the residual is just y - g(m)), 
+		  // and only the -tr(J'J Cov)/2 term uses the old J.  That is 
+		  // enough to accept or reject the step, and the Jacobian of a
+		  // rejected step is never needed.
+		  if (needF) {
+		    F = noise->CalcFreeEnergy( *noiseVox, 
+					       *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y);
+		    F = F + Fard; }
+		}
+
 	      if (printF) 
 		LOG << "      Fnoise == " << F << endl;
 
 
 	      iteration++;
+	      conv->UpdateMeans(fwdPosterior.means);
 	    }           
 	  while ( !conv->Test( F ) );
 	  // END of VB updates
 
+	  if ((int)itsHistogram.size() <= iteration)
+	    itsHistogram.resize(iteration+1, 0);
+	  itsHistogram[iteration]++;
+
 	  // Revert to old values at last stage if required
 	  if ( conv-> NeedRevert() )
           {
 	    *noiseVox = *noiseVoxSave;  // copy values, not pointers!
             fwdPosterior = fwdPosteriorSave;
 	    fwdPrior = fwdPriorSave;
-	    linear.ReCentre( fwdPosterior.means ); //just in case we go on to use this in motion correction
+	    if (conv->TrialSteps())
+	      linear.CopyLinearisation(linearSave);
+	    else
+	      linear.ReCentre( fwdPosterior.means ); //just in case we go on to use this in motion correction
 	  }
+	  else if (jacobianStale)
+	    {
+	      // The last step was accepted, so bring the Jacobian (and F) up
+	      // to date for the results
+	      linear.UpdateJacobian();
+	      if (needF) {
+		F = noise->CalcFreeEnergy( *noiseVox, 
+					   *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y);
+		F = F + Fard; }
+	    }
 	  conv->DumpTo(LOG, "    ");
 	} 
       catch (const overflow_error& e)
@@ -537,7 +704,6 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
 	  fwdPosterior, noiseVox->OutputAsMVN() );
 	if (needF)
 	  resultFs.at(voxel-1) = F;
-	modelpred.Column(voxel) = linear.Offset(); // get the model prediction which is stored within the linearized forward model
 
       } catch (...) {
 	// Even that can fail, due to results being singular
@@ -550,9 +716,17 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
 
 	if (needF)
 	  resultFs.at(voxel-1) = F;
-	modelpred.Column(voxel) = linear.Offset(); // get the model prediction which is stored within the linearized forward model
       }
+
+      // get the model prediction which is stored within the linearized forward model
+      if (Nmcstep > 0)
+	modelpred.Column(voxel) = linear.Offset();
+      if (resultFits != NULL)
+	resultFits->Put(voxel, linear.Offset());
+      if (step == Nmcstep)
+	VoxelsDone(voxel);
       
+      totalEvaluations += linear.Evaluations();
       delete noiseVox; noiseVox = NULL;
       delete noiseVoxSave;
     } //END of voxelwise updates
@@ -567,7 +741,20 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
   continuefromprevious = true; //we now take resultMVNs and use these as the starting point if we are to run again
   }// END of Steps that include motion correction and VB updates
 
-    while (continueFromDists.size()>0)
+  LOG << "Iterations to convergence (iterations: number of voxels):" << endl;
+  for (unsigned i = 0; i < itsHistogram.size(); i++)
+    if (itsHistogram[i] > 0)
+      LOG << "  " << i << ": " << itsHistogram[i] << endl;
+  LOG_ERR("Total forward model evaluations: " << totalEvaluations 
+	  << " (" << double(totalEvaluations)/Nvoxels << " per voxel)" << endl);
+  conv->DumpSummaryTo(LOG);
+  if (accelerate)
+    LOG_ERR("Extrapolated steps: " << accelAccepted << " accepted, " 
+	    << accelRejected << " rejected" << endl);
+  if (sparsity != NULL)
+    sparsity->Report();
+
+  while (continueFromDists.size()>0)
     {
       delete continueFromDists.back();
       continueFromDists.pop_back();
@@ -579,6 +766,25 @@ VariationalBayesInferenceTechnique::~VariationalBayesInferenceTechnique()
   delete conv;
   delete initialFwdPrior;
   delete initialFwdPosterior;
+  delete sparsity;
+}
+
+void VariationalBayesInferenceTechnique::ProbeJacobianSparsity()
+{
+  Tracer_Plus tr("VariationalBayesInferenceTechnique::ProbeJacobianSparsity");
+  if (sparsity == NULL)
+    return;
+
+  MVNDist about(model->NumParams());
+  if (initialFwdPosterior != NULL)
+    about = *initialFwdPosterior;
+  else
+    {
+      MVNDist prior(model->NumParams());
+      model->HardcodedInitialDists(prior, about);
+    }
+  model->Initialise(about);
+  sparsity->Probe(model, about.means);
 }
 
 
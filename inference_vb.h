@@ -83,7 +83,8 @@ class VariationalBayesInferenceTechnique : public InferenceTechnique {
    public:
       VariationalBayesInferenceTechnique() : conv(NULL), 
         initialFwdPrior(NULL), initialFwdPosterior(NULL), 
-        initialNoisePrior(NULL), initialNoisePosterior(NULL) { return; }
+        initialNoisePrior(NULL), initialNoisePosterior(NULL),
+        sparsity(NULL) { return; }
       virtual void Setup(ArgsType& args);
       //  virtual void SetOutputFilenames(ArgsType& args);
       virtual void DoCalculations(const DataSet& data);    
@@ -112,5 +113,15 @@ class VariationalBayesInferenceTechnique : public InferenceTechnique {
       bool haltOnBadVoxel;
       bool printF;
       bool needF;
+
+      // SQUAREM-style extrapolation of the posterior means (--accelerate)
+      bool accelerate;
+
+      // Structural zeros of the model's Jacobian (--sparse-jacobian);
+      // NULL to treat it as dense
+      JacobianSparsity* sparsity;
+      void ProbeJacobianSparsity();
+      // Find the pattern about the initial posterior, once the model
+      // has seen some data.  Does nothing if sparsity is NULL.
 };
 
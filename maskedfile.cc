@@ -0,0 +1,142 @@
+/*  maskedfile.cc - Masked (sparse) image files
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include "maskedfile.h"
+#include "easylog.h"
+#include "easyoptions.h"
+#include <cstring>
+#include "zlib.h"
+
+const char maskedFileMagic[8] = { 'F','A','B','M','S','K',0,0 };
+
+bool IsMaskedFile(const string& filename)
+{
+  const char* exts[] = { ".masked", ".masked.gz" };
+  for (int i = 0; i < 2; i++)
+    {
+      const size_t len = strlen(exts[i]);
+      if (filename.size() > len 
+          && filename.compare(filename.size() - len, len, exts[i]) == 0)
+        return true;
+    }
+  return false;
+}
+
+MaskedFile::MaskedFile(const string& filename)
+{
+  Tracer_Plus tr("MaskedFile::MaskedFile");
+
+  // gzread reads plain files too
+  gzFile in = gzopen(filename.c_str(), "rb");
+  if (in == NULL)
+    throw Invalid_option("Couldn't open " + filename);
+
+  bool ok = gzread(in, &hdr, sizeof(hdr)) == int(sizeof(hdr))
+    && memcmp(hdr.magic, maskedFileMagic, sizeof(maskedFileMagic)) == 0;
+  if (ok && (hdr.version != 1 || hdr.nVoxels < 0 || hdr.nFrames < 1
+             || (hdr.datatype != DT_FLOAT32 && hdr.datatype != DT_FLOAT64)))
+    {
+      gzclose(in);
+      throw Invalid_option(filename + " is a newer or damaged masked file");
+    }
+
+  vector<int64_t> index(ok ? hdr.nVoxels : 0);
+  ok = ok && (index.empty() || gzread(in, &index[0], index.size() * sizeof(int64_t)) 
+              == int(index.size() * sizeof(int64_t)));
+  maskIndex.assign(index.begin(), index.end());
+
+  // A frame at a time, since gzread takes an int
+  values.resize(ok ? size_t(hdr.nFrames) * hdr.nVoxels : 0);
+  vector<float> frame32;
+  for (int f = 0; ok && f < hdr.nFrames && hdr.nVoxels > 0; f++)
+    {
+      double* frame = &values[size_t(f) * hdr.nVoxels];
+      if (hdr.datatype == DT_FLOAT64)
+        ok = gzread(in, frame, hdr.nVoxels * sizeof(double)) 
+          == int(hdr.nVoxels * sizeof(double));
+      else
+        {
+          frame32.resize(hdr.nVoxels);
+          ok = gzread(in, &frame32[0], hdr.nVoxels * sizeof(float)) 
+            == int(hdr.nVoxels * sizeof(float));
+          copy(frame32.begin(), frame32.end(), frame);
+        }
+    }
+  gzclose(in);
+  if (!ok)
+    throw Invalid_option(filename + " isn't a masked file, or is truncated");
+}
+
+ReturnMatrix MaskedFile::AsMatrix() const
+{
+  Matrix m(NumFrames(), NumVoxels());
+  Real* p = m.Store(); // row-major, so the same order as values
+  copy(values.begin(), values.end(), p);
+  m.Release();
+  return m;
+}
@@ -0,0 +1,122 @@
+/*  maskedfile.h - Masked (sparse) image files
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "newimage/newimageall.h"
+
+using namespace std;
+using namespace NEWMAT;
+
+// A masked file holds an image's values in the masked voxels only, so it's
+// far smaller (and quicker to write) than a NIFTI file when the mask is 
+// sparse, e.g. a thin slab or an ROI.  NiftiWriter writes these with 
+// --output-layout=masked; fabber_expand turns them back into NIFTI.  The 
+// whole file is one gzip stream (or plain, at level 0) of:
+//
+//   MaskedFileHeader    fixed size, includes the grid's NIFTI header
+//   mask index          nVoxels int64s: each voxel's index in the grid
+//   values              nFrames blocks of nVoxels values, frame by frame
+
+struct MaskedFileHeader {
+  char magic[8];        // "FABMSK\0\0"
+  int32_t version;
+  int32_t datatype;     // DT_FLOAT32 or DT_FLOAT64
+  int32_t nFrames;
+  int32_t intent;
+  int64_t nVoxels;
+  float lo, hi;         // range of the values (not counting the zeros outside)
+  nifti_1_header grid;
+};
+
+extern const char maskedFileMagic[8];
+
+// By extension: .masked or .masked.gz
+bool IsMaskedFile(const string& filename);
+
+// Reads a whole masked file
+class MaskedFile {
+public:
+  MaskedFile(const string& filename);
+
+  const MaskedFileHeader& Header() const { return hdr; }
+  int NumFrames() const { return hdr.nFrames; }
+  int NumVoxels() const { return maskIndex.size(); }
+  const vector<long>& MaskIndex() const { return maskIndex; }
+  const vector<double>& Values() const { return values; } // frame by frame
+
+  // The values as a volume4D::matrix(mask)-style matrix, one row per frame
+  ReturnMatrix AsMatrix() const;
+
+private:
+  MaskedFileHeader hdr;
+  vector<long> maskIndex;
+  vector<double> values;
+};
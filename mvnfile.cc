@@ -0,0 +1,436 @@
+/*  mvnfile.cc - Compact binary container for per-voxel MVNs
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include "mvnfile.h"
+#include "niftiwriter.h"
+#include "easyoptions.h"
+#include <cstring>
+#include <cmath>
+#include <climits>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace NEWIMAGE;
+
+static const char mvnMagic[8] = { 'F','A','B','M','V','N',0,0 };
+static const int32_t mvnVersion = 1;
+
+// IEEE half-precision conversion, rounding to nearest even.  Done by hand
+// since there's no portable float16 type.
+static uint16_t FloatToHalf(float f)
+{
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  const uint32_t sign = (x >> 16) & 0x8000;
+  const int32_t fexp = (x >> 23) & 0xff;
+  uint32_t mant = x & 0x7fffff;
+
+  if (fexp == 0xff) // inf or NaN
+    return sign | 0x7c00 | (mant != 0 ? 0x200 : 0);
+  const int32_t exp = fexp - 127 + 15;
+  if (exp >= 31) // too big
+    return sign | 0x7c00;
+  if (exp <= 0) 
+    {
+      // Subnormal (or zero) half
+      if (exp < -10) 
+        return sign;
+      mant |= 0x800000;
+      const int shift = 14 - exp;
+      uint32_t half = mant >> shift;
+      const uint32_t rem = mant & ((1u << shift) - 1);
+      const uint32_t mid = 1u << (shift - 1);
+      if (rem > mid || (rem == mid && (half & 1)))
+        half++;
+      return sign | half;
+    }
+  uint32_t half = sign | (exp << 10) | (mant >> 13);
+  const uint32_t rem = mant & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (half & 1)))
+    half++; // a carry into the exponent is still correct
+  return half;
+}
+
+static float HalfToFloat(uint16_t h)
+{
+  const uint32_t sign = uint32_t(h & 0x8000) << 16;
+  const int32_t exp = (h >> 10) & 0x1f;
+  const uint32_t mant = h & 0x3ff;
+  if (exp == 0) // zero or subnormal
+    {
+      const float f = ldexp(float(mant), -24);
+      return sign ? -f : f;
+    }
+  uint32_t x;
+  if (exp == 31)
+    x = sign | 0x7f800000 | (mant << 13);
+  else
+    x = sign | (uint32_t(exp - 15 + 127) << 23) | (mant << 13);
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+bool IsMVNFile(const string& filename)
+{
+  return filename.size() > 4 
+    && filename.compare(filename.size() - 4, 4, ".mvn") == 0;
+}
+
+size_t MVNFile::RecordSize(int nParams, int corrBits)
+{
+  return 2 * nParams * sizeof(float) 
+    + (nParams * (nParams - 1) / 2) * (corrBits / 8);
+}
+
+void MVNFile::PackRecord(const MVNDist& mvn, int corrBits, char* rec)
+{
+  const int n = mvn.means.Nrows();
+  const SymmetricMatrix& cov = mvn.GetCovariance();
+  // Records needn't be aligned (with float16s), so copy rather than cast
+  ColumnVector sd(n);
+  for (int i = 1; i <= n; i++)
+    {
+      sd(i) = sqrt(cov(i,i));
+      const float m = mvn.means(i), s = sd(i);
+      memcpy(rec + (i-1) * sizeof(float), &m, sizeof(float));
+      memcpy(rec + (n+i-1) * sizeof(float), &s, sizeof(float));
+    }
+  char* corr = rec + 2 * n * sizeof(float);
+  for (int r = 2; r <= n; r++)
+    for (int c = 1; c < r; c++)
+      {
+        const float rho = (sd(r) > 0 && sd(c) > 0) ? cov(r,c) / (sd(r) * sd(c)) : 0;
+        if (corrBits == 16)
+          {
+            const uint16_t h = FloatToHalf(rho);
+            memcpy(corr, &h, sizeof(h));
+            corr += sizeof(h);
+          }
+        else
+          {
+            memcpy(corr, &rho, sizeof(rho));
+            corr += sizeof(rho);
+          }
+      }
+}
+
+void MVNFile::UnpackRecord(const char* rec, int n, int corrBits, MVNDist& mvn)
+{
+  vector<float> means(n), stdevs(n);
+  memcpy(&means[0], rec, n * sizeof(float));
+  memcpy(&stdevs[0], rec + n * sizeof(float), n * sizeof(float));
+  const char* corr = rec + 2 * n * sizeof(float);
+  SymmetricMatrix cov(n);
+  mvn.SetSize(n);
+  for (int r = 1; r <= n; r++)
+    {
+      mvn.means(r) = means[r-1];
+      cov(r,r) = double(stdevs[r-1]) * stdevs[r-1];
+      for (int c = 1; c < r; c++)
+        {
+          float rho;
+          if (corrBits == 16)
+            {
+              uint16_t h;
+              memcpy(&h, corr, sizeof(h));
+              corr += sizeof(h);
+              rho = HalfToFloat(h);
+            }
+          else
+            {
+              memcpy(&rho, corr, sizeof(rho));
+              corr += sizeof(rho);
+            }
+          cov(r,c) = double(rho) * stdevs[r-1] * stdevs[c-1];
+        }
+    }
+  mvn.SetCovariance(cov);
+}
+
+// Shared by Save and the creating constructor
+static MVNFileHeader MakeHeader(const nifti_1_header& grid, int nVoxels, 
+                                int nParams, int nNoise, int corrBits,
+                                string& names, const vector<string>& paramNames)
+{
+  // Unnamed parameters (e.g. most noise models') get made-up names
+  names = "";
+  for (int i = 0; i < nParams; i++)
+    names += (i < int(paramNames.size()) ? paramNames[i] : "param" + stringify(i+1)) + "\n";
+
+  MVNFileHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, mvnMagic, sizeof(mvnMagic));
+  hdr.version = mvnVersion;
+  hdr.nParams = nParams;
+  hdr.nNoise = nNoise;
+  hdr.corrBits = corrBits;
+  hdr.nVoxels = nVoxels;
+  hdr.namesOffset = sizeof(hdr);
+  hdr.indexOffset = hdr.namesOffset + names.size();
+  hdr.dataOffset = hdr.indexOffset + nVoxels * sizeof(int64_t);
+  hdr.grid = grid;
+  return hdr;
+}
+
+static bool WriteHeader(FILE* fp, const MVNFileHeader& hdr, const string& names,
+                        const vector<long>& maskIndex)
+{
+  vector<int64_t> index(maskIndex.begin(), maskIndex.end());
+  return fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+    && fwrite(names.data(), 1, names.size(), fp) == names.size()
+    && (index.empty() 
+        || fwrite(&index[0], sizeof(int64_t), index.size(), fp) == index.size());
+}
+
+MVNFile::MVNFile(const string& fname, bool w) 
+  : filename(fname), base(NULL), mapSize(0), writable(w)
+{
+  Tracer_Plus tr("MVNFile::MVNFile");
+  Map();
+}
+
+MVNFile::MVNFile(const string& fname, const MVNFile& like, 
+                 const vector<string>& paramNames, int nNoise)
+  : filename(fname), base(NULL), mapSize(0), writable(true)
+{
+  Tracer_Plus tr("MVNFile::MVNFile (create)");
+
+  string namesBlock;
+  const MVNFileHeader newHdr = MakeHeader(like.Grid(), like.NumVoxels(), 
+    paramNames.size(), nNoise, like.CorrBits(), namesBlock, paramNames);
+  const off_t total = newHdr.dataOffset 
+    + off_t(newHdr.nVoxels) * RecordSize(newHdr.nParams, newHdr.corrBits);
+
+  FILE* fp = fopen(filename.c_str(), "wb");
+  if (fp == NULL)
+    throw Invalid_option("Couldn't open " + filename + " for writing");
+  bool ok = WriteHeader(fp, newHdr, namesBlock, like.MaskIndex()) 
+    && fflush(fp) == 0 
+    && ftruncate(fileno(fp), total) == 0;
+  if (fclose(fp) != 0 || !ok)
+    throw Invalid_option("Error creating " + filename);
+
+  Map();
+}
+
+void MVNFile::Map()
+{
+  const int fd = open(filename.c_str(), writable ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+    throw Invalid_option("Couldn't open MVN file " + filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(hdr))
+    {
+      close(fd);
+      throw Invalid_option(filename + " isn't a FABBER .mvn file");
+    }
+  mapSize = st.st_size;
+  void* p = mmap(NULL, mapSize, PROT_READ | (writable ? PROT_WRITE : 0), 
+                 MAP_SHARED, fd, 0);
+  close(fd); // the mapping stays valid
+  if (p == MAP_FAILED)
+    throw Invalid_option("Couldn't map MVN file " + filename);
+  base = static_cast<char*>(p);
+
+  memcpy(&hdr, base, sizeof(hdr));
+  if (memcmp(hdr.magic, mvnMagic, sizeof(mvnMagic)) != 0)
+    {
+      munmap(base, mapSize); base = NULL;
+      throw Invalid_option(filename + " isn't a FABBER .mvn file");
+    }
+  if (hdr.version != mvnVersion || hdr.nParams < 1 || hdr.nVoxels < 0
+      || hdr.nVoxels > INT_MAX || hdr.nNoise < 0 || hdr.nNoise > hdr.nParams
+      || (hdr.corrBits != 16 && hdr.corrBits != 32))
+    {
+      munmap(base, mapSize); base = NULL;
+      throw Invalid_option(filename + ": unsupported .mvn version, or written on a machine with different byte order");
+    }
+  // The names, index and records must follow the header in that order and
+  // fit in the file.  Sizes are compared by division so that corrupt 
+  // counts can't overflow.
+  recordSize = RecordSize(hdr.nParams, hdr.corrBits);
+  if (hdr.namesOffset < int64_t(sizeof(hdr)) || hdr.indexOffset < hdr.namesOffset
+      || hdr.dataOffset < hdr.indexOffset || uint64_t(hdr.dataOffset) > mapSize
+      || uint64_t(hdr.nVoxels) > uint64_t(hdr.dataOffset - hdr.indexOffset) / sizeof(int64_t)
+      || uint64_t(hdr.nVoxels) > (mapSize - hdr.dataOffset) / recordSize)
+    {
+      munmap(base, mapSize); base = NULL;
+      throw Invalid_option(filename + " is truncated or corrupt");
+    }
+
+  // Names, one per line
+  names.clear();
+  string name;
+  for (const char* c = base + hdr.namesOffset; c < base + hdr.indexOffset; c++)
+    {
+      if (*c == '\n') { names.push_back(name); name = ""; }
+      else name += *c;
+    }
+  if (int(names.size()) != hdr.nParams || !name.empty())
+    {
+      munmap(base, mapSize); base = NULL;
+      throw Invalid_option(filename + " has " + stringify(names.size()) 
+                           + " parameter names for " + stringify(hdr.nParams) 
+                           + " parameters");
+    }
+
+  maskIndex.resize(hdr.nVoxels);
+  for (int v = 0; v < hdr.nVoxels; v++)
+    {
+      int64_t idx;
+      memcpy(&idx, base + hdr.indexOffset + v * sizeof(int64_t), sizeof(idx));
+      maskIndex[v] = idx;
+    }
+}
+
+MVNFile::~MVNFile()
+{
+  if (base != NULL)
+    {
+      if (writable)
+        msync(base, mapSize, MS_SYNC);
+      munmap(base, mapSize);
+    }
+}
+
+void MVNFile::CheckMask(const volume<float>& mask) const
+{
+  Tracer_Plus tr("MVNFile::CheckMask");
+  if (NiftiWriter(mask).MaskIndex() != maskIndex)
+    throw Invalid_option(filename + " was saved with a different mask");
+}
+
+void MVNFile::Read(int vox, MVNDist& mvn) const
+{
+  assert(vox >= 0 && vox < hdr.nVoxels);
+  UnpackRecord(Record(vox), hdr.nParams, hdr.corrBits, mvn);
+}
+
+void MVNFile::Write(int vox, const MVNDist& mvn)
+{
+  assert(vox >= 0 && vox < hdr.nVoxels);
+  if (!writable)
+    throw Logic_error("MVNFile::Write: " + filename + " was opened read-only");
+  if (mvn.means.Nrows() != hdr.nParams)
+    throw Invalid_option("MVNFile::Write: MVN has the wrong number of parameters for " + filename);
+  PackRecord(mvn, hdr.corrBits, Record(vox));
+}
+
+void MVNFile::ReadAll(vector<MVNDist*>& mvns) const
+{
+  Tracer_Plus tr("MVNFile::ReadAll");
+  for (unsigned i = 0; i < mvns.size(); i++) 
+    assert(mvns[i] == NULL); // should've deleted everything first. 
+
+  mvns.resize(hdr.nVoxels, NULL);
+  for (int vox = 0; vox < hdr.nVoxels; vox++)
+    {
+      mvns[vox] = new MVNDist(hdr.nParams);
+      Read(vox, *mvns[vox]);
+    }
+}
+
+void MVNFile::Save(const vector<MVNDist*>& mvns, const string& filename, 
+                   const volume<float>& mask, const vector<string>& paramNames,
+                   int nNoise, int corrBits)
+{
+  Tracer_Plus tr("MVNFile::Save");
+
+  const int nVoxels = mvns.size();
+  assert(nVoxels > 0 && mvns.at(0) != NULL);   
+  const int nParams = mvns.at(0)->means.Nrows();
+  if (corrBits != 16 && corrBits != 32)
+    throw Invalid_option("MVN precision must be 16 or 32 bits");
+
+  NiftiWriter grid(mask);
+  if (grid.NumVoxels() != nVoxels)
+    throw Invalid_option("MVNFile::Save: number of MVNs doesn't match the mask");
+
+  string names;
+  const MVNFileHeader hdr = MakeHeader(grid.Header(), nVoxels, nParams, 
+                                       nNoise, corrBits, names, paramNames);
+  const size_t recordSize = RecordSize(nParams, corrBits);
+  vector<char> rec(recordSize);
+
+  FILE* fp = fopen(filename.c_str(), "wb");
+  if (fp == NULL)
+    throw Invalid_option("Couldn't open " + filename + " for writing");
+  bool ok = WriteHeader(fp, hdr, names, grid.MaskIndex());
+  for (int vox = 0; ok && vox < nVoxels; vox++)
+    {
+      assert(mvns[vox]->means.Nrows() == nParams);
+      PackRecord(*mvns[vox], corrBits, &rec[0]);
+      ok = fwrite(&rec[0], 1, recordSize, fp) == recordSize;
+    }
+  if (fclose(fp) != 0 || !ok)
+    throw Invalid_option("Error writing " + filename);
+}
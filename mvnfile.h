@@ -0,0 +1,159 @@
+/*  mvnfile.h - Compact binary container for per-voxel MVNs
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <stdint.h>
+#include "dist_mvn.h"
+
+using namespace std;
+
+// A .mvn file holds one MVNDist per masked voxel, as an alternative to the
+// finalMVN NIFTI_INTENT_SYMMATRIX volume.  Layout (native byte order):
+//
+//   MVNFileHeader            fixed size, includes the grid's NIFTI header
+//   parameter names          nParams names, each ending in '\n'
+//   mask index               nVoxels int64s: each voxel's index in the grid
+//   records                  nVoxels fixed-size records, in mask order
+//
+// Each record is the means and standard deviations (float32) followed by 
+// the strict lower triangle of the correlation matrix, row by row, as 
+// float32 or float16.  Correlations lie in [-1,1] so halves lose very 
+// little, unlike storing tiny covariances directly.  Since the records are
+// fixed-size, any voxel can be read without touching the others.
+
+struct MVNFileHeader {
+  char magic[8];          // "FABMVN\0\0"
+  int32_t version;
+  int32_t nParams;        // including noise parameters
+  int32_t nNoise;         // how many of the params (at the end) are noise
+  int32_t corrBits;       // 16 or 32
+  int64_t nVoxels;
+  int64_t namesOffset, indexOffset, dataOffset;
+  nifti_1_header grid;    // geometry, so the file can be expanded without the mask
+};
+
+bool IsMVNFile(const string& filename); // true if it ends in .mvn
+
+// A voxel-indexed view of a .mvn file.  The file is memory-mapped, so 
+// opening it costs nothing however big it is, and reading or (if opened 
+// writable) overwriting a voxel only touches that voxel's record.
+class MVNFile {
+public:
+  // Map an existing file and read its header and mask index
+  MVNFile(const string& filename, bool writable = false);
+
+  // Create a new, writable file on the same grid as 'like', with space 
+  // for every voxel's record (initially all zero)
+  MVNFile(const string& filename, const MVNFile& like, 
+          const vector<string>& names, int nNoise);
+  ~MVNFile();
+
+  int NumParams() const { return hdr.nParams; }
+  int NumNoise() const { return hdr.nNoise; }
+  int NumVoxels() const { return hdr.nVoxels; }
+  int CorrBits() const { return hdr.corrBits; }
+  const vector<string>& Names() const { return names; }
+  const vector<long>& MaskIndex() const { return maskIndex; }
+  const nifti_1_header& Grid() const { return hdr.grid; }
+
+  void Read(int vox, MVNDist& mvn) const; // vox from 0, in mask order
+  void ReadAll(vector<MVNDist*>& mvns) const;
+  void Write(int vox, const MVNDist& mvn); // in place; sizes must match
+
+  // Check this file was saved on the same mask
+  void CheckMask(const NEWIMAGE::volume<float>& mask) const;
+
+  static void Save(const vector<MVNDist*>& mvns, const string& filename, 
+                   const NEWIMAGE::volume<float>& mask, 
+                   const vector<string>& names, int nNoise, int corrBits = 32);
+
+  // Record layout helpers
+  static size_t RecordSize(int nParams, int corrBits);
+  static void PackRecord(const MVNDist& mvn, int corrBits, char* rec);
+  static void UnpackRecord(const char* rec, int nParams, int corrBits, MVNDist& mvn);
+
+private:
+  string filename;
+  char* base;        // the mapped file
+  size_t mapSize;
+  bool writable;
+  MVNFileHeader hdr;
+  vector<string> names;
+  vector<long> maskIndex;
+  size_t recordSize;
+
+  void Map();
+  char* Record(int vox) const 
+    { return base + hdr.dataOffset + size_t(vox) * recordSize; }
+
+  MVNFile(const MVNFile&);               // not allowed
+  MVNFile& operator=(const MVNFile&);
+};
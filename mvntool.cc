@@ -76,7 +76,11 @@ int main() {cout << "MVNTOOL not built; compiled with __FABBER_LIBRARYONLY optio
 #include <stdexcept>
 #include <map>
 #include <string>
+#include <sstream>
+#include <cstdio>
 #include "dist_mvn.h"
+#include "mvnfile.h"
+#include "niftiwriter.h"
 #include "easyoptions.h"
 #include "newimage/newimageall.h"
 
@@ -87,39 +91,226 @@ using namespace NEWIMAGE;
 /* Function declarations */
 void Usage(const string& errorString = "");
 
-int main(int argc, char** argv)
+// One operation applied to every voxel's MVN.  Edits (WRITE, INSERT) 
+// change the MVN; extractions (VAL, VAR, CVAR) copy a value out into an 
+// image.  Any number of these are done in a single pass over the voxels.
+// Only the MVNs are streamed: value images and extracted images are held
+// whole, one float per masked voxel each.
+struct MVNOp {
+  enum Kind { WRITE, INSERT, VAL, VAR, CVAR } kind;
+  int param, cparam;       // counting from 1
+  string name;             // for an inserted parameter (.mvn files only)
+  double val, var;
+  string valim, varim;     // images to take the values from instead, if set
+  vector<float> valimData, varimData;
+  string outfile;          // for extractions
+  vector<float> image;
+
+  MVNOp() : kind(VAL), param(0), cparam(0), val(-1e-6), var(-1e-6) { return; }
+  bool IsEdit() const { return kind == WRITE || kind == INSERT; }
+};
+
+// Parameter number from a number or (if we know them) a name
+int ParamNumber(const string& s, const vector<string>& names)
 {
-	try
-	  {
-	    cout << "FABBER: MVNtool" << endl;
+  for (unsigned i = 0; i < names.size(); i++)
+    if (names[i] == s) return i+1;
+  int n = 0;
+  istringstream in(s);
+  if (!(in >> n) || !in.eof() || n < 1)
+    throw Invalid_option("Unknown parameter: " + s);
+  return n;
+}
 
-	    EasyOptions args(argc, argv);
+// A script value is either a number or an image filename
+void ParseValue(const string& s, double& val, string& image)
+{
+  istringstream in(s);
+  if (!(in >> val) || !in.eof())
+    image = s;
+}
 
-	    if (args.ReadBool("help"))
+/* Read a script of operations, one per line:
+     val <param> <outfile>
+     var <param> <outfile>
+     cvar <param> <param2> <outfile>
+     write <param> <mean> <variance>
+     new <param> <mean> <variance> [<name>]
+   where a mean or variance is a number or an image.  Names are tracked 
+   through insertions, so later lines can refer to new parameters. */
+void ParseScript(const string& filename, vector<string> names, vector<MVNOp>& ops)
+{
+  ifstream in(filename.c_str());
+  if (!in) 
+    throw Invalid_option("Couldn't open script " + filename);
+
+  string line;
+  for (int lineNo = 1; getline(in, line); lineNo++)
+    {
+      istringstream words(line.substr(0, line.find('#')));
+      string cmd, p, a, b;
+      if (!(words >> cmd))
+	continue;
+
+      MVNOp op;
+      if (cmd == "val" || cmd == "var")
+	{
+	  op.kind = (cmd == "val") ? MVNOp::VAL : MVNOp::VAR;
+	  words >> p >> op.outfile;
+	}
+      else if (cmd == "cvar")
+	{
+	  op.kind = MVNOp::CVAR;
+	  words >> p >> a >> op.outfile;
+	}
+      else if (cmd == "write" || cmd == "new")
+	{
+	  op.kind = (cmd == "write") ? MVNOp::WRITE : MVNOp::INSERT;
+	  words >> p >> a >> b;
+	}
+      else
+	throw Invalid_option(filename + ":" + stringify(lineNo) + ": unknown operation " + cmd);
+      if (words.fail())
+	throw Invalid_option(filename + ":" + stringify(lineNo) + ": too few arguments for " + cmd);
+
+      op.param = ParamNumber(p, names);
+      if (op.kind == MVNOp::CVAR)
+	op.cparam = ParamNumber(a, names);
+      if (op.IsEdit())
+	{
+	  ParseValue(a, op.val, op.valim);
+	  ParseValue(b, op.var, op.varim);
+	}
+      if (op.kind == MVNOp::INSERT)
+	{
+	  words >> op.name; // optional
+	  if (!names.empty() && op.param <= int(names.size()) + 1)
+	    names.insert(names.begin() + op.param - 1, op.name);
+	}
+      ops.push_back(op);
+    }
+}
+
+// Make sure every op refers to a parameter that will exist when it runs
+void CheckOps(const vector<MVNOp>& ops, int nParams)
+{
+  for (unsigned i = 0; i < ops.size(); i++)
+    {
+      const MVNOp& op = ops[i];
+      if (op.kind == MVNOp::INSERT)
+	{
+	  if (op.param > nParams+1) 
+	    throw Invalid_option("Cannot insert parameter here, not enough parameters in existing MVN");
+	  nParams++;
+	}
+      else if (op.param > nParams || op.cparam > nParams) 
+	throw Invalid_option("Cannot use parameter " + stringify(max(op.param, op.cparam)) + ", not enough parameters in existing MVN");
+    }
+}
+
+// Values of an image at each masked voxel, in mask order
+void LoadVoxelValues(const string& filename, const vector<long>& maskIndex, vector<float>& values)
+{
+  volume4D<float> vol;
+  read_volume4D(vol, filename);
+  const long nx = vol.xsize(), ny = vol.ysize(), nz = vol.zsize();
+  if (!maskIndex.empty() && maskIndex.back() >= nx*ny*nz)
+    throw Invalid_option(filename + " is smaller than the MVN's image");
+  values.resize(maskIndex.size());
+  for (unsigned v = 0; v < maskIndex.size(); v++)
+    {
+      const long i = maskIndex[v];
+      values[v] = vol(i % nx, (i / nx) % ny, i / (nx * ny), 0);
+    }
+}
+
+void PrepareOps(vector<MVNOp>& ops, const vector<long>& maskIndex)
+{
+  for (unsigned i = 0; i < ops.size(); i++)
+    {
+      if (ops[i].valim != "") LoadVoxelValues(ops[i].valim, maskIndex, ops[i].valimData);
+      if (ops[i].varim != "") LoadVoxelValues(ops[i].varim, maskIndex, ops[i].varimData);
+      if (!ops[i].IsEdit()) ops[i].image.assign(maskIndex.size(), 0.0f);
+    }
+}
+
+void ApplyOps(vector<MVNOp>& ops, int vox, MVNDist& mvn)
+{
+  for (unsigned i = 0; i < ops.size(); i++)
+    {
+      MVNOp& op = ops[i];
+      const double val = op.valimData.empty() ? op.val : op.valimData[vox];
+      const double var = op.varimData.empty() ? op.var : op.varimData[vox];
+      switch (op.kind)
+	{
+	case MVNOp::VAL:
+	  op.image[vox] = mvn.means(op.param);
+	  break;
+	case MVNOp::VAR:
+	  op.image[vox] = mvn.GetCovariance()(op.param, op.param);
+	  break;
+	case MVNOp::CVAR:
+	  op.image[vox] = mvn.GetCovariance()(op.param, op.cparam);
+	  break;
+	case MVNOp::WRITE:
+	  {
+	    SymmetricMatrix cov = mvn.GetCovariance();
+	    mvn.means(op.param) = val;
+	    cov(op.param, op.param) = var;
+	    mvn.SetCovariance(cov);
+	    break;
+	  }
+	case MVNOp::INSERT:
+	  {
+	    // The new parameter is uncorrelated with the others
+	    const int n = mvn.GetSize();
+	    const int p = op.param;
+	    const SymmetricMatrix oldCov = mvn.GetCovariance();
+	    const ColumnVector oldMeans = mvn.means;
+	    SymmetricMatrix cov(n+1);
+	    cov = 0;
+	    mvn.SetSize(n+1);
+	    for (int r = 1; r <= n+1; r++)
 	      {
-		Usage();
-		return 0;
+		if (r == p) continue;
+		const int ro = (r < p) ? r : r-1;
+		mvn.means(r) = oldMeans(ro);
+		for (int c = 1; c <= r; c++)
+		  if (c != p)
+		    cov(r,c) = oldCov(ro, (c < p) ? c : c-1);
 	      }
+	    mvn.means(p) = val;
+	    cov(p,p) = var;
+	    mvn.SetCovariance(cov);
+	    break;
+	  }
+	}
+    }
+}
 
-	    EasyLog::StartLogUsingStream(cout);
-
-	    /* parse command line arguments*/
-	    bool verbose=args.ReadBool("v");
+void WriteImages(const vector<MVNOp>& ops, const NiftiWriter& writer, bool verbose)
+{
+  for (unsigned i = 0; i < ops.size(); i++)
+    {
+      if (ops[i].IsEdit()) continue;
+      if (verbose) cout << "Writing output file " << ops[i].outfile << endl;
+      NiftiWriter::Job job;
+      job.filename = ops[i].outfile;
+      job.data = ops[i].image;
+      writer.Write(job);
+    }
+}
 
-	    string infile;
-	    string outfile;
-	    infile = args.Read("input");
-	    string maskfile;
-	    maskfile = args.Read("mask");
+// Build the single operation described by the command-line options
+MVNOp OpFromArgs(EasyOptions& args, const vector<string>& fileNames, 
+		 const string& infile, const string& outfile)
+{
+	    MVNOp op;
 	    int param=0;
 	    int cparam=0;
-	    outfile = args.ReadWithDefault("output",infile);
 
 	    bool ins; bool write;
 
-	    double val;	double var;
-	    string valimfile; string varimfile;
-	    bool bval=false;bool bvar=false;bool cvar=false;
 	    /* Choose what we want to do to/with the parameter - default is to read */
 	    ins = args.ReadBool("new"); //insert a new parameter
 	    write = args.ReadBool("write"); //overwrite an existing parameter
@@ -127,11 +318,12 @@ int main(int argc, char** argv)
 // determine which parameter we are reading/writing etc
 	    string plistfile = args.ReadWithDefault("param-list","");
 	    if (plistfile=="")
-	      { //use must have specified a parameter number
-		param = convertTo<int>(args.Read("param"));
+	      { //use must have specified a parameter number (or name, for .mvn files)
+		param = ParamNumber(args.Read("param"), fileNames);
 
 		//deal with --cvar option
-		cparam = convertTo<int>(args.ReadWithDefault("cvar","0"));
+		string cvarparam = args.ReadWithDefault("cvar","0");
+		if (cvarparam != "0") cparam = ParamNumber(cvarparam, fileNames);
 	      }
 	    else
 	      {
@@ -165,6 +357,7 @@ int main(int argc, char** argv)
 		  { //deal with current and new parameter lists
 		    // if we are here we must be inserting a new parameter
 		    ins=true;
+		    op.name = paramname;
 
 		    //load new parameter list
 		    ifstream newparamFile((nplistfile).c_str());
@@ -227,175 +420,154 @@ int main(int argc, char** argv)
 		  }
 	      }
 
+	    op.param = param;
+	    op.cparam = cparam;
 
 	    // Deal with --val and --var
 	    if (ins | write) {
 	      if (ins & write) { throw Invalid_option("Cannot insert and write at same time - choose either --new or --write"); }
 		
+		op.kind = ins ? MVNOp::INSERT : MVNOp::WRITE;
+		op.valim = args.ReadWithDefault("valim","");
+		op.varim = args.ReadWithDefault("varim","");
 
-		valimfile = args.ReadWithDefault("valim","");
-		varimfile = args.ReadWithDefault("varim","");
-
-		val = convertTo<double>(args.ReadWithDefault("val","-1e-6"));
-		var = convertTo<double>(args.ReadWithDefault("var","-1e-6"));
+		op.val = convertTo<double>(args.ReadWithDefault("val","-1e-6"));
+		op.var = convertTo<double>(args.ReadWithDefault("var","-1e-6"));
 	      }
 	    else {
 	      if (outfile==infile) throw Invalid_option("Output filename has not been specified");
 
-	      bval = args.ReadBool("val");
-	      bvar = args.ReadBool("var");
-	      if (cparam>0) cvar=true;
+	      bool bval = args.ReadBool("val");
+	      bool bvar = args.ReadBool("var");
+	      bool cvar = (cparam>0);
 
 	      if (bval & bvar) { throw Invalid_option("Cannot output value and variance at same time - choose either --val or --val"); }
 	      if (bval & cvar) { throw Invalid_option("Cannot output value and covariance at same time"); }
 	      if (bvar & cvar) { throw Invalid_option("Cannot output variance and covariance at same time"); }
 	      if (!bval & !bvar & !cvar) { throw Invalid_option("Please select whether you want to extract the value (--val) or the variance (--var) or a covaraince (--cvar)"); }
+
+	      op.kind = bval ? MVNOp::VAL : (bvar ? MVNOp::VAR : MVNOp::CVAR);
+	      op.outfile = outfile;
 	    }
 
+	    return op;
+}
 
+int main(int argc, char** argv)
+{
+	try
+	  {
+	    cout << "FABBER: MVNtool" << endl;
 
-	    /* Read in MVN file */
-	    volume<float> mask;
-            read_volume(mask,maskfile);
-	    mask.binarise(1e-16,mask.max()+1,exclusive);
+	    EasyOptions args(argc, argv);
 
-	    if (verbose) cout << "Read file" << endl;
-	    vector<MVNDist*> vmvnin;
-	    MVNDist::Load(vmvnin,infile,mask);
+	    if (args.ReadBool("help"))
+	      {
+		Usage();
+		return 0;
+	      }
 
-	    
-	    if (ins | write) {
-		/* section to deal with writing to or inserting into an MVN*/
+	    EasyLog::StartLogUsingStream(cout);
 
-	      // deal with the values we are going to insert
-	      ColumnVector inmean(vmvnin.size());
-	      ColumnVector invar(vmvnin.size());
-	      if (valimfile=="") {
-		inmean=val;
-	      }
-	      else {
-		volume4D<float> valimvol;
-		read_volume4D(valimvol,valimfile);
-		inmean = (valimvol.matrix(mask)).AsColumn();
-	      }
-	      if (varimfile=="") {
-		invar=var;
-	      }
-	      else {
-		volume4D<float> varimvol;
-		read_volume4D(varimvol,varimfile);
-		invar = (varimvol.matrix(mask)).AsColumn();
-	      }
+	    /* parse command line arguments*/
+	    bool verbose=args.ReadBool("v");
 
+	    string infile;
+	    string outfile;
+	    infile = args.Read("input");
+	    string maskfile;
+	    maskfile = args.ReadWithDefault("mask",""); // .mvn files carry their own
+	    outfile = args.ReadWithDefault("output",infile);
+	    string script = args.ReadWithDefault("script","");
 
-		vector<MVNDist*> vmvnout(vmvnin);
+	    // .mvn files know their parameter names
+	    vector<string> fileNames;
+	    if (IsMVNFile(infile))
+	      fileNames = MVNFile(infile).Names();
 
-		int oldsize;
-		MVNDist mvnin;
-		mvnin = *vmvnin[1];
-		oldsize = mvnin.GetSize();
+	    vector<MVNOp> ops;
+	    if (script != "")
+	      ParseScript(script, fileNames, ops);
+	    else
+	      ops.push_back(OpFromArgs(args, fileNames, infile, outfile));
 
-		if (ins)
-		  { 
-		    if (verbose) cout << "Inserting new parameter" << endl;
-		    if (param > oldsize+1) throw Invalid_option("Cannot insert parameter here, not enough parameters in existing MVN");
-		  }
-		else
-		  { if (param > oldsize) throw Invalid_option("Cannot edit this parameter, not enough parameters in existing MVN");}
-		SymmetricMatrix mvncov;
-		MVNDist mvnnew(1);
-		mvnnew.means = 0;
-		SymmetricMatrix covnew(1);
-		covnew(1,1) = 0;
-		mvnnew.SetCovariance(covnew);
-		MVNDist mvnout;
-		
-		/* Loop over each enrty in mvnin - each voxel! */
-		for (unsigned v=0;v < vmvnin.size(); v++)
-		  {
-		    mvnin = *vmvnin[v];
-		    
-		    if (ins)
-		      { /* insert new parameter */
-			//cout << "Add new parameter" << endl;
-			
-			if (param-1 >= 1)
-			  {
-			    MVNDist mvn1(param -1);
-			    mvn1.CopyFromSubmatrix(mvnin,1,param -1,0);
-			    mvnout=MVNDist(mvn1,mvnnew);
-			  }
-			else
-			  {
-			    mvnout = mvnnew;
-			  }
-			
-			if (oldsize >= param)
-			  {
-			    MVNDist mvn2(oldsize+1-param);
-			    mvn2.CopyFromSubmatrix(mvnin,param,oldsize,0);
-			    mvnout=MVNDist(mvnout,mvn2);
-			  }
-   
-			mvncov = mvnout.GetCovariance();
-		      }
-		    else
-		      { 
-			mvnout = mvnin;
-			mvncov = mvnin.GetCovariance();
-		      }
-		    
-		    /* Set parameters mean value and variance*/
-		    //cout << "Set parameter mean and variance" << endl;
-		    mvnout.means(param) = inmean(v+1);
-		    mvncov(param,param) = invar(v+1);
-		    mvnout.SetCovariance(mvncov);
-		    
-		    vmvnout[v] = new MVNDist(mvnout);
-		  }
+	    bool edits = false, inserts = false;
+	    for (unsigned i = 0; i < ops.size(); i++)
+	      {
+		edits = edits || ops[i].IsEdit();
+		inserts = inserts || ops[i].kind == MVNOp::INSERT;
+	      }
 
-		/* Save MVN to output */
-		if (verbose) cout << "Save file" << endl;
-		MVNDist::Save(vmvnout,outfile,mask);
+	    volume<float> mask;
+	    if (maskfile != "")
+	      {
+		read_volume(mask,maskfile);
+		mask.binarise(1e-16,mask.max()+1,exclusive);
 	      }
 
-	    else {
-	      /* Section to deal with reading a parameter out to an image */
-	      int nVoxels = vmvnin.size();
-	      Matrix image;
-	      image.ReSize(1,nVoxels);
-
-	      if (bval) {
-		if (verbose) cout << "Extracting value for parameter:" << param << endl;
-		for (int vox = 1; vox <= nVoxels; vox++)
+	    if (IsMVNFile(infile) && (!edits || IsMVNFile(outfile)))
+	      {
+		/* Stream through a mapped .mvn: one voxel at a time, and 
+		   overwrites happen in place */
+		const bool inPlace = edits && !inserts && outfile == infile;
+		MVNFile in(infile, inPlace);
+		if (maskfile != "") in.CheckMask(mask);
+		CheckOps(ops, in.NumParams());
+		PrepareOps(ops, in.MaskIndex());
+
+		MVNFile* out = NULL;
+		string tmpfile = outfile;
+		if (edits && !inPlace)
 		  {
-		    image(1,vox) = vmvnin[vox-1]->means(param);
+		    vector<string> names = in.Names();
+		    for (unsigned i = 0; i < ops.size(); i++)
+		      if (ops[i].kind == MVNOp::INSERT)
+			names.insert(names.begin() + ops[i].param - 1, 
+				     ops[i].name != "" ? ops[i].name : "param" + stringify(ops[i].param));
+		    if (outfile == infile) tmpfile = outfile + ".tmp";
+		    out = new MVNFile(tmpfile, in, names, in.NumNoise());
 		  }
-	      }
-	      else if (bvar) {
-		if (verbose) cout << "Extracting variance for parameter:" << param << endl;
-		for (int vox = 1; vox <= nVoxels; vox++)
+
+		if (verbose) cout << "Processing " << in.NumVoxels() << " voxels" << endl;
+		MVNDist mvn;
+		for (int vox = 0; vox < in.NumVoxels(); vox++)
 		  {
-		    image(1,vox) = vmvnin[vox-1]->GetCovariance()(param,param);
+		    in.Read(vox, mvn);
+		    ApplyOps(ops, vox, mvn);
+		    if (inPlace) in.Write(vox, mvn);
+		    else if (out != NULL) out->Write(vox, mvn);
 		  }
+		delete out;
+		if (tmpfile != outfile && rename(tmpfile.c_str(), outfile.c_str()) != 0)
+		  throw Invalid_option("Couldn't replace " + outfile);
+
+		WriteImages(ops, NiftiWriter(in.Grid(), in.MaskIndex()), verbose);
 	      }
-	      else if (cvar) {
-		if (verbose) cout << "Extracting co-variance for parameter " << param << "with parameter" << cparam << endl;
-		for (int vox =1; vox <= nVoxels; vox++)
+	    else
+	      {
+		/* NIFTI MVNs: load everything, as before */
+		if (maskfile == "") throw Invalid_option("--mask is needed for NIFTI MVN files");
+
+		if (verbose) cout << "Read file" << endl;
+		vector<MVNDist*> vmvn;
+		MVNDist::Load(vmvn,infile,mask);
+		CheckOps(ops, vmvn.at(0)->GetSize());
+
+		NiftiWriter writer(mask);
+		PrepareOps(ops, writer.MaskIndex());
+		for (unsigned v = 0; v < vmvn.size(); v++)
+		  ApplyOps(ops, v, *vmvn[v]);
+
+		if (edits)
 		  {
-		    image(1,vox) = vmvnin[vox-1]->GetCovariance()(param,cparam);
+		    /* Save MVN to output */
+		    if (verbose) cout << "Save file" << endl;
+		    MVNDist::Save(vmvn,outfile,mask);
 		  }
+		WriteImages(ops, writer, verbose);
+		for (unsigned v = 0; v < vmvn.size(); v++)
+		  delete vmvn[v];
 	      }
-
-	      if (verbose) cout << "Writing output file" << endl;
-
-              volume4D<float> output(mask.xsize(),mask.ysize(),mask.zsize(),1);
-	      copybasicproperties(mask,output);
-	      output.setmatrix(image,mask);
-	      output.setDisplayMaximumMinimum(output.max(),output.min());
-	      output.set_intent(NIFTI_INTENT_NONE,0,0,0);
-	      save_volume4D(output,outfile);
-	    }
 	      
 	    if (verbose) cout << "Done." << endl;
 	    
@@ -410,6 +582,10 @@ int main(int argc, char** argv)
 	  {
 	    cout << Exception::what() << endl;
 	  }
+	catch (const exception& e)
+	  {
+	    cout << e.what() << endl;
+	  }
 	catch (...)
 	  {
 	    cout << "There was an error!" << endl;
@@ -424,8 +600,9 @@ void Usage(const string& errorString)
        << "Arguments are mandatory unless they appear in [brackets].\n\n";
 
   cout << " --help : Prints this information." << endl
-       << " --input=<MVNfile> : Name of input MVN file." << endl
-       << " --param=<n> : Number of parameter to read/replace/insert." << endl << endl
+       << " --input=<MVNfile> : Name of input MVN file (NIFTI, or a .mvn file)." << endl
+       << " --mask=<NIFTIfile> : Mask the MVN was saved with (optional for .mvn files)." << endl
+       << " --param=<n> : Number (or, for .mvn files, name) of parameter to read/replace/insert." << endl << endl
        << " Extract behaviour (default):" << endl
        << " --output=<NIFIfile> : Name of file for output" << endl
        << "   [--val] : Write parameter value to file." << endl
@@ -437,7 +614,21 @@ void Usage(const string& errorString)
        << " --valim=<NIFITfile> : Image to write for mean of parameter." << endl
        << " --varim=<NIFITfile> : Image to write for variance of parameter." << endl
        << " --val=<mean_value>  : Mean value for parameter to be written." << endl
-       << " --var=<variance>    : Variance of parameter to be written." << endl
+       << " --var=<variance>    : Variance of parameter to be written." << endl << endl
+       << " Batch behaviour:" << endl
+       << " --script=<file> : Apply every operation in the file in a single pass, one per line:" << endl
+       << "     val <param> <NIFTIfile>" << endl
+       << "     var <param> <NIFTIfile>" << endl
+       << "     cvar <param> <param2> <NIFTIfile>" << endl
+       << "     write <param> <mean> <variance>" << endl
+       << "     new <param> <mean> <variance> [<name>]" << endl
+       << "   where <mean> and <variance> are numbers or NIFTI files." << endl
+       << "[--output]=<MVNfile> : Name of file for output if there are edits, overwrites input if not set" << endl
+       << endl
+       << " .mvn files are edited through a memory-mapped view, one voxel at a time;" << endl
+       << " overwriting parameters of a .mvn in place doesn't rewrite the rest of the file." << endl
+       << " The MVNs are never all in memory at once, but each value image and each output" << endl
+       << " image is (one float per masked voxel)." << endl
        << endl;
 }
 
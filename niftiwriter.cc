@@ -0,0 +1,806 @@
+/*  niftiwriter.cc - Fast writer for masked FABBER results
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include "niftiwriter.h"
+#include "maskedfile.h"
+#include "easylog.h"
+#include "easyoptions.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "zlib.h"
+
+using namespace NEWIMAGE;
+
+NiftiWriter::NiftiWriter(const volume<float>& mask)
+{
+  Tracer_Plus tr("NiftiWriter::NiftiWriter");
+
+  nx = mask.xsize(); ny = mask.ysize(); nz = mask.zsize();
+
+  // Get the voxel order the same way DataSet gets its coordinates, so it's
+  // guaranteed to match setmatrix/matrix(mask)
+  volume4D<float> coordvol(nx, ny, nz, 3);
+  for (int z = 0; z < nz; z++)
+    for (int y = 0; y < ny; y++)
+      for (int x = 0; x < nx; x++)
+        {
+          coordvol(x,y,z,0) = x;
+          coordvol(x,y,z,1) = y;
+          coordvol(x,y,z,2) = z;
+        }
+  Matrix coords = coordvol.matrix(mask);
+  maskIndex.resize(coords.Ncols());
+  for (int v = 0; v < coords.Ncols(); v++)
+    {
+      maskIndex[v] = long(coords(1,v+1)) 
+        + nx * (long(coords(2,v+1)) + ny * long(coords(3,v+1)));
+      assert(v == 0 || maskIndex[v] > maskIndex[v-1]);
+    }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.sizeof_hdr = sizeof(hdr);
+  hdr.dim[0] = 4;
+  hdr.dim[1] = nx; hdr.dim[2] = ny; hdr.dim[3] = nz;
+  hdr.dim[4] = hdr.dim[5] = hdr.dim[6] = hdr.dim[7] = 1;
+  hdr.pixdim[1] = mask.xdim(); 
+  hdr.pixdim[2] = mask.ydim(); 
+  hdr.pixdim[3] = mask.zdim();
+  hdr.pixdim[4] = 1;
+  hdr.datatype = DT_FLOAT32;
+  hdr.bitpix = 32;
+  hdr.vox_offset = 352;
+  hdr.scl_slope = 1;
+  hdr.xyzt_units = NIFTI_UNITS_MM | NIFTI_UNITS_SEC;
+  strcpy(hdr.descrip, "FABBER");
+  strcpy(hdr.magic, "n+1");
+
+  hdr.sform_code = mask.sform_code();
+  Matrix smat = mask.sform_mat();
+  for (int c = 0; c < 4; c++)
+    {
+      hdr.srow_x[c] = smat(1,c+1);
+      hdr.srow_y[c] = smat(2,c+1);
+      hdr.srow_z[c] = smat(3,c+1);
+    }
+
+  hdr.qform_code = mask.qform_code();
+  Matrix qmat = mask.qform_mat();
+  mat44 R;
+  for (int r = 0; r < 4; r++)
+    for (int c = 0; c < 4; c++)
+      R.m[r][c] = qmat(r+1,c+1);
+  float dx, dy, dz, qfac;
+  nifti_mat44_to_quatern(R, &hdr.quatern_b, &hdr.quatern_c, &hdr.quatern_d,
+                         &hdr.qoffset_x, &hdr.qoffset_y, &hdr.qoffset_z,
+                         &dx, &dy, &dz, &qfac);
+  hdr.pixdim[0] = qfac;
+
+  SetCompression();
+}
+
+NiftiWriter::NiftiWriter(const nifti_1_header& grid, const vector<long>& index)
+  : hdr(grid), maskIndex(index)
+{
+  nx = hdr.dim[1]; ny = hdr.dim[2]; nz = hdr.dim[3];
+  for (unsigned v = 1; v < maskIndex.size(); v++)
+    if (maskIndex[v] <= maskIndex[v-1])
+      throw Invalid_option("NiftiWriter: mask index isn't in ascending order");
+  SetCompression();
+}
+
+void NiftiWriter::SetCompression()
+{
+  // Same convention as the rest of FSL: plain .nii only if asked for
+  const char* outputType = getenv("FSLOUTPUTTYPE");
+  compress = !(outputType != NULL && string(outputType) == "NIFTI");
+}
+
+int NiftiWriter::Level(const Format& format) const
+{
+  if (format.level == DefaultLevel)
+    return compress ? 6 : 0; // 6 is what gzopen uses
+  return max(0, min(9, format.level));
+}
+
+// Small wrapper so the same code writes .nii and .nii.gz.  The file is
+// written under a temporary name and only renamed once it's complete, so
+// anything watching for the results never sees half a file.
+class NiftiFile {
+public:
+  NiftiFile(const string& name, int level) 
+    : filename(name), part(name + ".part"), fp(NULL), gz(NULL) 
+  {
+    if (level > 0)
+      {
+        const char mode[4] = { 'w', 'b', char('0' + level), 0 };
+        gz = gzopen(part.c_str(), mode);
+      }
+    else
+      fp = fopen(part.c_str(), "wb");
+    if (fp == NULL && gz == NULL)
+      throw runtime_error("Couldn't open " + part + " for writing");
+  }
+  ~NiftiFile() 
+  { 
+    if (fp != NULL || gz != NULL) // never finished
+      {
+        Finish();
+        remove(part.c_str());
+      }
+  }
+  bool Put(const void* buf, size_t len)
+  {
+    if (gz != NULL)
+      return gzwrite(gz, buf, len) == int(len);
+    return fwrite(buf, 1, len, fp) == len;
+  }
+  bool Close()
+  {
+    const bool ok = Finish() && rename(part.c_str(), filename.c_str()) == 0;
+    if (!ok)
+      remove(part.c_str());
+    return ok;
+  }
+private:
+  string filename, part;
+  FILE* fp;
+  gzFile gz;
+  bool Finish()
+  {
+    bool ok = true;
+    if (gz != NULL) { ok = (gzclose(gz) == Z_OK); gz = NULL; }
+    if (fp != NULL) { ok = (fclose(fp) == 0); fp = NULL; }
+    return ok;
+  }
+};
+
+string NiftiWriter::FullName(const string& name, int level, bool masked) const
+{
+  // Like save_volume, accept names with or without an extension
+  string filename = name;
+  const char* exts[] = { ".nii.gz", ".nii", ".masked.gz", ".masked" };
+  for (int i = 0; i < 4; i++)
+    {
+      const size_t len = strlen(exts[i]);
+      if (filename.size() > len 
+          && filename.compare(filename.size() - len, len, exts[i]) == 0)
+        {
+          filename.erase(filename.size() - len);
+          break;
+        }
+    }
+  return filename + (masked ? ".masked" : ".nii") + (level > 0 ? ".gz" : "");
+}
+
+nifti_1_header NiftiWriter::FileHeader(int nFrames, int intent, 
+                                       float lo, float hi, int datatype) const
+{
+  if (datatype != DT_FLOAT32 && datatype != DT_FLOAT64)
+    throw runtime_error("NiftiWriter only writes float32 or float64 files");
+  nifti_1_header h = hdr;
+  h.dim[4] = nFrames;
+  h.intent_code = intent;
+  h.datatype = datatype;
+  h.bitpix = (datatype == DT_FLOAT64) ? 64 : 32;
+  // Range is over the whole volume, so includes the zeros outside the mask
+  if (long(maskIndex.size()) < long(nx) * ny * nz) 
+    { if (lo > 0) lo = 0; if (hi < 0) hi = 0; }
+  h.cal_min = lo;
+  h.cal_max = hi;
+  return h;
+}
+
+void NiftiWriter::Write(const Job& job) const
+{
+  const long nVox = maskIndex.size();
+  if (long(job.data.size()) != nVox * job.nFrames)
+    throw runtime_error("Wrong amount of data for " + job.filename);
+
+  float lo = 0, hi = 0;
+  if (!job.data.empty())
+    {
+      lo = hi = job.data[0];
+      for (size_t i = 1; i < job.data.size(); i++)
+        {
+          if (job.data[i] < lo) lo = job.data[i];
+          if (job.data[i] > hi) hi = job.data[i];
+        }
+    }
+
+  FrameStream out(*this, job.filename, job.nFrames, job.intent, lo, hi, job.format);
+  out.Put(job.data.empty() ? NULL : &job.data[0], job.nFrames);
+  out.Close();
+}
+
+NiftiWriter::FrameStream::FrameStream(const NiftiWriter& w, const string& name,
+                                      int nFrames, int intent, float lo, float hi,
+                                      const Format& format)
+  : writer(w), file(NULL), 
+    filename(w.FullName(name, w.Level(format), format.masked)), 
+    datatype(format.datatype), masked(format.masked), framesLeft(nFrames), 
+    ok(true), slice(masked ? 0 : long(w.nx) * w.ny)
+{
+  const nifti_1_header h = writer.FileHeader(nFrames, intent, lo, hi, datatype);
+  file = new NiftiFile(filename, writer.Level(format));
+  if (masked)
+    {
+      MaskedFileHeader mh;
+      memset(&mh, 0, sizeof(mh));
+      memcpy(mh.magic, maskedFileMagic, sizeof(maskedFileMagic));
+      mh.version = 1;
+      mh.datatype = datatype;
+      mh.nFrames = nFrames;
+      mh.intent = intent;
+      mh.nVoxels = writer.maskIndex.size();
+      mh.lo = lo;
+      mh.hi = hi;
+      mh.grid = writer.hdr;
+      vector<int64_t> index(writer.maskIndex.begin(), writer.maskIndex.end());
+      ok = file->Put(&mh, sizeof(mh)) 
+        && (index.empty() || file->Put(&index[0], index.size() * sizeof(int64_t)));
+    }
+  else
+    {
+      const char extender[4] = { 0, 0, 0, 0 };
+      ok = file->Put(&h, sizeof(h)) && file->Put(extender, sizeof(extender));
+    }
+}
+
+NiftiWriter::FrameStream::~FrameStream()
+{
+  delete file;
+}
+
+void NiftiWriter::FrameStream::Put(const float* frames, int n)
+{
+  PutFrames(frames, n);
+}
+
+void NiftiWriter::FrameStream::Put(const double* frames, int n)
+{
+  PutFrames(frames, n);
+}
+
+template <class T>
+void NiftiWriter::FrameStream::PutFrames(const T* frames, int n)
+{
+  const long nVox = writer.maskIndex.size();
+  if (n > framesLeft)
+    throw runtime_error("Too many frames for " + filename);
+  framesLeft -= n;
+
+  for (int t = 0; ok && t < n; t++)
+    {
+      const T* frame = frames + t * nVox;
+      if (masked)
+        {
+          ok = Emit(frame, nVox);
+          continue;
+        }
+
+      // Voxels are in ascending grid order, so just fill in a slice at a time
+      const long sliceSize = slice.size();
+      long v = 0;
+      for (int z = 0; ok && z < writer.nz; z++)
+        {
+          const long sliceStart = z * sliceSize;
+          fill(slice.begin(), slice.end(), 0.0);
+          for (; v < nVox && writer.maskIndex[v] < sliceStart + sliceSize; v++)
+            slice[writer.maskIndex[v] - sliceStart] = frame[v];
+          ok = Emit(&slice[0], sliceSize);
+        }
+    }
+}
+
+template <class T>
+bool NiftiWriter::FrameStream::Emit(const T* values, long n)
+{
+  if (n == 0)
+    return true;
+  if (datatype == DT_FLOAT64)
+    {
+      wide.assign(values, values + n);
+      return file->Put(&wide[0], n * sizeof(double));
+    }
+  narrow.assign(values, values + n);
+  return file->Put(&narrow[0], n * sizeof(float));
+}
+
+void NiftiWriter::FrameStream::Close()
+{
+  if (!file->Close() || !ok || framesLeft != 0)
+    throw runtime_error("Error writing " + filename);
+}
+
+namespace {
+  struct WriteQueue {
+    const NiftiWriter* writer;
+    const vector<NiftiWriter::Job>* jobs;
+    size_t next;
+    string error;
+    pthread_mutex_t lock;
+  };
+
+  void* WriteWorker(void* arg)
+  {
+    WriteQueue& q = *static_cast<WriteQueue*>(arg);
+    while (true)
+      {
+        pthread_mutex_lock(&q.lock);
+        size_t i = q.next++;
+        pthread_mutex_unlock(&q.lock);
+        if (i >= q.jobs->size()) 
+          break;
+        try {
+          q.writer->Write((*q.jobs)[i]);
+        } catch (const exception& e) {
+          pthread_mutex_lock(&q.lock);
+          if (q.error.empty()) q.error = e.what();
+          pthread_mutex_unlock(&q.lock);
+        }
+      }
+    return NULL;
+  }
+}
+
+void NiftiWriter::WriteInParallel(const vector<Job>& jobs, int nThreads) const
+{
+  Tracer_Plus tr("NiftiWriter::WriteInParallel");
+
+  WriteQueue q;
+  q.writer = this;
+  q.jobs = &jobs;
+  q.next = 0;
+  pthread_mutex_init(&q.lock, NULL);
+
+  // This thread always takes part, so nThreads <= 1 means run serially
+  vector<pthread_t> threads;
+  for (int i = 1; i < nThreads && i < int(jobs.size()); i++)
+    {
+      pthread_t th;
+      if (pthread_create(&th, NULL, WriteWorker, &q) == 0)
+        threads.push_back(th);
+    }
+  WriteWorker(&q);
+  for (unsigned i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_mutex_destroy(&q.lock);
+  if (!q.error.empty())
+    throw runtime_error(q.error);
+}
+
+// A file that's written as its voxels become available.  Frames are stored
+// one after another, so for a .nii.gz each frame is compressed separately
+// as a raw deflate stream ending on a byte boundary (Z_SYNC_FLUSH).  Once
+// all the voxels are in, the header is compressed the same way and the 
+// pieces are joined into a single gzip member, with the CRCs combined -- 
+// the same trick pigz uses.  A .nii is simply written in place.  Either
+// way it's only renamed to its real name once it's complete.
+class NiftiWriter::VoxelStream {
+public:
+  VoxelStream(const NiftiWriter& w, const Job& j)
+    : writer(w), job(j), level(w.Level(j.format)), 
+      filename(w.FullName(j.filename, level, j.format.masked)), part(filename + ".part"), 
+      fp(NULL), done(0), gridDone(0), lo(0), hi(0)
+  {
+    if (long(job.data.size()) != long(writer.maskIndex.size()) * job.nFrames)
+      throw runtime_error("Wrong amount of data for " + job.filename);
+    if (job.format.datatype != DT_FLOAT32 && job.format.datatype != DT_FLOAT64)
+      throw runtime_error("NiftiWriter only writes float32 or float64 files");
+    if (job.format.masked)
+      return; // nothing to gain from writing these early, see Close
+    if (level > 0)
+      {
+        pieces.resize(job.nFrames + 1); // header last, written first
+        for (unsigned i = 0; i < pieces.size(); i++)
+          {
+            memset(&pieces[i].strm, 0, sizeof(z_stream));
+            if (deflateInit2(&pieces[i].strm, level, Z_DEFLATED, 
+                             -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+              throw runtime_error("Couldn't start compressing " + filename);
+            pieces[i].crc = crc32(0L, Z_NULL, 0);
+            pieces[i].len = 0;
+          }
+      }
+    else
+      {
+        fp = fopen(part.c_str(), "wb");
+        if (fp == NULL)
+          throw runtime_error("Couldn't open " + part + " for writing");
+      }
+  }
+
+  ~VoxelStream()
+  {
+    for (unsigned i = 0; i < pieces.size(); i++)
+      deflateEnd(&pieces[i].strm);
+    if (fp != NULL) // never finished, so don't leave half a file
+      {
+        fclose(fp);
+        remove(part.c_str());
+      }
+  }
+
+  // The first n voxels are final: write out the grid up to the last of them
+  void Put(long n)
+  {
+    if (n > done && !job.format.masked)
+      Advance(n, writer.maskIndex[n-1] + 1);
+  }
+
+  void Close()
+  {
+    // A masked file is just the job's data in order, so is quick to write
+    // once it's all there
+    if (job.format.masked)
+      {
+        writer.Write(job);
+        return;
+      }
+
+    const long gridSize = long(writer.nx) * writer.ny * writer.nz;
+    Advance(done, gridSize);
+
+    nifti_1_header h = writer.FileHeader(job.nFrames, job.intent, lo, hi, 
+                                         job.format.datatype);
+    char head[sizeof(h) + 4];
+    memcpy(head, &h, sizeof(h));
+    memset(head + sizeof(h), 0, 4); // no extensions
+
+    bool ok = true;
+    if (fp != NULL)
+      {
+        ok = pwrite(fileno(fp), head, sizeof(head), 0) == ssize_t(sizeof(head))
+          && fclose(fp) == 0;
+        fp = NULL;
+      }
+    else
+      {
+        Piece& header = pieces.back();
+        ok = Deflate(header, head, sizeof(head));
+        for (unsigned i = 0; ok && i < pieces.size(); i++)
+          ok = Deflate(pieces[i], NULL, 0, Z_SYNC_FLUSH);
+
+        // Header piece, frames in order, an empty final block, then the 
+        // gzip trailer
+        uLong crc = header.crc, len = header.len;
+        for (int f = 0; f < job.nFrames; f++)
+          {
+            crc = crc32_combine(crc, pieces[f].crc, pieces[f].len);
+            len += pieces[f].len;
+          }
+        const unsigned char gzHeader[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+        const unsigned char lastBlock[2] = { 3, 0 };
+        unsigned char trailer[8];
+        for (int b = 0; b < 4; b++)
+          {
+            trailer[b] = (crc >> (8*b)) & 0xff;
+            trailer[4+b] = (len >> (8*b)) & 0xff;
+          }
+
+        FILE* out = ok ? fopen(part.c_str(), "wb") : NULL;
+        ok = out != NULL 
+          && fwrite(gzHeader, 1, sizeof(gzHeader), out) == sizeof(gzHeader)
+          && Put(out, header);
+        for (int f = 0; ok && f < job.nFrames; f++)
+          ok = Put(out, pieces[f]);
+        ok = ok && fwrite(lastBlock, 1, 2, out) == 2 
+          && fwrite(trailer, 1, 8, out) == 8;
+        if (out != NULL && fclose(out) != 0)
+          ok = false;
+      }
+    ok = ok && rename(part.c_str(), filename.c_str()) == 0;
+    if (!ok)
+      {
+        remove(part.c_str());
+        throw runtime_error("Error writing " + filename);
+      }
+  }
+
+private:
+  struct Piece {
+    z_stream strm;
+    vector<unsigned char> out;
+    uLong crc, len;
+  };
+
+  const NiftiWriter& writer;
+  const Job& job;
+  int level;
+  string filename, part;
+  vector<Piece> pieces;  // if compressing
+  FILE* fp;              // if not
+  long done;             // voxels written so far
+  long gridDone;         // ...and the grid positions they've taken up to
+  float lo, hi;
+  vector<float> buf;
+  vector<double> wide;   // buf converted for DT_FLOAT64
+
+  static bool Deflate(Piece& p, const void* data, size_t n, int flush = Z_NO_FLUSH)
+  {
+    if (n > 0) // crc32() of NULL is the initial value
+      p.crc = crc32(p.crc, static_cast<const Bytef*>(data), n);
+    p.len += n;
+    p.strm.next_in = static_cast<Bytef*>(const_cast<void*>(data));
+    p.strm.avail_in = n;
+    do
+      {
+        const size_t used = p.out.size();
+        const size_t chunk = 1 << 16;
+        p.out.resize(used + chunk);
+        p.strm.next_out = &p.out[used];
+        p.strm.avail_out = chunk;
+        if (deflate(&p.strm, flush) == Z_STREAM_ERROR)
+          return false;
+        p.out.resize(used + chunk - p.strm.avail_out);
+      }
+    while (p.strm.avail_out == 0 || p.strm.avail_in > 0);
+    return true;
+  }
+
+  static bool Put(FILE* out, Piece& p)
+  {
+    const bool ok = p.out.empty() || fwrite(&p.out[0], 1, p.out.size(), out) == p.out.size();
+    vector<unsigned char>().swap(p.out);
+    return ok;
+  }
+
+  // Write voxels [done, n) and grid positions [gridDone, gridEnd) of every 
+  // frame, a window of the grid at a time
+  void Advance(long n, long gridEnd)
+  {
+    const long nVox = writer.maskIndex.size();
+    const long gridSize = long(writer.nx) * writer.ny * writer.nz;
+    const long window = 1 << 18;
+    long v = done;
+    for (long g0 = gridDone; g0 < gridEnd; g0 += window)
+      {
+        const long g1 = min(gridEnd, g0 + window);
+        const long v0 = v;
+        while (v < n && writer.maskIndex[v] < g1)
+          v++;
+        buf.resize(g1 - g0);
+        for (int f = 0; f < job.nFrames; f++)
+          {
+            fill(buf.begin(), buf.end(), 0.0f);
+            const float* frame = &job.data[0] + long(f) * nVox;
+            for (long u = v0; u < v; u++)
+              {
+                const float x = frame[u];
+                if (u == 0 && f == 0) lo = hi = x;
+                if (x < lo) lo = x;
+                if (x > hi) hi = x;
+                buf[writer.maskIndex[u] - g0] = x;
+              }
+            const void* out = &buf[0];
+            size_t bytes = sizeof(float);
+            if (job.format.datatype == DT_FLOAT64)
+              {
+                wide.assign(buf.begin(), buf.end());
+                out = &wide[0];
+                bytes = sizeof(double);
+              }
+            bool ok;
+            if (fp != NULL)
+              {
+                const off_t offset = (off_t(f) * gridSize + g0) * bytes + 352;
+                const ssize_t len = buf.size() * bytes;
+                ok = pwrite(fileno(fp), out, len, offset) == len;
+              }
+            else
+              ok = Deflate(pieces[f], out, buf.size() * bytes);
+            if (!ok)
+              throw runtime_error("Error writing " + filename);
+          }
+      }
+    done = n;
+    gridDone = gridEnd;
+  }
+
+  VoxelStream(const VoxelStream&);  // not allowed
+  VoxelStream& operator=(const VoxelStream&);
+};
+
+// The writing threads share a count of the voxels that are ready.  Each 
+// one looks after a fixed subset of the files.
+struct NiftiWriter::Background::Shared {
+  vector<VoxelStream*> streams;
+  int nThreads, nextId;
+  long ready;
+  bool finished, abandoned;
+  string error;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+void* NiftiWriter::Background::Work(void* arg)
+{
+  Shared& sh = *static_cast<Shared*>(arg);
+  pthread_mutex_lock(&sh.lock);
+  const int id = sh.nextId++;
+  pthread_mutex_unlock(&sh.lock);
+
+  long done = 0;
+  bool failed = false;
+  while (true)
+    {
+      pthread_mutex_lock(&sh.lock);
+      while (sh.ready == done && !sh.finished)
+        pthread_cond_wait(&sh.changed, &sh.lock);
+      const long n = sh.ready;
+      const bool last = sh.finished;
+      if (sh.abandoned)
+        failed = true; // leave the files unwritten
+      pthread_mutex_unlock(&sh.lock);
+
+      for (unsigned i = id; !failed && i < sh.streams.size(); i += sh.nThreads)
+        {
+          try {
+            sh.streams[i]->Put(n);
+            if (last)
+              sh.streams[i]->Close();
+          } catch (const exception& e) {
+            pthread_mutex_lock(&sh.lock);
+            if (sh.error.empty()) sh.error = e.what();
+            pthread_mutex_unlock(&sh.lock);
+            failed = true;
+          }
+        }
+      done = n;
+      if (last)
+        return NULL;
+    }
+}
+
+NiftiWriter::Background::Background(const NiftiWriter& writer, 
+                                    const vector<Job>& jobs, int nThreads)
+  : shared(new Shared)
+{
+  Tracer_Plus tr("NiftiWriter::Background::Background");
+
+  shared->nThreads = max(1, min(nThreads, int(jobs.size())));
+  shared->nextId = 0;
+  shared->ready = 0;
+  shared->finished = shared->abandoned = false;
+  pthread_mutex_init(&shared->lock, NULL);
+  pthread_cond_init(&shared->changed, NULL);
+  try {
+    for (unsigned i = 0; i < jobs.size(); i++)
+      shared->streams.push_back(new VoxelStream(writer, jobs[i]));
+  } catch (const exception& e) {
+    for (unsigned i = 0; i < shared->streams.size(); i++)
+      delete shared->streams[i];
+    shared->streams.clear();
+    throw Invalid_option(e.what());
+  }
+
+  // The threads wait for the lock before taking an id, so nThreads can 
+  // still be corrected if fewer of them start than were asked for
+  pthread_mutex_lock(&shared->lock);
+  for (int i = 0; i < shared->nThreads; i++)
+    {
+      pthread_t th;
+      if (pthread_create(&th, NULL, Work, shared) == 0)
+        threads.push_back(th);
+    }
+  shared->nThreads = threads.size();
+  pthread_mutex_unlock(&shared->lock);
+  if (threads.empty())
+    {
+      for (unsigned i = 0; i < shared->streams.size(); i++)
+        delete shared->streams[i];
+      shared->streams.clear();
+      throw Invalid_option("Couldn't start any output threads");
+    }
+}
+
+NiftiWriter::Background::~Background()
+{
+  // Without Finish (e.g. after an exception), the files are abandoned
+  pthread_mutex_lock(&shared->lock);
+  shared->finished = shared->abandoned = true;
+  pthread_cond_broadcast(&shared->changed);
+  pthread_mutex_unlock(&shared->lock);
+  for (unsigned i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+  for (unsigned i = 0; i < shared->streams.size(); i++)
+    delete shared->streams[i];
+  pthread_mutex_destroy(&shared->lock);
+  pthread_cond_destroy(&shared->changed);
+  delete shared;
+}
+
+void NiftiWriter::Background::VoxelsReady(long n)
+{
+  pthread_mutex_lock(&shared->lock);
+  if (n > shared->ready)
+    shared->ready = n;
+  pthread_cond_broadcast(&shared->changed);
+  pthread_mutex_unlock(&shared->lock);
+}
+
+void NiftiWriter::Background::Finish()
+{
+  if (threads.empty())
+    return;
+  pthread_mutex_lock(&shared->lock);
+  shared->finished = true;
+  pthread_cond_broadcast(&shared->changed);
+  pthread_mutex_unlock(&shared->lock);
+  for (unsigned i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+  threads.clear();
+  if (!shared->error.empty())
+    throw runtime_error(shared->error);
+}
@@ -0,0 +1,191 @@
+/*  niftiwriter.h - Fast writer for masked FABBER results
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "newimage/newimageall.h"
+
+using namespace std;
+using namespace NEWMAT;
+
+class NiftiFile; // .nii or .nii.gz output, see niftiwriter.cc
+
+// Writes masked voxel data straight to NIFTI-1 files on the mask's grid,
+// without building a full-size volume4D for every output.  Everything 
+// after construction works only on plain buffers, zlib and stdio (no
+// NEWMAT, no Tracer), so several files can safely be written at once 
+// from different threads; see WriteInParallel.
+class NiftiWriter {
+public:
+  // Take the grid geometry and voxel ordering from the mask.  Voxels are in
+  // the same order as volume4D::matrix(mask) gives them, i.e. the columns of 
+  // DataSet::GetVoxelData().
+  NiftiWriter(const NEWIMAGE::volume<float>& mask);
+
+  // Or from a header/index saved earlier (e.g. in a .mvn file)
+  NiftiWriter(const nifti_1_header& grid, const vector<long>& index);
+
+  // How a file is stored: DT_FLOAT32 or DT_FLOAT64, the gzip level (0 for
+  // none, or DefaultLevel to follow $FSLOUTPUTTYPE), and whether it's a 
+  // NIFTI file or just the masked voxels (a .masked file, see maskedfile.h)
+  enum { DefaultLevel = -1 };
+  struct Format {
+    int datatype;
+    int level;
+    bool masked;
+    Format() : datatype(DT_FLOAT32), level(DefaultLevel), masked(false) { return; }
+  };
+
+  // One output file.  data holds nFrames blocks of NumVoxels() values,
+  // one block per frame (the order they're written in).
+  struct Job {
+    string filename; // without extension
+    vector<float> data;
+    int nFrames;
+    int intent;
+    Format format;
+    Job() : nFrames(1), intent(NIFTI_INTENT_NONE) { return; }
+  };
+
+  void Write(const Job& job) const;
+  // Throws std::runtime_error on I/O failure (not Invalid_option, which
+  // isn't safe to construct off the main thread).
+
+  void WriteInParallel(const vector<Job>& jobs, int nThreads) const;
+  // Write all the jobs using up to nThreads threads.
+
+  // For outputs too big to hold at once: write a file a few frames at a 
+  // time, each frame being NumVoxels() values.  The header goes first, so
+  // the data range has to be known up front.
+  class FrameStream {
+  public:
+    FrameStream(const NiftiWriter& writer, const string& filename, 
+                int nFrames, int intent, float lo, float hi, 
+                const Format& format = Format());
+    ~FrameStream();
+    void Put(const float* frames, int n);
+    void Put(const double* frames, int n);
+    void Close(); // throws if anything failed
+  private:
+    const NiftiWriter& writer;
+    NiftiFile* file;
+    string filename;
+    int datatype;
+    bool masked;
+    int framesLeft;
+    bool ok;
+    vector<double> slice;
+    vector<float> narrow;
+    vector<double> wide;
+    template <class T> void PutFrames(const T* frames, int n);
+    template <class T> bool Emit(const T* values, long n); // as datatype
+    FrameStream(const FrameStream&);  // not allowed
+    FrameStream& operator=(const FrameStream&);
+  };
+  friend class FrameStream;
+
+  // Writes jobs in the background while their data is still being filled
+  // in, voxel by voxel in mask order.  Each file is built up (and 
+  // compressed) as its voxels arrive, so little is left to do once the 
+  // last one has.  The jobs mustn't move or change size meanwhile.
+  class Background {
+  public:
+    Background(const NiftiWriter& writer, const vector<Job>& jobs, int nThreads);
+    ~Background();
+    void VoxelsReady(long n); // the first n voxels of every job are final
+    void Finish();            // waits for all the files; throws if any failed
+  private:
+    struct Shared;
+    Shared* shared;
+    vector<pthread_t> threads;
+    static void* Work(void* shared); // each thread
+    Background(const Background&);  // not allowed
+    Background& operator=(const Background&);
+  };
+
+  class VoxelStream; // one of the Background's files, see niftiwriter.cc
+  friend class VoxelStream;
+
+  int NumVoxels() const { return maskIndex.size(); }
+  const vector<long>& MaskIndex() const { return maskIndex; }
+  const nifti_1_header& Header() const { return hdr; }
+
+private:
+  nifti_1_header hdr;   // geometry etc. taken from the mask
+  vector<long> maskIndex; // index of each masked voxel in the full grid (ascending)
+  int nx, ny, nz;
+  bool compress;        // .nii.gz (default) or .nii, from $FSLOUTPUTTYPE
+
+  void SetCompression();
+  int Level(const Format& format) const; // 0 (none) to 9
+  nifti_1_header FileHeader(int nFrames, int intent, float lo, float hi,
+                            int datatype) const;
+  string FullName(const string& name, int level, bool masked) const; // with the right extension
+};
@@ -89,6 +89,8 @@ double gammaln(double x)
 
 #include "noisemodel_ar.h"
 #include "noisemodel_white.h"
+#include "noisemodel_groups.h"
+#include "noisemodel_studentt.h"
 
 NoiseModel* NoiseModel::NewFromName(const string& name, ArgsType& args)
 {
@@ -120,6 +122,14 @@ NoiseModel* NoiseModel::NewFromName(const string& name, ArgsType& args)
       //      return new WhiteNoiseModel(pattern);
       return new WhiteNoiseModel(args);
     }
+    else if (name == "groups")
+    {
+      return new GroupedWhiteNoiseModel(args);
+    }
+    else if (name == "studentt")
+    {
+      return new StudentTNoiseModel(args);
+    }
     // Your models go here!
     else
     {
@@ -104,6 +104,10 @@ class NoiseModel {
     // Suggest some nice default values for noise parameters:
     virtual void HardcodedInitialDists(NoiseParams& prior, NoiseParams& posterior) const = 0;
 
+  // Name the noise parameters that should get their own output maps
+  // (mean_<name>).  Default is none, i.e. they only appear in finalMVN.
+    virtual void NameParams(vector<string>& names) const { names.clear(); }
+
   // Output your internal posterior distribution as an MVN.
   // (bit of a hack -- some noise models don't fit into the MVN framework well)
 //  virtual const MVNDist GetResultsAsMVN() const = 0;
@@ -0,0 +1,391 @@
+/*  noisemodel_groups.cc - Class implementation for the grouped white noise model
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include "noisemodel_groups.h"
+#include <fstream>
+#include <stdexcept>
+#include "miscmaths/miscmaths.h"
+using namespace MISCMATHS;
+using namespace Utilities;
+#include "easylog.h"
+
+void GroupedWhiteNoiseModel::HardcodedInitialDists(NoiseParams& priorIn,
+    NoiseParams& posteriorIn) const
+{
+    Tracer_Plus tr("GroupedWhiteNoiseModel::HardcodedInitialDists");
+    
+    GroupedWhiteParams& prior = dynamic_cast<GroupedWhiteParams&>(priorIn);
+    GroupedWhiteParams& posterior = dynamic_cast<GroupedWhiteParams&>(posteriorIn);
+    
+    assert(nGroups == prior.nPhis);
+    assert(nGroups == posterior.nPhis);
+
+    // Same as WhiteNoiseModel
+    for (int i = 0; i < nGroups; i++)
+    {
+	prior.phis[i].b = 1e6;
+	prior.phis[i].c = 1e-6;
+	posterior.phis[i].b = 1e-8;
+	posterior.phis[i].c = 50;
+    }
+}
+
+void GroupedWhiteNoiseModel::NameParams(vector<string>& names) const
+{
+    names.clear();
+    for (int i = 1; i <= nGroups; i++)
+        names.push_back("noise_precision_group" + stringify(i));
+}
+
+const MVNDist GroupedWhiteParams::OutputAsMVN() const
+{
+  Tracer_Plus tr("GroupedWhiteParams::OutputAsMVN");
+  
+  assert((unsigned)nPhis == phis.size());
+  MVNDist mvn( nPhis );
+  SymmetricMatrix vars( nPhis );
+  vars = 0;
+  for (int i = 1; i <= nPhis; i++)
+    {
+      mvn.means(i) = phis[i-1].CalcMean();
+      vars(i,i) = phis[i-1].CalcVariance();
+    }
+  mvn.SetCovariance(vars);
+  return mvn;
+}
+
+void GroupedWhiteParams::InputFromMVN( const MVNDist& mvn )
+{
+    const SymmetricMatrix& cov = mvn.GetCovariance();
+    for (int i = 1; i <= nPhis; i++)
+    {
+        phis[i-1].SetMeanVariance( mvn.means(i), cov(i,i) );
+        for (int j = i+1; j <= mvn.means.Nrows(); j++)
+            if (cov(i, j) != 0.0)
+                throw Invalid_option("Phis should have zero covariance!");
+    }    
+} 
+
+void GroupedWhiteParams::Dump(const string indent) const
+{
+  Tracer_Plus tr("GroupedWhiteParams::Dump");
+  for (int i = 0; i < nPhis; i++)
+    {
+      LOG << indent << "Phi_" << i+1 << ": ";
+      phis[i].Dump();
+    }
+}
+
+GroupedWhiteNoiseModel::GroupedWhiteNoiseModel(ArgsType& args)
+{ 
+  Tracer_Plus tr("GroupedWhiteNoiseModel::GroupedWhiteNoiseModel");
+
+  string groupFile = args.Read("noise-groups");
+  ifstream in(groupFile.c_str());
+  if (!in.good())
+    throw Invalid_option("Couldn't read noise group file '" + groupFile + "'\n");
+
+  nGroups = 0;
+  int g;
+  while (in >> g)
+    {
+      if (g < 1)
+	throw Invalid_option("Noise groups are numbered from 1; found " 
+			     + stringify(g) + " in " + groupFile + "\n");
+      groupPattern.push_back(g-1);
+      if (g > nGroups) nGroups = g;
+    }
+  if (!in.eof())
+    throw Invalid_option("Non-integer entry in noise group file '" + groupFile + "'\n");
+  if (groupPattern.empty())
+    throw Invalid_option("Noise group file '" + groupFile + "' is empty\n");
+
+  LOG << "GroupedWhiteNoiseModel: " << nGroups << " noise groups read from " 
+      << groupFile << endl;
+}
+
+void GroupedWhiteNoiseModel::MakeGroups(int dataLen) const
+{
+  if ((int)groupOf.size() == dataLen) 
+    return;  // already up-to-date
+
+  Tracer_Plus tr("GroupedWhiteNoiseModel::MakeGroups");
+  const int patternLen = groupPattern.size();
+  if (patternLen > dataLen)
+    throw Invalid_option(
+      "Noise group file is longer than the data... this is probably a mistake");
+
+  groupOf.resize(dataLen);
+  groupCount.assign(nGroups, 0);
+  for (int d = 0; d < dataLen; d++)
+    {
+      groupOf[d] = groupPattern[d % patternLen];
+      groupCount[groupOf[d]]++;
+    }
+
+  LOG << "Noise groups used are " << groupOf << endl;
+
+  for (int i = 0; i < nGroups; i++)
+    if (groupCount[i] == 0) // this phi is never used
+      throw Invalid_option("Noise group " + stringify(i+1) 
+	 + " has no volumes! This is probably a bad thing.");
+}
+
+void GroupedWhiteNoiseModel::GroupSquaredResiduals(const MVNDist& theta, 
+    const LinearFwdModel& linear, const ColumnVector& data, 
+    vector<double>& sums) const
+{
+  const Matrix& J = linear.Jacobian();
+  const ColumnVector k = data - linear.Offset() 
+    + J*(linear.Centre() - theta.means);
+  const Matrix JL = J * theta.GetCovariance();
+
+  const int nTimes = data.Nrows();
+  const int nTheta = J.Ncols();
+  const Real* kp = k.Store();
+  const Real* jp = J.Store();    // NEWMAT stores row-wise, so each row is
+  const Real* jlp = JL.Store();  // one data point's contiguous gradient
+
+  sums.assign(nGroups, 0.0);
+  for (int t = 0; t < nTimes; t++)
+    {
+      const Real* jRow = jp + t*nTheta;
+      const Real* jlRow = jlp + t*nTheta;
+      // Four partial sums, which the compiler can keep in vector registers
+      // (a single running sum can't be reordered)
+      double d[4] = { 0, 0, 0, 0 };
+      int p = 0;
+      for (; p + 4 <= nTheta; p += 4)
+	for (int i = 0; i < 4; i++)
+	  d[i] += jRow[p+i] * jlRow[p+i];
+      for (; p < nTheta; p++)
+	d[0] += jRow[p] * jlRow[p];
+      sums[groupOf[t]] += kp[t]*kp[t] + (d[0] + d[1]) + (d[2] + d[3]);
+    }
+}
+
+void GroupedWhiteNoiseModel::UpdateNoise(
+    NoiseParams& noise,
+    const NoiseParams& noisePrior,
+  	const MVNDist& theta,
+  	const LinearFwdModel& linear,
+  	const ColumnVector& data) const
+{
+  Tracer_Plus tr("GroupedWhiteNoiseModel::UpdateNoise");
+  
+  GroupedWhiteParams& posterior = dynamic_cast<GroupedWhiteParams&>(noise);
+  const GroupedWhiteParams& prior = dynamic_cast<const GroupedWhiteParams&>(noisePrior);
+  
+  MakeGroups(data.Nrows());
+  assert(nGroups == posterior.nPhis);
+  assert(nGroups == prior.nPhis);
+
+  vector<double> sums;
+  GroupSquaredResiduals(theta, linear, data, sums);
+
+  for (int i = 0; i < nGroups; i++)
+    {
+      posterior.phis[i].b = 1/( sums[i]*0.5 + 1/prior.phis[i].b);
+      posterior.phis[i].c = (groupCount[i]-1)*0.5 + prior.phis[i].c;
+    }
+}
+
+void GroupedWhiteNoiseModel::UpdateTheta(
+    const NoiseParams& noiseIn,
+  	MVNDist& theta,
+  	const MVNDist& thetaPrior,
+  	const LinearFwdModel& linear,
+        const ColumnVector& data,
+        MVNDist* thetaWithoutPrior,
+	float LMalpha) const
+{
+  Tracer_Plus tr("GroupedWhiteNoiseModel::UpdateTheta");
+
+  const GroupedWhiteParams& noise = dynamic_cast<const GroupedWhiteParams&>(noiseIn);
+
+  const ColumnVector &ml = linear.Centre();
+  const ColumnVector &gml = linear.Offset();
+  const Matrix &J = linear.Jacobian();
+
+  MakeGroups(data.Nrows());
+  assert(nGroups == noise.nPhis);
+
+  // The expected precision of each data point, i.e. the diagonal of X.
+  // The products below scale the rows of J by it rather than forming X.
+  vector<double> phiMean(nGroups);
+  for (int i = 0; i < nGroups; i++)
+    phiMean[i] = noise.phis[i].CalcMean();
+
+  const int nTimes = data.Nrows();
+  ColumnVector w(nTimes);
+  for (int t = 0; t < nTimes; t++)
+    w(t+1) = phiMean[groupOf[t]];
+
+  // Calculate Lambda & Lambda*m (without priors)
+  SymmetricMatrix Ltmp;
+  linear.WeightedJtJ(w, Ltmp);
+  ColumnVector mTmp = linear.WeightedJtv(w, data - gml + J*ml);
+
+  // Update Lambda and m (including priors)
+  theta.SetPrecisions(thetaPrior.GetPrecisions() + Ltmp);
+
+  LogAndSign chk = theta.GetPrecisions().LogDeterminant();
+  if (chk.Sign() <= 0) {
+    LOG << "Note: In UpdateTheta, theta precisions aren't positive-definite: "
+	<< chk.Sign() << ", " << chk.LogValue() << endl;
+  }      
+
+  if (LMalpha>0.0) {
+    // LM update, as in WhiteNoiseModel
+    SymmetricMatrix prec = theta.GetPrecisions();
+    DiagonalMatrix precdiag;
+    precdiag << prec;
+    ColumnVector Delta = linear.WeightedJtv(w, data - gml)
+      + thetaPrior.GetPrecisions()*thetaPrior.means - thetaPrior.GetPrecisions()*ml;
+    theta.means = ml + (prec + LMalpha*precdiag).i()*Delta;
+  }
+  else {
+    theta.means = theta.GetCovariance()
+      * ( mTmp + thetaPrior.GetPrecisions() * thetaPrior.means );
+  }
+
+  if (thetaWithoutPrior != NULL)
+    {
+      Tracer_Plus tr("GroupedWhiteNoiseModel::UpdateTheta - WithoutPrior calcs");
+      thetaWithoutPrior->SetSize(theta.GetSize());
+      thetaWithoutPrior->SetPrecisions(Ltmp);
+      thetaWithoutPrior->means = thetaWithoutPrior->GetCovariance() * mTmp;
+    }
+}
+
+double GroupedWhiteNoiseModel::CalcFreeEnergy(
+    const NoiseParams& noiseIn,
+    const NoiseParams& noisePriorIn,
+	const MVNDist& theta,
+  	const MVNDist& thetaPrior,
+  	const LinearFwdModel& linear,
+  	const ColumnVector& data) const
+{
+  Tracer_Plus tr("GroupedWhiteNoiseModel::CalcFreeEnergy");
+  const GroupedWhiteParams& noise = dynamic_cast<const GroupedWhiteParams&>(noiseIn);
+  const GroupedWhiteParams& noisePrior = dynamic_cast<const GroupedWhiteParams&>(noisePriorIn);
+
+  MakeGroups(data.Nrows());
+  vector<double> sums;
+  GroupSquaredResiduals(theta, linear, data, sums);
+
+  const int nTimes = data.Nrows();
+  const int nTheta = theta.means.Nrows();
+
+  // Same terms as WhiteNoiseModel::CalcFreeEnergy, except that the expected
+  // squared residuals are weighted by each group's expected precision.
+  double expectedLogThetaDist = 
+    +0.5 * theta.GetPrecisions().LogDeterminant().LogValue()
+    -0.5 * nTheta * (log(2*M_PI) + 1);
+
+  double expectedLogPhiDist = 0;
+  double expectedLogPosterior = 0;
+
+  for (int i = 0; i < nGroups; i++) 
+    {
+      const double si = noise.phis[i].b;
+      const double ci = noise.phis[i].c;
+      const double siPrior = noisePrior.phis[i].b;
+      const double ciPrior = noisePrior.phis[i].c;
+
+      expectedLogPhiDist +=
+	-gammaln(ci) - ci*log(si) - ci
+	+(ci-1)*(digamma(ci)+log(si));
+      
+      expectedLogPosterior += 
+	(digamma(ci)+log(si)) * ( groupCount[i]*0.5 + ciPrior - 1)
+	-0.5 * si*ci * sums[i]
+	-gammaln(ciPrior) -ciPrior*log(siPrior) - si*ci/siPrior;
+    } 
+
+  const SymmetricMatrix& Linv = theta.GetCovariance();
+  expectedLogPosterior +=
+    +0.5 * thetaPrior.GetPrecisions().LogDeterminant().LogValue()
+    -0.5 * nTimes * log(2*M_PI)
+    -0.5 * nTheta * log(2*M_PI)
+    -0.5 * ( (theta.means - thetaPrior.means).t() 
+	     * thetaPrior.GetPrecisions() 
+	     * (theta.means - thetaPrior.means) ).AsScalar()
+    -0.5 * (Linv * thetaPrior.GetPrecisions()).Trace();
+
+  double F = expectedLogPosterior - expectedLogThetaDist - expectedLogPhiDist;
+
+  if (! (F - F == 0) )
+  {
+    LOG_ERR("expectedLogThetaDist == " << expectedLogThetaDist << endl);
+    LOG_ERR("expectedLogPhiDist == " << expectedLogPhiDist << endl);
+    throw overflow_error("Non-finite free energy!");
+  }
+  
+  return F;
+}
@@ -0,0 +1,164 @@
+/*  noisemodel_groups.h - Class declaration for the grouped white noise model
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#pragma once
+#include "noisemodel.h"
+#include "dist_gamma.h"
+#include <vector>
+
+using namespace std;
+
+// White noise with one precision per group of volumes, where the group of
+// each volume is read from a text file (--noise-groups).  Equivalent to 
+// --noise=white with a --noise-pattern as long as the data, but the updates
+// work on per-sample sums rather than one DiagonalMatrix per phi, so the
+// cost doesn't grow with the number of groups.
+
+class GroupedWhiteParams : public NoiseParams {
+public:
+    virtual GroupedWhiteParams* Clone() const
+        { return new GroupedWhiteParams(*this); }
+    virtual const GroupedWhiteParams& operator=(const NoiseParams& in)
+      { const GroupedWhiteParams& from = dynamic_cast<const GroupedWhiteParams&>(in);
+	assert(nPhis == from.nPhis); phis = from.phis; return *this; }
+    
+    virtual const MVNDist OutputAsMVN() const;
+    virtual void InputFromMVN(const MVNDist& mvn);
+    
+    virtual void Dump(const string indent = "") const;
+    
+    GroupedWhiteParams(int N) : nPhis(N), phis(N) { return; }
+    GroupedWhiteParams(const GroupedWhiteParams& from) 
+        : nPhis(from.nPhis), phis(from.phis) { return; }
+    
+private:
+    friend class GroupedWhiteNoiseModel;
+    const int nPhis;
+    vector<GammaDist> phis;
+};    
+
+class GroupedWhiteNoiseModel : public NoiseModel {
+ public:
+
+    virtual GroupedWhiteParams* NewParams() const
+        { return new GroupedWhiteParams( nGroups ); }
+
+    virtual void HardcodedInitialDists(NoiseParams& prior, 
+        NoiseParams& posterior) const; 
+
+    virtual void NameParams(vector<string>& names) const;
+
+  // Constructor/destructor
+    GroupedWhiteNoiseModel(ArgsType& args);
+  // --noise-groups=<file> gives the (1-based) group index of each volume, 
+  // whitespace separated.  If the file is shorter than the data it is 
+  // repeated, as with --noise-pattern.
+
+  virtual ~GroupedWhiteNoiseModel() { return; }
+
+  // Do all the calculations
+  virtual void UpdateNoise(
+    NoiseParams& noise,
+    const NoiseParams& noisePrior,  
+  	const MVNDist& theta,
+  	const LinearFwdModel& model,
+  	const ColumnVector& data) const;
+
+  virtual void UpdateTheta(
+    const NoiseParams& noise,
+  	MVNDist& theta,
+  	const MVNDist& thetaPrior,
+  	const LinearFwdModel& model,
+        const ColumnVector& data,
+    MVNDist* thetaWithoutPrior = NULL,
+        float LMalpha = 0
+    ) const;
+
+  virtual double CalcFreeEnergy(
+    const NoiseParams& noise,
+    const NoiseParams& noisePrior,
+	const MVNDist& theta,
+  	const MVNDist& thetaPrior,
+  	const LinearFwdModel& model,
+  	const ColumnVector& data) const;
+
+ protected:
+  vector<int> groupPattern; // 0-based group of each entry in the file
+  int nGroups;
+
+  // Group of each data point (groupPattern repeated to the data length) and
+  // the number of data points in each group.  Mutable because it's a cache.
+  mutable vector<int> groupOf;
+  mutable vector<int> groupCount;
+  void MakeGroups(int dataLen) const;
+
+  // Sum over the data points in each group of k^2 + diag(J*Linv*J'),
+  // i.e. the expected squared residual under the current theta posterior.
+  void GroupSquaredResiduals(const MVNDist& theta, const LinearFwdModel& linear,
+			     const ColumnVector& data, vector<double>& sums) const;
+};
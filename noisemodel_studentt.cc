@@ -0,0 +1,359 @@
+/*  noisemodel_studentt.cc - Class implementation for the robust Student-t noise model
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include "noisemodel_studentt.h"
+#include <stdexcept>
+#include "miscmaths/miscmaths.h"
+using namespace MISCMATHS;
+using namespace Utilities;
+#include "easylog.h"
+
+void StudentTNoiseModel::HardcodedInitialDists(NoiseParams& priorIn,
+    NoiseParams& posteriorIn) const
+{
+    Tracer_Plus tr("StudentTNoiseModel::HardcodedInitialDists");
+    
+    StudentTParams& prior = dynamic_cast<StudentTParams&>(priorIn);
+    StudentTParams& posterior = dynamic_cast<StudentTParams&>(posteriorIn);
+
+    // Same as WhiteNoiseModel
+    prior.phi.b = 1e6;
+    prior.phi.c = 1e-6;
+    posterior.phi.b = 1e-8;
+    posterior.phi.c = 50;
+}
+
+const MVNDist StudentTParams::OutputAsMVN() const
+{
+  Tracer_Plus tr("StudentTParams::OutputAsMVN");
+  MVNDist mvn(1);
+  SymmetricMatrix vars(1);
+  mvn.means(1) = phi.CalcMean();
+  vars(1,1) = phi.CalcVariance();
+  mvn.SetCovariance(vars);
+  return mvn;
+}
+
+void StudentTParams::InputFromMVN( const MVNDist& mvn )
+{
+  if (mvn.GetSize() != 1)
+    throw Invalid_option("Student-t noise model has exactly one noise parameter\n");
+  phi.SetMeanVariance( mvn.means(1), mvn.GetCovariance()(1,1) );
+  lambdaRates.ReSize(0); // start again from unit weights
+} 
+
+void StudentTParams::Dump(const string indent) const
+{
+  Tracer_Plus tr("StudentTParams::Dump");
+  LOG << indent << "Phi: ";
+  phi.Dump();
+  if (lambdaRates.Nrows() > 0)
+    LOG << indent << "Lambda rates: " << lambdaRates.t();
+}
+
+StudentTNoiseModel::StudentTNoiseModel(ArgsType& args)
+{ 
+  Tracer_Plus tr("StudentTNoiseModel::StudentTNoiseModel");
+  nu = convertTo<double>(args.ReadWithDefault("noise-dof","4"));
+  if (nu <= 0)
+    throw Invalid_option("--noise-dof must be positive\n");
+  lambdaShape = (nu+1)*0.5;
+}
+
+void StudentTNoiseModel::Precalculate( NoiseParams& noiseIn, 
+    const NoiseParams&, const ColumnVector& sampleData ) const
+{
+  StudentTParams& noise = dynamic_cast<StudentTParams&>(noiseIn);
+  if (noise.lambdaRates.Nrows() != sampleData.Nrows())
+    {
+      // E[lambda_t] = 1 everywhere, i.e. start off as white noise
+      noise.lambdaRates.ReSize(sampleData.Nrows());
+      noise.lambdaRates = lambdaShape;
+    }
+}
+
+void StudentTNoiseModel::SquaredResiduals(const MVNDist& theta, 
+    const LinearFwdModel& linear, const ColumnVector& data, 
+    ColumnVector& sq) const
+{
+  const Matrix& J = linear.Jacobian();
+  const ColumnVector k = data - linear.Offset() 
+    + J*(linear.Centre() - theta.means);
+  const Matrix JL = J * theta.GetCovariance();
+
+  const int nTimes = data.Nrows();
+  const int nTheta = J.Ncols();
+  sq.ReSize(nTimes);
+  const Real* kp = k.Store();
+  const Real* jp = J.Store();    // row-wise storage: one row per data point
+  const Real* jlp = JL.Store();
+  Real* sqp = sq.Store();
+
+  for (int t = 0; t < nTimes; t++)
+    {
+      const Real* jRow = jp + t*nTheta;
+      const Real* jlRow = jlp + t*nTheta;
+      // Four partial sums, which the compiler can keep in vector registers
+      // (a single running sum can't be reordered)
+      double d[4] = { 0, 0, 0, 0 };
+      int p = 0;
+      for (; p + 4 <= nTheta; p += 4)
+	for (int i = 0; i < 4; i++)
+	  d[i] += jRow[p+i] * jlRow[p+i];
+      for (; p < nTheta; p++)
+	d[0] += jRow[p] * jlRow[p];
+      sqp[t] = kp[t]*kp[t] + (d[0] + d[1]) + (d[2] + d[3]);
+    }
+}
+
+void StudentTNoiseModel::Weights(const StudentTParams& noise, int nTimes,
+    ColumnVector& w) const
+{
+  const double phiMean = noise.phi.CalcMean();
+  w.ReSize(nTimes);
+  if (noise.lambdaRates.Nrows() != nTimes)
+    {
+      w = phiMean;
+      return;
+    }
+  const Real* rp = noise.lambdaRates.Store();
+  Real* wp = w.Store();
+  for (int t = 0; t < nTimes; t++)
+    wp[t] = phiMean * lambdaShape / rp[t];
+}
+
+void StudentTNoiseModel::UpdateNoise(
+    NoiseParams& noiseIn,
+    const NoiseParams& noisePriorIn,
+  	const MVNDist& theta,
+  	const LinearFwdModel& linear,
+  	const ColumnVector& data) const
+{
+  Tracer_Plus tr("StudentTNoiseModel::UpdateNoise");
+  
+  StudentTParams& posterior = dynamic_cast<StudentTParams&>(noiseIn);
+  const StudentTParams& prior = dynamic_cast<const StudentTParams&>(noisePriorIn);
+  
+  const int nTimes = data.Nrows();
+  ColumnVector sq;
+  SquaredResiduals(theta, linear, data, sq);
+
+  // Lambda update (using the current phi), then phi given the new lambdas
+  const double phiMean = posterior.phi.CalcMean();
+  posterior.lambdaRates.ReSize(nTimes);
+  const Real* sqp = sq.Store();
+  Real* rp = posterior.lambdaRates.Store();
+  double weightedSum = 0;
+  for (int t = 0; t < nTimes; t++)
+    {
+      rp[t] = 0.5*(nu + phiMean*sqp[t]);
+      weightedSum += lambdaShape / rp[t] * sqp[t];
+    }
+
+  posterior.phi.b = 1/( weightedSum*0.5 + 1/prior.phi.b );
+  posterior.phi.c = nTimes*0.5 + prior.phi.c;
+}
+
+void StudentTNoiseModel::UpdateTheta(
+    const NoiseParams& noiseIn,
+  	MVNDist& theta,
+  	const MVNDist& thetaPrior,
+  	const LinearFwdModel& linear,
+        const ColumnVector& data,
+        MVNDist* thetaWithoutPrior,
+	float LMalpha) const
+{
+  Tracer_Plus tr("StudentTNoiseModel::UpdateTheta");
+
+  const StudentTParams& noise = dynamic_cast<const StudentTParams&>(noiseIn);
+
+  const ColumnVector &ml = linear.Centre();
+  const ColumnVector &gml = linear.Offset();
+  const Matrix &J = linear.Jacobian();
+
+  const int nTimes = data.Nrows();
+  ColumnVector w;
+  Weights(noise, nTimes, w);
+
+  // X = diag(w), applied by scaling the rows of J
+  SymmetricMatrix Ltmp;
+  linear.WeightedJtJ(w, Ltmp);
+  ColumnVector mTmp = linear.WeightedJtv(w, data - gml + J*ml);
+
+  theta.SetPrecisions(thetaPrior.GetPrecisions() + Ltmp);
+
+  LogAndSign chk = theta.GetPrecisions().LogDeterminant();
+  if (chk.Sign() <= 0) {
+    LOG << "Note: In UpdateTheta, theta precisions aren't positive-definite: "
+	<< chk.Sign() << ", " << chk.LogValue() << endl;
+  }      
+
+  if (LMalpha>0.0) {
+    // LM update, as in WhiteNoiseModel
+    SymmetricMatrix prec = theta.GetPrecisions();
+    DiagonalMatrix precdiag;
+    precdiag << prec;
+    ColumnVector Delta = linear.WeightedJtv(w, data - gml)
+      + thetaPrior.GetPrecisions()*thetaPrior.means - thetaPrior.GetPrecisions()*ml;
+    theta.means = ml + (prec + LMalpha*precdiag).i()*Delta;
+  }
+  else {
+    theta.means = theta.GetCovariance()
+      * ( mTmp + thetaPrior.GetPrecisions() * thetaPrior.means );
+  }
+
+  if (thetaWithoutPrior != NULL)
+    {
+      Tracer_Plus tr("StudentTNoiseModel::UpdateTheta - WithoutPrior calcs");
+      thetaWithoutPrior->SetSize(theta.GetSize());
+      thetaWithoutPrior->SetPrecisions(Ltmp);
+      thetaWithoutPrior->means = thetaWithoutPrior->GetCovariance() * mTmp;
+    }
+}
+
+double StudentTNoiseModel::CalcFreeEnergy(
+    const NoiseParams& noiseIn,
+    const NoiseParams& noisePriorIn,
+	const MVNDist& theta,
+  	const MVNDist& thetaPrior,
+  	const LinearFwdModel& linear,
+  	const ColumnVector& data) const
+{
+  Tracer_Plus tr("StudentTNoiseModel::CalcFreeEnergy");
+  const StudentTParams& noise = dynamic_cast<const StudentTParams&>(noiseIn);
+  const StudentTParams& noisePrior = dynamic_cast<const StudentTParams&>(noisePriorIn);
+
+  const int nTimes = data.Nrows();
+  const int nTheta = theta.means.Nrows();
+
+  ColumnVector sq;
+  SquaredResiduals(theta, linear, data, sq);
+
+  const double si = noise.phi.b;
+  const double ci = noise.phi.c;
+  const double siPrior = noisePrior.phi.b;
+  const double ciPrior = noisePrior.phi.c;
+  const double expectedLogPhi = digamma(ci) + log(si);
+  const double phiMean = si*ci;
+
+  double expectedLogThetaDist = 
+    +0.5 * theta.GetPrecisions().LogDeterminant().LogValue()
+    -0.5 * nTheta * (log(2*M_PI) + 1);
+
+  double expectedLogPhiDist =
+    -gammaln(ci) - ci*log(si) - ci + (ci-1)*expectedLogPhi;
+
+  // Likelihood plus the lambda prior and entropy terms, summed over samples.
+  // Before the first noise update the lambdas are all at E[lambda]=1.
+  const bool haveLambdas = (noise.lambdaRates.Nrows() == nTimes);
+  const double halfNu = 0.5*nu;
+  const double lambdaPriorConst = halfNu*log(halfNu) - gammaln(halfNu);
+  const double lambdaEntropyConst = lambdaShape + gammaln(lambdaShape) 
+    + (1-lambdaShape)*digamma(lambdaShape);
+  const double digammaShape = digamma(lambdaShape);
+  const Real* sqp = sq.Store();
+  const Real* rp = haveLambdas ? noise.lambdaRates.Store() : NULL;
+
+  double expectedLogLikelihood = 0;
+  double lambdaTerms = 0;
+  for (int t = 0; t < nTimes; t++)
+    {
+      const double rate = haveLambdas ? rp[t] : lambdaShape;
+      const double lambdaMean = lambdaShape / rate;
+      const double expectedLogLambda = digammaShape - log(rate);
+      expectedLogLikelihood += 
+	0.5*expectedLogLambda - 0.5*phiMean*lambdaMean*sqp[t];
+      lambdaTerms += (halfNu-1)*expectedLogLambda - halfNu*lambdaMean
+	- log(rate);
+    }
+  expectedLogLikelihood += 0.5*nTimes*(expectedLogPhi - log(2*M_PI));
+  lambdaTerms += nTimes*(lambdaPriorConst + lambdaEntropyConst);
+
+  double expectedLogPriors =
+    (ciPrior-1)*expectedLogPhi - phiMean/siPrior
+    -gammaln(ciPrior) - ciPrior*log(siPrior)
+    +0.5 * thetaPrior.GetPrecisions().LogDeterminant().LogValue()
+    -0.5 * nTheta * log(2*M_PI)
+    -0.5 * ( (theta.means - thetaPrior.means).t() 
+	     * thetaPrior.GetPrecisions() 
+	     * (theta.means - thetaPrior.means) ).AsScalar()
+    -0.5 * (theta.GetCovariance() * thetaPrior.GetPrecisions()).Trace();
+
+  double F = expectedLogLikelihood + lambdaTerms + expectedLogPriors
+    - expectedLogThetaDist - expectedLogPhiDist;
+
+  if (! (F - F == 0) )
+  {
+    LOG_ERR("expectedLogThetaDist == " << expectedLogThetaDist << endl);
+    LOG_ERR("expectedLogPhiDist == " << expectedLogPhiDist << endl);
+    LOG_ERR("lambdaTerms == " << lambdaTerms << endl);
+    throw overflow_error("Non-finite free energy!");
+  }
+  
+  return F;
+}
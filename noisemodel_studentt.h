@@ -0,0 +1,161 @@
+/*  noisemodel_studentt.h - Class declaration for the robust Student-t noise model
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#pragma once
+#include "noisemodel.h"
+#include "dist_gamma.h"
+
+// Student-t noise, written as a scale mixture of Gaussians:
+//   y_t ~ N(g(theta), 1/(phi*lambda_t)),  lambda_t ~ Ga(nu/2, nu/2)
+// Each data point gets its own posterior on lambda_t, so outliers (e.g.
+// motion spikes) are down-weighted in the theta update rather than
+// dragging the whole voxel off.  The VB updates are the usual IRLS-style
+// reweighting: E[lambda_t] = (nu+1) / (nu + E[phi]*E[residual_t^2]).
+
+class StudentTParams : public NoiseParams {
+public:
+    virtual StudentTParams* Clone() const
+        { return new StudentTParams(*this); }
+    virtual const StudentTParams& operator=(const NoiseParams& in)
+      { const StudentTParams& from = dynamic_cast<const StudentTParams&>(in);
+	phi = from.phi; lambdaRates = from.lambdaRates; return *this; }
+    
+    // Only phi goes in the MVN; the lambdas are per-sample and are 
+    // re-estimated from the data.
+    virtual const MVNDist OutputAsMVN() const;
+    virtual void InputFromMVN(const MVNDist& mvn);
+    
+    virtual void Dump(const string indent = "") const;
+    
+    StudentTParams() { return; }
+    StudentTParams(const StudentTParams& from) 
+        : phi(from.phi), lambdaRates(from.lambdaRates) { return; }
+    
+private:
+    friend class StudentTNoiseModel;
+    GammaDist phi;
+    // q(lambda_t) = Ga(shape=(nu+1)/2, rate=lambdaRates(t)).  Empty until
+    // Precalculate/UpdateNoise has seen the data.
+    ColumnVector lambdaRates;
+};    
+
+class StudentTNoiseModel : public NoiseModel {
+ public:
+
+    virtual StudentTParams* NewParams() const
+        { return new StudentTParams(); }
+
+    virtual void HardcodedInitialDists(NoiseParams& prior, 
+        NoiseParams& posterior) const; 
+
+    virtual void Precalculate( NoiseParams& noise, const NoiseParams& noisePrior,
+        const ColumnVector& sampleData ) const;
+
+  // Constructor/destructor
+    StudentTNoiseModel(ArgsType& args);
+    // --noise-dof=<nu> : degrees of freedom of the t distribution (default 4)
+
+  virtual ~StudentTNoiseModel() { return; }
+
+  virtual void UpdateNoise(
+    NoiseParams& noise,
+    const NoiseParams& noisePrior,  
+  	const MVNDist& theta,
+  	const LinearFwdModel& model,
+  	const ColumnVector& data) const;
+
+  virtual void UpdateTheta(
+    const NoiseParams& noise,
+  	MVNDist& theta,
+  	const MVNDist& thetaPrior,
+  	const LinearFwdModel& model,
+        const ColumnVector& data,
+    MVNDist* thetaWithoutPrior = NULL,
+        float LMalpha = 0
+    ) const;
+
+  virtual double CalcFreeEnergy(
+    const NoiseParams& noise,
+    const NoiseParams& noisePrior,
+	const MVNDist& theta,
+  	const MVNDist& thetaPrior,
+  	const LinearFwdModel& model,
+  	const ColumnVector& data) const;
+
+ protected:
+  double nu;          // degrees of freedom
+  double lambdaShape; // (nu+1)/2, the shape of every q(lambda_t)
+
+  // E[residual_t^2] = k_t^2 + diag(J*Linv*J')_t, for each data point
+  void SquaredResiduals(const MVNDist& theta, const LinearFwdModel& linear,
+			const ColumnVector& data, ColumnVector& sq) const;
+
+  // E[phi]*E[lambda_t]: the effective precision of each data point
+  void Weights(const StudentTParams& noise, int nTimes, 
+	       ColumnVector& w) const;
+};
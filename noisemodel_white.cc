@@ -241,9 +241,11 @@ void WhiteNoiseModel::UpdateNoise(
   for (int i = 1; i <= nPhis; i++)
     {
       const DiagonalMatrix& Qi = Qis[i-1];
+      SymmetricMatrix JtQiJ;
+      linear.WeightedJtJ(Qi, JtQiJ);
       double tmp = 
 	(k.t() * Qi * k).AsScalar()
-	+ (theta.GetCovariance() * J.t() * Qi * J).Trace();
+	+ (theta.GetCovariance() * JtQiJ).Trace();
       
       posterior.phis[i-1].b =
 	1/( tmp*0.5 + 1/prior.phis[i-1].b);
@@ -302,10 +304,8 @@ void WhiteNoiseModel::UpdateTheta(
 
   // Calculate Lambda & Lambda*m (without priors)
   SymmetricMatrix Ltmp;
-  Ltmp << J.t() * X * J;  
-  // use << instead of = because this is considered a lossy assignment
-  // (since NEWMAT isn't smart enough to know J'*X*J is always symmetric)
-  ColumnVector mTmp = J.t() * X * (data - gml + J*ml);
+  linear.WeightedJtJ(X, Ltmp);
+  ColumnVector mTmp = linear.WeightedJtv(X, data - gml + J*ml);
 
   // Update Lambda and m (including priors)
   theta.SetPrecisions(thetaPrior.GetPrecisions() + Ltmp);
@@ -327,7 +327,7 @@ void WhiteNoiseModel::UpdateTheta(
     precdiag << prec;
 
     // a different (but equivalent?) form for the LM update
-    Delta = J.t() * X * (data - gml) + thetaPrior.GetPrecisions()*thetaPrior.means - thetaPrior.GetPrecisions()*ml;
+    Delta = linear.WeightedJtv(X, data - gml) + thetaPrior.GetPrecisions()*thetaPrior.means - thetaPrior.GetPrecisions()*ml;
     theta.means = ml + (prec + LMalpha*precdiag).i()*Delta;
 
     // LM update
@@ -427,10 +427,13 @@ double WhiteNoiseModel::CalcFreeEnergy(
      } 
 
    expectedLogPosteriorParts[1] = 0; //*NB not required
-  
+
+  SymmetricMatrix JtJ;
+  linear.JtJ(JtJ);
+
   expectedLogPosteriorParts[2] =
     -0.5 * (k.t() *  k).AsScalar() 
-    -0.5 * (J.t() * J * Linv).Trace(); //*NB remove Qsum
+    -0.5 * (JtJ * Linv).Trace(); //*NB remove Qsum
   
   expectedLogPosteriorParts[3] =
     +0.5 * thetaPrior.GetPrecisions().LogDeterminant().LogValue()
@@ -0,0 +1,235 @@
+/*  posteriorsamples.cc - Posterior sample output
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include "posteriorsamples.h"
+#include "easylog.h"
+#include "easyoptions.h"
+#include "newmatap.h"
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+static const char sampleMagic[8] = { 'F','A','B','S','M','P',0,0 };
+
+SampleFileWriter::SampleFileWriter(const string& fname, const NiftiWriter& grid,
+                                   const vector<string>& paramNames, 
+                                   int samples, int seed)
+  : filename(fname), fp(NULL), nParams(paramNames.size()), nSamples(samples),
+    ok(true)
+{
+  Tracer_Plus tr("SampleFileWriter::SampleFileWriter");
+
+  string names;
+  for (int i = 0; i < nParams; i++)
+    names += paramNames[i] + "\n";
+  vector<int64_t> index(grid.MaskIndex().begin(), grid.MaskIndex().end());
+
+  SampleFileHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, sampleMagic, sizeof(sampleMagic));
+  hdr.version = 1;
+  hdr.nParams = nParams;
+  hdr.nSamples = nSamples;
+  hdr.seed = seed;
+  hdr.nVoxels = index.size();
+  hdr.namesOffset = sizeof(hdr);
+  hdr.indexOffset = hdr.namesOffset + names.size();
+  hdr.dataOffset = hdr.indexOffset + index.size() * sizeof(int64_t);
+  hdr.grid = grid.Header();
+
+  fp = fopen(filename.c_str(), "wb");
+  if (fp == NULL)
+    throw Invalid_option("Couldn't open " + filename + " for writing");
+  ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+    && fwrite(names.data(), 1, names.size(), fp) == names.size()
+    && (index.empty() 
+        || fwrite(&index[0], sizeof(int64_t), index.size(), fp) == index.size());
+}
+
+SampleFileWriter::~SampleFileWriter()
+{
+  if (fp != NULL)
+    fclose(fp);
+}
+
+void SampleFileWriter::Put(const double* samples, int nVox)
+{
+  const size_t perVox = size_t(nParams) * nSamples;
+  rec.resize(perVox * nVox);
+  for (int v = 0; v < nVox; v++)
+    for (int s = 0; s < nSamples; s++)
+      for (int p = 0; p < nParams; p++)
+        rec[v*perVox + s*nParams + p] = samples[v*perVox + p*nSamples + s];
+  if (ok && !rec.empty())
+    ok = fwrite(&rec[0], sizeof(float), rec.size(), fp) == rec.size();
+}
+
+void SampleFileWriter::Close()
+{
+  const bool closed = (fclose(fp) == 0);
+  fp = NULL;
+  if (!closed || !ok)
+    throw Invalid_option("Error writing " + filename);
+}
+
+GaussianRandom::GaussianRandom(unsigned long seed)
+  : state(seed * 2685821657736338717ULL + 1442695040888963407ULL), 
+    haveSpare(false), spare(0)
+{
+  if (state == 0) state = 1; // xorshift gets stuck at zero
+}
+
+double GaussianRandom::Uniform()
+{
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  const uint64_t r = state * 2685821657736338717ULL;
+  return (double(r >> 11) + 0.5) / 9007199254740992.0; // (0,1), 53 bits
+}
+
+double GaussianRandom::Next()
+{
+  if (haveSpare)
+    {
+      haveSpare = false;
+      return spare;
+    }
+  const double r = sqrt(-2.0 * log(Uniform()));
+  const double theta = 2.0 * M_PI * Uniform();
+  spare = r * sin(theta);
+  haveSpare = true;
+  return r * cos(theta);
+}
+
+void GaussianRandom::Fill(double* p, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    p[i] = Next();
+}
+
+void SampleFactor(const SymmetricMatrix& cov, double* L)
+{
+  const int n = cov.Nrows();
+  LowerTriangularMatrix chol(n);
+  try 
+    {
+      chol = Cholesky(cov);
+    }
+  catch (Exception)
+    {
+      Warning::IssueOnce("Posterior covariance not positive definite; sampling without correlations");
+      chol = 0;
+      for (int i = 1; i <= n; i++)
+        chol(i,i) = (cov(i,i) > 0) ? sqrt(cov(i,i)) : 0;
+    }
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < n; j++)
+      L[i*n + j] = (j <= i) ? chol(i+1,j+1) : 0;
+}
+
+void DrawSampleBlock(int n, int nVox, int nSamples, const double* means,
+                     const double* L, GaussianRandom& rng, double* out)
+{
+  // Deviates go straight into out, then each voxel's rows are replaced 
+  // bottom up by means + L*z (row i only needs rows k <= i of z)
+  const size_t perVox = size_t(n) * nSamples;
+  rng.Fill(out, perVox * nVox);
+  for (int v = 0; v < nVox; v++)
+    {
+      const double* Lv = L + v*n*n;
+      double* x = out + v*perVox;
+      for (int i = n - 1; i >= 0; i--)
+        {
+          double* xi = x + i*nSamples;
+          const double lii = Lv[i*n + i];
+          for (int s = 0; s < nSamples; s++)
+            xi[s] *= lii;
+          for (int k = 0; k < i; k++)
+            {
+              const double lik = Lv[i*n + k];
+              if (lik == 0) continue;
+              const double* zk = x + k*nSamples;
+              for (int s = 0; s < nSamples; s++)
+                xi[s] += lik * zk[s];
+            }
+          for (int s = 0; s < nSamples; s++)
+            xi[s] += means[v*n + i];
+        }
+    }
+}
+
+float Percentile(vector<float>& values, double pct)
+{
+  assert(!values.empty());
+  sort(values.begin(), values.end());
+  const double rank = pct / 100.0 * (values.size() - 1);
+  const size_t lo = size_t(floor(rank));
+  const size_t hi = min(lo + 1, values.size() - 1);
+  return values[lo] + (rank - lo) * (values[hi] - values[lo]);
+}
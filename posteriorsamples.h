@@ -0,0 +1,147 @@
+/*  posteriorsamples.h - Posterior sample output
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <stdint.h>
+#include "niftiwriter.h"
+
+using namespace std;
+
+// A .samples file holds draws from each masked voxel's posterior over the
+// model parameters.  Layout (native byte order), much like a .mvn file:
+//
+//   SampleFileHeader         fixed size, includes the grid's NIFTI header
+//   parameter names          nParams names, each ending in '\n'
+//   mask index               nVoxels int64s: each voxel's index in the grid
+//   records                  one per voxel, in mask order: nSamples rows of
+//                            nParams float32s (all of sample 1, then 2...)
+
+struct SampleFileHeader {
+  char magic[8];          // "FABSMP\0\0"
+  int32_t version;
+  int32_t nParams;
+  int32_t nSamples;
+  int32_t seed;           // so a run can be repeated
+  int64_t nVoxels;
+  int64_t namesOffset, indexOffset, dataOffset;
+  nifti_1_header grid;
+};
+
+class SampleFileWriter {
+public:
+  SampleFileWriter(const string& filename, const NiftiWriter& grid, 
+                   const vector<string>& names, int nSamples, int seed);
+  ~SampleFileWriter();
+
+  // The next nVox voxels' samples: each voxel nParams x nSamples, row-major
+  void Put(const double* samples, int nVox);
+  void Close();                    // throws if anything went wrong
+
+private:
+  string filename;
+  FILE* fp;
+  int nParams, nSamples;
+  bool ok;
+  vector<float> rec;
+
+  SampleFileWriter(const SampleFileWriter&);  // not allowed
+  SampleFileWriter& operator=(const SampleFileWriter&);
+};
+
+// Standard normal deviates from a seeded generator (xorshift64* with the 
+// Box-Muller transform), so samples are repeatable and independent of rand()
+class GaussianRandom {
+public:
+  GaussianRandom(unsigned long seed);
+  double Next();
+  void Fill(double* p, size_t n);
+
+private:
+  uint64_t state;
+  bool haveSpare;
+  double spare;
+  double Uniform(); // in (0,1)
+};
+
+// Lower Cholesky factor of cov, row-major into L (n x n, zeros above the
+// diagonal).  If cov isn't positive definite the correlations are dropped.
+void SampleFactor(const SymmetricMatrix& cov, double* L);
+
+// Draw nSamples from N(means, L*L') for each of nVox voxels at once: 
+// voxel v's means start at means[v*n] and its factor at L[v*n*n].  The
+// normal deviates for the whole block are drawn together, in the same 
+// order as voxel-by-voxel draws would take them.  out gets n x nSamples
+// per voxel, row-major.
+void DrawSampleBlock(int n, int nVox, int nSamples, const double* means,
+                     const double* L, GaussianRandom& rng, double* out);
+
+// Percentile (0-100) of values, which get sorted; linear interpolation
+float Percentile(vector<float>& values, double pct);
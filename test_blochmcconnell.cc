@@ -0,0 +1,160 @@
+/*  test_blochmcconnell.cc - Checks SpectrumBatch against Spectrum
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include "blochmcconnell.h"
+
+// SpectrumBatch (bmLanes points at a time) must agree with the one point
+// at a time Spectrum.  Returns non-zero if any point differs by more than
+// this.
+const double tolerance = 1e-6;
+
+// Pool parameters much as CESTFwdModel uses them: water, an amide pool 
+// and a slower, broad MT-like pool.  If waterOnly is false the two solute
+// pools also exchange with each other.
+BlochMcConnell ThreePools(bool waterOnly)
+{
+  ColumnVector M0(3);
+  Matrix kij(3,3), T12(2,3);
+  M0(1) = 1; M0(2) = 0.01; M0(3) = 0.1;
+  kij = 0;
+  kij(2,1) = 40; kij(1,2) = kij(2,1)*M0(2)/M0(1);
+  kij(3,1) = 25; kij(1,3) = kij(3,1)*M0(3)/M0(1);
+  if (!waterOnly) { kij(2,3) = 5; kij(3,2) = 0.5; }
+  T12(1,1) = 1.3;  T12(1,2) = 0.77; T12(1,3) = 1;    // T1
+  T12(2,1) = 0.05; T12(2,2) = 0.01; T12(2,3) = 1e-5; // T2
+  return BlochMcConnell(M0, kij, T12);
+}
+
+int main()
+{
+  const double wlam = 42.58e6*3*2*M_PI; // water frequency at 3T (rad/s)
+
+  // 63 points is not a multiple of bmLanes, so the last batch is partial.
+  // Every tenth point has no saturation.
+  const int npoints = 63;
+  ColumnVector w(npoints), w1(npoints), t(npoints);
+  Matrix wi(3, npoints);
+  for (int k = 1; k <= npoints; k++)
+    {
+      w(k) = (k-32)*0.25*wlam/1e6;
+      w1(k) = (k%10 == 0) ? 0 : 1e-6*42.58e6*2*M_PI*(1 + k%3);
+      t(k) = 1 + (k*7)%50;
+      wi(1,k) = 0.1*wlam/1e6 + k*0.3;
+      wi(2,k) = 3.5*wlam/1e6;
+      wi(3,k) = -2.4*wlam/1e6;
+    }
+
+  // A shaped pulse (Gaussian-like, with a gap) repeated t times, and a
+  // single continuous block lasting t
+  const int nseg = 21;
+  ColumnVector pmag(nseg), pt(nseg);
+  for (int s = 1; s <= 20; s++)
+    {
+      const double x = (s-10.5)/5;
+      pmag(s) = exp(-x*x);
+      pt(s) = 0.005;
+    }
+  pmag(21) = 0; pt(21) = 0.01;
+  const CESTPulse pulsed(pmag, pt);
+  ColumnVector cmag(1), ct(1);
+  cmag = 1; ct = 1e12;
+  const CESTPulse continuous(cmag, ct);
+
+  const CESTPulse* pulses[3] = { NULL, &pulsed, &continuous };
+  const char* names[3] = { "steady state", "pulsed", "continuous" };
+
+  int failures = 0;
+  for (int waterOnly = 1; waterOnly >= 0; waterOnly--)
+    {
+      const BlochMcConnell bm = ThreePools(waterOnly);
+      for (int p = 0; p < 3; p++)
+	{
+	  ColumnVector ref, batch;
+	  bm.Spectrum(ref, w, w1, t, wi, pulses[p]);
+	  bm.SpectrumBatch(batch, w, w1, t, wi, pulses[p]);
+
+	  double maxdiff = 0;
+	  for (int k = 1; k <= npoints && k <= batch.Nrows(); k++)
+	    {
+	      const double diff = fabs(ref(k) - batch(k));
+	      if (!(diff <= maxdiff)) maxdiff = diff; // NaN counts as a failure
+	    }
+	  const bool ok = (maxdiff <= tolerance) && (batch.Nrows() == npoints);
+	  if (!ok) failures++;
+
+	  cout << (ok ? "ok     " : "FAILED ") << names[p] 
+	       << (waterOnly ? ", water exchange only" : ", solute-solute exchange")
+	       << ": max difference " << maxdiff << endl;
+	}
+    }
+
+  return failures ? 1 : 0;
+}
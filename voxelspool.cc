@@ -0,0 +1,123 @@
+/*  voxelspool.cc - Per-voxel vectors kept in a temporary file
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include "voxelspool.h"
+#include "easylog.h"
+#include "easyoptions.h"
+#include <unistd.h>
+#include <sys/types.h>
+
+VoxelSpool::VoxelSpool(int length, int nVoxels)
+  : fp(NULL), len(length), nVox(nVoxels), buf(length)
+{
+  Tracer_Plus tr("VoxelSpool::VoxelSpool");
+  fp = tmpfile(); // deleted automatically when closed
+  if (fp == NULL)
+    throw Invalid_option("Couldn't create a temporary file for per-voxel results");
+}
+
+VoxelSpool::~VoxelSpool()
+{
+  if (fp != NULL)
+    fclose(fp);
+}
+
+void VoxelSpool::Put(int vox, const ColumnVector& values)
+{
+  assert(vox >= 1 && vox <= nVox);
+  assert(values.Nrows() == len);
+  for (int i = 0; i < len; i++)
+    buf[i] = values(i+1);
+  const off_t offset = off_t(vox-1) * len * sizeof(float);
+  if (pwrite(fileno(fp), &buf[0], len * sizeof(float), offset) != ssize_t(len * sizeof(float)))
+    throw Invalid_option("Error writing per-voxel results to a temporary file");
+}
+
+void VoxelSpool::Get(int vox, vector<float>& values) const
+{
+  assert(vox >= 1 && vox <= nVox);
+  values.resize(len);
+  const off_t offset = off_t(vox-1) * len * sizeof(float);
+  if (pread(fileno(fp), &values[0], len * sizeof(float), offset) != ssize_t(len * sizeof(float)))
+    throw Invalid_option("Error reading per-voxel results back from a temporary file");
+}
+
+void VoxelSpool::GetFrames(int first, int n, vector<float>& out) const
+{
+  assert(first >= 0 && n >= 0 && first + n <= len);
+  out.resize(size_t(n) * nVox);
+  vector<float> part(n);
+  for (int v = 0; v < nVox; v++)
+    {
+      const off_t offset = (off_t(v) * len + first) * sizeof(float);
+      if (n > 0 && pread(fileno(fp), &part[0], n * sizeof(float), offset) != ssize_t(n * sizeof(float)))
+        throw Invalid_option("Error reading per-voxel results back from a temporary file");
+      for (int f = 0; f < n; f++)
+        out[size_t(f) * nVox + v] = part[f];
+    }
+}
@@ -0,0 +1,104 @@
+/*  voxelspool.h - Per-voxel vectors kept in a temporary file
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2013 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#pragma once
+#include <cstdio>
+#include <vector>
+#include "newimage/newimageall.h"
+
+using namespace std;
+using namespace NEWMAT;
+
+// Holds one fixed-length vector per voxel (e.g. a model fit time series)
+// in an anonymous temporary file rather than in memory, stored voxel by 
+// voxel as floats.  Voxels can be written in any order, but the file is 
+// only as big as the highest voxel written.
+class VoxelSpool {
+public:
+  VoxelSpool(int length, int nVoxels);
+  ~VoxelSpool();
+
+  int Length() const { return len; }
+  int NumVoxels() const { return nVox; }
+
+  void Put(int vox, const ColumnVector& values); // vox from 1, like columns
+  void Get(int vox, vector<float>& values) const;
+
+  // Frames [first, first+n) of every voxel (first from 0), frame by frame:
+  // out[f*NumVoxels() + v].  This is the transpose needed to write images.
+  void GetFrames(int first, int n, vector<float>& out) const;
+
+private:
+  FILE* fp;
+  int len;
+  int nVox;
+  mutable vector<float> buf;
+
+  VoxelSpool(const VoxelSpool&);               // not allowed
+  VoxelSpool& operator=(const VoxelSpool&);
+};